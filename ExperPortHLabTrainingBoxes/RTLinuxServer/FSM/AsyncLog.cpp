@@ -0,0 +1,158 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#ifndef _REENTRANT
+#define _REENTRANT
+#endif
+#include "AsyncLog.h"
+
+#include <pthread.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+
+namespace AsyncLog
+{
+  volatile int level = Info;
+
+  namespace
+  {
+    const unsigned long RingSize = 4096; // must be a power of 2
+    const unsigned long RingMask = RingSize-1;
+    const unsigned DrainSleepUS = 1000; // how long the drain thread naps when the ring is empty
+
+    struct Record
+    {
+      /* Sequence number, as in D. Vyukov's bounded queue: the slot at index
+         i is free for the producer that claimed position pos when its seq
+         is pos, and holds a record for the consumer at pos when it's pos+1.
+         It's stored minus the slot's index so that the all-zeroes static
+         initialization is already the right starting state. */
+      volatile unsigned long seq;
+      struct timeval tv;
+      const char *fmt;
+      long args[MaxArgs];
+      unsigned short level, textlen;
+      char text[MaxText];
+    };
+
+    Record ring[RingSize];
+    volatile unsigned long head = 0; ///< next position a producer claims
+    unsigned long tail = 0; ///< next position the drain thread reads, only it touches this
+    volatile unsigned long nDropped = 0;
+
+    pthread_t drainThread;
+    volatile bool running = false, stopping = false;
+    std::ostream *out = 0;
+
+    inline unsigned long seqOf(unsigned long idx) { return ring[idx].seq + idx; }
+    inline void setSeq(unsigned long idx, unsigned long s) { ring[idx].seq = s - idx; }
+
+    void writeRecord(std::ostream & os, const Record & r)
+    {
+      char line[MaxText + 256];
+      struct tm tm;
+      localtime_r(&r.tv.tv_sec, &tm);
+      int n = snprintf(line, sizeof(line), "%02d:%02d:%02d.%06ld ",
+                       tm.tm_hour, tm.tm_min, tm.tm_sec, (long)r.tv.tv_usec);
+      if (r.level != Info)
+        n += snprintf(line + n, sizeof(line) - n, "%s: ", levelName(Level(r.level)));
+      if (r.fmt)
+        n += snprintf(line + n, sizeof(line) - n, r.fmt, r.args[0], r.args[1], r.args[2], r.args[3], r.args[4], r.args[5]);
+      if (n >= (int)sizeof(line)) n = sizeof(line) - 1;
+      os.write(line, n);
+      unsigned len = r.textlen;
+      while (len && (r.text[len-1] == '\n' || r.text[len-1] == '\r')) --len;
+      os.write(r.text, len);
+      if (r.textlen == MaxText) os << "...";
+      os << '\n';
+    }
+
+    /// returns the number of records written out
+    unsigned drain(std::ostream & os)
+    {
+      static unsigned long reportedDropped = 0;
+      unsigned ct = 0;
+      for (;;) {
+        const unsigned long idx = tail & RingMask;
+        if (seqOf(idx) != tail + 1) break;
+        __sync_synchronize(); // read the record only after we saw its seq
+        writeRecord(os, ring[idx]);
+        __sync_synchronize(); // done reading before handing the slot back
+        setSeq(idx, tail + RingSize);
+        ++tail, ++ct;
+      }
+      if (nDropped != reportedDropped) {
+        os << "AsyncLog: log ring overflowed, " << nDropped - reportedDropped << " records were dropped\n";
+        reportedDropped = nDropped;
+      }
+      if (ct) os.flush();
+      return ct;
+    }
+  }
+
+  extern "C" void *asyncLogDrainThr(void *)
+  {
+    while (!stopping)
+      if (!drain(*out)) ::usleep(DrainSleepUS);
+    drain(*out);
+    return 0;
+  }
+
+  const char *levelName(Level l)
+  {
+    static const char * const names[] = { "ERROR", "WARNING", "INFO", "DEBUG", "TRACE" };
+    return unsigned(l) <= Trace ? names[l] : "UNKNOWN";
+  }
+
+  void put(Level l, const char *fmt, const char *text, size_t textlen,
+           long a0, long a1, long a2, long a3, long a4, long a5)
+  {
+    unsigned long pos = head, idx;
+    for (;;) {
+      idx = pos & RingMask;
+      const long dif = long(seqOf(idx) - pos);
+      if (dif == 0) {
+        const unsigned long prev = __sync_val_compare_and_swap(&head, pos, pos+1);
+        if (prev == pos) break; // claimed it
+        pos = prev;
+      } else if (dif < 0) {
+        // full -- the drain thread is behind, don't wait for it
+        __sync_fetch_and_add(&nDropped, 1);
+        return;
+      } else
+        pos = head;
+    }
+    Record & r = ring[idx];
+    ::gettimeofday(&r.tv, 0);
+    r.fmt = fmt;
+    r.args[0] = a0, r.args[1] = a1, r.args[2] = a2, r.args[3] = a3, r.args[4] = a4, r.args[5] = a5;
+    r.level = l;
+    if (textlen > MaxText) textlen = MaxText;
+    r.textlen = textlen;
+    if (textlen) ::memcpy(r.text, text, textlen);
+    __sync_synchronize(); // the record must be complete before it is published
+    setSeq(idx, pos+1);
+  }
+
+  unsigned long dropped() { return nDropped; }
+
+  void start(std::ostream & os)
+  {
+    if (running) return;
+    out = &os;
+    stopping = false;
+    running = pthread_create(&drainThread, 0, asyncLogDrainThr, 0) == 0;
+  }
+
+  void stop()
+  {
+    if (running) {
+      stopping = true;
+      pthread_join(drainThread, 0);
+      running = false;
+    } else if (out)
+      drain(*out); // never started or already stopped, just write out what's left
+  }
+}
@@ -0,0 +1,63 @@
+#ifndef AsyncLog_h
+#define AsyncLog_h
+
+#include <sys/types.h>
+#include <string.h>
+#include <ostream>
+
+/**
+   A logger that never blocks the thread doing the logging.
+
+   Log records go into a fixed-size lock-free ring (many producers, one
+   consumer) and a background thread formats them and writes them out.
+   A record is compact: a pointer to a printf-style format string (which
+   must be a string literal, or at least outlive the record), up to
+   MaxArgs integer arguments, and optionally a bit of text that gets
+   appended after the formatted part.  So logging costs a few stores and
+   one atomic increment; all the formatting happens in the drain thread.
+
+   If the ring is full the record is dropped and counted rather than
+   waiting for the drain thread.  The drain thread reports how many were
+   lost.
+*/
+namespace AsyncLog
+{
+  enum Level {
+    Error = 0,
+    Warning,
+    Info,      ///< the default -- connections, errors and other rare events
+    Debug,     ///< every command and reply
+    Trace      ///< everything, including matrix dumps
+  };
+
+  enum { MaxArgs = 6, MaxText = 440 };
+
+  /// the current log level, records above it are discarded at the call site
+  extern volatile int level;
+  inline bool enabled(Level l) { return int(l) <= level; }
+  extern const char *levelName(Level l);
+
+  /// queue a record for the drain thread, text (if any) is truncated to MaxText bytes
+  extern void put(Level l, const char *fmt, const char *text, size_t textlen,
+                  long a0 = 0, long a1 = 0, long a2 = 0, long a3 = 0,
+                  long a4 = 0, long a5 = 0);
+
+  inline void logf(Level l, const char *fmt, long a0 = 0, long a1 = 0, long a2 = 0, long a3 = 0, long a4 = 0, long a5 = 0)
+  { if (enabled(l)) put(l, fmt, 0, 0, a0, a1, a2, a3, a4, a5); }
+
+  inline void logs(Level l, const char *fmt, const char *text, long a0 = 0, long a1 = 0)
+  { if (enabled(l)) put(l, fmt, text, text ? ::strlen(text) : 0, a0, a1); }
+
+  inline void logs(Level l, const char *fmt, const std::string & text, long a0 = 0, long a1 = 0)
+  { if (enabled(l)) put(l, fmt, text.data(), text.length(), a0, a1); }
+
+  /// number of records dropped so far because the ring was full
+  extern unsigned long dropped();
+
+  /// starts the drain thread, writing to out
+  extern void start(std::ostream & out);
+  /// writes out whatever is still queued and stops the drain thread
+  extern void stop();
+}
+
+#endif
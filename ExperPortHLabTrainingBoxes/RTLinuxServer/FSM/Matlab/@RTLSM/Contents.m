@@ -87,10 +87,29 @@
 %                   (2) that SetStateMatrix() should only be called
 %                   in between trials.
 %
+%                SetStateMatrix(sm, state_matrix, pend_flg, true) sends
+%                the matrix sparse, for big matrices whose states
+%                mostly stay put.  See SetStateMatrix.m for the details.
+%
 % sm = Set_StateMatrix(sm, Matrix state_matrix)
 %                An alias for SetStateMatrix().  See the help for
 %                that function instead.
 %
+% sm = PatchStateMatrix(sm, cells)
+%                Changes a few cells, one [row col value] per row of
+%                cells, of the state matrix last sent with
+%                SetStateMatrix().  See PatchStateMatrix.m for the
+%                details.
+%
+% [string hash] = GetStateMatrixHash(sm)
+%                The server's name for the state matrix last sent,
+%                for SetStateMatrixHash().
+%
+% [sm, ok] = SetStateMatrixHash(sm, hash, pend_sm_swap_flg)
+%                Sends a state matrix the server has cached again by
+%                its hash, ok is 0 if it is no longer cached.  See
+%                SetStateMatrixHash.m for the details.
+%
 % num = GetStateMachine(fsm)
 %                Query the FSM server to find out which of the 6
 %                state machines we are connected to.
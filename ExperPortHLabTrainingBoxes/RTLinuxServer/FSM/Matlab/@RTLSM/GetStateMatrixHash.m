@@ -0,0 +1,17 @@
+% [string hash] = GetStateMatrixHash(sm)
+%                The server's name for the state matrix last sent with
+%                SetStateMatrix(), to pass to SetStateMatrixHash() later
+%                to send the same matrix again without transferring it.
+%                Empty if the server doesn't know one, because the
+%                matrix has been patched with PatchStateMatrix() since.
+function [hash] = GetStateMatrixHash(sm)
+  ChkConn(sm);
+  FSMClient('sendstring', sm.handle, sprintf('GET STATE MATRIX HASH\n'));
+  lines = FSMClient('readlines', sm.handle);
+  hash = '';
+  if (isempty(lines)), error('GET STATE MATRIX HASH error, empty result! Is the connection down?'); end;
+  line = deblank(lines(1,:));
+  if (~isempty(findstr(line, 'ERROR'))), return; end;
+  hash = line;
+  if (size(lines, 1) < 2), ReceiveOK(sm, 'GET STATE MATRIX HASH'); end;
+  return;
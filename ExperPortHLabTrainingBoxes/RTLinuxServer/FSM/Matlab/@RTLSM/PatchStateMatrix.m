@@ -0,0 +1,29 @@
+% sm = PatchStateMatrix(sm, cells)
+%
+%                Changes a few cells of the state matrix last sent with
+%                SetStateMatrix(), which is much cheaper than sending
+%                the whole matrix again when only some timeouts or
+%                outputs change from one trial to the next.
+%
+%                cells is a K x 3 matrix with one [row col value] per
+%                cell, row and col indexing the state_matrix as it was
+%                passed to SetStateMatrix() (so row 1 is state 0, and
+%                TIMEOUT_TIME values are in seconds).  Only states can
+%                be changed, the input events, output routing and
+%                scheduled waves need a SetStateMatrix().
+%
+%                The patched matrix takes effect just like a new one
+%                from SetStateMatrix() would, including waiting for the
+%                next jump to state 0 if the matrix was sent with that
+%                flag.  It is an error if there is no state matrix or
+%                it changed shape.
+function [sm] = PatchStateMatrix(sm, cells)
+  ChkConn(sm);
+  [k, n] = size(cells);
+  if (n ~= 3 | k < 1), error('cells must be a K x 3 matrix of [row col value]'); end;
+  cells(:,1:2) = cells(:,1:2) - 1; % the server counts from 0
+  [res] = FSMClient('sendstring', sm.handle, sprintf('PATCH STATE MATRIX %u\n', k));
+  ReceiveREADY(sm, 'PATCH STATE MATRIX');
+  [res] = FSMClient('sendmatrix', sm.handle, cells);
+  ReceiveOK(sm, 'PATCH STATE MATRIX');
+  return;
@@ -1,5 +1,6 @@
 % sm = SetStateMatrix(sm, Matrix state_matrix) 
 % sm = SetStateMatrix(sm, Matrix state_matrix, bool_for_pend_sm_swap_flg) 
+% sm = SetStateMatrix(sm, Matrix state_matrix, bool_for_pend_sm_swap_flg, bool_use_sparse) 
 %
 %                This command defines the state matrix that governs
 %                the control algorithm during behavior trials. 
@@ -31,6 +32,16 @@
 %                jumping to state 0 of another, and thus have cleaner
 %                inter-trial interval handling. 
 %
+%                The third usage, with a true bool_use_sparse, sends
+%                only the cells that differ from the default (0, but
+%                for the input event and TIMEOUT_STATE columns, the
+%                state itself) and has the state machine keep the
+%                matrix in that form.  That is much faster for big
+%                matrices where most states stay put on most events,
+%                and allows for up to 65535 states.  A sparse state
+%                matrix can only be patched (see PatchStateMatrix) in
+%                its TIMEOUT_TIME and output columns.
+%
 %                Note:
 %                   (1) the part of the state matrix that is being
 %                   run during intertrial intervals should remain
@@ -40,11 +51,13 @@
 %                   in between trials.
 %
 function [sm] = SetStateMatrix(varargin)
-  if (nargin < 2 | nargin > 3),  error ('invalid number of arguments'); end;
+  if (nargin < 2 | nargin > 4),  error ('invalid number of arguments'); end;
   sm = varargin{1};
   mat = varargin{2};
   pend_sm_swap_flg = 0;
-  if (nargin == 3), pend_sm_swap_flg = varargin{3}; end;
+  if (nargin >= 3), pend_sm_swap_flg = varargin{3}; end;
+  use_sparse = 0;
+  if (nargin >= 4), use_sparse = varargin{4}; end;
   ChkConn(sm);
   [m,n] = size(mat);
   [m_i, n_i] = size(sm.input_event_mapping);  
@@ -97,6 +110,7 @@ function [sm] = SetStateMatrix(varargin)
       else vec(1,i) = 0;
       end;
   end;
+  nstates = m;
   m = m + 1; % increment m since we added this vector
   mat(m,1:n) =  vec; 
   
@@ -156,6 +170,20 @@ function [sm] = SetStateMatrix(varargin)
   output_spec_str = UrlEncode(sm, output_spec_str);
   
   [m,n] = size(mat);
+  if (use_sparse),
+    % send [row col value] of the cells that aren't the default, 0-indexed
+    dflt = zeros(m, n);
+    dflt(1:nstates, 1:n_i+1) = repmat((0:nstates-1)', 1, n_i+1);
+    [r, c] = find(mat ~= dflt);
+    cells = [r-1 c-1 mat(sub2ind([m n], r, c))];
+    % format for SET STATE MATRIX SPARSE command is 
+    % SET STATE MATRIX SPARSE rows cols num_cells num_in_events num_sched_waves in_chan_type ready_for_trial_jumpstate OUTPUT_SPEC_STR_URL_ENCODED pend_sm_swap_flg
+    [res] = FSMClient('sendstring', sm.handle, sprintf(['SET STATE' ...
+                    ' MATRIX SPARSE %u %u %u %u %u %s %u %s %u\n'], m, n, size(cells,1), n_i, m_s, sm.in_chan_type, sm.ready_for_trial_jumpstate, output_spec_str, pend_sm_swap_flg));
+    ReceiveREADY(sm, 'SET STATE MATRIX SPARSE');
+    if (~isempty(cells)), [res] = FSMClient('sendmatrix', sm.handle, cells); end;
+    ReceiveOK(sm, 'SET STATE MATRIX SPARSE');
+  else
   % format for SET STATE MATRIX command is 
   % SET STATE MATRIX rows cols num_in_events num_sched_waves in_chan_type ready_for_trial_jumpstate IGNORED IGNORED IGNORED OUTPUT_SPEC_STR_URL_ENCODED
   [res] = FSMClient('sendstring', sm.handle, sprintf(['SET STATE' ...
@@ -163,6 +191,7 @@ function [sm] = SetStateMatrix(varargin)
   ReceiveREADY(sm, 'SET STATE MATRIX');
   [res] = FSMClient('sendmatrix', sm.handle, mat);
   ReceiveOK(sm, 'SET STATE MATRIX');
+  end;
   
   % now, send the AO waves *that changed* Note that sending an empty matrix
   % is like clearing a specific wave
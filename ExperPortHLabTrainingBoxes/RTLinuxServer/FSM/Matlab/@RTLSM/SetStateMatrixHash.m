@@ -0,0 +1,21 @@
+% [sm, ok] = SetStateMatrixHash(sm, hash, pend_sm_swap_flg)
+%                Sends a state matrix again by the hash that
+%                GetStateMatrixHash() returned after it was sent with
+%                SetStateMatrix().  This is much faster than sending the
+%                matrix, for protocols that go back and forth between a
+%                few matrices.  The server only keeps the last few
+%                matrices anyone sent, so ok is 0 if it no longer has
+%                this one, in which case it needs a SetStateMatrix().
+%
+%                The input events, output routing and scheduled waves
+%                are the ones that were in effect when the matrix was
+%                sent, not the current ones.  pend_sm_swap_flg is as
+%                for SetStateMatrix(), and defaults to 0.
+function [sm, ok] = SetStateMatrixHash(sm, hash, pend_sm_swap_flg)
+  if (nargin < 3), pend_sm_swap_flg = 0; end;
+  ChkConn(sm);
+  FSMClient('sendstring', sm.handle, sprintf('SET STATE MATRIX HASH %s %u\n', hash, pend_sm_swap_flg));
+  lines = FSMClient('readlines', sm.handle);
+  if (isempty(lines)), error('SET STATE MATRIX HASH error, empty result! Is the connection down?'); end;
+  ok = isempty(findstr(lines(1,:), 'ERROR'));
+  return;
@@ -0,0 +1,133 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#ifndef _REENTRANT
+#define _REENTRANT
+#endif
+#include "Metrics.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <map>
+#include <sstream>
+
+LatencyHistogram::LatencyHistogram()
+  : total(0), sum(0), max(0)
+{
+  memset(const_cast<unsigned long *>(counts), 0, sizeof(counts));
+}
+
+unsigned LatencyHistogram::bucketOf(unsigned long long us)
+{
+  if (us < SubBuckets) return us;
+  const unsigned e = 63 - __builtin_clzll(us); // floor(log2(us)), >= SubBits
+  if (e >= MaxExp) return NumBuckets - 1;
+  return (e - SubBits + 1) * SubBuckets + unsigned(us >> (e - SubBits)) - SubBuckets;
+}
+
+unsigned long long LatencyHistogram::bucketValue(unsigned b)
+{
+  if (b < SubBuckets) return b;
+  const unsigned e = b / SubBuckets + SubBits - 1, sub = b % SubBuckets;
+  const unsigned long long lower = (unsigned long long)(SubBuckets + sub) << (e - SubBits);
+  return lower + ((1ULL << (e - SubBits)) >> 1);
+}
+
+void LatencyHistogram::record(unsigned long long us)
+{
+  __sync_fetch_and_add(&counts[bucketOf(us)], 1);
+  __sync_fetch_and_add(&total, 1);
+  __sync_fetch_and_add(&sum, us);
+  unsigned long long m = max;
+  while (us > m) {
+    const unsigned long long prev = __sync_val_compare_and_swap(&max, m, us);
+    if (prev == m) break;
+    m = prev;
+  }
+}
+
+LatencyHistogram::Summary LatencyHistogram::summary() const
+{
+  // a snapshot taken while others record may be off by a few counts, that's fine
+  Summary s;
+  s.count = total;
+  s.max = max;
+  s.mean = s.count ? double(sum) / s.count : 0.;
+  const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+  double *outs[] = { &s.p50, &s.p90, &s.p99, &s.p999 };
+  unsigned long long seen = 0;
+  unsigned q = 0;
+  for (unsigned b = 0; b < NumBuckets && q < 4; ++b) {
+    seen += counts[b];
+    while (q < 4 && s.count && seen >= qs[q] * s.count) {
+      const unsigned long long v = bucketValue(b);
+      *outs[q++] = v > s.max ? s.max : v;
+    }
+  }
+  for ( ; q < 4; ++q) *outs[q] = double(s.max);
+  return s;
+}
+
+namespace Metrics
+{
+  namespace
+  {
+    struct Entry
+    {
+      std::string name, labels;
+      LatencyHistogram *h;
+    };
+    typedef std::map<std::string, Entry> Registry;
+    Registry registry; // sorted by name then labels, so a metric's lines come out together
+    pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+
+    std::string withLabels(const std::string & name, const std::string & labels, const char *extra = 0)
+    {
+      std::string ret = name;
+      if (labels.empty() && !extra) return ret;
+      ret += "{" + labels;
+      if (extra) ret += std::string(labels.empty() ? "" : ",") + extra;
+      return ret + "}";
+    }
+  }
+
+  LatencyHistogram & histogram(const std::string & name, const std::string & labelsIn)
+  {
+    pthread_mutex_lock(&registryLock);
+    std::string labels = labelsIn;
+    Registry::iterator it = registry.find(name + "{" + labels);
+    if (it == registry.end() && registry.size() >= MaxHistograms) {
+      labels = "other=\"1\""; // don't let junk labels eat up memory
+      it = registry.find(name + "{" + labels);
+    }
+    if (it == registry.end()) {
+      Entry e;
+      e.name = name;
+      e.labels = labels;
+      e.h = new LatencyHistogram;
+      it = registry.insert(Registry::value_type(name + "{" + labels, e)).first;
+    }
+    LatencyHistogram & h = *it->second.h;
+    pthread_mutex_unlock(&registryLock);
+    return h;
+  }
+
+  std::string text()
+  {
+    std::ostringstream s;
+    pthread_mutex_lock(&registryLock);
+    for (Registry::const_iterator it = registry.begin(); it != registry.end(); ++it) {
+      const Entry & e = it->second;
+      const LatencyHistogram::Summary sum = e.h->summary();
+      s << withLabels(e.name + "_count", e.labels) << " " << sum.count << "\n"
+        << withLabels(e.name + "_mean", e.labels) << " " << sum.mean << "\n"
+        << withLabels(e.name, e.labels, "quantile=\"0.5\"") << " " << sum.p50 << "\n"
+        << withLabels(e.name, e.labels, "quantile=\"0.9\"") << " " << sum.p90 << "\n"
+        << withLabels(e.name, e.labels, "quantile=\"0.99\"") << " " << sum.p99 << "\n"
+        << withLabels(e.name, e.labels, "quantile=\"0.999\"") << " " << sum.p999 << "\n"
+        << withLabels(e.name + "_max", e.labels) << " " << sum.max << "\n";
+    }
+    pthread_mutex_unlock(&registryLock);
+    return s.str();
+  }
+}
@@ -0,0 +1,57 @@
+#ifndef Metrics_h
+#define Metrics_h
+
+#include <string>
+
+/**
+   Latency histograms for the server's runtime statistics (GET STATS and
+   the metrics port).
+
+   A LatencyHistogram counts microsecond values in log-linear buckets, in
+   the style of HdrHistogram: SubBuckets linear buckets for every power of
+   two, so any value is counted with better than 100/SubBuckets percent
+   precision, from 1us up to days, in a few KB.  Recording is a handful of
+   atomic adds, no locks, so any thread may record into any histogram.
+
+   Histograms are created on first use by name and never freed, and
+   Metrics::text() renders them all in the Prometheus text format.
+*/
+class LatencyHistogram
+{
+public:
+  enum { SubBits = 5, SubBuckets = 1 << SubBits, MaxExp = 40, NumBuckets = (MaxExp - SubBits + 1) * SubBuckets };
+
+  LatencyHistogram();
+  void record(unsigned long long us);
+  void recordSecs(double secs) { record(secs > 0. ? (unsigned long long)(secs * 1e6 + 0.5) : 0); }
+
+  struct Summary
+  {
+    unsigned long long count, max;
+    double mean, p50, p90, p99, p999;
+  };
+  Summary summary() const;
+
+private:
+  static unsigned bucketOf(unsigned long long us);
+  static unsigned long long bucketValue(unsigned b); ///< the middle of bucket b
+
+  volatile unsigned long counts[NumBuckets];
+  volatile unsigned long long total, sum, max;
+};
+
+namespace Metrics
+{
+  /** The histogram for metric name with the given Prometheus labels (say
+      cmd="GET EVENTS"), created if need be.  At most MaxHistograms get
+      created, after that the labels become other="1". */
+  extern LatencyHistogram & histogram(const std::string & name, const std::string & labels = "");
+
+  enum { MaxHistograms = 256 };
+
+  /** All the histograms, as a Prometheus "summary" each: name_count,
+      name_mean, name{quantile=...} and name_max lines. */
+  extern std::string text();
+}
+
+#endif
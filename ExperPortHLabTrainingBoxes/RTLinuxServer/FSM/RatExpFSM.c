@@ -9,6 +9,9 @@
  * License: GPL v2 or later.
  */
 
+#ifdef FSM_SIM
+#include "RatExpFSMSim.h" /* the userspace simulator, see RatExpFSMSim.h */
+#else
 #include <linux/module.h> 
 #include <linux/kernel.h>
 #include <linux/version.h>
@@ -18,6 +21,7 @@
 #include <linux/delay.h>
 #include <asm/semaphore.h> /* for synchronization primitives           */
 #include <asm/bitops.h>    /* for set/clear bit                        */
+#include <asm/system.h>    /* for cmpxchg                              */
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
 #include <linux/string.h> /* some memory copyage                       */
@@ -41,12 +45,16 @@
    first bit to be bit 0. */
 static __inline__ int __ffs(int x) { return ffs(x)-1; }
 #endif
+#endif
 
 #include "RatExpFSM.h"
+#ifndef FSM_SIM
 #include "../LynxTrig/LynxTrigVirt.h" /* Ehh ugly, I know.. but it's a 
                                          hack for now.. */
 #include "FSMExternalTime.h" /* for the external time shm stuff */
+#endif
 #include "softtask.h" /* for asynchronous process context kernel tasks! */
+#include "timerwheel.h" /* for state timeouts and sched wave edges */
 
 #define MODULE_NAME "RatExpFSM"
 #ifdef MODULE_LICENSE
@@ -71,11 +79,17 @@ typedef unsigned FSMID_t;
 static int initRunStates(void);
 static int initRunState(FSMID_t);
 static int initShm(void);
+static int claimPoolSlot(void);
+static int poolSlotRef(unsigned slot, int delta);
+static void releaseFSMSlots(FSMID_t);
+static int otherSlotForWriting(FSMID_t);
 static int initBuddyTask(void);
 static int initFifos(void);
 static int initTaskPeriod(void);
 static int initRT(void);
 static int initComedi(void);
+static void reconfigureFSMIO(FSMID_t); /* the per-FSM part of reconfigureIO() */
+static void requestReconfigureIO(FSMID_t); /* reconfigureIO() from FSM f's tick */
 static void reconfigureIO(void); /* helper that reconfigures DIO channels 
                                     for INPUT/OUTPUT whenever the state 
                                     matrix, etc changes, computes ai_chans_in_use_mask, di_chans_in_use_mask, etc */
@@ -88,6 +102,9 @@ static void cleanupAOWave(volatile struct AOWaveINTERNAL *, FSMID_t fsm_id, int
 
 /* The callback called by rtlinux scheduler every task period... */
 static void *doFSM (void *);
+/* ..and, with threaded=1, the per state machine RT threads it drives */
+static void *doFSMThread (void *);
+static void doFSMTick(FSMID_t, hrtime_t cycleT0);
 
 /* Called whenever the /proc/RatExpFSM proc file is read */
 static int myseq_show (struct seq_file *m, void *d);
@@ -110,15 +127,23 @@ module_exit(cleanup);
 static volatile Shm *shm = 0;
 static volatile struct LynxTrigVirtShm *lynxTrigShm = 0; /* For lynx sound triggering.. */
 static volatile struct FSMExtTimeShm *extTimeShm = 0; /* for external time synch. */
+static volatile struct FSMHistShm *histShm = 0; /* state histories, exported to userspace */
+static volatile struct FSMBlobPool *fsmPool = 0; /* the FSMs themselves, shared with userspace */
 
 #define JITTER_TOLERANCE_NS 76000
-#define MAX_HISTORY 65536 /* The maximum number of state transitions we remember -- note that the struct StateTransition is currently 16 bytes so the memory we consume (in bytes) is this number times 16! */
 #define DEFAULT_SAMPLING_RATE 6000
 #define DEFAULT_AI_SAMPLING_RATE 10000
 #define DEFAULT_AI_SETTLING_TIME 5
 #define DEFAULT_TRIGGER_MS 1
 #define DEFAULT_AI "synch"
 #define MAX_AI_CHANS (sizeof(unsigned)*8)
+#define EVT_WORD_BITS (sizeof(unsigned long)*8)
+/* enough words for event ids 0 to FSM_MAX_IN_EVENTS, the last being the 
+   timeout column of an FSM with that many input events */
+#define EVT_WORDS ((FSM_MAX_IN_EVENTS + EVT_WORD_BITS) / EVT_WORD_BITS)
+/* A set of wave ids, 0 to FSM_MAX_SCHED_WAVES-1, see waveSetAdd() etc. */
+#define WAVE_WORDS ((FSM_MAX_SCHED_WAVES + EVT_WORD_BITS - 1) / EVT_WORD_BITS)
+struct WaveSet { unsigned long w[WAVE_WORDS]; };
 #define MAX(a,b) ( a > b ? a : b )
 #define MIN(a,b) ( a < b ? a : b )
 static char COMEDI_DEVICE_FILE[] = "/dev/comediXXXXXXXXXXXXXXX";
@@ -127,9 +152,14 @@ int minordev = 0, minordev_ai = -1, minordev_ao = -1,
     ai_sampling_rate = DEFAULT_AI_SAMPLING_RATE, 
     ai_settling_time = DEFAULT_AI_SETTLING_TIME,  /* in microsecs. */
     trigger_ms = DEFAULT_TRIGGER_MS,    
+    num_fsms = FSM_DEFAULT_STATE_MACHINES,
+    threaded = 0,
+    fsm_pool_slots = 0,
     debug = 0,
     avoid_redundant_writes = 0;
 char *ai = DEFAULT_AI;
+static unsigned n_fsms = 0; /* num_fsms, once initShm() has checked it, 
+                               for comparing with FSMID_t's */
 
 #ifndef STR
 #define STR1(x) #x
@@ -149,6 +179,12 @@ MODULE_PARM(ai_settling_time, "i");
 MODULE_PARM_DESC(ai_settling_time, "The amount of time, in microseconds, that it takes an AI channel to settle.  This is a function of the max sampling rate of the board. Defaults to " STR(DEFAULT_AI_SETTLING_TIME) ".");
 MODULE_PARM(trigger_ms, "i");
 MODULE_PARM_DESC(trigger_ms, "The amount of time, in milliseconds, to sustain trigger outputs.  Defaults to " STR(DEFAULT_TRIGGER_MS) ".");
+MODULE_PARM(num_fsms, "i");
+MODULE_PARM_DESC(num_fsms, "The number of state machines to run, each with its own fifos, history and (for the server) client connection.  At most " STR(FSM_MAX_STATE_MACHINES) ".  Defaults to " STR(FSM_DEFAULT_STATE_MACHINES) ".");
+MODULE_PARM(threaded, "i");
+MODULE_PARM_DESC(threaded, "If true, run each state machine on its own RT thread, pinned to its own CPU, with the main RT thread left to do the DAQ board I/O each cycle.  Needs at least 2 CPUs.  Defaults to 0 (all state machines run in turn on the one RT thread).");
+MODULE_PARM(fsm_pool_slots, "i");
+MODULE_PARM_DESC(fsm_pool_slots, "The number of FSMs, of up to " STR(FSM_MEMORY_BYTES) " bytes each, that the state machines can have loaded between them: each one holds one for the FSM it runs, and one more while a new FSM or patch waits to be swapped in.  At most " STR(FSM_POOL_MAX_SLOTS) ".  Defaults to 0, meaning 2 per state machine, plus 1 for the empty FSM (which only takes a few bytes).");
 MODULE_PARM(debug, "i");
 MODULE_PARM_DESC(debug, "If true, print extra (cryptic) debugging output.  Defaults to 0.");
 MODULE_PARM(avoid_redundant_writes, "i");
@@ -171,26 +207,44 @@ MODULE_PARM_DESC(ai, "This can either be \"synch\" or \"asynch\" to determine wh
 #define NUM_ROWS(f) (rs[(f)].states->n_rows)
 #define NUM_COLS(f) (rs[(f)].states->n_cols)
 #define TIMER_EXPIRED(f,state_timeout_us) ( (rs[(f)].current_ts - rs[(f)].current_timer_start) >= ((int64)(state_timeout_us))*1000LL )
-#define RESET_TIMER(f) (rs[(f)].current_timer_start = rs[(f)].current_ts)
-#define NUM_TRANSITIONS(f) ((rs[(f)].history.num_transitions))
+#define RESET_TIMER(f) do { rs[(f)].current_timer_start = rs[(f)].current_ts; armStateTimer(f); } while (0)
+/* Timer ids on each FSM's timer wheel: the state timeout, then one per 
+   sched wave (for the wave's next edge) */
+#define STATE_TIMER 0
+#define WAVE_TIMER(wave) (1+(wave))
+#define NUM_TIMERS WAVE_TIMER(FSM_MAX_SCHED_WAVES)
+#define TIMERS(f) ((struct TimerWheel *)&rs[(f)].timers)
+#define NUM_TRANSITIONS(f) ((rs[(f)].history->num_transitions))
 #define IN_CHAN_TYPE(f) ((const unsigned)rs[(f)].states->routing.in_chan_type)
 #define AI_THRESHOLD_VOLTS_HI ((const unsigned)4)
 #define AI_THRESHOLD_VOLTS_LOW ((const unsigned)3)
 enum { SYNCH_MODE = 0, ASYNCH_MODE, UNKNOWN_MODE };
 #define AI_MODE ((const unsigned)ai_mode)
+#define POOL_BLOB(i) FSM_POOL_BLOB(fsmPool, (i))
+#define POOL_REFS(i) (fsmPool->refs[(i)])
 #define FSM_PTR(f) ((struct FSMBlob *)(rs[(f)].states))
-#define OTHER_FSM_PTR(f) ((struct FSMBlob *)(FSM_PTR(f) == &rs[(f)].states1 ? &rs[(f)].states2 : &rs[(f)].states1))
+#define OTHER_FSM_PTR(f) POOL_BLOB(rs[(f)].other_slot)
 #define INPUT_ROUTING(f,x) (rs[(f)].states->routing.input_routing[(x)])
-#define SW_INPUT_ROUTING(f,x) ( !rs[(f)].states->has_sched_waves ? -1 : rs[(f)].states->routing.sched_wave_input[(x)] )
-#define SW_OUTPUT_ROUTING(f,x) ( !rs[(f)].states->has_sched_waves ? -1 : rs[(f)].states->routing.sched_wave_output[(x)] )
+#define SW_INPUT_ROUTING(f,x) ( !rs[(f)].has_sched_waves ? -1 : rs[(f)].states->routing.sched_wave_input[(x)] )
+#define SW_OUTPUT_ROUTING(f,x) ( !rs[(f)].has_sched_waves ? -1 : rs[(f)].states->routing.sched_wave_output[(x)] )
 static struct proc_dir_entry *proc_ent = 0;
 static volatile int rt_task_stop = 0; /* Internal variable to stop the RT 
                                          thread. */
 static volatile int rt_task_running = 0;
 
-static struct SoftTask *buddyTask[NUM_STATE_MACHINES] = {0}, /* non-RT kernel-side process context buddy 'tasklet' */
+static struct SoftTask *buddyTask[FSM_MAX_STATE_MACHINES] = {0}, /* non-RT kernel-side process context buddy 'tasklet' */
                        *buddyTaskComedi = 0;
 static pthread_t rt_task;
+/* threaded=1: one RT thread per state machine.  doFSM() bumps tick_seq once
+   the inputs are read, each FSM thread does its tick and stores tick_seq in
+   fsm_tick_done[f], and doFSM() waits for all of them before writing the
+   outputs. */
+static pthread_t fsm_task[FSM_MAX_STATE_MACHINES];
+static int fsm_task_running[FSM_MAX_STATE_MACHINES] = {0};
+static volatile unsigned long tick_seq = 0, fsm_tick_done[FSM_MAX_STATE_MACHINES] = {0};
+static hrtime_t tick_t0 = 0;
+static struct timespec tick_wakeup;
+static volatile int reconfigure_pending = 0; /* an FSM thread wants reconfigureIO() */
 static comedi_t *dev = 0, *dev_ai = 0, *dev_ao = 0;
 static unsigned subdev = 0, subdev_ai = 0, subdev_ao = 0, n_chans_ai_subdev = 0, n_chans_dio_subdev = 0, n_chans_ao_subdev = 0, maxdata_ai = 0, maxdata_ao = 0;
 
@@ -213,10 +267,8 @@ comedi_krange ai_krange, ao_krange;
 unsigned long ai_asynch_buffer_size = 0; /* Size of driver's DMA circ. buf. */
 unsigned ai_range = 0, ai_mode = UNKNOWN_MODE, ao_range = 0;
 unsigned ai_chans_in_use_mask = 0, di_chans_in_use_mask = 0, do_chans_in_use_mask = 0; 
-unsigned int lastTriggers; /* Remember the trigger lines -- these 
-                              get shut to 0 after 1 cycle                */
 uint64 cycle = 0; /* the current cycle */
-uint64 trig_cycle[NUM_STATE_MACHINES] = {0}; /* The cycle at which a trigger occurred, useful for deciding when to clearing a trigger (since we want triggers to last trigger_ms) */
+uint64 trig_cycle[FSM_MAX_STATE_MACHINES] = {0}; /* The cycle at which a trigger occurred, useful for deciding when to clearing a trigger (since we want triggers to last trigger_ms) */
 #define BILLION 1000000000
 #define MILLION 1000000
 uint64 task_period_ns = BILLION;
@@ -232,28 +284,25 @@ static inline void CHK_AND_DO_LYNX_TRIG(FSMID_t f, unsigned which_card, unsigned
 /*---------------------------------------------------------------------------- 
   More internal 'global' variables and data structures.
 -----------------------------------------------------------------------------*/
-struct StateHistory
-{
-  /* The state history is a circular history.  It is a series of 
-     state number/timestamp pairs, that keeps growing until it loops around
-     to the beginning.                                                       */
-  struct StateTransition transitions[MAX_HISTORY];
-  unsigned num_transitions; /* Number of total transitions since RESET of state
-                               machine.  
-                               Index into array: num_transitions%MAX_HISTORY */
-};
-
 struct RunState {
     /* TODO: verify this is smp-safe.                                        */
     
     /* FSM Specification */
     
-    /* The actual state transition specifications -- 
-       we have two of them since we swap them when a new FSM comes in from
-       userspace to avoid dropping events during ITI. */
-    struct FSMBlob    states1;
-    struct FSMBlob    states2;
-    struct FSMBlob   *states;
+    /* The actual state transition specifications live in fsmPool.  We
+       hold two of them: the one we run, and the other one which a new FSM
+       from userspace goes into, so that we can swap them to avoid dropping 
+       events during ITI.  0 (the empty FSM) means no slot. */
+    unsigned          cur_slot;
+    unsigned          other_slot;
+    struct FSMBlob   *states; /* == POOL_BLOB(cur_slot) */
+
+    /* Cached from states by swapFSMs(), kept here rather than in the 
+       blob as the pool slots are shared with userspace.  */
+    unsigned has_sched_waves;
+    /* The input channels whose edge-up (resp. edge-down) is routed to an 
+       input event column, for detectInputEvents() */
+    unsigned in_chan_up_mask, in_chan_down_mask;
 
     /* End FSM Specification. */
 
@@ -304,14 +353,19 @@ struct RunState {
     int64 edge_down_ts; /**< from: edge_up_ts + SchedWave::sustain_us        */
     int64 end_ts;       /**< from: edge_down_ts + SchedWave::refractory_us   */
   } active_wave[FSM_MAX_SCHED_WAVES];
-  /** A quick mask of the currently active scheduled waves.  The set bits
-      in this mask correspond to array indices of the active_wave
+  /** The currently active scheduled waves, as indices of the active_wave
       array above. */
-  unsigned active_wave_mask;
-  /** A quick mask of the currently active AO waves.  The set bits
-      in this mask correspond to array indices of the aowaves array outside 
-      this struct. */
-  unsigned active_ao_wave_mask; 
+  struct WaveSet active_waves;
+  /** The deadlines the RT task is waiting on: each active wave's next 
+      component and the current state's timeout, so that a cycle only 
+      looks at the ones that are due. */
+  struct TimerWheel timers;
+  struct TimerWheelTimer timer_slots[NUM_TIMERS];
+  /** Set when the STATE_TIMER goes off, cleared when it is armed again */
+  int state_timed_out;
+  /** The currently active AO waves, as indices of the aowaves array 
+      below. */
+  struct WaveSet active_ao_waves;
   /** Store pointers to analog output wave data -- 
    *  Note: to avoid memory leaks make sure initRunState() is never called when
    *  we have active valid pointers here!  This means that aowaves should be cleaned
@@ -330,6 +384,19 @@ struct RunState {
   /** Keep track of trigger and cont chans per state machine */
   unsigned do_chans_trig_mask, do_chans_cont_mask;
 
+  /** Remember the trigger lines -- these get shut to 0 after trigger_ms */
+  unsigned last_triggers;
+
+  /** This tick's DO writes, merged and written by commitDataWrites() */
+  unsigned pending_output_bits, pending_output_mask;
+
+  /** This tick's AO writes, one per line, written by commitAOWrites() */
+  struct AOWrite {
+    unsigned chan;
+    lsampl_t samp;
+  } ao_writes[FSM_MAX_SCHED_WAVES];
+  unsigned n_ao_writes;
+
   /** Keep track of the last IP out trig values to avoid sending dupe packets -- used by doOutput() */
   char last_ip_outs_is_valid[FSM_MAX_OUT_EVENTS];
   /** Keep track of the last IP out trig values to avoid sending dupe packets -- used by doOutput() */
@@ -337,14 +404,20 @@ struct RunState {
 
   unsigned pending_fsm_swap; /**< iff true, need to swap fsms on next state0 
                                   crossing */
+  /** Set by the buddy task for the RT task: the FSM it was given (a sparse 
+      one) was malformed and was not copied into the other bank */
+  unsigned new_fsm_bad;
 
-  /* This *always* should be at the end of this struct since we don't clear
-     the whole thing in initRunState(), but rather clear bytes up until
-     this point! */
-    struct StateHistory history;             /* Our state history record.   */
+  /** Set by the RT task for the buddy task: the FSMPATCH is for the other
+      bank itself, which is waiting to be swapped in, not the current one */
+  unsigned patch_pending_bank;
+
+  /* Our state history record, points into histShm (see struct StateHistory 
+     in RatExpFSM.h for how it's read from userspace).                      */
+  volatile struct StateHistory *history;
 };
 
-volatile static struct RunState rs[NUM_STATE_MACHINES];
+static volatile struct RunState *rs = 0; /* num_fsms of them, vmalloc'd by initRunStates() */
 
 
 /*---------------------------------------------------------------------------
@@ -353,28 +426,43 @@ volatile static struct RunState rs[NUM_STATE_MACHINES];
 static inline volatile struct StateTransition *historyAt(FSMID_t, unsigned);
 static inline volatile struct StateTransition *historyTop(FSMID_t);
 static inline void historyPush(FSMID_t, int event_id);
+static inline void publishStatus(FSMID_t); /**< snapshots rs[f] into SHM_STATUS(shm, f) for userspace */
 
 static int gotoState(FSMID_t, unsigned state_no, int event_id_for_history); /**< returns 1 if new state, 0 if was the same and no real transition ocurred, -1 on error */
-static unsigned long detectInputEvents(FSMID_t); /**< returns 0 on no input detected, otherwise returns bitfield array of all the events detected -- each bit corresponds to a state matrix "in event column" position, eg center in is bit 0, center out is bit 1, left-in is bit 2, etc */
+/** A set of input event ids, a bit per state matrix "in event column" position, eg center in is bit 0, center out is bit 1, left-in is bit 2, etc */
+struct EventSet { unsigned long w[EVT_WORDS]; };
+static inline void eventSetAdd(struct EventSet *, unsigned event_id);
+static inline int waveSetHas(const volatile struct WaveSet *, unsigned wave);
+static inline void waveSetAdd(volatile struct WaveSet *, unsigned wave);
+static inline void waveSetDel(volatile struct WaveSet *, unsigned wave);
+static inline int waveSetFirst(const volatile struct WaveSet *); /**< the lowest wave id in the set, -1 if it's empty */
+static inline unsigned waveSetMask32(const volatile struct WaveSet *); /**< waves 0-31 of the set as a bit mask, for struct FSMStatus */
+static void detectInputEvents(FSMID_t, struct EventSet *); /**< adds all the input events detected to the set */
 static int doSanityChecksStartup(void); /**< Checks mod params are sane. */
 static int doSanityChecksRuntime(FSMID_t); /**< Checks FSM input/output params */
+static int checkSparseFSM(FSMID_t, const struct FSMBlob *); /**< Checks the layout of a sparse FSM, called by the buddy task */
 static void doOutput(FSMID_t);
 static void clearAllOutputLines(FSMID_t);
 static inline void clearTriggerLines(FSMID_t);
 static void dispatchEvent(FSMID_t, unsigned event_id);
 static void handleFifos(FSMID_t);
-static inline void dataWrite(unsigned chan, unsigned bit);
+static inline void dataWrite(FSMID_t, unsigned chan, unsigned bit);
 static void commitDataWrites(void);
+static void aoWrite(FSMID_t, unsigned chan, lsampl_t samp);
+static void commitAOWrites(void);
 static void grabAllDIO(void);
 static void grabAI(void); /* AI version of above.. */
 static void doDAQ(void); /* does the data acquisition for remaining channels that grabAI didn't get.  See STARTDAQ fifo cmd. */
-static unsigned long processSchedWaves(FSMID_t); /**< updates active wave state, does output, returns event id mask of any waves that generated input events (if any) */
-static unsigned long processSchedWavesAO(FSMID_t); /**< updates active wave state, does output, returns event id mask of any waves that generated input events (if any) */
+static void runTimers(FSMID_t, struct EventSet *); /**< fires whatever is due on the FSM's timer wheel: sched wave components and the state timeout */
+static void expireSchedWave(FSMID_t, unsigned wave, struct EventSet *); /**< updates the wave's state, does output, adds the event ids of any edges that generated input events (if any) to the set */
+static void armStateTimer(FSMID_t); /**< (re)arms the STATE_TIMER for the current state's timeout */
+static void processSchedWavesAO(FSMID_t, struct EventSet *); /**< updates active wave state, does output, adds the event ids of any waves that generated input events (if any) to the set */
 static void scheduleWave(FSMID_t, unsigned wave_id, int op);
 static void scheduleWaveDIO(FSMID_t, unsigned wave_id, int op);
 static void scheduleWaveAO(FSMID_t, unsigned wave_id, int op);
 static void stopActiveWaves(FSMID_t); /* called when FSM starts a new trial */
 static void updateHasSchedWaves(FSMID_t);
+static void updateInChanMasks(FSMID_t);
 static void swapFSMs(FSMID_t);
 
 /* just like clock_gethrtime but instead it used timespecs */
@@ -436,13 +524,19 @@ void cleanup (void)
   if (proc_ent)
     remove_proc_entry(MODULE_NAME, 0);
 
+  rt_task_stop = 1;
   if (rt_task_running) {
-    rt_task_stop = 1;
     pthread_cancel(rt_task);
     pthread_join(rt_task, 0);
   }
-  for (f = 0; f < NUM_STATE_MACHINES; ++f) {
-    cleanupAOWaves(f);
+  for (f = 0; f < n_fsms; ++f) 
+    if (fsm_task_running[f]) {
+      pthread_cancel(fsm_task[f]);
+      pthread_join(fsm_task[f], 0);
+      fsm_task_running[f] = 0;
+    }
+  for (f = 0; f < n_fsms; ++f) {
+    if (rs) cleanupAOWaves(f);
 
     if (buddyTask[f]) softTaskDestroy(buddyTask[f]);
     buddyTask[f] = 0;
@@ -473,7 +567,7 @@ void cleanup (void)
   }
 
   if (shm)  { 
-    for (f = 0; f < NUM_STATE_MACHINES; ++f) {
+    for (f = 0; f < n_fsms; ++f) {
       if (shm->fifo_in[f] >= 0) rtf_destroy(shm->fifo_in[f]);
       if (shm->fifo_out[f] >= 0) rtf_destroy(shm->fifo_out[f]);
       if (shm->fifo_trans[f] >= 0) rtf_destroy(shm->fifo_trans[f]);
@@ -484,6 +578,18 @@ void cleanup (void)
     mbuff_free(SHM_NAME, (void *)shm); 
     shm = 0; 
   }
+  if (rs) {
+    vfree((void *)rs);
+    rs = 0;
+  }
+  if (histShm) {
+    mbuff_free(FSM_HIST_SHM_NAME, (void *)histShm);
+    histShm = 0;
+  }
+  if (fsmPool) {
+    mbuff_free(FSM_POOL_SHM_NAME, (void *)fsmPool);
+    fsmPool = 0;
+  }
   if (lynxTrigShm) {
     /* Kcount needs to be decremented so need to detach.. */
     mbuff_detach(LYNX_TRIG_VIRT_SHM_NAME, (void *)lynxTrigShm);
@@ -509,7 +615,7 @@ static void printStats(void)
 static int initBuddyTask(void)
 {
   FSMID_t f;
-  for (f = 0; f < NUM_STATE_MACHINES; ++f) {
+  for (f = 0; f < n_fsms; ++f) {
     buddyTask[f] = softTaskCreate(buddyTaskHandler, MODULE_NAME" Buddy Task");
     if (!buddyTask[f]) return -ENOMEM;
   }
@@ -522,17 +628,44 @@ static int initShm(void)
 {
   FSMID_t f;
 
-  shm = (volatile struct Shm *) mbuff_alloc(SHM_NAME, SHM_SIZE);
+  if (num_fsms < 1 || num_fsms > FSM_MAX_STATE_MACHINES) {
+    ERROR("num_fsms=%d is out of range, it needs to be from 1 to %d.\n", num_fsms, FSM_MAX_STATE_MACHINES);
+    num_fsms = 0; /* so that cleanup() doesn't go past the end of anything */
+    return -EINVAL;
+  }
+  n_fsms = num_fsms;
+
+  shm = (volatile struct Shm *) mbuff_alloc(SHM_NAME, SHM_SIZE(num_fsms));
   if (! shm)  return -ENOMEM;
   
-  memset((void *)shm, 0, sizeof(*shm));
+  memset((void *)shm, 0, SHM_SIZE(num_fsms));
+  shm->num_fsms = num_fsms;
   shm->magic = SHM_MAGIC;
   
   shm->fifo_debug = -1;
   
-  for (f = 0; f < NUM_STATE_MACHINES; ++f)
+  for (f = 0; f < n_fsms; ++f)
     shm->fifo_nrt_output[f] = shm->fifo_daq[f] = shm->fifo_trans[f] = shm->fifo_out[f] = shm->fifo_in[f] = -1;
 
+  histShm = (volatile struct FSMHistShm *) mbuff_alloc(FSM_HIST_SHM_NAME, FSM_HIST_SHM_SIZE(num_fsms));
+  if (! histShm)  return -ENOMEM;
+  memset((void *)histShm, 0, FSM_HIST_SHM_SIZE(num_fsms));
+  histShm->num_fsms = num_fsms;
+  histShm->magic = FSM_HIST_SHM_MAGIC;
+
+  if (!fsm_pool_slots) fsm_pool_slots = 2*num_fsms + 1;
+  if (fsm_pool_slots < 2 || fsm_pool_slots > FSM_POOL_MAX_SLOTS) {
+    ERROR("fsm_pool_slots=%d is out of range, it needs to be from 2 to %d.\n", fsm_pool_slots, FSM_POOL_MAX_SLOTS);
+    return -EINVAL;
+  }
+  fsmPool = (volatile struct FSMBlobPool *) mbuff_alloc(FSM_POOL_SHM_NAME, FSM_POOL_SHM_SIZE(fsm_pool_slots));
+  if (! fsmPool)  return -ENOMEM;
+  memset((void *)fsmPool, 0, FSM_POOL_SHM_SIZE(fsm_pool_slots));
+  fsmPool->num_slots = fsm_pool_slots;
+  POOL_REFS(0) = 1; /* never free */
+  wmb();
+  fsmPool->magic = FSM_POOL_SHM_MAGIC;
+
   lynxTrigShm = mbuff_attach(LYNX_TRIG_VIRT_SHM_NAME, LYNX_TRIG_VIRT_SHM_SIZE);
   if (!lynxTrigShm) {
     LOG_MSG("Could not attach to SHM %s.\n", LYNX_TRIG_VIRT_SHM_NAME);
@@ -575,7 +708,7 @@ static int initFifos(void)
 
   /* Open up fifos here.. */
   
-  for (f = 0; f < NUM_STATE_MACHINES; ++f) {
+  for (f = 0; f < n_fsms; ++f) {
     err = find_free_rtf(&minor, FIFO_SZ);
     if (err < 0) return 1;
     shm->fifo_out[f] = minor;
@@ -609,27 +742,35 @@ static int initRunStates(void)
 {
   FSMID_t f;
   int ret = 0;
-  for (f = 0; !ret && f < NUM_STATE_MACHINES; ++f) ret |= initRunState(f);
+  /* too big to be static for FSM_MAX_STATE_MACHINES of them */
+  rs = (volatile struct RunState *) vmalloc(num_fsms * sizeof(struct RunState));
+  if (!rs) return -ENOMEM;
+  for (f = 0; !ret && f < n_fsms; ++f) ret |= initRunState(f);
   return ret;
 }
 
 static int initRunState(FSMID_t f)
 {
-  /* Clear the runstate memory area.. note how we only clear the beginning
-     and don't touch the state history since it is rather large! */
-  memset((void *)&rs[f], 0, sizeof(rs[f]) - sizeof(struct StateHistory));
-  rs[f].states = (struct FSMBlob *)&rs[f].states1;
+  /* Clear the runstate memory area.. the state history isn't in it since it 
+     is rather large! */
+  memset((void *)&rs[f], 0, sizeof(rs[f]));
+  rs[f].states = POOL_BLOB(0); /* callers release our slots beforehand */
 
   /* Now, initialize the history.. */
-  rs[f].history.num_transitions = 0; /* indicate no state history. */
+  rs[f].history = &histShm->history[f];
+  rs[f].history->num_transitions = 0; /* indicate no state history. */
+  /* ..and tell readers in the middle of a copy, see struct StateHistory */
+  wmb();
+  ++rs[f].history->reset_count;
 
   /* clear first element of transitions array to be anal */
-  memset((void *)&rs[f].history.transitions[0], 0, sizeof(rs[f].history.transitions[0]));
+  memset((void *)&rs[f].history->transitions[0], 0, sizeof(rs[f].history->transitions[0]));
   
   /* Grab current time from gethrtime() which is really the pentium TSC-based 
      timer  on most systems. */
   rs[f].init_ts = gethrtime();
 
+  timerWheelInit(TIMERS(f), (struct TimerWheelTimer *)rs[f].timer_slots, NUM_TIMERS, 0);
   RESET_TIMER(f);
 
   rs[f].forced_event = -1; /* Negative value here means not forced.. this needs
@@ -691,6 +832,42 @@ static int initComedi(void)
   return 0;
 }
 
+static void reconfigureFSMIO(FSMID_t f)
+{
+  unsigned i;
+
+  rs[f].do_chans_cont_mask = 0;
+  rs[f].do_chans_trig_mask = 0;
+  /* indicate to doOutputs() that the last_ip_outs array is to be ignored
+     until an output occurs on that ip_out column */
+  memset((void *)&rs[f].last_ip_outs_is_valid, 0, sizeof(rs[f].last_ip_outs_is_valid));
+
+  for (i = 0; i < NUM_OUT_COLS(f); ++i) {
+    struct OutputSpec *spec = OUTPUT_ROUTING(f,i);
+    switch (spec->type) {
+    case OSPEC_DOUT:
+      rs[f].do_chans_cont_mask |= ((0x1<<(spec->to+1 - spec->from))-1) << spec->from;        
+      break;
+    case OSPEC_TRIG:
+      rs[f].do_chans_trig_mask |= ((0x1<<(spec->to+1 - spec->from))-1) << spec->from;
+      break;
+    }
+  }
+}
+
+static void requestReconfigureIO(FSMID_t f)
+{
+  if (!threaded) {
+    reconfigureIO();
+    return;
+  }
+  /* The other state machines are running: just redo our own masks now, so
+     the rest of this tick sees them, and leave the shared masks and the DIO
+     config to doFSM(), once all the state machines are done with the tick */
+  reconfigureFSMIO(f);
+  reconfigure_pending = 1;
+}
+
 static void reconfigureIO(void)
 {
   int i, reconf_ct = 0;
@@ -711,30 +888,14 @@ static void reconfigureIO(void)
   di_chans_in_use_mask = 0;
   do_chans_in_use_mask = 0;
 
-  for (f = 0; f < NUM_STATE_MACHINES; ++f) {
-    rs[f].do_chans_cont_mask = 0;
-    rs[f].do_chans_trig_mask = 0;
-    /* indicate to doOutputs() that the last_ip_outs array is to be ignored
-       until an output occurs on that ip_out column */
-    memset((void *)&rs[f].last_ip_outs_is_valid, 0, sizeof(rs[f].last_ip_outs_is_valid));
-
+  for (f = 0; f < n_fsms; ++f) {
+    reconfigureFSMIO(f);
     for (i = FIRST_IN_CHAN(f); i < NUM_IN_CHANS(f); ++i)
       if (IN_CHAN_TYPE(f) == AI_TYPE)
         ai_chans_in_use_mask |= 0x1<<i;
       else
         di_chans_in_use_mask |= 0x1<<i;
-    for (i = 0; i < NUM_OUT_COLS(f); ++i) {
-      struct OutputSpec *spec = OUTPUT_ROUTING(f,i);
-      switch (spec->type) {
-      case OSPEC_DOUT:
-        rs[f].do_chans_cont_mask |= ((0x1<<(spec->to+1 - spec->from))-1) << spec->from;        
-        break;
-      case OSPEC_TRIG:
-        rs[f].do_chans_trig_mask |= ((0x1<<(spec->to+1 - spec->from))-1) << spec->from;
-        break;
-      }
-      do_chans_in_use_mask |= rs[f].do_chans_cont_mask|rs[f].do_chans_trig_mask;
-    }
+    do_chans_in_use_mask |= rs[f].do_chans_cont_mask|rs[f].do_chans_trig_mask;
   }
 
   DEBUG("ReconfigureIO masks: ai_chans_in_use_mask 0x%x di_chans_in_use_mask 0x%x do_chans_in_use_mask 0x%x\n", ai_chans_in_use_mask, di_chans_in_use_mask, do_chans_in_use_mask);
@@ -1207,6 +1368,25 @@ static int initRT(void)
   sched_param.sched_priority = sched_get_priority_max(SCHED_FIFO);
   error = pthread_attr_setschedparam(&attr, &sched_param);  
   if (error) return -error;
+  if (threaded && rtl_num_cpus() < 2) {
+    WARNING("threaded=1 needs at least 2 CPUs, running all state machines on the one RT thread.\n");
+    threaded = 0;
+  }
+  if (threaded) {
+    FSMID_t f;
+    /* The I/O thread gets CPU 0, the state machines share the rest */
+    pthread_attr_setcpu_np(&attr, 0);
+    for (f = 0; f < n_fsms; ++f) {
+      pthread_attr_t fattr;
+      pthread_attr_init(&fattr);
+      pthread_attr_setfp_np(&fattr, 1);
+      pthread_attr_setschedparam(&fattr, &sched_param);
+      pthread_attr_setcpu_np(&fattr, 1 + f % (rtl_num_cpus()-1));
+      error = pthread_create(&fsm_task[f], &fattr, doFSMThread, (void *)(long)f);
+      if (error) return -error;
+      fsm_task_running[f] = 1;
+    }
+  }
   error = pthread_create(&rt_task, &attr, doFSM, 0);
   if (error) return -error;
   return 0;
@@ -1230,12 +1410,46 @@ static int doSanityChecksStartup(void)
   return ret;
 }
 
+static int checkSparseFSM(FSMID_t f, const struct FSMBlob *fsm)
+{
+  const unsigned *row_ptr, *pairs;
+  unsigned s, i, nevt = fsm->routing.num_evt_cols;
+
+  if (!fsm->sparse) return 0;
+  if (fsm->n_cols <= nevt + 1 
+      || FSMBlobCells(1, fsm->n_rows, fsm->n_cols, nevt, fsm->num_pairs) > FSM_FLAT_SIZE) {
+    ERROR("FSM %u: sparse FSM of %u x %u with %u pairs doesn't fit!\n", f, fsm->n_rows, fsm->n_cols, fsm->num_pairs);
+    return -EINVAL;
+  }
+  row_ptr = FSM_SPARSE_ROW_PTR(fsm);
+  pairs = FSM_SPARSE_PAIRS(fsm);
+  if (row_ptr[0] != 0 || row_ptr[fsm->n_rows] != fsm->num_pairs) {
+    ERROR("FSM %u: sparse FSM row offsets don't span its %u pairs!\n", f, fsm->num_pairs);
+    return -EINVAL;
+  }
+  for (s = 0; s < fsm->n_rows; ++s) {
+    if (row_ptr[s+1] < row_ptr[s]) {
+      ERROR("FSM %u: sparse FSM row offsets decrease at state %u!\n", f, s);
+      return -EINVAL;
+    }
+    for (i = row_ptr[s]; i < row_ptr[s+1]; ++i) {
+      const unsigned c = FSM_SPARSE_PAIR_COL(pairs[i]);
+      if (c > nevt || FSM_SPARSE_PAIR_STATE(pairs[i]) >= fsm->n_rows
+          || (i > row_ptr[s] && c <= FSM_SPARSE_PAIR_COL(pairs[i-1]))) {
+        ERROR("FSM %u: sparse FSM has a bad transition in state %u!\n", f, s);
+        return -EINVAL;
+      }
+    }
+  }
+  return 0;
+}
+
 static int doSanityChecksRuntime(FSMID_t f)
 {
   int ret = 0;
 /*   int n_chans = n_chans_dio_subdev + NUM_AI_CHANS, ret = 0; */
 /*   char buf[256]; */
-/*   static int not_first_time[NUM_STATE_MACHINES] = {0}; */
+/*   static int not_first_time[FSM_MAX_STATE_MACHINES] = {0}; */
 
   if (READY_FOR_TRIAL_JUMPSTATE(f) >= NUM_ROWS(f) || READY_FOR_TRIAL_JUMPSTATE(f) <= 0)  
     WARNING("ready_for_trial_jumpstate of %d need to be between 0 and %d!\n", 
@@ -1250,6 +1464,9 @@ static int doSanityChecksRuntime(FSMID_t f)
 /*   if ( dev && n_chans < NUM_CHANS(f))  */
 /*     ERROR("COMEDI device only has %d input channels, but FSM parameters require at least %d channels!\n", n_chans, NUM_CHANS(f)), ret = -EINVAL; */
   
+  if (NUM_INPUT_EVENTS(f) > FSM_MAX_IN_EVENTS)
+    ERROR("FSM %u has %d input event columns, at most %d are supported.\n", f, (int)NUM_INPUT_EVENTS(f), (int)FSM_MAX_IN_EVENTS), ret = -EINVAL;
+
   if (IN_CHAN_TYPE(f) == AI_TYPE && AFTER_LAST_IN_CHAN(f) > MAX_AI_CHANS) 
     ERROR("The input channels specified (%d-%d) exceed MAX_AI_CHANS (%d).\n", (int)FIRST_IN_CHAN(f), ((int)AFTER_LAST_IN_CHAN(f))-1, (int)MAX_AI_CHANS), ret = -EINVAL;
   if (ret) return ret;
@@ -1295,7 +1512,7 @@ static int myseq_show (struct seq_file *m, void *dummy)
                cb_eos_skips, cb_eos_skipped_scans, ai_n_overflows);    
   }
 
-  for (f = 0; f < NUM_STATE_MACHINES; ++f) {
+  for (f = 0; f < n_fsms; ++f) {
     if (f > 0) seq_printf(m, "\n"); /* additional newline between FSMs */
 
     seq_printf(m, 
@@ -1305,15 +1522,23 @@ static int myseq_show (struct seq_file *m, void *dummy)
     if (!rs[f].valid) {
       seq_printf(m, "FSM is not specified or is invalid.\n");
     } else {
-      int structlen = sizeof(struct RunState) - sizeof(struct StateHistory);
+      int structlen = sizeof(struct RunState);
       struct RunState *ss = (struct RunState *)vmalloc(structlen);
       if (ss) {
-        unsigned state_it;
-        unsigned num_rows = NUM_ROWS(f), num_in_evts = NUM_IN_EVT_COLS(f);
+        unsigned state_it, num_rows, num_in_evts, slot;
         
+        /* hold a reference on the FSM we print, so that nothing is written
+           over it meanwhile, and make sure it's still the current one */
+        for (;;) {
+          slot = rs[f].cur_slot;
+          poolSlotRef(slot, 1);
+          if (slot == rs[f].cur_slot) break;
+          poolSlotRef(slot, -1);
+        }
         memcpy(ss, (struct RunState *)&rs[f], structlen);
-        /* setup the pointer to the real fsm correctly */
-        ss->states = (rs[f].states == &rs[f].states1 ? &ss->states1 : &ss->states2);
+        ss->states = POOL_BLOB(slot);
+        num_rows = ss->states->n_rows;
+        num_in_evts = ss->states->routing.num_evt_cols;
         
         seq_printf(m, "Current State: %d\t"    "Transition Count:%d\n", 
                    (int)ss->current_state,     (int)NUM_TRANSITIONS(f));      
@@ -1337,7 +1562,7 @@ static int myseq_show (struct seq_file *m, void *dummy)
           GET_STATE(ss->states, state, state_it);
           seq_printf(m, "State %d:\t", (int)state_it);
           for (i = 0; i < num_in_evts; ++i) 
-            seq_printf(m, "%d ", state->input[i]);
+            seq_printf(m, "%d ", FSMNextState(ss->states, state_it, i));
           seq_printf(m, "%d ", state->timeout_state);
           seq_printf(m, "%ld.%06lu ", Micro2Sec(state->timeout_us, &i), i);
           for (i = 0; i < state->n_outputs; ++i) 
@@ -1352,7 +1577,7 @@ static int myseq_show (struct seq_file *m, void *dummy)
           seq_printf(m, "%s Channel IDs: ", ss->states->routing.in_chan_type == AI_TYPE ? "AI" : "DIO");
           /* argh this is an O(n^2) algorithm.. sorry :( */
           for (i = 0; i < ss->states->routing.num_evt_cols; ++i)
-            for (j = 0; j < FSM_MAX_IN_EVENTS; ++j)
+            for (j = 0; j < FSM_MAX_IN_EDGES; ++j)
               if (ss->states->routing.input_routing[j] == i) {
                 int chan_id = j/2;
                 seq_printf(m, "%c%d ", j%2 ? '-' : '+', chan_id);
@@ -1409,23 +1634,24 @@ static int myseq_show (struct seq_file *m, void *dummy)
           }
         }            
 
-        if (ss->states->has_sched_waves) { /* Print Sched. Wave statistics */
+        if (ss->has_sched_waves) { /* Print Sched. Wave statistics */
           int i;
           seq_printf(m, "\nFSM %u Scheduled Wave Info\n"
                           "-------------------------\n", f);
           /* Print stats on AO Waves */
           for (i = 0; i < FSM_MAX_SCHED_WAVES; ++i) {
             if (ss->aowaves[i].nsamples && ss->aowaves[i].samples) {
-              seq_printf(m, "AO  Sched. Wave %d  %u bytes (%s)\n", i, ss->aowaves[i].nsamples*(sizeof(*ss->aowaves[i].samples)+sizeof(*ss->aowaves[i].evt_cols)), ss->active_ao_wave_mask & 0x1<<i ? "playing" : "idle");
+              seq_printf(m, "AO  Sched. Wave %d  %lu bytes (%s)\n", i, (unsigned long)(ss->aowaves[i].nsamples*(sizeof(*ss->aowaves[i].samples)+sizeof(*ss->aowaves[i].evt_cols))), waveSetHas(&ss->active_ao_waves, i) ? "playing" : "idle");
             }
           }
           /* Print stats on DIO Sched Waves */
           for (i = 0; i < FSM_MAX_SCHED_WAVES; ++i) {
             if (ss->states->sched_waves[i].enabled) {
-              seq_printf(m, "DIO Sched. Wave %d  (%s)\n", i, ss->active_wave_mask & 0x1<<i ? "playing" : "idle");
+              seq_printf(m, "DIO Sched. Wave %d  (%s)\n", i, waveSetHas(&ss->active_waves, i) ? "playing" : "idle");
             }
           }
         }
+        poolSlotRef(slot, -1);
         vfree(ss);
       } else {
         seq_printf(m, "Cannot retrieve FSM data:  Temporary failure in memory allocation.\n");
@@ -1496,8 +1722,8 @@ static void *doFSM (void *arg)
     } while(0);
 #endif
     
-    for (f = 0; f < NUM_STATE_MACHINES; ++f) {
-      if (lastTriggers && triggersExpired(f)) 
+    for (f = 0; f < n_fsms; ++f) {
+      if (rs[f].last_triggers && triggersExpired(f)) 
         /* Clears the results of the last 'trigger' output done, but only
            when the trigger 'expires' which means it has been 'sustained' in 
            the on position for trigger_ms milliseconds. */
@@ -1509,115 +1735,25 @@ static void *doFSM (void *arg)
     if (di_chans_in_use_mask) grabAllDIO(); 
     if (ai_chans_in_use_mask) grabAI(); 
     
-    for (f = 0; f < NUM_STATE_MACHINES; ++f) {
-      /* Grab time */
-      rs[f].current_ts = cycleT0 - rs[f].init_ts;
-      rs[f].ext_current_ts = FSM_EXT_TIME_GET(extTimeShm);
-
-      handleFifos(f);
-      
-      if ( rs[f].valid ) {
-
-        unsigned long events_bits = 0;
-        int got_timeout = 0, n_evt_loops;
-        DECLARE_STATE_PTR(state);
-        GET_STATE(rs[f].states, state, rs[f].current_state);
-        
-        
-        if ( rs[f].forced_times_up ) {
-          
-          /* Ok, it was a forced timeout.. */
-          if (state->timeout_us != 0) got_timeout = 1;
-          rs[f].forced_times_up = 0;
-          
-        } 
-        
-        if (rs[f].forced_event > -1) {
-          
-          /* Ok, it was a forced input transition.. indicate this event in our bitfield array */
-          events_bits |= 0x1 << rs[f].forced_event;
-          rs[f].forced_event = -1;
-          
-        } 
-        
-        /* If we aren't paused.. detect timeout events and input events */
-        if ( !rs[f].paused  ) {
-          
-          /* Check for state timeout -- 
-             IF Curent state *has* a timeout (!=0) AND the timeout expired */
-          if ( !got_timeout && state->timeout_us != 0 && TIMER_EXPIRED(f, state->timeout_us) )   {
-            
-            got_timeout = 1;
-            
-            if (debug > 1) {
-              char buf[22];
-              strncpy(buf, uint64_to_cstr(rs[f].current_ts), 21);
-              buf[21] = 0;
-              DEBUG("timer expired in state %u t_us: %u timer: %s ts: %s\n", rs[f].current_state, state->timeout_us, uint64_to_cstr(rs[f].current_timer_start), buf);
-            }
-            
-          }
-          
-          /* Normal event transition code -- detectInputEvents() returns
-             a bitfield array of all the input events we have right now.
-             Note how we can have multiple ones, and they all get
-             acknowledged by the loop later in this function!
-             
-             Note we |= this because we may have forced some event to be set 
-             as part of the forced_event stuff in this function above.  */
-          events_bits |= detectInputEvents(f);   
-          
-          if (debug >= 2) {
-            DEBUG("FSM %u Got input events mask %08x\n", f, events_bits);
-          }
-          
-          /* Process the scheduled waves by checking if any of their components
-             expired.  For scheduled waves that result in an input event
-             on edge-up/edge-down, they will return those event ids
-             as a bitfield array.  */
-          events_bits |= processSchedWaves(f);
-          
-          if (debug >= 2) {
-            DEBUG("FSM %u After processSchedWaves(), got input events mask %08x\n", f, events_bits);
-          }
-          
-          /* Process the scheduled AO waves -- do analog output for
-             samples this cycle.  If there's an event id for the samples
-             outputted, will get a mask of event ids.  */
-          events_bits |= processSchedWavesAO(f);
-          
-          if (debug >= 2) {
-            DEBUG("FSM %u After processSchedWavesAO(), got input events mask %08x\n", f, events_bits);
-          }
-          
-        }
-        
-        if (got_timeout) 
-          /* Timeout expired, transistion to timeout_state.. */
-          gotoState(f, state->timeout_state, -1);
-        
-        
-        /* Normal event transition code, keep popping ones off our 
-           bitfield array, events_bits. */
-        for (n_evt_loops = 0; events_bits && n_evt_loops < NUM_INPUT_EVENTS(f); ++n_evt_loops) {
-          unsigned event_id; 
-          
-          /* use asm/bitops.h __ffs to find the first set bit */
-          event_id = __ffs(events_bits);
-          /* now clear or 'pop off' the bit.. */
-          events_bits &= ~(0x1UL << event_id); 
-          
-          dispatchEvent(f, event_id);
-        }
-        
-        if (NUM_INPUT_EVENTS(f) && n_evt_loops >= NUM_INPUT_EVENTS(f) && events_bits) {
-          ERROR_INT("Event detection code in doFSM() for FSM %u tried to loop more than %d times!  DEBUG ME!\n", f, n_evt_loops, NUM_INPUT_EVENTS(f));
-        }
-        
+    if (threaded) {
+      /* release the FSM threads for this tick, then wait for them all */
+      tick_t0 = cycleT0;
+      tick_wakeup = next_task_wakeup;
+      wmb();
+      ++tick_seq;
+      for (f = 0; f < n_fsms; ++f)
+        while (fsm_tick_done[f] != tick_seq && !rt_task_stop) cpu_relax();
+      rmb();
+      if (reconfigure_pending) {
+        reconfigure_pending = 0;
+        reconfigureIO();
       }
-    } /* end loop through each state machine */
+    } else {
+      for (f = 0; f < n_fsms; ++f) doFSMTick(f, cycleT0);
+    }
 
     commitDataWrites();   
+    commitAOWrites();
     
     cycleTf = gethrtime();
     
@@ -1644,9 +1780,143 @@ static void *doFSM (void *arg)
   return 0;
 }
 
+/* Everything a tick does for state machine f, on the RT thread or, in 
+   threaded mode, on f's own thread (see doFSMThread()) */
+static void doFSMTick(FSMID_t f, hrtime_t cycleT0)
+{
+  /* Grab time */
+  rs[f].current_ts = cycleT0 - rs[f].init_ts;
+  rs[f].ext_current_ts = FSM_EXT_TIME_GET(extTimeShm);
+
+  handleFifos(f);
+  
+  if ( rs[f].valid ) {
+
+    struct EventSet events = {{0}};
+    int got_timeout = 0;
+    unsigned w, n_evt_words;
+    DECLARE_STATE_PTR(state);
+    GET_STATE(rs[f].states, state, rs[f].current_state);
+    
+    
+    if ( rs[f].forced_times_up ) {
+      
+      /* Ok, it was a forced timeout.. */
+      if (state->timeout_us != 0) got_timeout = 1;
+      rs[f].forced_times_up = 0;
+      
+    } 
+    
+    if (rs[f].forced_event > -1) {
+      
+      /* Ok, it was a forced input transition.. indicate this event in our bitfield array */
+      eventSetAdd(&events, rs[f].forced_event);
+      rs[f].forced_event = -1;
+      
+    } 
+    
+    /* If we aren't paused.. detect timeout events and input events */
+    if ( !rs[f].paused  ) {
+      
+      /* Fire whatever timers are due: the scheduled wave components
+         (for those that result in an input event on edge-up/edge-down, 
+         their event ids get added to the set) and the state timeout. */
+      runTimers(f, &events);
+      
+      if (debug >= 2) {
+        DEBUG("FSM %u After runTimers(), got input events mask %08lx (first word)\n", f, events.w[0]);
+      }
+      
+      /* Check for state timeout -- 
+         IF Curent state *has* a timeout (!=0) AND the timeout expired */
+      if ( !got_timeout && rs[f].state_timed_out )   {
+        
+        got_timeout = 1;
+        
+        if (debug > 1) {
+          char buf[22];
+          strncpy(buf, uint64_to_cstr(rs[f].current_ts), 21);
+          buf[21] = 0;
+          DEBUG("timer expired in state %u t_us: %u timer: %s ts: %s\n", rs[f].current_state, state->timeout_us, uint64_to_cstr(rs[f].current_timer_start), buf);
+        }
+        
+      }
+      
+      /* Normal event transition code -- detectInputEvents() returns
+         a bitfield array of all the input events we have right now.
+         Note how we can have multiple ones, and they all get
+         acknowledged by the loop later in this function!
+         
+         Note it adds to the set because we may have forced some event to
+         be set as part of the forced_event stuff in this function above.  */
+      detectInputEvents(f, &events);
+      
+      if (debug >= 2) {
+        DEBUG("FSM %u Got input events mask %08lx (first word)\n", f, events.w[0]);
+      }
+      
+      /* Process the scheduled AO waves -- do analog output for
+         samples this cycle.  If there's an event id for the samples
+         outputted, will get a mask of event ids.  */
+      processSchedWavesAO(f, &events);
+      
+      if (debug >= 2) {
+        DEBUG("FSM %u After processSchedWavesAO(), got input events mask %08lx (first word)\n", f, events.w[0]);
+      }
+      
+    }
+    
+    if (got_timeout) 
+      /* Timeout expired, transistion to timeout_state.. */
+      gotoState(f, state->timeout_state, -1);
+    
+    
+    /* Normal event transition code, keep popping ones off our 
+       event set, a word at a time, in order of event id. Only the 
+       words up to the timeout column's can have any bits set. */
+    n_evt_words = NUM_INPUT_EVENTS(f) / EVT_WORD_BITS + 1;
+    for (w = 0; w < n_evt_words && w < EVT_WORDS; ++w) {
+      while (events.w[w]) {
+        /* use asm/bitops.h __ffs to find the first set bit */
+        unsigned bit = __ffs(events.w[w]);
+        /* now clear or 'pop off' the bit.. */
+        events.w[w] &= events.w[w] - 1;
+      
+        dispatchEvent(f, w * EVT_WORD_BITS + bit);
+      }
+    }
+    
+  }
+
+  publishStatus(f);
+}
+
+/* The RT thread of state machine f in threaded mode: sleep until the next
+   tick, spin for the rest of the way until doFSM() has read the inputs
+   and released the tick, do the tick, and say so. */
+static void *doFSMThread(void *arg)
+{
+  FSMID_t f = (FSMID_t)(long)arg;
+  unsigned long seen = tick_seq;
+  struct timespec wakeup;
+
+  while (!rt_task_stop) {
+    while (tick_seq == seen && !rt_task_stop) cpu_relax();
+    seen = tick_seq;
+    rmb();
+    doFSMTick(f, tick_t0);
+    wakeup = tick_wakeup;
+    wmb();
+    fsm_tick_done[f] = seen;
+    clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &wakeup, 0);
+  }
+  pthread_exit(0);
+  return 0;
+}
+
 static inline volatile struct StateTransition *historyAt(FSMID_t f, unsigned idx) 
 {
-  return &rs[f].history.transitions[idx % MAX_HISTORY];
+  return &rs[f].history->transitions[idx % MAX_HISTORY];
 }
 
 static inline volatile struct StateTransition *historyTop(FSMID_t f)
@@ -1654,6 +1924,33 @@ static inline volatile struct StateTransition *historyTop(FSMID_t f)
   return historyAt(f, NUM_TRANSITIONS(f)-1);
 }
 
+/* Publish a snapshot of the status of FSM f to SHM_STATUS(shm, f), see
+   struct FSMStatus in RatExpFSM.h for the seqlock protocol. */
+static inline void publishStatus(FSMID_t f)
+{
+  volatile struct FSMStatus *st = SHM_STATUS(shm, f);
+
+  ++st->seq; /* odd: update in progress */
+  wmb();
+  st->current_state = rs[f].current_state;
+  st->transition_count = NUM_TRANSITIONS(f);
+  st->paused = rs[f].paused;
+  st->valid = rs[f].valid;
+  st->active_wave_mask = waveSetMask32(&rs[f].active_waves);
+  st->active_ao_wave_mask = waveSetMask32(&rs[f].active_ao_waves);
+  st->current_ts = rs[f].current_ts;
+  if (rs[f].valid || rs[f].pending_fsm_swap) {
+    const struct FSMBlob *latest = rs[f].pending_fsm_swap ? OTHER_FSM_PTR(f) : FSM_PTR(f);
+    st->fsm_rows = latest->n_rows;
+    st->fsm_cols = latest->n_cols;
+    st->fsm_evt_cols = latest->routing.num_evt_cols;
+  } else 
+    st->fsm_rows = st->fsm_cols = st->fsm_evt_cols = 0;
+  st->pending_swap = rs[f].pending_fsm_swap;
+  wmb();
+  ++st->seq; /* even: consistent again */
+}
+
 static inline void transitionNotifyUserspace(FSMID_t f, volatile struct StateTransition *transition)
 {
   const unsigned long sz = sizeof(*transition);
@@ -1667,16 +1964,18 @@ static inline void historyPush(FSMID_t f, int event_id)
 {
   volatile struct StateTransition * transition;
 
-  /* increment current index.. it is ok to increment indefinitely since 
-     indexing into array uses % MAX_HISTORY */
-  ++rs[f].history.num_transitions;
-  
-  transition = historyTop(f);
+  /* fill in the next slot first.. */
+  transition = historyAt(f, NUM_TRANSITIONS(f));
   transition->previous_state = rs[f].previous_state;
   transition->state = rs[f].current_state;
   transition->ts = rs[f].current_ts;  
   transition->ext_ts = rs[f].ext_current_ts;
   transition->event_id = event_id;
+  /* ..and only then publish it by incrementing the current index, since 
+     userspace reads the history directly.  It is ok to increment 
+     indefinitely since indexing into array uses % MAX_HISTORY */
+  wmb();
+  ++rs[f].history->num_transitions;
   transitionNotifyUserspace(f, transition);
 }
 
@@ -1750,7 +2049,9 @@ static int gotoState(FSMID_t f, unsigned state, int event_id)
 
 static void doOutput(FSMID_t f)
 {
-  static struct NRTOutput nrt_out;
+  /* one each, since with threaded=1 the state machines run concurrently */
+  static struct NRTOutput nrt_outs[FSM_MAX_STATE_MACHINES];
+  struct NRTOutput *nrt_out = &nrt_outs[f];
 
   unsigned i, ip_out_col = 0;
   DECLARE_STATE_PTR(state);
@@ -1797,16 +2098,16 @@ static void doOutput(FSMID_t f)
           || rs[f].last_ip_outs[ip_out_col] != state->output[i]) {
         rs[f].last_ip_outs[ip_out_col] = state->output[i];
         rs[f].last_ip_outs_is_valid[ip_out_col] = 1;
-        nrt_out.magic = NRTOUTPUT_MAGIC;
-        nrt_out.state = rs[f].current_state;
-        nrt_out.trig = state->output[i];
-        nrt_out.ts_nanos = rs[f].current_ts;
-        nrt_out.type = spec->type == OSPEC_TCP ? NRT_TCP : NRT_UDP;
-        nrt_out.col = &state->output[i] - state->column;
-        snprintf(nrt_out.ip_host, IP_HOST_LEN, "%s", spec->host);
-        nrt_out.ip_port = spec->port;
-        snprintf(nrt_out.ip_packet_fmt, FMT_TEXT_LEN, "%s", spec->fmt_text);
-        rtf_put(shm->fifo_nrt_output[f], &nrt_out, sizeof(nrt_out));
+        nrt_out->magic = NRTOUTPUT_MAGIC;
+        nrt_out->state = rs[f].current_state;
+        nrt_out->trig = state->output[i];
+        nrt_out->ts_nanos = rs[f].current_ts;
+        nrt_out->type = spec->type == OSPEC_TCP ? NRT_TCP : NRT_UDP;
+        nrt_out->col = state->n_inputs + 2 + i;
+        snprintf(nrt_out->ip_host, IP_HOST_LEN, "%s", spec->host);
+        nrt_out->ip_port = spec->port;
+        snprintf(nrt_out->ip_packet_fmt, FMT_TEXT_LEN, "%s", spec->fmt_text);
+        rtf_put(shm->fifo_nrt_output[f], nrt_out, sizeof(*nrt_out));
       }
       ip_out_col++;
       break;
@@ -1821,8 +2122,8 @@ static void doOutput(FSMID_t f)
     while (trigs) {
       i = __ffs(trigs);
       trigs &= ~(0x1<<i);
-      dataWrite(i, 1);  
-      lastTriggers |= 0x1<<i; 
+      dataWrite(f, i, 1);  
+      rs[f].last_triggers |= 0x1<<i; 
     }
     resetTriggerTimer(f);
   }
@@ -1831,8 +2132,8 @@ static void doOutput(FSMID_t f)
   while ( contmask ) {
     i = __ffs(contmask);
     contmask &= ~(0x1<<i);
-    if ( (0x1<<i) & conts )  dataWrite(i, 1);
-    else                     dataWrite(i, 0);
+    if ( (0x1<<i) & conts )  dataWrite(f, i, 1);
+    else                     dataWrite(f, i, 0);
   }
 
 }
@@ -1844,17 +2145,49 @@ static inline void clearTriggerLines(FSMID_t f)
   while (mask) {
     i = __ffs(mask);
     mask &= ~(0x1<<i);
-    if ( (0x1 << i) & lastTriggers ) {
-      dataWrite(i, 0);
-      lastTriggers &= ~(0x1<<i);
+    if ( (0x1 << i) & rs[f].last_triggers ) {
+      dataWrite(f, i, 0);
+      rs[f].last_triggers &= ~(0x1<<i);
     }
   }
 }
 
-static unsigned long detectInputEvents(FSMID_t f)
+static inline void eventSetAdd(struct EventSet *events, unsigned event_id)
+{
+  events->w[event_id / EVT_WORD_BITS] |= 0x1UL << (event_id % EVT_WORD_BITS);
+}
+
+static inline int waveSetHas(const volatile struct WaveSet *set, unsigned wave)
+{
+  return (set->w[wave / EVT_WORD_BITS] >> (wave % EVT_WORD_BITS)) & 0x1UL;
+}
+
+static inline void waveSetAdd(volatile struct WaveSet *set, unsigned wave)
+{
+  set->w[wave / EVT_WORD_BITS] |= 0x1UL << (wave % EVT_WORD_BITS);
+}
+
+static inline void waveSetDel(volatile struct WaveSet *set, unsigned wave)
+{
+  set->w[wave / EVT_WORD_BITS] &= ~(0x1UL << (wave % EVT_WORD_BITS));
+}
+
+static inline int waveSetFirst(const volatile struct WaveSet *set)
+{
+  unsigned i;
+  for (i = 0; i < WAVE_WORDS; ++i)
+    if (set->w[i]) return i*EVT_WORD_BITS + __ffs(set->w[i]);
+  return -1;
+}
+
+static inline unsigned waveSetMask32(const volatile struct WaveSet *set)
 {
-  unsigned i, bits, bits_prev;
-  unsigned long events = 0;
+  return (unsigned)set->w[0]; /* unsigned long is at least 32 bits */
+}
+
+static void detectInputEvents(FSMID_t f, struct EventSet *events)
+{
+  unsigned bits, bits_prev, up, down;
   
   switch(IN_CHAN_TYPE(f)) { 
   case DIO_TYPE: /* DIO input */
@@ -1871,26 +2204,24 @@ static unsigned long detectInputEvents(FSMID_t f)
     break;
   }
   
-  /* Loop through all our event channel id's comparing them to our DIO bits */
-  for (i = FIRST_IN_CHAN(f); i < AFTER_LAST_IN_CHAN(f); ++i) {
-    int bit = ((0x1 << i) & bits) != 0, 
-        last_bit = ((0x1 << i) & bits_prev) != 0,
-        event_id_edge_up = INPUT_ROUTING(f, i*2), /* Even numbered input event 
-                                                  id's are edge-up events.. */
-        event_id_edge_down = INPUT_ROUTING(f, i*2+1); /* Odd numbered ones are 
-                                                      edge-down */
-
-    /* Edge-up transitions */ 
-    if (event_id_edge_up > -1 && bit && !last_bit) /* before we were below, now we are above,  therefore yes, it is an blah-IN */
-      events |= 0x1 << event_id_edge_up; 
-    
-    /* Edge-down transitions */ 
-    if (event_id_edge_down > -1 /* input event is actually routed somewhere */
-        && last_bit /* Last time we were above */
-        && !bit ) /* Now we are below, therefore yes, it is event*/
-      events |= 0x1 << event_id_edge_down; /* Return the event id */		   
+  /* Find all the edges at once, then only visit the channels that have 
+     one that is routed to an input event column, so that the cost of 
+     this doesn't grow with the number of channels.  */
+  up = bits & ~bits_prev & rs[f].in_chan_up_mask;
+  down = ~bits & bits_prev & rs[f].in_chan_down_mask;
+
+  /* Edge-up transitions, even numbered input event id's */
+  while (up) {
+    unsigned i = __ffs(up);
+    up &= up - 1;
+    eventSetAdd(events, INPUT_ROUTING(f, i*2));
+  }
+  /* Edge-down transitions, odd numbered ones */
+  while (down) {
+    unsigned i = __ffs(down);
+    down &= down - 1;
+    eventSetAdd(events, INPUT_ROUTING(f, i*2+1));
   }
-  return events; 
 }
 
 
@@ -1903,7 +2234,7 @@ static void dispatchEvent(FSMID_t f, unsigned event_id)
     ERROR_INT("FSM %u event id %d is > NUM_INPUT_EVENTS %d!\n", f, (int)event_id, (int)NUM_INPUT_EVENTS(f));
     return;
   }
-  next_state = (event_id == NUM_INPUT_EVENTS(f)) ? state->timeout_state : state->input[event_id]; 
+  next_state = (event_id == NUM_INPUT_EVENTS(f)) ? state->timeout_state : FSMNextState(FSM_PTR(f), rs[f].current_state, event_id); 
   gotoState(f, next_state, event_id);
 }
 
@@ -1915,11 +2246,11 @@ static void clearAllOutputLines(FSMID_t f)
   while (mask) {
     i = __ffs(mask);
     mask &= ~(0x1<<i);
-    dataWrite(i, 0);
+    dataWrite(f, i, 0);
   }
 }
 
-static int buddyTaskCmds[NUM_STATE_MACHINES] = {0};
+static int buddyTaskCmds[FSM_MAX_STATE_MACHINES] = {0};
 
 static void handleFifos(FSMID_t f)
 {
@@ -1948,20 +2279,23 @@ static void handleFifos(FSMID_t f)
        2. Indicate we should reply to user fifo by setting do_reply */
 
     switch(BUDDY_TASK_DONE) {
-    case FSM: {
+    case FSM: 
+    case FSMSLOT: {
       int was_sane = 0;
       rs[f].states = OTHER_FSM_PTR(f); /* temporarily swap FSMs so
                                           than the sanity checks see the 
                                           new FSM.  The new FSM was in fact
-                                          written-to by the buddy task.  */
-      was_sane = !doSanityChecksRuntime(f);
-      rs[f].states = OTHER_FSM_PTR(f);
+                                          handed to us by the buddy task. */
+      was_sane = !rs[f].new_fsm_bad && !doSanityChecksRuntime(f);
+      rs[f].states = POOL_BLOB(rs[f].cur_slot);
+      SHM_MSG(shm, f)->u.fsm_accepted = was_sane;
 
       if (!was_sane) {
         
           /* uh-oh.. it's a bad FSM?  Reject it.. */
+          releaseFSMSlots(f);
           initRunState(f);
-          reconfigureIO();
+          requestReconfigureIO(f);
 
       } else { 
           /* FSM good.. */   
@@ -1981,6 +2315,20 @@ static void handleFifos(FSMID_t f)
       do_reply = 1;
       break;
     }
+    case FSMPATCH:
+      /* the buddy task wrote the patched FSM into the other bank, it
+         goes in just like a new one, it only can't be insane */
+      if (SHM_MSG(shm, f)->u.fsm_patch.ok) {
+        if (!OTHER_FSM_PTR(f)->wait_for_jump_to_state_0_to_swap_fsm || !rs[f].valid)
+          swapFSMs(f);
+        else
+          rs[f].pending_fsm_swap = 1;
+      } else if (rs[f].patch_pending_bank) {
+        rs[f].pending_fsm_swap = 1; /* refused, the pending FSM is untouched */
+      }
+      do_reply = 1;
+      break;
+
     case GETFSM:
       do_reply = 1;
       break;
@@ -1989,13 +2337,13 @@ static void handleFifos(FSMID_t f)
       /* these may have had race conditions with non-rt, so set them again.. */
       rs[f].current_ts = 0;
       RESET_TIMER(f);
-      reconfigureIO(); /* to reset DIO config since our routing spec 
-                           changed */
+      requestReconfigureIO(f); /* to reset DIO config since our routing spec 
+                                   changed */
       do_reply = 1;
       break;
 
     case AOWAVE:
-      /* need up upadte rs.states->has_sched_waves flag as that affects 
+      /* need up upadte rs.has_sched_waves flag as that affects 
        * whether we check the last column of the FSM for sched wave triggers. */
       updateHasSchedWaves(f);
       /* we just finished processing/allocating an AO wave, reply to 
@@ -2013,7 +2361,7 @@ static void handleFifos(FSMID_t f)
   } else {     /* !BUDDY_TASK_BUSY */
 
     /* See if a message is ready, and if so, take it from the SHM */
-    struct ShmMsg *msg = (struct ShmMsg *)&shm->msg[f];
+    struct ShmMsg *msg = (struct ShmMsg *)SHM_MSG(shm, f);
 
     errcode = rtf_get(shm->fifo_in[f], &dummy, sizeof(dummy));
 
@@ -2037,8 +2385,8 @@ static void handleFifos(FSMID_t f)
       
       BUDDY_TASK_PEND(RESET); /* slow operation because it clears FSM blob,
                                  pend it to non-RT buddy task. */
-      reconfigureIO(); /* to reset DIO config since our routing spec 
-                           changed */
+      requestReconfigureIO(f); /* to reset DIO config since our routing spec 
+                                   changed */
       break;
         
     case TRANSITIONCOUNT:
@@ -2052,9 +2400,9 @@ static void handleFifos(FSMID_t f)
         unsigned *num = &msg->u.transitions.num; /* alias.. */
         unsigned i;
 
-        if ( *from >= rs[f].history.num_transitions) 
+        if ( *from >= NUM_TRANSITIONS(f)) 
           *from = NUM_TRANSITIONS(f) ? NUM_TRANSITIONS(f)-1 : 0;
-        if (*num + *from > rs[f].history.num_transitions)
+        if (*num + *from > NUM_TRANSITIONS(f))
           *num = NUM_TRANSITIONS(f) - *from + 1;
         
         if (*num > MSG_MAX_TRANSITIONS)
@@ -2074,7 +2422,7 @@ static void handleFifos(FSMID_t f)
       /* We reset the timer, just in case the new FSM's rs.current_state 
          had a timeout defined. */
       RESET_TIMER(f);
-      /* Notice fall through to next case.. */
+      /* fall through */
     case GETPAUSE:
       msg->u.is_paused = rs[f].paused;
       do_reply = 1;
@@ -2082,7 +2430,7 @@ static void handleFifos(FSMID_t f)
       
     case INVALIDATE:
       rs[f].valid = 0;
-      /* Notice fall through.. */
+      /* fall through */
     case GETVALID:
       msg->u.is_valid = rs[f].valid;
       do_reply = 1;
@@ -2099,10 +2447,20 @@ static void handleFifos(FSMID_t f)
       /*clearAllOutputLines();
         stopActiveWaves(); */
       
+      rs[f].pending_fsm_swap = 0; /* the buddy task replaces the other FSM,
+                                     the reply above sets this again */
       BUDDY_TASK_PEND(FSM);      /* Since this is a *slow* operation,
                                     let's defer processing to non-RT
                                     buddy task. */
       break;
+
+    case FSMSLOT:
+      /* as for FSM, only there's nothing to copy: the buddy task checks 
+         the new FSM (which it has to do outside RT too, if it's sparse) 
+         and adopts its slot as the other FSM */
+      rs[f].pending_fsm_swap = 0;
+      BUDDY_TASK_PEND(FSMSLOT);
+      break;
       
     case GETFSM:
 
@@ -2171,7 +2529,7 @@ static void handleFifos(FSMID_t f)
             while (forced_mask) {
               unsigned chan = __ffs(forced_mask);
               forced_mask &= ~(0x1<<chan);
-              dataWrite(chan, 0);
+              dataWrite(f, chan, 0);
             }
             rs[f].forced_outputs_mask = (msg->u.forced_outputs << __ffs(rs[f].do_chans_cont_mask)) & rs[f].do_chans_cont_mask;
       }
@@ -2232,6 +2590,14 @@ static void handleFifos(FSMID_t f)
         do_reply = 1;
         break;
 
+    case FSMPATCH:
+      /* the buddy task may patch an FSM that's waiting to be swapped in,
+         which mustn't happen half way through, see the FSMPATCH reply above */
+      rs[f].patch_pending_bank = rs[f].pending_fsm_swap;
+      rs[f].pending_fsm_swap = 0;
+      BUDDY_TASK_PEND(FSMPATCH);
+      break;
+
     case AOWAVE:
         
         BUDDY_TASK_PEND(AOWAVE); /* a slow operation -- it has to allocate
@@ -2250,6 +2616,9 @@ static void handleFifos(FSMID_t f)
   }
 
   if (do_reply) {
+    /* so that a status query issued right after this reply already sees
+       the effects of this command */
+    publishStatus(f);
     errcode = rtf_put(shm->fifo_out[f], &dummy, sizeof(dummy));
     if (errcode != sizeof(dummy)) {
       static int once_only = 0;
@@ -2268,28 +2637,39 @@ static void handleFifos(FSMID_t f)
 
 }
 
-static unsigned pending_output_bits = 0, pending_output_mask = 0;
-
-static inline void dataWrite(unsigned chan, unsigned bit)
+static inline void dataWrite(FSMID_t f, unsigned chan, unsigned bit)
 {
   unsigned bitpos = 0x1 << chan;
-  if (!(bitpos & do_chans_in_use_mask)) {
-    ERROR_INT("Got write request for a channel (%u) that is not in the do_chans_in_use_mask (%x)!  FIXME!\n", chan, do_chans_in_use_mask);
-    return;
-  }
-  pending_output_mask |= bitpos;
+  rs[f].pending_output_mask |= bitpos;
   if (bit) /* set bit.. */
-    pending_output_bits |= bitpos;
+    rs[f].pending_output_bits |= bitpos;
   else /* clear bit.. */
-    pending_output_bits &= ~bitpos;
+    rs[f].pending_output_bits &= ~bitpos;
 }
 
 static void commitDataWrites(void)
 {
   hrtime_t dio_ts = 0, dio_te = 0;
+  unsigned pending_output_bits = 0, pending_output_mask = 0;
   FSMID_t f;
   
-  for (f = 0; f < NUM_STATE_MACHINES; ++f) {
+  /* Merge the state machines' writes, in FSM order so that, as when they
+     all wrote to the one set of pending bits, the last writer wins. */
+  for (f = 0; f < n_fsms; ++f) {
+    unsigned mask = rs[f].pending_output_mask;
+    pending_output_bits = (pending_output_bits & ~mask) | (rs[f].pending_output_bits & mask);
+    pending_output_mask |= mask;
+    rs[f].pending_output_bits = rs[f].pending_output_mask = 0;
+  }
+  /* Checked here rather than in dataWrite() since, with threaded=1, an FSM
+     that changed its routing this tick only gets its channels added to
+     the mask when reconfigureIO() runs at the end of the tick. */
+  if (pending_output_mask & ~do_chans_in_use_mask) {
+    ERROR_INT("Got write request for channels (%x) that are not in the do_chans_in_use_mask (%x)!  FIXME!\n", pending_output_mask & ~do_chans_in_use_mask, do_chans_in_use_mask);
+    pending_output_mask &= do_chans_in_use_mask;
+  }
+
+  for (f = 0; f < n_fsms; ++f) {
     /* Override with the 'forced' bits. */
     pending_output_mask |= rs[f].forced_outputs_mask;
     pending_output_bits |= rs[f].forced_outputs_mask;
@@ -2306,9 +2686,33 @@ static void commitDataWrites(void)
   
   if(debug > 2)
     DEBUG("WRITES: dio_out mask: %x bits: %x for cycle %s took %u ns\n", pending_output_mask, pending_output_bits, uint64_to_cstr(cycle), (unsigned)(dio_te - dio_ts));
+}
+
+static void aoWrite(FSMID_t f, unsigned chan, lsampl_t samp)
+{
+  unsigned i;
+  /* a later write this tick to the same line replaces the earlier one */
+  for (i = 0; i < rs[f].n_ao_writes; ++i)
+    if (rs[f].ao_writes[i].chan == chan) break;
+  if (i >= FSM_MAX_SCHED_WAVES) {
+    ERROR_INT("FSM %u: more than %u AO lines written in one cycle!\n", f, (unsigned)FSM_MAX_SCHED_WAVES);
+    return;
+  }
+  if (i == rs[f].n_ao_writes) ++rs[f].n_ao_writes;
+  rs[f].ao_writes[i].chan = chan;
+  rs[f].ao_writes[i].samp = samp;
+}
+
+static void commitAOWrites(void)
+{
+  FSMID_t f;
+  unsigned i;
 
-  pending_output_bits = 0;
-  pending_output_mask = 0;
+  for (f = 0; f < n_fsms; ++f) {
+    for (i = 0; i < rs[f].n_ao_writes; ++i)
+      comedi_data_write(dev_ao, subdev_ao, rs[f].ao_writes[i].chan, ao_range, 0, rs[f].ao_writes[i].samp);
+    rs[f].n_ao_writes = 0;
+  }
 }
 
 static void grabAllDIO(void)
@@ -2390,7 +2794,7 @@ static void doDAQ(void)
   FSMID_t f;
   unsigned seen_chans = ai_chans_in_use_mask;
 
-  for (f = 0; f < NUM_STATE_MACHINES; ++f) {
+  for (f = 0; f < n_fsms; ++f) {
     static unsigned short samps[MAX_AI_CHANS];
     unsigned mask = rs[f].daq_ai_chanmask;
     unsigned ct = 0;
@@ -2554,85 +2958,129 @@ static inline void putDebugFifo(unsigned val)
   }
 }
 
-static unsigned long processSchedWaves(FSMID_t f)
-{  
-  unsigned wave_mask = rs[f].active_wave_mask;
-  unsigned long wave_events = 0;
+struct TimerCtx
+{
+  FSMID_t f;
+  struct EventSet *events;
+};
 
-  while (wave_mask) {
-    unsigned wave = __ffs(wave_mask);
-    struct ActiveWave *w = &((struct RunState *)&rs[f])->active_wave[wave];
-    wave_mask &= ~(0x1<<wave);
-
-    if (w->edge_up_ts && w->edge_up_ts <= rs[f].current_ts) {
-      /* Edge-up timer expired, set the wave high either virtually or
-         physically or both. */
-          int id = SW_INPUT_ROUTING(f, wave*2);
-          if (id > -1 && id <= NUM_IN_EVT_COLS(f)) {
-            wave_events |= 0x1 << id; /* mark the event as having occurred
-                                         for the in-event of the matrix, if
-                                         it's routed as an input event wave
-                                         for edge-up transitions. */
-          }
-          id = SW_OUTPUT_ROUTING(f, wave);
+static void timerFired(void *arg, unsigned id)
+{
+  struct TimerCtx *ctx = (struct TimerCtx *)arg;
+  if (id == STATE_TIMER) {
+    FSMID_t f = ctx->f;
+    DECLARE_STATE_PTR(state);
+    GET_STATE(rs[f].states, state, rs[f].current_state);
+    if (state->timeout_us != 0 && TIMER_EXPIRED(f, state->timeout_us))
+      rs[f].state_timed_out = 1;
+    else 
+      armStateTimer(f); /* the timeout changed under us, try again */
+  } else
+    expireSchedWave(ctx->f, id - WAVE_TIMER(0), ctx->events);
+}
 
-          if ( id > -1 ) 
-            dataWrite(id, 1); /* if it's routed to do output, do the output. */
+static void runTimers(FSMID_t f, struct EventSet *events)
+{
+  struct TimerCtx ctx;
+  ctx.f = f;
+  ctx.events = events;
+  timerWheelAdvance(TIMERS(f), rs[f].current_ts > 0 ? rs[f].current_ts : 0, timerFired, &ctx);
+}
 
-          w->edge_up_ts = 0; /* mark this component done */
-    }
-    if (w->edge_down_ts && w->edge_down_ts <= rs[f].current_ts) {
-      /* Edge-down timer expired, set the wave high either virtually or
-         physically or both. */
-          int id = SW_INPUT_ROUTING(f, wave*2+1);
-          if (id > -1 && id <= NUM_IN_EVT_COLS(f)) {
-            wave_events |= 0x1 << id; /* mark the event as having occurred
-                                         for the in-event of the matrix, if
-                                         it's routed as an input event wave
-                                         for edge-up transitions. */
-          }
-          id = SW_OUTPUT_ROUTING(f, wave);
+static void armStateTimer(FSMID_t f)
+{
+  DECLARE_STATE_PTR(state);
 
-          if ( id > -1 ) 
-            dataWrite(id, 0); /* if it's routed to do output, do the output. */
+  rs[f].state_timed_out = 0;
+  GET_STATE(rs[f].states, state, rs[f].current_state);
+  if (state->timeout_us != 0)
+    timerWheelArm(TIMERS(f), STATE_TIMER, rs[f].current_timer_start + ((int64)state->timeout_us)*1000LL);
+  else
+    timerWheelCancel(TIMERS(f), STATE_TIMER);
+}
 
-          w->edge_down_ts = 0; /* mark this wave component done */
-    } 
-    if (w->end_ts && w->end_ts <= rs[f].current_ts) {
-          /* Refractory period ended and/or wave is deactivated */
-          rs[f].active_wave_mask &= ~(0x1<<wave); /* deactivate the wave */
-          w->end_ts = 0; /* mark this wave component done */
-    }
+/* Arms the wave's timer for its next component, or, if it has none left, 
+   deactivates the wave */
+static void armWaveTimer(FSMID_t f, unsigned wave)
+{
+  const struct ActiveWave *w = &((struct RunState *)&rs[f])->active_wave[wave];
+  int64 next = w->edge_up_ts ? w->edge_up_ts : (w->edge_down_ts ? w->edge_down_ts : w->end_ts);
+  if (next) 
+    timerWheelArm(TIMERS(f), WAVE_TIMER(wave), next);
+  else {
+    timerWheelCancel(TIMERS(f), WAVE_TIMER(wave));
+    waveSetDel(&rs[f].active_waves, wave);
+  }
+}
+
+static void expireSchedWave(FSMID_t f, unsigned wave, struct EventSet *events)
+{  
+  struct ActiveWave *w = &((struct RunState *)&rs[f])->active_wave[wave];
+
+  if (w->edge_up_ts && w->edge_up_ts <= rs[f].current_ts) {
+    /* Edge-up timer expired, set the wave high either virtually or
+       physically or both. */
+        int id = SW_INPUT_ROUTING(f, wave*2);
+        if (id > -1 && id < (int)NUM_IN_EVT_COLS(f)) {
+          eventSetAdd(events, id); /* mark the event as having occurred
+                                      for the in-event of the matrix, if
+                                      it's routed as an input event wave
+                                      for edge-up transitions. */
+        }
+        id = SW_OUTPUT_ROUTING(f, wave);
+
+        if ( id > -1 ) 
+          dataWrite(f, id, 1); /* if it's routed to do output, do the output. */
+
+        w->edge_up_ts = 0; /* mark this component done */
+  }
+  if (w->edge_down_ts && w->edge_down_ts <= rs[f].current_ts) {
+    /* Edge-down timer expired, set the wave high either virtually or
+       physically or both. */
+        int id = SW_INPUT_ROUTING(f, wave*2+1);
+        if (id > -1 && id < (int)NUM_IN_EVT_COLS(f)) {
+          eventSetAdd(events, id); /* mark the event as having occurred
+                                      for the in-event of the matrix, if
+                                      it's routed as an input event wave
+                                      for edge-up transitions. */
+        }
+        id = SW_OUTPUT_ROUTING(f, wave);
+
+        if ( id > -1 ) 
+          dataWrite(f, id, 0); /* if it's routed to do output, do the output. */
+
+        w->edge_down_ts = 0; /* mark this wave component done */
+  } 
+  if (w->end_ts && w->end_ts <= rs[f].current_ts) {
+        /* Refractory period ended and/or wave is deactivated */
+        w->end_ts = 0; /* mark this wave component done */
   }
-  return wave_events;
+  armWaveTimer(f, wave); /* for the next component, if any */
 }
 
-static unsigned long processSchedWavesAO(FSMID_t f)
+static void processSchedWavesAO(FSMID_t f, struct EventSet *events)
 {  
-  unsigned wave_mask = rs[f].active_ao_wave_mask;
-  unsigned long wave_events = 0;
+  struct WaveSet waves = *(struct WaveSet *)&rs[f].active_ao_waves;
+  int wave;
 
-  while (wave_mask) {
-    unsigned wave = __ffs(wave_mask);
+  while ((wave = waveSetFirst(&waves)) > -1) {
     volatile struct AOWaveINTERNAL *w = &rs[f].aowaves[wave];
-    wave_mask &= ~(0x1<<wave);
+    waveSetDel(&waves, wave);
 
     if (w->cur >= w->nsamples && w->loop) w->cur = 0;
     if (w->cur < w->nsamples) {
       int evt_col = w->evt_cols[w->cur];
       if (dev_ao && w->aoline < NUM_AO_CHANS) {
-        lsampl_t samp = w->samples[w->cur];
-        comedi_data_write(dev_ao, subdev_ao, w->aoline, ao_range, 0, samp);
+        aoWrite(f, w->aoline, w->samples[w->cur]);
       }
-      if (evt_col > -1 && evt_col <= NUM_IN_EVT_COLS(f))
-        wave_events |= 0x1 << evt_col;
+      if (evt_col > -1 && evt_col < (int)NUM_IN_EVT_COLS(f))
+        eventSetAdd(events, evt_col);
       w->cur++;
     } else { /* w->cur >= w->nsamples, so wave ended.. unschedule it. */
       scheduleWaveAO(f, wave, -1);
-      rs[f].active_ao_wave_mask &= ~(1<<wave);
+      waveSetDel(&rs[f].active_ao_waves, wave);
     }
   }
-  return wave_events;
 }
 
 static void scheduleWave(FSMID_t f, unsigned wave_id, int op)
@@ -2658,7 +3106,7 @@ static void scheduleWaveDIO(FSMID_t f, unsigned wave_id, int op)
   if (op > 0) {
     /* start/trigger a scheduled wave */
     
-    if ( rs[f].active_wave_mask & 0x1<<wave_id ) /*  wave is already running! */
+    if ( waveSetHas(&rs[f].active_waves, wave_id) ) /*  wave is already running! */
     {
         DEBUG("FSM %u Got wave start request %u for an already-active scheduled DIO wave!\n", f, wave_id);
         return;  
@@ -2670,17 +3118,19 @@ static void scheduleWaveDIO(FSMID_t f, unsigned wave_id, int op)
     w->edge_up_ts = rs[f].current_ts + ((int64)s->preamble_us)*1000LL;
     w->edge_down_ts = w->edge_up_ts + ((int64)s->sustain_us)*1000LL;
     w->end_ts = w->edge_down_ts + ((int64)s->refraction_us)*1000LL;  
-    rs[f].active_wave_mask |= 0x1<<wave_id; /* set the bit, enable */
+    waveSetAdd(&rs[f].active_waves, wave_id); /* enable */
+    armWaveTimer(f, wave_id);
 
   } else {
     /* Prematurely stop/cancel an already-running scheduled wave.. */
 
-    if (!(rs[f].active_wave_mask & 0x1<<wave_id) ) /* wave is not running! */
+    if (!waveSetHas(&rs[f].active_waves, wave_id) ) /* wave is not running! */
     {
         DEBUG("Got wave stop request %u for an already-inactive scheduled DIO wave!\n", wave_id);
         return;  
     }
-    rs[f].active_wave_mask &= ~(0x1<<wave_id); /* clear the bit, disable */
+    waveSetDel(&rs[f].active_waves, wave_id); /* disable */
+    timerWheelCancel(TIMERS(f), WAVE_TIMER(wave_id));
   }
 }
 
@@ -2693,50 +3143,132 @@ static void scheduleWaveAO(FSMID_t f, unsigned wave_id, int op)
   w = &rs[f].aowaves[wave_id];
   if (op > 0) {
     /* start/trigger a scheduled AO wave */    
-    if ( rs[f].active_ao_wave_mask & 0x1<<wave_id ) /* wave is already running! */
+    if ( waveSetHas(&rs[f].active_ao_waves, wave_id) ) /* wave is already running! */
     {
         DEBUG("FSM %u Got wave start request %u for an already-active scheduled AO wave!\n", f, wave_id);
         return;  
     }
     w->cur = 0;
-    rs[f].active_ao_wave_mask |= 0x1<<wave_id; /* set the bit, enable */
+    waveSetAdd(&rs[f].active_ao_waves, wave_id); /* enable */
 
   } else {
     /* Prematurely stop/cancel an already-running scheduled wave.. */
-    if (!(rs[f].active_ao_wave_mask & 0x1<<wave_id) ) /* wave is not running! */
+    if (!waveSetHas(&rs[f].active_ao_waves, wave_id) ) /* wave is not running! */
     {
         DEBUG("FSM %u Got wave stop request %u for an already-inactive scheduled AO wave!\n", f, wave_id);
         return;  
     }
-    rs[f].active_ao_wave_mask &= ~(0x1<<wave_id); /* clear the bit, disable */
+    waveSetDel(&rs[f].active_ao_waves, wave_id); /* disable */
     if (dev_ao && w->nsamples && w->aoline < NUM_AO_CHANS)
       /* write 0 on wave stop */
-      comedi_data_write(dev_ao, subdev_ao, w->aoline, ao_range, 0, 0);
+      aoWrite(f, w->aoline, 0);
     w->cur = 0;
   }
 }
 
 static void stopActiveWaves(FSMID_t f) /* called when FSM starts a new trial */
 {  
-  while (rs[f].active_wave_mask) { 
-    unsigned wave = __ffs(rs[f].active_wave_mask);
+  int wave;
+  while ((wave = waveSetFirst(&rs[f].active_waves)) > -1) { 
     struct ActiveWave *w = &((struct RunState *)&rs[f])->active_wave[wave];
-    rs[f].active_wave_mask &= ~(1<<wave); /* clear bit */
+    waveSetDel(&rs[f].active_waves, wave);
+    timerWheelCancel(TIMERS(f), WAVE_TIMER(wave));
     if (w->edge_down_ts && w->edge_down_ts <= rs[f].current_ts) {
           /* The wave was in the middle of a high, so set the line back low
              (if there actually is a line). */
           int id = SW_OUTPUT_ROUTING(f, wave);
 
           if (id > -1) 
-            dataWrite(id, 0); /* if it's routed to do output, set it low. */
+            dataWrite(f, id, 0); /* if it's routed to do output, set it low. */
     }
     memset(w, 0, sizeof(*w));  
   }
-  while (rs[f].active_ao_wave_mask) {
-    unsigned wave = __ffs(rs[f].active_ao_wave_mask);
-    scheduleWaveAO(f, wave, -1); /* should clear bit in rs.active_ao_wave_mask */
-    rs[f].active_ao_wave_mask &= ~(0x1<<wave); /* just in case */
+  while ((wave = waveSetFirst(&rs[f].active_ao_waves)) > -1) {
+    scheduleWaveAO(f, wave, -1); /* should take it out of rs.active_ao_waves */
+    waveSetDel(&rs[f].active_ao_waves, wave); /* just in case */
+  }
+}
+
+/* Claims a free slot of fsmPool, returns it or -1 if they are all in use */
+static int claimPoolSlot(void)
+{
+  unsigned i;
+  for (i = 1; i < fsmPool->num_slots; ++i)
+    if (!POOL_REFS(i) && cmpxchg(&POOL_REFS(i), 0, 1) == 0) 
+      return i;
+  return -1;
+}
+
+/* Adds delta to the reference count of a slot of fsmPool, returns the new
+   count.  Slot 0, the empty FSM, is never freed so it's not counted. */
+static int poolSlotRef(unsigned slot, int delta)
+{
+  int old;
+  if (!slot) return 1;
+  do {
+    old = POOL_REFS(slot);
+  } while (cmpxchg(&POOL_REFS(slot), old, old + delta) != old);
+  return old + delta;
+}
+
+/* Gives back both of FSM f's slots, leaving it with the empty FSM */
+static void releaseFSMSlots(FSMID_t f)
+{
+  unsigned cur = rs[f].cur_slot, other = rs[f].other_slot;
+  rs[f].states = POOL_BLOB(0);
+  rs[f].cur_slot = rs[f].other_slot = 0;
+  rs[f].has_sched_waves = rs[f].in_chan_up_mask = rs[f].in_chan_down_mask = 0;
+  wmb();
+  poolSlotRef(cur, -1);
+  poolSlotRef(other, -1);
+}
+
+/* Called from the buddy task: makes sure the other FSM is in a slot that
+   nobody else is reading (/proc may be, if it was the current one), so it
+   can be written.  Returns the slot, or -1 if the pool is all used up. */
+static int otherSlotForWriting(FSMID_t f)
+{
+  int slot = rs[f].other_slot;
+  if (slot && POOL_REFS(slot) == 1) return slot;
+  if ((slot = claimPoolSlot()) < 0) return -1;
+  poolSlotRef(rs[f].other_slot, -1);
+  rs[f].other_slot = slot;
+  return slot;
+}
+
+/* Called from the buddy task: write the current FSM with patch p applied
+   into the other bank (or patch the other bank in place, if it's the one
+   waiting to be swapped in).  Returns 0 on success. */
+static int patchFSM(FSMID_t f, const struct FSMPatch *p)
+{
+  struct FSMBlob *cur = FSM_PTR(f), *other = OTHER_FSM_PTR(f),
+                 *target = rs[f].patch_pending_bank ? other : cur;
+  unsigned i, n = p->num;
+
+  if ((!rs[f].valid && !rs[f].patch_pending_bank) || n > FSM_PATCH_MAX_CELLS
+      || p->n_rows != target->n_rows || p->n_cols != target->n_cols
+      || p->num_evt_cols != target->routing.num_evt_cols) {
+    DEBUG("FSM %u: refusing a patch for a %ux%u FSM with %u event columns\n", f, (unsigned)p->n_rows, (unsigned)p->n_cols, (unsigned)p->num_evt_cols);
+    return -EINVAL;
+  }
+  for (i = 0; i < n; ++i)
+    if (p->cells[i].row >= target->n_rows || p->cells[i].col >= target->n_cols
+        || FSMCellIndex(target, p->cells[i].row, p->cells[i].col) < 0) {
+      DEBUG("FSM %u: refusing a patch of cell %u,%u, which a sparse FSM doesn't have\n", f, (unsigned)p->cells[i].row, (unsigned)p->cells[i].col);
+      return -EINVAL;
+    }
+  if (!rs[f].patch_pending_bank) {
+    if (otherSlotForWriting(f) < 0) {
+      ERROR("FSM %u: refusing a patch, there is no free slot for it in the FSM pool (see fsm_pool_slots)\n", f);
+      return -ENOMEM;
+    }
+    other = OTHER_FSM_PTR(f);
+    memcpy(other, cur, FSMBlobUsedSize(cur));
   }
+
+  for (i = 0; i < n; ++i)
+    other->flat[FSMCellIndex(other, p->cells[i].row, p->cells[i].col)] = p->cells[i].value;
+  return 0;
 }
 
 static void buddyTaskHandler(void *arg)
@@ -2745,32 +3277,62 @@ static void buddyTaskHandler(void *arg)
   int *req = &buddyTaskCmds[f];
   struct ShmMsg *msg = 0;
 
-  if (f >= NUM_STATE_MACHINES) {
+  if (f >= n_fsms) {
     ERROR_INT("buddyTask got invalid fsm id handle %u!\n", f);
     return; 
   }
-  msg = (struct ShmMsg *)&shm->msg[f];
+  msg = (struct ShmMsg *)SHM_MSG(shm, f);
   switch (*req) {
   case FSM:
     /* use alternate FSM as temporary space during this interruptible copy 
        realtime task will swap the pointers when it realizes the copy
        is done */
-    memcpy(OTHER_FSM_PTR(f), (void *)&msg->u.fsm, sizeof(*OTHER_FSM_PTR(f)));  
+    rs[f].new_fsm_bad = checkSparseFSM(f, (struct FSMBlob *)&msg->u.fsm) != 0;
+    if (rs[f].new_fsm_bad) break;
+    if (otherSlotForWriting(f) < 0) {
+      ERROR("FSM %u: no free slot in the FSM pool for a new FSM (see fsm_pool_slots)\n", f);
+      rs[f].new_fsm_bad = 1;
+      break;
+    }
+    memcpy(OTHER_FSM_PTR(f), (void *)&msg->u.fsm, FSMBlobUsedSize(&msg->u.fsm));  
     /* NB: in the case where we have deferred FSM swapping (the jump
        to state 0 stuff) then this is a BUG!  We really should be cleaning 
        up the AO waves at that point, not now! */
     cleanupAOWaves(f); /* we have to free existing AO waves here because a new
                          FSM might not have a sched_waves column.. */
     break;
+  case FSMSLOT: {
+    /* userspace already wrote the FSM into the slot, which we just take
+       over as the other FSM, reference and all */
+    unsigned slot = msg->u.fsm_slot;
+    if (!slot || slot >= fsmPool->num_slots) {
+      ERROR("FSM %u: got an FSM in slot %u of the FSM pool, which has %u slots\n", f, slot, fsmPool->num_slots);
+      rs[f].new_fsm_bad = 1;
+      break;
+    }
+    rs[f].new_fsm_bad = checkSparseFSM(f, POOL_BLOB(slot)) != 0;
+    if (rs[f].new_fsm_bad) {
+      poolSlotRef(slot, -1);
+      break;
+    }
+    poolSlotRef(rs[f].other_slot, -1);
+    rs[f].other_slot = slot;
+    cleanupAOWaves(f); /* as for FSM, above */
+    break;
+  }
+  case FSMPATCH:
+    msg->u.fsm_patch.ok = !patchFSM(f, &msg->u.fsm_patch);
+    break;
   case GETFSM:
     if (!rs[f].valid) {      
-      memset((void *)&msg->u.fsm, 0, sizeof(msg->u.fsm));      
+      memset((void *)&msg->u.fsm, 0, FSMBLOB_HDR_SIZE);      
     } else {      
-      memcpy((void *)&msg->u.fsm, FSM_PTR(f), sizeof(*FSM_PTR(f)));      
+      memcpy((void *)&msg->u.fsm, FSM_PTR(f), FSMBlobUsedSize(FSM_PTR(f)));      
     }
     break;
   case RESET:
     cleanupAOWaves(f); /* frees any allocated AO waves.. */
+    releaseFSMSlots(f);
     initRunState(f);
     break;
   case AOWAVE: {
@@ -2849,15 +3411,35 @@ static void updateHasSchedWaves(FSMID_t f)
 	int yesno = 0;
 	for (i = 0; i < NUM_OUT_COLS(f); ++i)
       yesno = yesno || (OUTPUT_ROUTING(f,i)->type == OSPEC_SCHED_WAVE);  	
-	rs[f].states->has_sched_waves = yesno;
+	rs[f].has_sched_waves = yesno;
+}
+
+static void updateInChanMasks(FSMID_t f)
+{
+  unsigned i, up = 0, down = 0;
+  for (i = 0; i < FSM_MAX_IN_CHANS; ++i) {
+    int col = INPUT_ROUTING(f, i*2);
+    if (col > -1 && col < (int)NUM_IN_EVT_COLS(f)) up |= 0x1U << i;
+    col = INPUT_ROUTING(f, i*2+1);
+    if (col > -1 && col < (int)NUM_IN_EVT_COLS(f)) down |= 0x1U << i;
+  }
+  rs[f].in_chan_up_mask = up;
+  rs[f].in_chan_down_mask = down;
 }
 
 static void swapFSMs(FSMID_t f)
 {
+  unsigned slot = rs[f].cur_slot;
   /*LOG_MSG("Cycle: %lu  Swapping-in new FSM\n", (unsigned long)cycle);*/
-  rs[f].states = OTHER_FSM_PTR(f);
-  updateHasSchedWaves(f); /* just updates rs.states->has_sched_waves flag*/
-  reconfigureIO(); /* to have new routing take effect.. */
+  rs[f].cur_slot = rs[f].other_slot;
+  rs[f].other_slot = 0;
+  rs[f].states = POOL_BLOB(rs[f].cur_slot);
+  wmb();
+  poolSlotRef(slot, -1); /* the old FSM's, an idle FSM only holds the one */
+  updateHasSchedWaves(f); /* just updates rs.has_sched_waves flag*/
+  updateInChanMasks(f); /* and the masks detectInputEvents() uses */
+  requestReconfigureIO(f); /* to have new routing take effect.. */
+  armStateTimer(f); /* the current state's timeout may have changed */
   rs[f].valid = 1; /* Unlock FSM.. */
   rs[f].pending_fsm_swap = 0;
 }
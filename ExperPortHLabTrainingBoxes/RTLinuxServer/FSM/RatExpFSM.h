@@ -27,7 +27,10 @@ extern "C" {
 #define FSM_MAX_SCHED_WAVES (sizeof(unsigned)*8)
 #define FSM_MAX_IN_CHANS 32
 #define FSM_MAX_OUT_CHANS 32
-#define FSM_MAX_IN_EVENTS (FSM_MAX_IN_CHANS*2)
+#define FSM_MAX_IN_EDGES (FSM_MAX_IN_CHANS*2)
+/* Input event columns can be fed by channel edges, sched waves, AO waves 
+   and forced events alike, so there can be more of them than edges */
+#define FSM_MAX_IN_EVENTS 256
 #define FSM_MAX_OUT_EVENTS 16 /* this should be enough, right? */
 
 struct SchedWave
@@ -92,20 +95,20 @@ struct FSMBlob
                             4 of the fixed columns at the end plus possibly 1
                             column for the SCHED_WAVE column at the end
                             if present. */
-  unsigned flat[FSM_FLAT_SIZE];
-
   unsigned short ready_for_trial_jumpstate; /**< normally always 35 */
   /**< if true, uploading a new state matrix does not take effect immediately,
        but instead, the new FSM only takes effect when the old FSM 
        jumps to state 0.  This is so that all FSMs have a well-defined
        entry point.  */
   unsigned short wait_for_jump_to_state_0_to_swap_fsm; 
+  /** Iff true the cells in flat[] are in the sparse layout (see
+      FSM_SPARSE_PAIRS() below) rather than n_rows x n_cols dense cells */
+  unsigned short sparse;
+  /** For the sparse layout: the number of (column, next state) pairs */
+  unsigned num_pairs;
   /** The scheduled wave specifications.  @see struct SchedWave */
   struct SchedWave sched_waves[FSM_MAX_SCHED_WAVES];
 
-  /** Cached flag for scheduled waves. */
-  unsigned has_sched_waves;
-
   /** Struct to describe routing mappings from input/output channel id's
       to physical channel id's.  */
   struct Routing {
@@ -113,11 +116,11 @@ struct FSMBlob
 
     unsigned num_in_chans;  /** <= FSM_MAX_IN_CHANS                      */
     unsigned first_in_chan; /** <= FSM_MAX_IN_CHANS                      */
-    unsigned num_evt_cols;  /** <= FSM_MAX_IN_CHANS*2                    */
+    unsigned num_evt_cols;  /** <= FSM_MAX_IN_EVENTS                     */
 
     /** Associative array of phys_in_chan_id*2+(edge down?1:0) -> matrix 
         column */
-    int input_routing[FSM_MAX_IN_EVENTS];
+    int input_routing[FSM_MAX_IN_EDGES];
     /** Map of sched_wave_id*2+(edge down ? 1 : 0) -> matrix column  
         or -1 for none */
     int sched_wave_input[FSM_MAX_SCHED_WAVES*2];
@@ -129,12 +132,98 @@ struct FSMBlob
     /** Defines the meaning of an output column */
     struct OutputSpec output_routing[FSM_MAX_OUT_EVENTS];
   } routing;
+
+  /** The matrix cells.  This is deliberately the last member so that only 
+      the cells in use need to be copied around. 
+      @see FSMBlobUsedSize() */
+  unsigned flat[FSM_FLAT_SIZE];
 };
 
+/** Size of everything in struct FSMBlob that precedes the matrix cells */
+#define FSMBLOB_HDR_SIZE ((unsigned long)&((struct FSMBlob *)0)->flat[0])
+
 /** Low-level interface to struct FSMBlob.  
-    For a given struct FSMBlob *, get the data for row, col */
+    For a given struct FSMBlob *, get the data for row, col of a dense FSM */
 #define FSM_AT(_fsm_, _row_, _col_) \
-    ((_fsm_)->flat[_row_*(_fsm_)->n_cols + _col_])
+    ((_fsm_)->flat[(_row_)*(_fsm_)->n_cols + (_col_)])
+
+/** The sparse layout, for FSMs with many states that mostly stay put on
+    most events.  flat[] holds, one after the other:
+
+    - For each state, its n_cols - num_evt_cols - 1 columns past the 
+      timeout state (timeout_us, then the outputs) -- FSM_SPARSE_FIXED_COLS
+    - n_rows+1 offsets into the pairs, state s's being the ones from 
+      row_ptr[s] up to row_ptr[s+1] -- FSM_SPARSE_ROW_PTR
+    - num_pairs FSM_SPARSE_PAIR(col, next_state) for the input event and 
+      timeout state columns, sorted by column within each state --
+      FSM_SPARSE_PAIRS
+    
+    An input event or timeout state column that has no pair leads back to
+    the same state. */
+#define FSM_SPARSE_FIXED_COLS(_fsm_) ((_fsm_)->n_cols - (_fsm_)->routing.num_evt_cols - 1)
+#define FSM_SPARSE_ROW_PTR(_fsm_) (&(_fsm_)->flat[(_fsm_)->n_rows * FSM_SPARSE_FIXED_COLS(_fsm_)])
+#define FSM_SPARSE_PAIRS(_fsm_) (FSM_SPARSE_ROW_PTR(_fsm_) + (_fsm_)->n_rows + 1)
+#define FSM_SPARSE_PAIR(_col_, _state_) (((unsigned)(_col_) << 16) | (unsigned)(_state_))
+#define FSM_SPARSE_PAIR_COL(_pair_) ((_pair_) >> 16)
+#define FSM_SPARSE_PAIR_STATE(_pair_) ((_pair_) & 0xffff)
+
+/** The number of cells in flat[] that an FSM of this shape uses */
+static inline unsigned long FSMBlobCells(unsigned sparse, unsigned rows, unsigned cols, unsigned num_evt_cols, unsigned num_pairs)
+{
+  if (!sparse) return (unsigned long)rows * cols;
+  return (unsigned long)rows * (cols - num_evt_cols - 1) + rows + 1 + num_pairs;
+}
+
+/** The number of bytes at the start of an FSMBlob that are actually in use,
+    that is, the header plus its matrix cells. */
+static inline unsigned long FSMBlobUsedSize(const volatile struct FSMBlob *fsm)
+{
+  unsigned long cells = FSMBlobCells(fsm->sparse, fsm->n_rows, fsm->n_cols, fsm->routing.num_evt_cols, fsm->num_pairs);
+  if (cells > FSM_FLAT_SIZE) cells = FSM_FLAT_SIZE;
+  return FSMBLOB_HDR_SIZE + cells*sizeof(unsigned);
+}
+
+/** The index in flat[] of cell row, col, or -1 if it has none (the input
+    event and timeout state columns of a sparse FSM) */
+static inline long FSMCellIndex(const struct FSMBlob *fsm, unsigned row, unsigned col)
+{
+  const unsigned nevt = fsm->routing.num_evt_cols;
+  if (!fsm->sparse) return (long)row * fsm->n_cols + col;
+  if (col <= nevt) return -1;
+  return (long)row * FSM_SPARSE_FIXED_COLS(fsm) + (col - nevt - 1);
+}
+
+/** The timeout_us cell of a state, which its output cells follow in
+    either layout */
+static inline unsigned *FSMTimeoutCell(struct FSMBlob *fsm, unsigned row)
+{
+  if (!fsm->sparse) return &FSM_AT(fsm, row, fsm->routing.num_evt_cols + 1);
+  return &fsm->flat[row * FSM_SPARSE_FIXED_COLS(fsm)];
+}
+
+/** Where state goes on input event col (or, for col == num_evt_cols, on
+    timeout) */
+static inline unsigned FSMNextState(const struct FSMBlob *fsm, unsigned state, unsigned col)
+{
+  const unsigned *row_ptr, *pairs;
+  unsigned i, end;
+  if (!fsm->sparse) return FSM_AT(fsm, state, col);
+  row_ptr = FSM_SPARSE_ROW_PTR(fsm);
+  pairs = FSM_SPARSE_PAIRS(fsm);
+  for (i = row_ptr[state], end = row_ptr[state+1]; i < end; ++i) {
+    const unsigned c = FSM_SPARSE_PAIR_COL(pairs[i]);
+    if (c == col) return FSM_SPARSE_PAIR_STATE(pairs[i]);
+    if (c > col) break;
+  }
+  return state;
+}
+
+/** The value of cell row, col as it would be in the dense layout */
+static inline unsigned FSMCell(const struct FSMBlob *fsm, unsigned row, unsigned col)
+{
+  const long idx = FSMCellIndex(fsm, row, col);
+  return idx < 0 ? FSMNextState(fsm, row, col) : fsm->flat[idx];
+}
 
  /** Structure to encapsulate a single state in the state matrix.
      It basically is a convenience for accessing columns in the state matrix.
@@ -175,7 +264,8 @@ struct State
   /* Note that whereas the above 'column/input' field is actually pointing
      into FSMBlob (and thus is a good way to modify the FSM for an
      FSMBlob), the remaining two fields are copies taken from
-     column[n_inputs] to column[n_inputs+1]  */
+     column[n_inputs] to column[n_inputs+1].  For a sparse FSM input is
+     0, use FSMNextState() instead, but output still points into it.  */
   unsigned timeout_state; /* Where to go on timeout.. */
   unsigned timeout_us;  /* How long 'till state times out in microseconds 
                             -- 0 for never   */
@@ -190,10 +280,10 @@ do { \
   struct State * const _state = (struct State *)(state_); \
   if (no >= _fsm->n_rows) no = 0; \
   _state->n_inputs = _fsm->routing.num_evt_cols; \
-  _state->input = &FSM_AT(_fsm, no, 0); \
-  _state->timeout_state = FSM_AT(_fsm, no, _state->n_inputs); \
-  _state->timeout_us = FSM_AT(_fsm, no, _state->n_inputs+1); \
-  _state->output = &FSM_AT(_fsm, no, _state->n_inputs+2); \
+  _state->input = _fsm->sparse ? 0 : &FSM_AT(_fsm, no, 0); \
+  _state->timeout_state = FSMNextState(_fsm, no, _state->n_inputs); \
+  _state->timeout_us = *FSMTimeoutCell(_fsm, no); \
+  _state->output = FSMTimeoutCell(_fsm, no) + 1; \
   _state->n_outputs = _fsm->routing.num_out_cols; \
 } while(0)
 
@@ -209,8 +299,32 @@ struct StateTransition
   long long ext_ts; /* Nanosecond timestamp from external reference clock */
   unsigned short previous_state;
   unsigned short state; /* The state that was entered via this transition.   */
-  signed char event_id; /* The event_id that *led* to this state.  An event_id
-                           is basically a column position.                   */
+  signed short event_id; /* The event_id that *led* to this state.  An event_id
+                            is basically a column position.                  */
+};
+
+/** A few cells to change in the FSM most recently uploaded, which is
+    cheaper than sending the whole FSM again when only some timeouts or
+    outputs differ from one trial to the next.  The patched FSM gets
+    swapped in just like a new one (so it honors
+    wait_for_jump_to_state_0_to_swap_fsm), but the routing, sched waves
+    and AO waves stay as they are.
+
+    Only state rows can be patched, and values are as in FSMBlob::flat
+    (timeouts in microseconds).  The patch is refused (ok == 0) if there is
+    no valid FSM, if it doesn't have the shape the patch was made for, or
+    if a cell is out of range. */
+#define FSM_PATCH_MAX_CELLS 1024
+struct FSMPatch
+{
+  unsigned short n_rows, n_cols;  /**< the FSM shape this patch is for */
+  unsigned short num_evt_cols;
+  unsigned short num;             /**< cells used below */
+  int ok;                         /**< reply: nonzero iff it was applied */
+  struct FSMPatchCell {
+    unsigned short row, col;
+    unsigned value;
+  } cells[FSM_PATCH_MAX_CELLS];
 };
 
 #define AOWAVE_MEMORY_BYTES (FSM_MEMORY_BYTES/2)
@@ -269,6 +383,8 @@ enum ShmMsgID
                      AO channels, a precursor to uploading a correct AO wave
                      to kernel */
     AOWAVE, /* set/clear an existing AO wave */
+    FSMPATCH, /* Change a few cells of the FSM, see struct FSMPatch */
+    FSMSLOT, /* Load an FSM already written to a slot of the FSMBlobPool */
     LAST_SHM_MSG_ID
 };
 
@@ -337,9 +453,83 @@ struct ShmMsg {
       /* For id == AOWAVE */
       struct AOWave aowave;
 
+      /* For id == FSMPATCH */
+      struct FSMPatch fsm_patch;
+
+      /* For id == FSMSLOT: the FSMBlobPool slot the new FSM is in, which
+         the sender has claimed (see struct FSMBlobPool).  Its reference
+         goes to RT with the message, whether or not the FSM is any good. */
+      unsigned fsm_slot;
+
+      /* The reply to FSM and FSMSLOT: nonzero if RT took the new FSM, 0 if
+         it failed its checks (or there was no room for it) */
+      unsigned fsm_accepted;
+
     } u;
   };
 
+  /** ShmMsg framing.  
+
+      struct ShmMsg is sized for its largest union members (struct FSMBlob 
+      and struct AOWave) but nearly every message uses only a few bytes of 
+      it.  Only the header (the id) plus the part of the union that is 
+      meaningful for a given id ever needs to be copied in or out of the 
+      shm, and ShmMsgSize() returns how many bytes that is for either the 
+      request (as filled in by userspace) or the reply (as filled in by the 
+      RT task).  
+
+      The used part is always a prefix of the struct, with one exception:
+      AOWAVE requests also use evt_cols[0..nsamples), which lives after the
+      full samples[] array.  See SHM_MSG_AOWAVE_EVT_COLS_OFFSET. */
+#define SHM_MSG_REQUEST 0
+#define SHM_MSG_REPLY   1
+#define SHM_MSG_HDR_SIZE ((unsigned long)&((struct ShmMsg *)0)->u)
+#define SHM_MSG_SIZEOF_U(member) \
+  (SHM_MSG_HDR_SIZE + sizeof(((struct ShmMsg *)0)->u.member))
+#define SHM_MSG_AOWAVE_EVT_COLS_OFFSET \
+  ((unsigned long)&((struct ShmMsg *)0)->u.aowave.evt_cols[0])
+
+  static inline unsigned long ShmMsgSize(const volatile struct ShmMsg *msg, int is_reply)
+  {
+    unsigned long n;
+    switch (msg->id) {
+    case FSM:  
+      return is_reply ? SHM_MSG_SIZEOF_U(fsm_accepted) : SHM_MSG_HDR_SIZE + FSMBlobUsedSize(&msg->u.fsm);
+    case GETFSM:  
+      return SHM_MSG_HDR_SIZE + (is_reply ? FSMBlobUsedSize(&msg->u.fsm) : 0);
+    case TRANSITIONS:
+      n = is_reply ? msg->u.transitions.num : 0;
+      if (n > MSG_MAX_TRANSITIONS) n = MSG_MAX_TRANSITIONS;
+      return (unsigned long)&((struct ShmMsg *)0)->u.transitions.transitions[n];
+    case AOWAVE:
+      n = is_reply ? 0 : msg->u.aowave.nsamples;
+      if (n > AOWAVE_MAX_SAMPLES) n = AOWAVE_MAX_SAMPLES;
+      return (unsigned long)&((struct ShmMsg *)0)->u.aowave.samples[n];
+    case FSMPATCH:
+      n = is_reply ? 0 : msg->u.fsm_patch.num;
+      if (n > FSM_PATCH_MAX_CELLS) n = FSM_PATCH_MAX_CELLS;
+      return (unsigned long)&((struct ShmMsg *)0)->u.fsm_patch.cells[n];
+    case TRANSITIONCOUNT:   return SHM_MSG_SIZEOF_U(transition_count);
+    case GETPAUSE:       
+    case PAUSEUNPAUSE:      return SHM_MSG_SIZEOF_U(is_paused);
+    case GETVALID:
+    case INVALIDATE:        return SHM_MSG_SIZEOF_U(is_valid);
+    case FORCEEVENT:        return SHM_MSG_SIZEOF_U(forced_event);
+    case FORCESOUND:        return SHM_MSG_SIZEOF_U(forced_triggers);
+    case FORCEOUTPUT:       return SHM_MSG_SIZEOF_U(forced_outputs);
+    case GETRUNTIME:        return SHM_MSG_SIZEOF_U(runtime_us);
+    case GETCURRENTSTATE:   return SHM_MSG_SIZEOF_U(current_state);
+    case FORCESTATE:        return SHM_MSG_SIZEOF_U(forced_state);
+    case GETFSMSIZE:        return SHM_MSG_SIZEOF_U(fsm_size);
+    case GETNUMINPUTEVENTS: return SHM_MSG_SIZEOF_U(num_input_events);
+    case STARTDAQ:          return SHM_MSG_SIZEOF_U(start_daq);
+    case GETAOMAXDATA:      return SHM_MSG_SIZEOF_U(ao_maxdata);
+    case FSMSLOT:           return is_reply ? SHM_MSG_SIZEOF_U(fsm_accepted) : SHM_MSG_SIZEOF_U(fsm_slot);
+    default: /* RESET, FORCETIMESUP, READYFORTRIAL, STOPDAQ carry no payload */
+      return SHM_MSG_HDR_SIZE;
+    }
+  }
+
   /** Struct put into shm->fifo_daq, 1 per scan */
   struct DAQScan 
   {
@@ -397,7 +587,38 @@ struct ShmMsg {
     };
   };
 
-# define NUM_STATE_MACHINES 6
+  /** The number of state machines is the num_fsms module parameter,
+      which defaults to FSM_DEFAULT_STATE_MACHINES and can be at most
+      FSM_MAX_STATE_MACHINES.  Userspace finds it in Shm::num_fsms. */
+# define FSM_DEFAULT_STATE_MACHINES 6
+# define FSM_MAX_STATE_MACHINES 16
+
+  /** A snapshot of an FSM's status, republished by the RT task every tick
+      so that userspace can answer simple read-only queries (current state,
+      event counter, time, is running) without an RT round-trip.
+
+      It is protected by a sequence counter (a seqlock): the RT task makes
+      seq odd while it updates the block and even again when it is done.  
+      Readers copy the block and retry if seq was odd or changed while 
+      they were copying. */
+  struct FSMStatus
+  {
+    unsigned seq;
+    unsigned current_state;
+    unsigned transition_count;
+    unsigned paused;
+    unsigned valid;
+    unsigned active_wave_mask;    /* sched waves currently running */
+    unsigned active_ao_wave_mask; /* AO waves currently playing */
+    long long current_ts; /* nanoseconds since FSM reset, same clock as 
+                             StateTransition::ts */
+    /* shape of the most recently uploaded FSM (the one waiting to be
+       swapped in, if any) which is what a FSMPATCH applies to, 0 if none */
+    unsigned short fsm_rows, fsm_cols, fsm_evt_cols;
+    /* nonzero while that FSM waits to be swapped in, it has a pool slot 
+       of its own then, see struct FSMBlobPool */
+    unsigned short pending_swap;
+  };
 
   /** 
       The shared memory -- not every plugin needs shared memory but 
@@ -406,22 +627,27 @@ struct ShmMsg {
   */
   struct Shm 
   { 
-    int fifo_out[NUM_STATE_MACHINES]; /* The kernel-to-user FIFO             */
-    int fifo_in[NUM_STATE_MACHINES];  /* The user-to-kernel FIFO             */
-    int fifo_trans[NUM_STATE_MACHINES]; /* Kernel-to-user FIFO to notify of 
+    int fifo_out[FSM_MAX_STATE_MACHINES]; /* The kernel-to-user FIFO             */
+    int fifo_in[FSM_MAX_STATE_MACHINES];  /* The user-to-kernel FIFO             */
+    int fifo_trans[FSM_MAX_STATE_MACHINES]; /* Kernel-to-user FIFO to notify of 
                                            state transitions                 */
-    int fifo_daq[NUM_STATE_MACHINES]; /* Kernel-to-user FIFO that contains DAQ scans.. */
-    int fifo_nrt_output[NUM_STATE_MACHINES]; /* Kernel-to-user FIFO that contains NRTOutput structs for non-realtime state machine outputs! */
+    int fifo_daq[FSM_MAX_STATE_MACHINES]; /* Kernel-to-user FIFO that contains DAQ scans.. */
+    int fifo_nrt_output[FSM_MAX_STATE_MACHINES]; /* Kernel-to-user FIFO that contains NRTOutput structs for non-realtime state machine outputs! */
     int fifo_debug; /* The kernel-to-user FIFO setup for debugging           */
-    
-    /* When fifo_in gets an int, this value is read by kernel-process.
+
+    unsigned num_fsms; /* The number of state machines, only the first 
+                          num_fsms entries of the arrays here are used   */
+    int    magic;               /*< Should always equal SHM_MAGIC            */
+
+    /* Then, at SHM_HDR_SIZE, num_fsms struct ShmMsg (see SHM_MSG()) and 
+       num_fsms struct FSMStatus (see SHM_STATUS()).
+
+       When fifo_in gets an int, the ShmMsg is read by kernel-process.
        (The alternative would have been to write this msg to a FIFO
        but that's a lot of wasteful double-copying.  It's faster to
        use the shm directly, and only use the FIFO for synchronization
-       and notification.  */
-    struct ShmMsg msg[NUM_STATE_MACHINES]; 
-
-    int    magic;               /*< Should always equal SHM_MAGIC            */
+       and notification.  The FSMStatus is published by the RT task each
+       tick, see struct FSMStatus above.                                 */
   };
 
 
@@ -436,8 +662,95 @@ struct ShmMsg {
 #endif
 
 #define SHM_NAME "RatExpFSM"
-#define SHM_MAGIC ((int)(0xf0010112)) /*< Magic no. for shm... 'fool0112'  */
-#define SHM_SIZE (sizeof(struct Shm))
+/* The shm magic numbers change whenever the layout of what's in the shm 
+   does (struct Shm, ShmMsg, FSMStatus, FSMBlob..), so that a server and 
+   a module that don't agree on it refuse to talk */
+#define SHM_MAGIC ((int)(0xf0010118)) /*< Magic no. for shm... 'fool0118'  */
+/* The header is rounded up so that the ShmMsgs after it are aligned */
+#define SHM_HDR_SIZE ((sizeof(struct Shm)+15UL)&~15UL)
+#define SHM_SIZE(n) (SHM_HDR_SIZE + (unsigned long)(n)*(sizeof(struct ShmMsg)+sizeof(struct FSMStatus)))
+/* The message buffer and the status of state machine f in shm s (which
+   must have room for at least f+1 of them) */
+#define SHM_MSG(s,f) ((volatile struct ShmMsg *)((volatile char *)(s) + SHM_HDR_SIZE) + (f))
+#define SHM_STATUS(s,f) ((volatile struct FSMStatus *)SHM_MSG((s),(s)->num_fsms) + (f))
+
+#define MAX_HISTORY 65536 /* The maximum number of state transitions we remember -- note that the struct StateTransition is currently 24 bytes so the memory we consume (in bytes) is this number times 24 times the number of state machines! */
+
+  /** The state history of one FSM: a circular buffer of all its
+      transitions since the last RESET.
+
+      The RT task writes transition number n (counting from 0) to
+      transitions[n % MAX_HISTORY], does a write barrier and only then sets
+      num_transitions to n+1.  On a reset it sets num_transitions to 0,
+      does a write barrier and then increments reset_count.  So a reader
+      that reads reset_count, then num_transitions, then copies any range
+      below it, then reads num_transitions (N) and reset_count again has a
+      good copy of every entry i in the range for which i + MAX_HISTORY > N,
+      provided reset_count didn't change.  (N alone can't tell: after a
+      reset it may have grown past the range again already.)   */
+  struct StateHistory
+  {
+    struct StateTransition transitions[MAX_HISTORY];
+    unsigned num_transitions; /* Number of total transitions since RESET of state
+                                 machine.  
+                                 Index into array: num_transitions%MAX_HISTORY */
+    unsigned reset_count; /* Number of RESETs, see above */
+  };
+
+  /** The state histories live in their own shm, apart from struct Shm, so
+      that userspace can read them directly (it should never write them). */
+  struct FSMHistShm
+  {
+    int magic; /*< Should always equal FSM_HIST_SHM_MAGIC */
+    unsigned num_fsms; /* the same as Shm::num_fsms */
+    struct StateHistory history[1]; /* really num_fsms of them */
+  };
+
+#define FSM_HIST_SHM_NAME "RatExpFSMHist"
+#define FSM_HIST_SHM_MAGIC ((int)(0xf0010119))
+#define FSM_HIST_SHM_SIZE(n) (sizeof(struct FSMHistShm) + ((unsigned long)(n)-1)*sizeof(struct StateHistory))
+
+  /** A pool of FSMBlobs in shm that all the state machines share, so that
+      userspace can build a new FSM in place and have RT adopt it without
+      copying it (see FSMSLOT).  
+
+      Each slot has a reference count in refs[].  A slot with refs 0 is 
+      free, and anyone may claim it by atomically changing its count from
+      0 to 1.  Whoever holds a reference may not have the slot's blob
+      change under them, and the one who claimed a slot owns its contents
+      until it hands the slot (and the reference) over in an FSMSLOT 
+      message.  RT holds a reference on the slot each FSM is running and,
+      while a new FSM waits to be swapped in, on one more, and drops them 
+      on RESET.  So that an FSM never holds more than two, userspace only 
+      claims a slot for an FSM that has no FSM waiting to be swapped in 
+      (FSMStatus::pending_swap), one at a time, otherwise it sends the FSM
+      in the ShmMsg and RT reuses the waiting FSM's slot.
+
+      A process that dies between claiming a slot and handing it over 
+      would leak it, so userspace notes its pid in claimer[] meanwhile, 
+      and the server gives back any slots whose claimer is gone when it
+      attaches.
+
+      Slot 0 is an empty FSM that is never claimed: an FSM that has no 
+      slot of its own runs it.  It's only the FSMBlob header, the others 
+      are full size. */
+  struct FSMBlobPool
+  {
+    int magic; /*< Should always equal FSM_POOL_SHM_MAGIC */
+    unsigned num_slots; /* including slot 0 */
+#define FSM_POOL_MAX_SLOTS 64
+    volatile int refs[FSM_POOL_MAX_SLOTS];
+    volatile int claimer[FSM_POOL_MAX_SLOTS]; /* pid, 0 if RT's or free */
+    /* Then, at FSM_POOL_HDR_SIZE, slot 0's FSMBlob header and num_slots-1 
+       struct FSMBlob, see FSM_POOL_BLOB() */
+  };
+
+#define FSM_POOL_SHM_NAME "RatExpFSMPool"
+#define FSM_POOL_SHM_MAGIC ((int)(0xf0010117))
+#define FSM_POOL_HDR_SIZE ((sizeof(struct FSMBlobPool)+15UL)&~15UL)
+#define FSM_POOL_EMPTY_SIZE ((FSMBLOB_HDR_SIZE+15UL)&~15UL)
+#define FSM_POOL_SHM_SIZE(n) (FSM_POOL_HDR_SIZE + FSM_POOL_EMPTY_SIZE + ((unsigned long)(n)-1)*sizeof(struct FSMBlob))
+#define FSM_POOL_BLOB(p,i) ((struct FSMBlob *)((char *)(p) + FSM_POOL_HDR_SIZE + ((i) ? FSM_POOL_EMPTY_SIZE + ((unsigned long)(i)-1)*sizeof(struct FSMBlob) : 0)))
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,182 @@
+#ifndef RAT_EXP_FSM_PROTO_H
+#  define RAT_EXP_FSM_PROTO_H
+
+#include "RatExpFSM.h" /* for the int32/uint32 typedefs, DIO_TYPE, etc */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /** Binary protocol ("protocol 2") for RatExpFSMServer.
+
+      A client switches a connection over to this protocol by sending the
+      text command "PROTOCOL 2" and reading back "OK".  From then on both
+      directions carry frames: a struct FSMProtoHdr followed by payload_len
+      bytes of payload.  Everything is in host byte order (the rigs and the
+      server are all x86), doubles are IEEE 754, and matrices are
+      column-major just like in Matlab.
+
+      Every request frame gets exactly one reply frame with the same opcode
+      and req_id, and a status of FSM_PROTO_OK or FSM_PROTO_ERROR.  Clients
+      should match replies to requests by req_id rather than by order.
+
+      Unlike the text protocol, each frame names the state machine it
+      operates on, so one connection can drive all of them, and matrices
+      travel inside the request or reply frame (no MATRIX/READY handshake),
+      so every command is exactly one round-trip.
+
+      Frames may be pipelined: the server runs every request it has
+      buffered and writes all their replies with a single send.  To make
+      a group of commands explicit (say, the trial-start sequence of SET
+      STATE MATRIX, SET AO WAVE..., READY TO START TRIAL), wrap their
+      request frames, back to back, in the payload of one FSM_OP_BATCH
+      frame.  They are run in order and the reply's payload holds their
+      reply frames, in the same order.  The batch itself only fails if
+      its payload is malformed (nested batches count as malformed); check
+      each embedded reply for the outcome of the individual commands.
+      A failed batch's payload is a uint32, the index of the malformed
+      request frame, followed by the reply frames of the ones before it,
+      which did run. */
+
+#define FSM_PROTO_VERSION 2
+#define FSM_PROTO_MAGIC 0x46534d32 /* 'FSM2' */
+#define FSM_PROTO_MAX_PAYLOAD (16*1024*1024)
+
+  enum FSMProtoStatus { FSM_PROTO_OK = 0, FSM_PROTO_ERROR = -1 };
+
+  struct FSMProtoHdr
+  {
+    uint32 magic;       /* always FSM_PROTO_MAGIC */
+    uint16 opcode;      /* one of FSMProtoOp below */
+    uint16 fsm_id;      /* the state machine this frame is about */
+    uint32 req_id;      /* chosen by the client, echoed back in the reply */
+    int32  status;      /* replies only: one of FSMProtoStatus */
+    uint32 payload_len; /* number of payload bytes following this header */
+  };
+
+  /** Opcodes, with the payloads they carry.  "none" means payload_len is 0.
+      The semantics are the same as those of the text command of the same
+      name. */
+  enum FSMProtoOp
+  {
+    FSM_OP_NOOP = 1,             /* req: none  reply: none */
+    FSM_OP_SET_STATE_MATRIX,     /* req: FSMProtoSetMatrix  reply: none */
+    FSM_OP_GET_STATE_MATRIX,     /* req: none  reply: FSMProtoMatrix */
+    FSM_OP_INITIALIZE,           /* req: none  reply: none */
+    FSM_OP_HALT,                 /* req: none  reply: none */
+    FSM_OP_RUN,                  /* req: none  reply: none */
+    FSM_OP_FORCE_TIME_UP,        /* req: none  reply: none */
+    FSM_OP_READY_TO_START_TRIAL, /* req: none  reply: none */
+    FSM_OP_TRIGSOUND,            /* req: int32 trigger mask  reply: none */
+    FSM_OP_BYPASS_DOUT,          /* req: int32 output mask  reply: none */
+    FSM_OP_FORCE_STATE,          /* req: uint32 state  reply: none */
+    FSM_OP_GET_EVENT_COUNTER,    /* req: none  reply: uint32 */
+    FSM_OP_IS_RUNNING,           /* req: none  reply: uint32 */
+    FSM_OP_GET_TIME,             /* req: none  reply: double seconds */
+    FSM_OP_GET_CURRENT_STATE,    /* req: none  reply: uint32 */
+    FSM_OP_GET_EVENTS,           /* req: FSMProtoGetEvents  reply: FSMProtoMatrix */
+    FSM_OP_START_DAQ,            /* req: FSMProtoStartDAQ  reply: none */
+    FSM_OP_STOP_DAQ,             /* req: none  reply: none */
+    FSM_OP_GET_DAQ_SCANS,        /* req: none  reply: FSMProtoMatrix */
+    FSM_OP_SET_AO_WAVE,          /* req: FSMProtoSetAOWave  reply: none */
+    FSM_OP_GET_NUM_STATE_MACHINES, /* req: none  reply: uint32 */
+    FSM_OP_BATCH,                /* req: request frames  reply: reply frames */
+    FSM_OP_GET_DAQ_DECIMATED,    /* req: FSMProtoGetDAQDecimated  reply: FSMProtoMatrix */
+    FSM_OP_PATCH_STATE_MATRIX,   /* req: FSMProtoMatrix of n x 3 cells  reply: none */
+    FSM_OP_SET_STATE_MATRIX_HASH, /* req: FSMProtoSetMatrixHash  reply: none */
+    FSM_OP_GET_STATE_MATRIX_HASH, /* req: none  reply: uint64 */
+    FSM_OP_SET_STATE_MATRIX_SPARSE, /* req: FSMProtoSetMatrix, spec, FSMProtoMatrix of nnz x 3 cells  reply: none */
+    FSM_OP_LAST
+  };
+
+  /** A matrix: this header followed by rows*cols doubles */
+  struct FSMProtoMatrix
+  {
+    uint32 rows, cols;
+  };
+
+  /** FSM_OP_SET_STATE_MATRIX: this header, then output_spec_len bytes of
+      output spec string (\1type\2data... as in the text protocol, but not
+      URL-encoded), then the rows*cols doubles of the matrix. */
+  struct FSMProtoSetMatrix
+  {
+    uint32 rows, cols;
+    uint32 num_events;
+    uint32 num_sched_waves;
+    uint32 in_chan_type;          /* DIO_TYPE or AI_TYPE */
+    uint32 ready_for_trial_state;
+    uint32 swap_on_state0;        /* wait for a jump to state 0 to swap in
+                                     the new matrix */
+    uint32 output_spec_len;
+  };
+
+  /** FSM_OP_SET_STATE_MATRIX_SPARSE: like FSM_OP_SET_STATE_MATRIX, but
+      the rows*cols doubles are replaced by an FSMProtoMatrix header and 
+      nnz x 3 doubles, the row, col and value of each cell that isn't the
+      default.  The default is 0, but for the input event and timeout 
+      state columns of states it is the state itself.  RT then gets the
+      matrix in its sparse layout, which allows for many more states. */
+
+  /** FSM_OP_SET_STATE_MATRIX_HASH: resend a matrix the server still has
+      cached, hash being what FSM_OP_GET_STATE_MATRIX_HASH said after it
+      was uploaded.  Fails if it has since been evicted from the cache. */
+  struct FSMProtoSetMatrixHash
+  {
+    uint64 hash;
+    uint32 swap_on_state0;
+    uint32 reserved;
+  };
+
+  struct FSMProtoGetEvents
+  {
+    uint32 first, last; /* inclusive range of event indices */
+  };
+
+  struct FSMProtoStartDAQ
+  {
+    uint32 chan_mask;
+    int32 range_min; /* fixed point, in microvolts */
+    int32 range_max; /* fixed point, in microvolts */
+  };
+
+  struct FSMProtoGetDAQDecimated
+  {
+    uint32 factor;   /* 10 or 100 */
+    uint32 reserved;
+    double t0, t1;   /* window, in seconds, of bucket start times */
+  };
+
+  /** FSM_OP_SET_AO_WAVE: this header followed by rows*cols doubles,
+      rows == 0 clears the wave. */
+  struct FSMProtoSetAOWave
+  {
+    uint32 id, aoline, loop;
+    uint32 rows, cols;
+  };
+
+  /** STREAM DAQ (a text protocol command): after its "OK" the connection
+      carries nothing but DAQ blocks, sent as scans come in.  Each is this
+      header followed by payload_len bytes: nscans int64 timestamps (in
+      nanoseconds), then nchans columns of nscans uint16 raw samples.
+      Volts are sample*scale + offset.
+
+      Scans are numbered from server startup, and a block's scans are
+      first_scan .. first_scan+nscans-1, so a first_scan past the end of
+      the previous block means scans were lost (the client fell more than
+      the server's DAQ buffer behind, or a new START DAQ discarded them). */
+#define FSM_DAQ_BLOCK_MAGIC 0x44415142 /* 'DAQB' */
+
+  struct FSMProtoDAQBlock
+  {
+    uint32 magic;       /* always FSM_DAQ_BLOCK_MAGIC */
+    uint32 payload_len; /* number of bytes following this header */
+    uint64 first_scan;  /* sequence number of the first scan in the block */
+    uint32 nscans, nchans;
+    double scale, offset;
+  };
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef RAT_EXP_FSM_RECORD_H
+#  define RAT_EXP_FSM_RECORD_H
+
+#include "RatExpFSM.h" /* for the int typedefs, StateTransition, DAQScan, NRTOutput */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+  /** Session recordings, as written by RatExpFSMServer after START
+      RECORDING: one file per state machine holding everything its fifos
+      delivered -- state transitions, DAQ scans and NRT outputs.
+
+      The file is a struct FSMRecFileHdr followed by records.  A record is
+      a struct FSMRecHdr followed by len bytes of payload, padded with
+      zeroes to a multiple of 8 bytes (FSM_REC_PADDED_LEN), so that every
+      record and every struct in it is 8-byte aligned in an mmap'ed file.
+      Payloads by type:
+
+        FSM_REC_TRANSITIONS  struct StateTransition[len/sizeof(StateTransition)]
+        FSM_REC_DAQ          struct DAQScans back to back, each followed by
+                             its nsamps raw samples, just as in fifo_daq
+        FSM_REC_NRT          struct NRTOutput[len/sizeof(NRTOutput)]
+        FSM_REC_INDEX        struct FSMRecIndex then its nentries entries
+
+      Records are only ever appended.  Every so often the writer appends an
+      index record listing the records since the previous one (their offset,
+      first timestamp and trial), waits for it to be on disk, and only then
+      updates last_index in the file header -- the one field that is ever
+      rewritten.  So after a crash last_index still points to a good index
+      record.  To find a timestamp or a trial, follow the index chain back
+      from last_index, then walk the records after the last index up to the
+      end of the file; a record whose payload runs past the end of the file
+      was cut short by the crash and ends the data. */
+
+#define FSM_REC_MAGIC 0x52534d46 /* 'FSMR' */
+#define FSM_REC_VERSION 2 /* 2: StateTransition::event_id is a short */
+#define FSM_REC_PADDED_LEN(len) (((len) + 7) & ~7U)
+
+  enum FSMRecType
+  {
+    FSM_REC_TRANSITIONS = 1,
+    FSM_REC_DAQ,
+    FSM_REC_NRT,
+    FSM_REC_INDEX
+  };
+
+  struct FSMRecFileHdr
+  {
+    uint32 magic;       /* always FSM_REC_MAGIC */
+    uint32 version;     /* FSM_REC_VERSION */
+    uint32 fsm_id;      /* the state machine that was recorded */
+    uint32 hdr_size;    /* sizeof(struct FSMRecFileHdr), the first record starts here */
+    int64  start_time;  /* when recording started, seconds since the Unix epoch */
+    uint64 last_index;  /* file offset of the newest index record, 0 if none yet */
+  };
+
+  struct FSMRecHdr
+  {
+    uint32 type;        /* one of FSMRecType */
+    uint32 len;         /* payload bytes following this header, not counting padding */
+    int64  ts_nanos;    /* timestamp of the first item in the payload, FSM time */
+    uint32 trial;       /* how many times the FSM had entered state 0 since recording started */
+    uint32 reserved;
+  };
+
+  struct FSMRecIndex
+  {
+    uint64 prev_index;  /* file offset of the previous index record, 0 if this is the first */
+    uint32 nentries;
+    uint32 reserved;
+  };
+
+  struct FSMRecIndexEntry
+  {
+    uint64 offset;      /* file offset of the record's FSMRecHdr */
+    int64  ts_nanos;    /* the record's ts_nanos */
+    uint32 trial;       /* the record's trial */
+    uint32 type;        /* the record's type */
+  };
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -5,13 +5,21 @@
 #define _REENTRANT
 #endif
 #include "RatExpFSM.h"
+#include "RatExpFSMProto.h"
 #include "rtos_utility.h"
+#include "AsyncLog.h"
+#include "SessionRecorder.h"
+#include "Metrics.h"
 
 #include <unistd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/poll.h>
+#include <fcntl.h>
 #include <string.h>
 #include <errno.h>
 #include <netinet/in.h>
@@ -26,66 +34,96 @@
 #include <limits.h>
 
 #include <cstdlib>
+#include <cmath>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
 #include <string>
 #include <cstring>
 #include <list>
+#include <deque>
 #include <map>
+#include <set>
 #include <vector>
 #include <memory>
+#include <algorithm>
 
 #define MIN(a,b) ( (a) < (b) ? (a) : (b) )
+#define MAX_LINE 2048
+#define MAX_BATCH_OUTPUT (4*1024*1024) /* bytes of BEGIN BATCH replies held back before sending some anyway */
+
+class Connection;
+
+/* Single producer, multiple consumer ring of state transitions.  The
+   producer (the transNotify thread) writes an entry and only then publishes 
+   it by bumping head.  Consumers never lock or write anything here, each 
+   one keeps its own cursor, so they can't slow down each other or the 
+   producer.  A consumer that falls more than Size entries behind loses the
+   oldest ones, and read() tells it how many. */
+struct TransRing
+{
+  enum { Size = 2048 }; // store 2048 state transitions in memory from transNotify thread
+
+  TransRing() : head(0) {}
+
+  void push(const StateTransition & t) 
+  { 
+    buf[head % Size] = t; 
+    __sync_synchronize(); // entry must be complete before it's published
+    head = head + 1; 
+  }
+  /// the number of transitions pushed so far, a new consumer's cursor starts here
+  unsigned long count() const { return head; }
+  /// copies transitions [cursor, count()) to out and advances cursor, returns the number lost to overflow
+  unsigned long read(unsigned long & cursor, std::vector<StateTransition> & out) const
+  {
+    const unsigned long h = head;
+    unsigned long lost = 0;
+    __sync_synchronize(); // don't read the entries before head
+    if (h - cursor > Size) lost = h - cursor - Size, cursor = h - Size;
+    out.clear();
+    for (unsigned long i = cursor; i != h; ++i) out.push_back(buf[i % Size]);
+    __sync_synchronize(); // finish reading the entries before checking head again
+    // the producer may have been writing over the oldest ones while we copied them,
+    // entry i is intact as long as i + Size > head
+    const unsigned long clobbered = MIN(head + 1 - cursor > Size ? head + 1 - cursor - Size : 0, out.size());
+    out.erase(out.begin(), out.begin() + clobbered);
+    cursor = h;
+    return lost + clobbered;
+  }
 
-class ConnectionThread;
-
-template <class T> struct CircBuf
-{
-  CircBuf(size_t n_elems) : n(n_elems ? n_elems : 1), ct(0) { buf.resize(n_elems); }
-  ~CircBuf() { buf.clear(); }
-  T & operator[](unsigned long long i) { return buf[(unsigned)(i%n)]; }
-  void push(const T & t) { (*this)[ct++] = t;  }
-  // use this to increment counter with the data already in the buf
-  void push() { ct++; }
-  T & next() { return (*this)[count()]; }
-  unsigned long long count() const { return ct; }
-  unsigned long countNormalized() const { return ct > n ? ct%n : ct; }
-  size_t size() const { return n; }
-  void clear() { ct = 0; }
 private:
-  std::vector<T> buf;
-  size_t n;
-  unsigned long long ct;
+  StateTransition buf[Size];
+  volatile unsigned long head; // unsigned long so that it's read and written atomically, differences are wrap-safe
 };
 
 namespace 
 { // anonymous namespaced globales
   volatile struct Shm *shm = 0;
+  const volatile struct FSMHistShm *histShm = 0; // 0 if the RT module doesn't export its history, then use TRANSITIONS
+  volatile struct FSMBlobPool *fsmPool = 0; // 0 if the RT module has no FSM pool, then new FSMs go to RT in the ShmMsg
+  int numStateMachines = 0; // however many the RT module was loaded with, see attachShm()
   int listen_fd = -1; /* Our listen socket.. */
   unsigned short listenPort = 3333;
-  typedef std::map<ConnectionThread *, ConnectionThread *> ConnectedThreadsList;
-  unsigned n_threads;
-  ConnectedThreadsList connectedThreads;
-  pthread_mutex_t connectedThreadsLock = PTHREAD_MUTEX_INITIALIZER;
+  int metricsPort = 0; /* plain text metrics on localhost, 0 means none (3334, the obvious choice, is LynxTrigServer's) */
+  int epoll_fd = -1; /* The reactor's epoll set: listen socket + idle client sockets */
+  typedef std::set<Connection *> ConnectionList;
+  ConnectionList connections; /* all live connections, protected by connectionsLock */
+  pthread_mutex_t connectionsLock = PTHREAD_MUTEX_INITIALIZER;
+  // a client that stalls in the middle of a command can't hog a worker longer than this
+  const int SOCK_IO_TIMEOUT_SECS = 30;
+  // NRT outputs: how long a resolved address is trusted, how long to wait on
+  // an NRT host before giving up on a packet, and how long to leave an
+  // unreachable one alone before trying again
+  const int NRT_DNS_CACHE_SECS = 60;
+  const int NRT_IO_TIMEOUT_MS = 2000;
+  const int NRT_RETRY_SECS = 1;
 
   std::string UrlEncode(const std::string &);
   std::string UrlDecode(const std::string &);
   std::string FormatPacketText(const std::string &, const NRTOutput *);
 };  
 
-struct DAQScanVec : public DAQScan
-{
-  std::vector<double> samples;
-    
-  void assign(const DAQScan *ds, unsigned maxData, double rangeMin, double rangeMax) { 
-    static_cast<DAQScan &>(*this) = *ds; 
-    samples.resize(nsamps);
-    for (unsigned i = 0; i < nsamps; ++i)
-      samples[i] = (ds->samps[i]/double(maxData) * (rangeMax-rangeMin)) + rangeMin;
-  }
-};
-
 struct MutexLocker
 {
   MutexLocker(pthread_mutex_t *m) : mut(*m) { pthread_mutex_lock(&mut); }
@@ -94,105 +132,542 @@ struct MutexLocker
   pthread_mutex_t & mut;
 };
 
+// A slot of the RT module's FSMBlobPool, claimed to build an FSM in, see
+// struct FSMBlobPool.  Our reference is dropped when this goes out of scope,
+// unless handOver() gave it to RT with the slot in FSMSLOT.
+class PoolSlot
+{
+public:
+  /// wanted is false for an FSM that already has a pool slot waiting to be swapped in, see struct FSMBlobPool
+  explicit PoolSlot(bool wanted) : slot(0) 
+  {
+    for (unsigned i = 1; wanted && fsmPool && i < fsmPool->num_slots; ++i)
+      if (!fsmPool->refs[i] && __sync_bool_compare_and_swap(&fsmPool->refs[i], 0, 1)) {
+        fsmPool->claimer[i] = ::getpid(); // see reclaimPoolSlots()
+        slot = i;
+        break;
+      }
+  }
+  ~PoolSlot() 
+  { 
+    if (!slot) return;
+    fsmPool->claimer[slot] = 0;
+    __sync_fetch_and_sub(&fsmPool->refs[slot], 1); 
+  }
+  // 0 if there was no pool, or no free slot in it
+  FSMBlob *blob() const { return slot ? FSM_POOL_BLOB(fsmPool, slot) : 0; }
+  /// our reference goes to RT with the FSMSLOT message, the blob is RT's from here on
+  unsigned handOver() 
+  {
+    const unsigned s = slot;
+    fsmPool->claimer[s] = 0;
+    slot = 0;
+    return s;
+  }
+private:
+  PoolSlot(const PoolSlot &);
+  PoolSlot & operator=(const PoolSlot &);
+  unsigned slot;
+};
+
+
+class Timer
+{
+public:
+  Timer() { reset(); }
+  void reset();
+  double elapsed() const; // returns number of seconds since ctor or reset() was called 
+private:
+  struct timeval ts;
+};
+
+void Timer::reset()
+{
+  ::gettimeofday(&ts, NULL);
+}
+
+double Timer::elapsed() const
+{
+  if (ts.tv_sec == 0) return 0.0;
+  struct timeval tv;
+  ::gettimeofday(&tv, NULL);
+  return tv.tv_sec - ts.tv_sec + (tv.tv_usec - ts.tv_usec)/1000000.0;
+}
+
+
+/* One level of the DAQ decimation pyramid: the min, max and sum of each
+   channel over consecutive buckets of `factor` scans, kept up to date as
+   scans come in.  The 10x level is fed scans, the 100x level the 10x
+   level's buckets and so on, so each scan costs a few compares and adds
+   at the bottom level only.  Bucket n lives in slot n % Capacity.  Part
+   of DAQRing, so also protected by FSMSpecific::daqLock. */
+struct DAQLevel
+{
+  enum { Capacity = 65536 }; // buckets kept per level, so the 10x level spans 2.5 times the raw ring
+
+  DAQLevel() : factor(1), nChans(0), head(0), first(0), count(0), ts(Capacity) {}
+
+  /// make room for nchans channels per bucket, drops the buckets stored so far
+  void configure(unsigned fac, unsigned nchans)
+  {
+    factor = fac;
+    if (nchans != nChans) {
+      std::vector<unsigned short> tmpMin(size_t(Capacity)*nchans), tmpMax(size_t(Capacity)*nchans);
+      std::vector<unsigned> tmpSum(size_t(Capacity)*nchans);
+      mins.swap(tmpMin), maxs.swap(tmpMax), sums.swap(tmpSum);
+      accMin.resize(nchans), accMax.resize(nchans), accSum.resize(nchans);
+      nChans = nchans;
+    }
+    first = head;
+    count = 0;
+  }
+  /// feed one raw scan, true if that completed a bucket
+  bool add(long long t, const unsigned short *samps, unsigned nsamps)
+  {
+    if (!count) accTs = t;
+    for (unsigned c = 0; c < nChans; ++c) {
+      const unsigned short v = c < nsamps ? samps[c] : 0;
+      if (!count || v < accMin[c]) accMin[c] = v;
+      if (!count || v > accMax[c]) accMax[c] = v;
+      accSum[c] = (count ? accSum[c] : 0) + v;
+    }
+    return ++count == factor && complete();
+  }
+  /// feed the newest bucket of the level below, true if that completed a bucket here
+  bool add(const DAQLevel & below)
+  {
+    const unsigned slot = (below.head - 1) % Capacity;
+    if (!count) accTs = below.ts[slot];
+    for (unsigned c = 0; c < nChans; ++c) {
+      const unsigned i = c*Capacity + slot;
+      if (!count || below.mins[i] < accMin[c]) accMin[c] = below.mins[i];
+      if (!count || below.maxs[i] > accMax[c]) accMax[c] = below.maxs[i];
+      accSum[c] = (count ? accSum[c] : 0) + below.sums[i];
+    }
+    return (count += below.factor) == factor && complete();
+  }
+  /// the oldest bucket still stored
+  unsigned long long oldest() const { return head - first > Capacity ? head - Capacity : first; }
+  /// the first stored bucket that starts at or after t nanoseconds, head if none
+  unsigned long long find(long long t) const
+  {
+    unsigned long long lo = oldest(), hi = head;
+    while (lo < hi) {
+      const unsigned long long mid = lo + (hi - lo)/2;
+      if (ts[mid % Capacity] < t) lo = mid + 1;
+      else hi = mid;
+    }
+    return lo;
+  }
+
+  unsigned factor, nChans;
+  unsigned long long head; ///< number of buckets completed so far
+  unsigned long long first; ///< the first bucket completed since the last configure()
+  unsigned count; ///< scans in the bucket being filled
+  long long accTs;
+  std::vector<unsigned short> accMin, accMax;
+  std::vector<unsigned> accSum;
+  std::vector<long long> ts; ///< the bucket's first scan's timestamp
+  std::vector<unsigned short> mins, maxs; ///< channel c's column starts at c*Capacity
+  std::vector<unsigned> sums; ///< channel c's column starts at c*Capacity
+
+private:
+  bool complete()
+  {
+    const unsigned slot = head % Capacity;
+    ts[slot] = accTs;
+    for (unsigned c = 0; c < nChans; ++c) {
+      mins[c*Capacity + slot] = accMin[c];
+      maxs[c*Capacity + slot] = accMax[c];
+      sums[c*Capacity + slot] = accSum[c];
+    }
+    ++head;
+    count = 0;
+    return true;
+  }
+};
+
+/* The DAQ scans read from fifo_daq, kept as the raw samples the board
+   gave us, in one preallocated column per channel plus a column of
+   timestamps.  So taking in a scan is a handful of stores and never
+   allocates; samples get scaled to volts only when a client reads them
+   (see scaleDAQSamples()).  Scans are numbered in the order they arrive,
+   scan n lives in slot n % Capacity.  It also keeps the decimated
+   versions of the scans, see DAQLevel.  Protected by FSMSpecific::daqLock. */
+struct DAQRing
+{
+  enum { Capacity = 128*2048 }; // store 128*2048 scans in memory from daq thread
+  enum { NumLevels = 2, LevelRatio = 10 }; // 10x and 100x
+
+  DAQRing() : nChans(0), head(0), first(0), tail(0), ts(Capacity) { configure(0); }
+
+  /// make room for nchans channels per scan, drops the scans stored so far
+  void configure(unsigned nchans)
+  {
+    if (nchans != nChans) {
+      std::vector<unsigned short> tmp(size_t(Capacity)*nchans);
+      samps.swap(tmp);
+      nChans = nchans;
+    }
+    first = tail = head;
+    for (unsigned l = 0, fac = LevelRatio; l < NumLevels; ++l, fac *= LevelRatio)
+      levels[l].configure(fac, nchans);
+  }
+  void push(const DAQScan *sc)
+  {
+    const unsigned slot = head % Capacity;
+    const unsigned n = MIN(unsigned(sc->nsamps), nChans);
+    ts[slot] = sc->ts_nanos;
+    for (unsigned c = 0; c < n; ++c) samps[c*Capacity + slot] = sc->samps[c];
+    for (unsigned c = n; c < nChans; ++c) samps[c*Capacity + slot] = 0;
+    ++head;
+    if (levels[0].add(sc->ts_nanos, sc->samps, n))
+      for (unsigned l = 1; l < NumLevels && levels[l].add(levels[l-1]); ++l) ;
+  }
+  /// the level that decimates by factor, 0 if there's none
+  const DAQLevel *level(unsigned factor) const
+  {
+    for (unsigned l = 0; l < NumLevels; ++l)
+      if (levels[l].factor == factor) return &levels[l];
+    return 0;
+  }
+  /** Copies up to maxScans scans from [cursor, head) to outTs and
+      outSamps and advances cursor past them.  outSamps gets one column of
+      samples per channel, each outTs.size() long.  Returns the number of
+      scans skipped because they were overwritten or dropped by configure(). */
+  unsigned long long read(unsigned long long & cursor, std::vector<long long> & outTs, std::vector<unsigned short> & outSamps,
+                          unsigned maxScans = Capacity) const
+  {
+    unsigned long long lost = 0;
+    const unsigned long long oldest = head - first > Capacity ? head - Capacity : first;
+    if (cursor < oldest) lost = oldest - cursor, cursor = oldest;
+    const unsigned n = MIN(head - cursor, (unsigned long long)maxScans), slot = cursor % Capacity;
+    const unsigned n1 = MIN(n, Capacity - slot); // the part before the wrap
+    outTs.resize(n);
+    outSamps.resize(size_t(n)*nChans);
+    if (n) {
+      memcpy(&outTs[0], &ts[slot], n1*sizeof(ts[0]));
+      if (n > n1) memcpy(&outTs[n1], &ts[0], (n-n1)*sizeof(ts[0]));
+      for (unsigned c = 0; c < nChans; ++c) {
+        memcpy(&outSamps[c*n], &samps[c*Capacity + slot], n1*sizeof(samps[0]));
+        if (n > n1) memcpy(&outSamps[c*n + n1], &samps[c*Capacity], (n-n1)*sizeof(samps[0]));
+      }
+    }
+    cursor += n;
+    return lost;
+  }
+
+  unsigned nChans;
+  unsigned long long head; ///< number of scans pushed so far, the next scan's number
+  unsigned long long first; ///< the first scan stored since the last configure()
+  unsigned long long tail; ///< the first scan GET DAQ SCANS hasn't returned yet
+  std::vector<long long> ts;
+  std::vector<unsigned short> samps; ///< channel c's column starts at c*Capacity
+  DAQLevel levels[NumLevels];
+};
+
+/* raw DAQ samples to volts -- a plain loop over contiguous arrays so the
+   compiler can vectorize it */
+static void scaleDAQSamples(const unsigned short * __restrict__ in, double * __restrict__ out, 
+                            unsigned n, double scale, double offset)
+{
+  for (unsigned i = 0; i < n; ++i) out[i] = in[i] * scale + offset;
+}
 
 struct Matrix;
+struct SparseMatrix;
 
 struct FSMSpecific
 {
   FSMSpecific() 
     : fifo_in(-1), fifo_out(-1), fifo_trans(-1), fifo_daq(-1), fifo_nrt_output(-1),
-    transBuf(2048), // store 2048 strate transitions in memory from transNotify thread
-      daqBuf(128*2048), // store 128000 scans in memory from daq thread
       transNotifyThread(0), daqReadThread(0),
       daqNumChans(0), daqMaxData(1), aoMaxData(1),
-      daqRangeMin(0.), daqRangeMax(5.)
+      daqRangeMin(0.), daqRangeMax(5.), daqRate(0.), daqRateScans(0),
+      rtRoundTrip(0), rtLockWait(0)
   {
     pthread_mutex_init(&msgFifoLock, 0);
-    pthread_mutex_init(&transNotifyLock, 0);
+    pthread_mutex_init(&uploadLock, 0);
     pthread_mutex_init(&daqLock, 0);
-    pthread_cond_init(&transNotifyCond, 0);
   }
   ~FSMSpecific() 
   {
-    pthread_cond_destroy(&transNotifyCond);
-    pthread_mutex_destroy(&transNotifyLock);
     pthread_mutex_destroy(&daqLock);
+    pthread_mutex_destroy(&uploadLock);
     pthread_mutex_destroy(&msgFifoLock);
   }
 
   Matrix getDAQScans(); /**< returns an MxN matrix, where each row is a scan 
                            ideal for sending to Matlab.. */
+  /** The decimated scans that start between t0 and t1 seconds: one row per
+      bucket of factor scans, with its start time then the minimum, maximum
+      and mean of every channel (all the minima first, then the maxima, then
+      the means).  False if there is no level for factor. */
+  bool getDAQDecimated(unsigned factor, double t0, double t1, Matrix & m);
 
 
   volatile int fifo_in, fifo_out, fifo_trans, fifo_daq, fifo_nrt_output;
-  pthread_mutex_t msgFifoLock, transNotifyLock, daqLock;
-  pthread_cond_t transNotifyCond;
-  CircBuf<StateTransition> transBuf;
-  CircBuf<DAQScanVec> daqBuf;
+  pthread_mutex_t msgFifoLock, daqLock;
+  pthread_mutex_t uploadLock; ///< one new FSM or patch at a time, so that the FSM never holds more than two pool slots
+  TransRing transRing;
+  DAQRing daqRing;
+  SessionRecorder recorder; ///< fed by the fifo threads, see START RECORDING
   pthread_t transNotifyThread, daqReadThread, nrtReadThread;
   unsigned daqNumChans, daqMaxData, aoMaxData;
   double daqRangeMin, daqRangeMax;
+  double daqRate; ///< scans/sec over the last second or so of ingest, protected by daqLock
+  unsigned long long daqRateScans; ///< scans since daqRateTimer was reset
+  Timer daqRateTimer;
+  LatencyHistogram *rtRoundTrip, *rtLockWait; ///< sendToRT() timings, created by attachShm()
 
   void *transNotifyThrFun();
   void *daqThrFun();
   void *nrtThrFun();
-  void doNRT_IP(const NRTOutput *, bool isUDP) const;
 };
 
 static void *transNotifyThrWrapper(void *);
 static void *daqThrWrapper(void *);
 static void *nrtThrWrapper(void *);
   
-static FSMSpecific fsms[NUM_STATE_MACHINES];
+static FSMSpecific *fsms = 0; // numStateMachines of them, created by attachShm()
 
 static std::vector<double> splitNumericString(const std::string & str,
                                               const std::string &delims = ",");
   
+static std::string metricsText();
+
 static std::ostream *logstream = 0; // in case we want to log stuff later..
 
-static std::ostream & log(int lock_unlock = -1)
+static pthread_key_t logLineKey;
+static void deleteLogLine(void *p) { delete static_cast<std::ostringstream *>(p); }
+static void makeLogLineKey() { pthread_key_create(&logLineKey, deleteLogLine); }
+
+/* log(1) starts a new line in a per-thread buffer, log() appends to it and
+   log(0) hands the line to AsyncLog at the given level.  No lock is taken and
+   nothing is written by the calling thread.  This is for the rare messages,
+   the per-command ones use AsyncLog::logf()/logs() which skip the formatting
+   too. */
+static std::ostream & log(int begin_end = -1, AsyncLog::Level lvl = AsyncLog::Info)
 {
-  static pthread_mutex_t mut = PTHREAD_MUTEX_INITIALIZER;
-  std::ostream *ret;
-  if (logstream)
-    ret = logstream;
-  else 
-    ret = &std::cerr;
-    
-  if (lock_unlock > -1) {
-    if (lock_unlock == 1) pthread_mutex_lock(&mut);
-    else pthread_mutex_unlock(&mut);
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, makeLogLineKey);
+  std::ostringstream *line = static_cast<std::ostringstream *>(pthread_getspecific(logLineKey));
+  if (!line) {
+    line = new std::ostringstream;
+    pthread_setspecific(logLineKey, line);
+  }
+  if (begin_end == 0) {
+    const std::string & str = line->str();
+    if (str.length()) AsyncLog::logs(lvl, "", str);
   }
-  return *ret;
+  if (begin_end > -1) line->str("");
+  return *line;
 }
 
-extern "C" { static void * threadfunc_wrapper(void *arg); }
+/* Sends the packets of the TCP/UDP NRT outputs.  The per-FSM nrtThrFun()
+ * threads just format each packet and post() it here, so they keep the
+ * small NRT output fifo drained no matter how slow the network is.
+ * Packets are queued per destination (host, port and protocol) and sent
+ * in order by a small pool of worker threads, at most one worker per
+ * destination at a time, so a slow or dead host only holds up its own
+ * packets.  A destination keeps its resolved address for NRT_DNS_CACHE_SECS
+ * and keeps its socket open between packets: UDP sockets stay connected,
+ * TCP connections are kept alive and only reopened when the peer closes
+ * them or a send fails. */
+class NRTDispatcher
+{
+public:
+  enum {
+    NumWorkers = 4,
+    MaxQueue = 256 ///< per destination, a host that can't keep up loses the oldest packets
+  };
+
+  NRTDispatcher();
+  void start(); ///< creates the worker threads
+  void post(const std::string & host, unsigned short port, bool udp, const std::string & packet);
+  std::string stats(); ///< one line per destination, for GET NRT STATS
+  void *workerThrFun();
+
+private:
+  struct Packet
+  {
+    Packet(const std::string & d) : data(d) {}
+    std::string data;
+    Timer queued;
+  };
+  struct Dest
+  {
+    Dest(const std::string & key, const std::string & h, unsigned short p, bool u);
+    std::string host;
+    unsigned short port;
+    bool udp;
+    std::deque<Packet> queue;
+    bool busy; ///< a worker is sending this destination's packets
+    bool ready; ///< in readyList
+    // the rest are only touched by the worker that has the destination busy
+    int sock;
+    struct sockaddr_in addr;
+    bool resolved, failed;
+    Timer resolvedAt, failedAt;
+    // statistics, protected by lock
+    unsigned long sent, dropped, errors;
+    double latencySum, latencyMax; ///< seconds from post() to send()
+    LatencyHistogram & latency; ///< the same, for GET STATS
+  };
+  typedef std::map<std::string, Dest *> DestMap;
+
+  bool sendPacket(Dest & d, const std::string & data);
+  bool connectDest(Dest & d);
+  void closeDest(Dest & d);
+
+  DestMap dests;
+  std::deque<Dest *> readyList; ///< destinations with queued packets and no worker
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+};
+
+static NRTDispatcher nrtDispatcher;
+
+/* The last few state machines uploaded (by anyone, to any FSM), as the
+ * FSMBlobs uploadMatrix() built, keyed by a hash of the blob.  SET STATE
+ * MATRIX HASH sends one of these to RT again without the client having to
+ * resend and the server having to reparse the matrix.  Least recently used
+ * entries are evicted once there are more than MaxEntries. */
+class FSMCache
+{
+public:
+  enum { MaxEntries = 16 };
+
+  FSMCache() : hits(0), misses(0) { pthread_mutex_init(&lock, 0); }
+  ~FSMCache() { pthread_mutex_destroy(&lock); }
+
+  /// FNV-1a over the used part of the blob, with the swap flag cleared
+  static uint64 hash(const FSMBlob & fsm);
+  /// blob is the used part of the FSMBlob RT just took for fsmId, h its hash(); it's swapped in, leaving blob empty
+  void insert(unsigned fsmId, uint64 h, std::vector<char> & blob);
+  /// copies the blob for h into fsm, false if it isn't cached (any more)
+  bool lookup(uint64 h, FSMBlob & fsm);
+  /// the hash of what was last uploaded to fsmId, 0 if unknown (or patched since)
+  uint64 current(unsigned fsmId);
+  void setCurrent(unsigned fsmId, uint64 h);
+  std::string stats(); ///< for metricsText()
+
+private:
+  typedef std::list<std::pair<uint64, std::vector<char> > > LRUList; ///< most recently used first
+  LRUList lru;
+  std::map<uint64, LRUList::iterator> index;
+  std::map<unsigned, uint64> currentHash;
+  unsigned long long hits, misses;
+  pthread_mutex_t lock;
+};
+
+static FSMCache fsmCache;
 
-class ConnectionThread
+/* What a NOTIFY EVENTS subscriber asked for, and the events waiting to go
+ * out to it.  Once the connection is Detached only the notify hub thread
+ * touches this. */
+struct NotifySubscription
+{
+  enum { DefaultQueue = 2048 };
+
+  NotifySubscription() 
+    : verbose(false), intervalMS(0), queueMax(DefaultQueue), reportDrops(false), dropped(0) {}
+
+  bool parse(const std::string & args); ///< the arguments of NOTIFY EVENTS, false on a syntax error
+  bool matches(const StateTransition & t) const
+  {
+    return (states.empty() || (t.state < states.size() && states[t.state]))
+      && (events.empty() || (t.event_id+1 >= 0 && unsigned(t.event_id+1) < events.size() && events[t.event_id+1]));
+  }
+  void enqueue(const StateTransition & t)
+  {
+    // bounded, a client that can't keep up loses the oldest events
+    if (queue.size() >= queueMax) queue.pop_front(), ++dropped;
+    queue.push_back(t);
+  }
+
+  bool verbose;
+  std::vector<bool> states; ///< indexed by state number, empty means all states
+  std::vector<bool> events; ///< indexed by event_id+1 (so timeouts, -1, are at 0), empty means all events
+  unsigned intervalMS; ///< send at most this often, 0 means as soon as they arrive
+  unsigned queueMax; ///< events held back before the oldest get dropped
+  bool reportDrops; ///< tell the client how many it lost, only if it asked for a QUEUE
+  std::deque<StateTransition> queue;
+  unsigned long dropped; ///< since the last time the queue was sent
+  Timer lastSent;
+};
+
+/* Client sockets are owned by the reactor in doServer(), which epoll's on all
+ * of them.  Once a complete command line is buffered, the Connection is handed
+ * to one of a fixed pool of worker threads which runs the command (and its RT
+ * round-trip), then gives it back to the reactor.  Sockets are registered
+ * EPOLLONESHOT, so at any moment a Connection belongs to exactly one of: the
+ * reactor, the work queue or a worker, or (for good, after NOTIFY EVENTS or
+ * STREAM DAQ) the notify hub. */
+class Connection
 {
 public:
-  ConnectionThread();
-  ~ConnectionThread();
-  bool isRunning() const {return thread_running;}
-  bool hasRun() const {return thread_ran;}
-  bool start(int socket_fd, const std::string & remoteHost = "unknown");
+  enum Status { 
+    Idle = 0,  ///< all buffered commands were run, wait for more input
+    Closed,    ///< peer hung up or asked to quit, connection should be reaped
+    Detached   ///< became a NOTIFY EVENTS or STREAM DAQ subscriber and left the worker pool
+  };
+
+  Connection(int socket_fd, const std::string & remoteHost = "unknown");
+  ~Connection();
+  int fd() const { return sock; }
+  bool readAvail(); ///< reactor: non-blocking read of pending socket data into inbuf, false on EOF/error
+  bool hasCommand() const; ///< true if a complete command line (or protocol 2 frame) is buffered
+  Status processCommands(ShmMsg & msgbuf); ///< worker: run all buffered commands, msgbuf is the worker's scratch ShmMsg
+  // for Detached connections, only called from the notify hub thread
+  bool notifyPump(); ///< send out any new state transitions (or DAQ scans), false on error
+  bool notifyInput(); ///< the socket became readable, false if the subscriber should be reaped
+  bool notifyPending() const { return !outbuf.empty(); } ///< true if output is waiting for the socket to become writable
+  int notifyTimeout() const; ///< ms until queued events are due to be sent, -1 if nothing is waiting on the clock
+
 private:
   static int id;
 
-  // FSM/Globals mutex lock around global data so threads don't stomp on each other
-  pthread_t handle;
   int sock, myid, fsm_id;
+  unsigned protocol; ///< 1 for the text protocol, FSM_PROTO_VERSION once the client sent "PROTOCOL 2"
   std::string remoteHost;
-  volatile bool thread_running, thread_ran;
+  std::string inbuf; ///< bytes read from sock but not yet consumed by a command
+  std::string outbuf; ///< replies held back while corked, see flushOutput()
+  bool eof;
+  NotifySubscription notify;
+  unsigned long notifyCursor; ///< our read position in fsms[fsm_id].transRing
+  bool daqStream; ///< a STREAM DAQ subscriber rather than a NOTIFY EVENTS one
+  unsigned long long daqCursor; ///< the next scan in fsms[fsm_id].daqRing to send
+  bool corked; ///< if true sockSend() appends to outbuf rather than sending
+  bool batching; ///< between BEGIN BATCH and END BATCH
+  unsigned batchErrors; ///< number of commands that failed in the current batch
+  Timer connectionTimer;
 
-  std::ostream &log(int i = -1) 
+  std::ostream &log(int i = -1, AsyncLog::Level lvl = AsyncLog::Info) 
   { 
-    if (i == 0) return ::log(i); // unlock, so don't output anything extra...
-    return ::log(i) << "[Thread " << myid << " (" << remoteHost << ")] "; 
+    if (i == 0) return ::log(i, lvl); // submit, so don't output anything extra...
+    return ::log(i) << "[Connection " << myid << " (" << remoteHost << ")] "; 
   }
 
-
-  ShmMsg msg; //< needed to put this in class data because it broke the stack it's so freakin' big now
+  ShmMsg *msg; //< the worker's scratch buffer, only valid inside processCommands() -- it's too freakin' big to have one per connection
+
+  Status doCommand(std::string & line);
+  Status doFrame(const FSMProtoHdr & req, const std::string & payload);
+
+  // The commands themselves, shared by the text and binary protocols
+  void doHalt();
+  void doRun();
+  void doTrigSound(int trigmask);
+  void doBypassDout(int bypassmask);
+  bool doForceState(unsigned state);
+  bool getStateMatrix(Matrix & m);
+  bool getEvents(int first, int last, Matrix & m);
+  static void transitionToRow(const StateTransition & t, unsigned num_input_events, Matrix & m, int row);
+  bool startDAQ(unsigned chanMask, int rangeMin, int rangeMax);
+  void stopDAQ();
+  void setAOWave(unsigned id, unsigned aoline, unsigned loop, const Matrix *m); ///< m == 0 clears the wave
+  bool sendMatrixText(const Matrix & m); ///< text protocol "MATRIX rows cols"/READY handshake, then the data
+  bool formatDAQBlock(); ///< STREAM DAQ: put the next block of scans in outbuf, false if there were none
 
   // Functions to send commands to the realtime process via the rt-fifos
   void sendToRT(ShmMsgID cmd); // send a simple command, one of RESET, PAUSEUNPAUSE, INVALIDATE. Upon return we know the command completed.
@@ -201,57 +676,304 @@ private:
   unsigned getNumInputEventsFromRT(void);
   int sockSend(const std::string & str) ;
   int sockSend(const void *buf, size_t len, bool is_binary = false, int flags = 0);
+  bool flushOutput(); ///< send everything in outbuf with a single ::send()
+  bool flushNotify(); ///< notify hub: send as much of outbuf as the socket takes without blocking, false on error
   int sockReceiveData(void *buf, int size, bool is_binary = true);
   std::string sockReceiveLine();
-  bool uploadMatrix(const Matrix & m, unsigned numEvents, unsigned numSchedWaves, const std::string & inChanType, unsigned readyForTrialState,  const std::string & outputSpecStr, unsigned wait_for_state0_crossing_to_do_fsm_swap_flg);
-
+  /// M is a Matrix, sent to RT as a dense FSM, or a SparseMatrix, sent as a sparse one
+  template <class M> bool uploadMatrix(const M & m, unsigned numEvents, unsigned numSchedWaves, const std::string & inChanType, unsigned readyForTrialState,  const std::string & outputSpecStr, unsigned wait_for_state0_crossing_to_do_fsm_swap_flg);
+
+  /// sends RT the blob fsmCache has for hash, false if it has none or RT refused it
+  bool uploadCachedMatrix(uint64 hash, unsigned wait_for_state0_crossing_to_do_fsm_swap_flg);
+  /// hands RT the new FSM in slot (or in msg if slot has none), false if RT refused it
+  bool sendMatrix(PoolSlot & slot);
+  bool patchMatrix(const Matrix & cells); ///< cells is n x 3: row, col, value
   bool downloadMatrix(Matrix & m);
-  void doNotifyEvents(bool full = false); ///< if in full mode, actually write out the text of the event, one per line, otherwise write only the character 'e' with no newline
   std::vector<OutputSpec> parseOutputSpecStr(const std::string & str);
-
-  
-  // the extern "C" wrapper func passed to pthread_create
-  friend void *threadfunc_wrapper(void *);
-  void *threadFunc();
 };
 
-int ConnectionThread::id = 0;
+int Connection::id = 0;
+
+Connection::Connection(int sock_fd, const std::string & rhost) 
+  : sock(sock_fd), protocol(1), remoteHost(rhost), eof(false), notifyCursor(0), daqStream(false), daqCursor(0), corked(false), batching(false), batchErrors(0), msg(0)
+{ 
+  myid = id++; 
+  fsm_id = 0; 
+}
 
-ConnectionThread::ConnectionThread() : sock(-1), thread_running(false), thread_ran(false) { myid = id++; fsm_id = 0; }
-ConnectionThread::~ConnectionThread()
+Connection::~Connection()
 { 
   if (sock > -1)  ::shutdown(sock, SHUT_RDWR), ::close(sock), sock = -1;
-  if (isRunning())  pthread_join(handle, NULL), thread_running = false;
-  log(1) <<  "deleted." << std::endl;
-  log(0);
+  log(1) << "Connection to host " << remoteHost << " ended after " << connectionTimer.elapsed() << " seconds." << std::endl; log(0);
 }
-extern "C" 
+
+bool Connection::hasCommand() const
 {
-  static void * threadfunc_wrapper(void *arg)   
-  { 
-    pthread_detach(pthread_self());
-    ConnectionThread *me = static_cast<ConnectionThread *>(arg);
-    void * ret = me->threadFunc();  
-    // now, try and reap myself..
-    if (0 == pthread_mutex_lock(&connectedThreadsLock)) {
-      ConnectedThreadsList::iterator it;
-      if ( (it = connectedThreads.find(me)) != connectedThreads.end() ) {
-        delete me;
-        connectedThreads.erase(it);
-        n_threads--;
-        log(1) << "Auto-reaped dead thread, have " << n_threads << " still running." << std::endl; log(0);
+  if (protocol == FSM_PROTO_VERSION) {
+    if (inbuf.length() < sizeof(FSMProtoHdr)) return false;
+    FSMProtoHdr hdr;
+    std::memcpy(&hdr, inbuf.data(), sizeof(hdr));
+    // a garbage header counts as complete so that processCommands() gets to reject it
+    if (hdr.magic != FSM_PROTO_MAGIC || hdr.payload_len > FSM_PROTO_MAX_PAYLOAD) return true;
+    return inbuf.length() - sizeof(hdr) >= hdr.payload_len;
+  }
+  return inbuf.find('\n') != std::string::npos || inbuf.length() >= MAX_LINE;
+}
+
+bool Connection::readAvail()
+{
+  char buf[4096];
+  // stop once a whole command is buffered -- any payload that follows it 
+  // (matrix data, etc) is read by the worker that runs the command
+  while (!hasCommand()) {
+    int ret = ::recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+    if (ret > 0) inbuf.append(buf, ret);
+    else if (ret < 0 && errno == EINTR) continue;
+    else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    else { eof = true; break; } // orderly shutdown or socket error
+  }
+  return !eof;
+}
+
+// the command's words (the leading all-caps ones) without its arguments, for GET STATS
+static std::string commandName(const std::string & line)
+{
+  std::istringstream s(line);
+  std::string tok, name;
+  for (unsigned n = 0; n < 4 && s >> tok; ++n) {
+    bool word = true;
+    for (unsigned i = 0; i < tok.length() && word; ++i) word = isupper(tok[i]) || tok[i] == '_';
+    if (!word) break;
+    name += (name.length() ? " " : "") + tok;
+  }
+  return name.length() ? name : "UNKNOWN";
+}
+
+// the text command each binary opcode corresponds to
+static const char *protoOpName(unsigned op)
+{
+  static const char * const names[] = {
+    "UNKNOWN", "NOOP", "SET STATE MATRIX", "GET STATE MATRIX", "INITIALIZE", "HALT", "RUN",
+    "FORCE TIME UP", "READY TO START TRIAL", "TRIGSOUND", "BYPASS DOUT", "FORCE STATE",
+    "GET EVENT COUNTER", "IS RUNNING", "GET TIME", "GET CURRENT STATE", "GET EVENTS",
+    "START DAQ", "STOP DAQ", "GET DAQ SCANS", "SET AO WAVE", "GET NUM STATE MACHINES",
+    "BATCH", "GET DAQ DECIMATED", "PATCH STATE MATRIX", "SET STATE MATRIX HASH",
+    "GET STATE MATRIX HASH", "SET STATE MATRIX SPARSE"
+  };
+  return op < sizeof(names)/sizeof(*names) ? names[op] : names[0];
+}
+
+static LatencyHistogram & commandLatency(const std::string & name)
+{
+  return Metrics::histogram("fsm_command_latency_us", "cmd=\"" + name + "\"");
+}
+
+Connection::Status Connection::processCommands(ShmMsg & msgbuf)
+{
+  Status status = Idle;
+  msg = &msgbuf;
+  while (status == Idle && hasCommand()) {
+    if (protocol == FSM_PROTO_VERSION) {
+      FSMProtoHdr hdr;
+      std::memcpy(&hdr, inbuf.data(), sizeof(hdr));
+      if (hdr.magic != FSM_PROTO_MAGIC || hdr.payload_len > FSM_PROTO_MAX_PAYLOAD) {
+        log(1) << "Bad frame header (magic " << std::hex << hdr.magic << std::dec << ", " << hdr.payload_len << " bytes payload), dropping connection" << std::endl; log(0, AsyncLog::Error);
+        status = Closed;
+        break;
       }
-      pthread_mutex_unlock(&connectedThreadsLock);
+      std::string payload = inbuf.substr(sizeof(hdr), hdr.payload_len);
+      inbuf.erase(0, sizeof(hdr) + hdr.payload_len);
+      // replies to pipelined frames go out together once all buffered frames ran
+      corked = true;
+      Timer cmdTimer;
+      status = doFrame(hdr, payload);
+      if (status != Detached) commandLatency(protoOpName(hdr.opcode)).recordSecs(cmdTimer.elapsed());
+      continue;
+    }
+    std::string line = sockReceiveLine();
+    // empty line means connection error, same as it always did
+    Timer cmdTimer;
+    status = line.length() ? doCommand(line) : Closed;
+    if (line.length() && status != Detached) commandLatency(commandName(line)).recordSecs(cmdTimer.elapsed());
+    if (batching && outbuf.length() > MAX_BATCH_OUTPUT) {
+      // a long batch doesn't get to buffer without limit, send what it has so far
+      corked = false;
+      if (!flushOutput()) status = Closed;
+      corked = true;
     }
-    return ret;
   }
+  if (corked && !batching) {
+    corked = false;
+    if (status != Closed && !flushOutput()) status = Closed;
+  }
+  msg = 0;
+  if (status == Idle && eof) status = Closed;
+  return status;
+}
+
+namespace 
+{
+  struct WorkQueue
+  {
+    WorkQueue() { pthread_mutex_init(&lock, 0); pthread_cond_init(&cond, 0); }
+    ~WorkQueue() { pthread_cond_destroy(&cond); pthread_mutex_destroy(&lock); }
+    void push(Connection *c) 
+    { 
+      MutexLocker ml(lock); 
+      q.push_back(c); 
+      pthread_cond_signal(&cond); 
+    }
+    Connection *pop()
+    {
+      MutexLocker ml(lock);
+      while (q.empty()) pthread_cond_wait(&cond, &lock);
+      Connection *c = q.front();
+      q.pop_front();
+      return c;
+    }
+    std::list<Connection *> q;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+  };
+
+  WorkQueue workQueue;
+};
+
+static void reapConnection(Connection *c)
+{
+  MutexLocker ml(connectionsLock);
+  connections.erase(c);
+  delete c; // closing the socket also removes it from the epoll set
+  log(1) << "Reaped connection, have " << connections.size() << " still open." << std::endl; log(0);
+}
+
+// hand an Idle connection back to the reactor, or straight back to the 
+// work queue if it already has more commands buffered
+static void rearmConnection(Connection *c)
+{
+  if (c->hasCommand()) {
+    workQueue.push(c);
+    return;
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.ptr = c;
+  if (::epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd(), &ev)) {
+    log(1) << "Error: epoll_ctl returned " << ::strerror(errno) << std::endl; log(0, AsyncLog::Error);
+    reapConnection(c);
+  }
+}
+
+/* NOTIFY EVENTS and STREAM DAQ subscribers are all served by one thread, the
+ * notify hub.  It epoll's on their sockets (to notice them hanging up, or
+ * becoming writable again after a short write) and on a pipe that the
+ * transNotify and daq threads poke when new transitions or scans arrive, and
+ * the workers poke when they hand over a new subscriber. */
+namespace
+{
+  int notifyEpollFd = -1, notifyPipe[2] = { -1, -1 };
+  volatile int notifyWakePending = 0;
+  Timer notifyWakeTimer; // when the pending wake up was asked for, only set by whoever sets notifyWakePending
+  volatile int notifySubscriberCount = 0;
+  std::list<Connection *> notifyAdds; // new subscribers, protected by notifyAddLock
+  pthread_mutex_t notifyAddLock = PTHREAD_MUTEX_INITIALIZER;
 }
-bool ConnectionThread::start(int sock_fd, const std::string & rhost)
+
+static void wakeNotifyHub()
 {
-  if (isRunning()) return false;
-  sock = sock_fd;  
-  remoteHost = rhost;
-  return 0 == pthread_create(&handle, NULL, threadfunc_wrapper, static_cast<void *>(this));
+  // the fifo threads start before the hub exists, and nobody is subscribed yet
+  if (notifyPipe[1] < 0) return;
+  // one byte in the pipe is enough to wake the hub up, don't pile up more
+  if (__sync_lock_test_and_set(&notifyWakePending, 1)) return;
+  notifyWakeTimer.reset();
+  char c = 0;
+  while (::write(notifyPipe[1], &c, 1) < 0 && errno == EINTR) ;
+}
+
+static void notifyHubAdd(Connection *c)
+{
+  struct epoll_event ev; // non-NULL for pre 2.6.9 kernels
+  ::epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd(), &ev); // the reactor is done with it
+  {
+    MutexLocker ml(notifyAddLock);
+    notifyAdds.push_back(c);
+  }
+  wakeNotifyHub();
+}
+
+extern "C" 
+{
+  static void * notifyHubThrWrapper(void *)
+  {
+    pthread_detach(pthread_self());
+    // subscriber -> whether we are currently polling it for EPOLLOUT
+    typedef std::map<Connection *, bool> Subscribers;
+    Subscribers subs;
+    struct epoll_event evs[64];
+    int timeout = -1; // until the next subscriber with an INTERVAL is due
+    LatencyHistogram & fanout = Metrics::histogram("fsm_notify_fanout_us");
+    while (1) {
+      bool woken = false;
+      Timer wokeAt;
+      int n = ::epoll_wait(notifyEpollFd, evs, sizeof(evs)/sizeof(*evs), timeout);
+      if (n < 0 && errno != EINTR) {
+        log(1) << "Error: notify hub epoll_wait returned " << ::strerror(errno) << std::endl; log(0, AsyncLog::Error);
+        continue;
+      }
+      std::set<Connection *> dead;
+      for (int i = 0; i < n; ++i) {
+        Connection *c = static_cast<Connection *>(evs[i].data.ptr);
+        if (!c) {
+          char buf[64];
+          while (::read(notifyPipe[0], buf, sizeof(buf)) > 0) ;
+          woken = true;
+          wokeAt = notifyWakeTimer;
+          __sync_lock_release(&notifyWakePending);
+          __sync_synchronize(); // so that we see everything pushed before the next wake up was skipped
+        } else if ((evs[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP)) && !c->notifyInput())
+          dead.insert(c);
+      }
+      std::list<Connection *> adds;
+      {
+        MutexLocker ml(notifyAddLock);
+        adds.swap(notifyAdds);
+      }
+      for (std::list<Connection *>::iterator it = adds.begin(); it != adds.end(); ++it) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = *it;
+        if (::epoll_ctl(notifyEpollFd, EPOLL_CTL_ADD, (*it)->fd(), &ev)) {
+          log(1) << "Error: epoll_ctl returned " << ::strerror(errno) << std::endl; log(0, AsyncLog::Error);
+          reapConnection(*it);
+        } else
+          subs[*it] = false;
+      }
+      // pump everyone, it's cheap if there's nothing new for them
+      timeout = -1;
+      for (Subscribers::iterator it = subs.begin(); it != subs.end(); ) {
+        Connection *c = it->first;
+        if (dead.count(c) || !c->notifyPump()) {
+          subs.erase(it++);
+          reapConnection(c);
+          continue;
+        }
+        if (c->notifyPending() != it->second) {
+          struct epoll_event ev;
+          it->second = c->notifyPending();
+          ev.events = it->second ? EPOLLIN|EPOLLOUT : EPOLLIN;
+          ev.data.ptr = c;
+          ::epoll_ctl(notifyEpollFd, EPOLL_CTL_MOD, c->fd(), &ev);
+        }
+        const int due = c->notifyPending() ? -1 : c->notifyTimeout();
+        if (due > -1 && (timeout < 0 || due < timeout)) timeout = due;
+        ++it;
+      }
+      notifySubscriberCount = subs.size();
+      // how long from new transitions (or scans) arriving to everyone having been handed them
+      if (woken && !subs.empty()) fanout.recordSecs(wokeAt.elapsed());
+    }
+    return 0;
+  }
 }
 
 /* NOTE that all functions in this program have the potential to throw
@@ -268,11 +990,54 @@ private:
   std::string reason;
 };
 
+// copy only the used part of a ShmMsg, see ShmMsgSize() in RatExpFSM.h
+static void shmMsgCopy(volatile ShmMsg *dst, const volatile ShmMsg *src, int is_reply)
+{
+  std::memcpy(const_cast<ShmMsg *>(dst), const_cast<const ShmMsg *>(src), ShmMsgSize(src, is_reply));
+  if (src->id == AOWAVE && !is_reply) {
+    unsigned n = MIN(src->u.aowave.nsamples, AOWAVE_MAX_SAMPLES);
+    std::memcpy(reinterpret_cast<char *>(const_cast<ShmMsg *>(dst)) + SHM_MSG_AOWAVE_EVT_COLS_OFFSET,
+                reinterpret_cast<const char *>(const_cast<const ShmMsg *>(src)) + SHM_MSG_AOWAVE_EVT_COLS_OFFSET,
+                n * sizeof(src->u.aowave.evt_cols[0]));
+  }
+}
+
+// read the status block the RT task publishes every tick for FSM f, see 
+// struct FSMStatus in RatExpFSM.h.  Never blocks on RT.
+static FSMStatus readStatus(unsigned f)
+{
+  volatile FSMStatus & st = *SHM_STATUS(shm, f);
+  FSMStatus ret;
+  unsigned seq;
+  do {
+    while ( (seq = st.seq) & 0x1 ) ; // RT is mid-update, it won't take long
+    __sync_synchronize();
+    std::memcpy(&ret, const_cast<FSMStatus *>(&st), sizeof(ret));
+    __sync_synchronize();
+  } while (seq != st.seq);
+  return ret;
+}
+
+/* Gives back the pool slots that a server which died left claimed: nobody
+   else would ever free them, see struct FSMBlobPool. */
+static void reclaimPoolSlots()
+{
+  for (unsigned i = 1; i < fsmPool->num_slots; ++i) {
+    const int pid = fsmPool->claimer[i];
+    if (!pid || pid == ::getpid() || ::kill(pid, 0) == 0 || errno != ESRCH) continue;
+    if (__sync_bool_compare_and_swap(&fsmPool->claimer[i], pid, 0)) {
+      __sync_fetch_and_sub(&fsmPool->refs[i], 1);
+      log(1) << "Gave back slot " << i << " of " << FSM_POOL_SHM_NAME << ", which process " << pid << " claimed but never handed to RT." << std::endl; log(0, AsyncLog::Warning);
+    }
+  }
+}
+
 static void attachShm()
 {
   // first, connect to the shm buffer..
   RTOS::ShmStatus shmStatus;
-  void *shm_notype = RTOS::shmAttach(SHM_NAME, SHM_SIZE, &shmStatus);
+  // just the header at first, it says how big the rest is
+  void *shm_notype = RTOS::shmAttach(SHM_NAME, sizeof(struct Shm), &shmStatus);
     
   if (!shm_notype)
     throw Exception(std::string("Cannot connect to ") + SHM_NAME
@@ -281,6 +1046,83 @@ static void attachShm()
     
   if (shm->magic != SHM_MAGIC)
     throw Exception("Attached to shared memory buffer, but the magic number is invalid!\n");
+
+  const unsigned n = shm->num_fsms;
+  RTOS::shmDetach((void *)shm);
+  shm = 0;
+  if (n < 1 || n > FSM_MAX_STATE_MACHINES)
+    throw Exception("Attached to shared memory buffer, but the number of state machines in it is invalid!\n");
+  shm_notype = RTOS::shmAttach(SHM_NAME, SHM_SIZE(n), &shmStatus);
+  if (!shm_notype)
+    throw Exception(std::string("Cannot connect to all of ") + SHM_NAME
+                    + ", error was: " + RTOS::statusString(shmStatus));
+  shm = const_cast<volatile Shm *>(static_cast<Shm *>(shm_notype));
+  numStateMachines = n;
+  fsms = new FSMSpecific[n];
+  for (unsigned f = 0; f < n; ++f) {
+    std::ostringstream label;
+    label << "fsm=\"" << f << "\"";
+    fsms[f].rtLockWait = &Metrics::histogram("fsm_rt_lock_wait_us", label.str());
+    fsms[f].rtRoundTrip = &Metrics::histogram("fsm_rt_roundtrip_us", label.str());
+  }
+  log(1) << "The RT module is running " << n << " state machines." << std::endl; log(0);
+
+  // the state history is optional, without it GET EVENTS falls back to TRANSITIONS requests
+  shm_notype = RTOS::shmAttach(FSM_HIST_SHM_NAME, FSM_HIST_SHM_SIZE(n), &shmStatus);
+  if (!shm_notype) {
+    log(1) << "Cannot connect to " << FSM_HIST_SHM_NAME << ", error was: " << RTOS::statusString(shmStatus) << ", will read events from the RT fifos instead." << std::endl; log(0, AsyncLog::Warning);
+  } else if (static_cast<FSMHistShm *>(shm_notype)->magic != FSM_HIST_SHM_MAGIC
+             || static_cast<FSMHistShm *>(shm_notype)->num_fsms != n) {
+    log(1) << "Attached to " << FSM_HIST_SHM_NAME << ", but the magic number is invalid, will read events from the RT fifos instead." << std::endl; log(0, AsyncLog::Warning);
+    RTOS::shmDetach(shm_notype);
+  } else
+    histShm = static_cast<FSMHistShm *>(shm_notype);
+
+  // so is the FSM pool, without it new FSMs are copied through the ShmMsg
+  shm_notype = RTOS::shmAttach(FSM_POOL_SHM_NAME, sizeof(struct FSMBlobPool), &shmStatus);
+  if (!shm_notype) {
+    log(1) << "Cannot connect to " << FSM_POOL_SHM_NAME << ", error was: " << RTOS::statusString(shmStatus) << ", will send state matrices through " << SHM_NAME << " instead." << std::endl; log(0, AsyncLog::Warning);
+    return;
+  }
+  const unsigned nslots = static_cast<FSMBlobPool *>(shm_notype)->num_slots;
+  const bool poolOk = static_cast<FSMBlobPool *>(shm_notype)->magic == FSM_POOL_SHM_MAGIC
+                      && nslots > 1 && nslots <= FSM_POOL_MAX_SLOTS;
+  RTOS::shmDetach(shm_notype);
+  if (!poolOk) {
+    log(1) << "Attached to " << FSM_POOL_SHM_NAME << ", but the magic number is invalid, will send state matrices through " << SHM_NAME << " instead." << std::endl; log(0, AsyncLog::Warning);
+    return;
+  }
+  shm_notype = RTOS::shmAttach(FSM_POOL_SHM_NAME, FSM_POOL_SHM_SIZE(nslots), &shmStatus);
+  if (!shm_notype) {
+    log(1) << "Cannot connect to all of " << FSM_POOL_SHM_NAME << ", error was: " << RTOS::statusString(shmStatus) << ", will send state matrices through " << SHM_NAME << " instead." << std::endl; log(0, AsyncLog::Warning);
+    return;
+  }
+  fsmPool = static_cast<FSMBlobPool *>(shm_notype);
+  reclaimPoolSlots();
+}
+
+
+/* Copy transitions [first, first+num) of FSM f straight out of the exported
+   history, see struct StateHistory in RatExpFSM.h.  Returns false if they
+   are no longer (or not yet) all there. */
+static bool readHistory(unsigned f, unsigned first, unsigned num, StateTransition *out)
+{
+  const volatile StateHistory & h = histShm->history[f];
+  const unsigned resets = h.reset_count;
+  __sync_synchronize(); // read the reset count before the count it guards
+  if (first + num > h.num_transitions) return false;
+  __sync_synchronize(); // don't read the entries before the count
+  for (unsigned done = 0; done < num; ) {
+    const unsigned slot = (first + done) % MAX_HISTORY;
+    const unsigned n = MIN(num - done, MAX_HISTORY - slot);
+    std::memcpy(out + done, const_cast<const StateTransition *>(&h.transitions[slot]), n * sizeof(*out));
+    done += n;
+  }
+  __sync_synchronize(); // finish reading the entries before checking the count again
+  const unsigned now = h.num_transitions;
+  __sync_synchronize();
+  // RT wrote over the oldest ones meanwhile, or the FSM was reset
+  return first + MAX_HISTORY > now && first + num <= now && h.reset_count == resets;
 }
   
 static void fifoReadAllAvail(int f)
@@ -299,14 +1141,15 @@ static void fifoReadAllAvail(int f)
     numLeft -= nread;
   }
     
-  if (numStale) 
-    log() << "Cleared " << numStale << " old bytes from input fifo " 
-           << f << "." << std::endl; 
+  if (numStale) {
+    log(1) << "Cleared " << numStale << " old bytes from input fifo " 
+           << f << "." << std::endl; log(0);
+  }
 }
 
 static void openFifos()
 {
-  for (int f = 0; f < NUM_STATE_MACHINES; ++f) {
+  for (int f = 0; f < numStateMachines; ++f) {
     FSMSpecific & fsm = fsms[f];
     fsm.fifo_in = RTOS::openFifo(shm->fifo_out[f]);
     if (fsm.fifo_in < 0) throw Exception ("Could not open RTF fifo_in for reading");
@@ -326,7 +1169,7 @@ static void openFifos()
 
 static void closeFifos()
 {
-  for (int f = 0; f < NUM_STATE_MACHINES; ++f) {
+  for (int f = 0; f < numStateMachines; ++f) {
     FSMSpecific & fsm = fsms[f];
     if (fsm.fifo_in >= 0) ::close(fsm.fifo_in);
     if (fsm.fifo_out >= 0) ::close(fsm.fifo_out);
@@ -339,7 +1182,7 @@ static void closeFifos()
 
 static void createTransNotifyThreads()
 {
-  for (int f = 0; f < NUM_STATE_MACHINES; ++f) {
+  for (int f = 0; f < numStateMachines; ++f) {
     int ret = pthread_create(&fsms[f].transNotifyThread, NULL, transNotifyThrWrapper, reinterpret_cast<void *>(f));
     if (ret) 
       throw Exception("Could not create a required thread, 'state transition notify thread'!");
@@ -348,7 +1191,7 @@ static void createTransNotifyThreads()
   
 static void createDAQReadThreads()
 {
-  for (int f = 0; f < NUM_STATE_MACHINES; ++f) {
+  for (int f = 0; f < numStateMachines; ++f) {
     int ret = pthread_create(&fsms[f].daqReadThread, NULL, daqThrWrapper, reinterpret_cast<void *>(f));
     if (ret) 
       throw Exception("Could not create a required thread, 'daq fifo read thread'!");
@@ -357,7 +1200,7 @@ static void createDAQReadThreads()
 
 static void createNRTReadThreads()
 {
-  for (int f = 0; f < NUM_STATE_MACHINES; ++f) {
+  for (int f = 0; f < numStateMachines; ++f) {
     int ret = pthread_create(&fsms[f].nrtReadThread, NULL, nrtThrWrapper, reinterpret_cast<void *>(f));
     if (ret) 
       throw Exception("Could not create a required thread, 'nrt output fifo read thread'!");
@@ -370,6 +1213,7 @@ static void init()
   openFifos();
   createTransNotifyThreads();
   createDAQReadThreads();
+  nrtDispatcher.start();
   createNRTReadThreads();
 }
   
@@ -377,19 +1221,34 @@ static void cleanup(void)
 {
   if (listen_fd >= 0) { ::close(listen_fd);  listen_fd = -1; }
   closeFifos();
+  for (int f = 0; f < numStateMachines; ++f) fsms[f].recorder.stop();
   if (shm) { RTOS::shmDetach((void *)shm); shm = 0; }
+  if (histShm) { RTOS::shmDetach((const void *)histShm); histShm = 0; }
+  if (fsmPool) { RTOS::shmDetach((void *)fsmPool); fsmPool = 0; }
+  AsyncLog::stop();
 }
 
 
 static void handleArgs(int argc, const char *argv[])
 {
-  if (argc == 2) {
+  if (argc >= 2 && argc <= 4) {
     // listenport override
     listenPort = atoi(argv[1]);
     if (! listenPort) throw Exception ("Could not parse listen port.");
+    if (argc == 3) {
+      // log level override, same as the SET LOG LEVEL command
+      int lvl = atoi(argv[2]);
+      if (lvl < AsyncLog::Error || lvl > AsyncLog::Trace) throw Exception ("Log level must be 0-4.");
+      AsyncLog::level = lvl;
+    }
+    if (argc == 4) {
+      // the metrics port, off unless given
+      metricsPort = atoi(argv[3]);
+      if (metricsPort < 0 || metricsPort > USHRT_MAX) throw Exception ("Could not parse metrics port.");
+    }
   } else if (argc != 1) {
     throw Exception(std::string("Unknown command line parameters.  Usage: ")
-                    + argv[0] + " [listenPort]"); 
+                    + argv[0] + " [listenPort [logLevel [metricsPort]]]"); 
       
   }
 }
@@ -403,7 +1262,7 @@ static void sighandler(int sig)
     sendToRT(PAUSEUNPAUSE);
     } catch (...) {}*/
     
-  log() << "Caught signal " << sig << " cleaning up..." << std::endl; 
+  log(1) << "Caught signal " << sig << " cleaning up..." << std::endl; log(0);
     
   cleanup();
     
@@ -456,27 +1315,256 @@ Matrix & Matrix::vertCat(const Matrix &rhs)
   return *this = mat;  
 }
 
-class Timer
+// A state matrix given as just the cells that differ from the default,
+// which is 0, except in the input event and timeout state columns of the
+// states (the first loopRows rows and loopCols columns), where it is the
+// row's own state.  That's most of the cells of a big state matrix.
+struct SparseMatrix
 {
 public:
-  Timer() { reset(); }
-  void reset();
-  double elapsed() const; // returns number of seconds since ctor or reset() was called 
+  /// triplets is nnz x 3: row, col, value. ok() is false if any are out of range
+  SparseMatrix(int m, int n, int loopRows, int loopCols, const Matrix & triplets);
+  double at(int r, int c) const;
+  int rows() const { return m; }
+  int cols() const { return n; }
+  bool ok() const { return valid; }
 private:
-  struct timeval ts;
+  typedef std::pair<unsigned long, double> Cell; // r*n+c, value
+  static bool cellLess(const Cell & a, const Cell & b) { return a.first < b.first; }
+  std::vector<Cell> cells; // sorted by r*n+c
+  int m, n, loopRows, loopCols;
+  bool valid;
 };
 
-void Timer::reset()
+SparseMatrix::SparseMatrix(int m, int n, int loopRows, int loopCols, const Matrix & triplets)
+  : m(m), n(n), loopRows(loopRows), loopCols(loopCols), valid(true)
 {
-  ::gettimeofday(&ts, NULL);
+  cells.reserve(triplets.rows());
+  for (int i = 0; i < triplets.rows(); ++i) {
+    const double r = triplets.at(i, 0), c = triplets.at(i, 1);
+    if (r < 0 || r >= m || c < 0 || c >= n) { valid = false; return; }
+    cells.push_back(Cell(static_cast<unsigned long>(r)*n + static_cast<unsigned long>(c), triplets.at(i, 2)));
+  }
+  // if a cell is given more than once, the last one counts
+  std::stable_sort(cells.begin(), cells.end(), cellLess);
+  std::vector<Cell>::iterator out = cells.begin();
+  for (std::vector<Cell>::iterator it = cells.begin(); it != cells.end(); ++it) {
+    if (out != cells.begin() && (out-1)->first == it->first) *(out-1) = *it;
+    else *out++ = *it;
+  }
+  cells.erase(out, cells.end());
 }
 
-double Timer::elapsed() const
+double SparseMatrix::at(int r, int c) const
 {
-  if (ts.tv_sec == 0) return 0.0;
-  struct timeval tv;
-  ::gettimeofday(&tv, NULL);
-  return tv.tv_sec - ts.tv_sec + (tv.tv_usec - ts.tv_usec)/1000000.0;
+  const Cell key(static_cast<unsigned long>(r)*n + c, 0.);
+  std::vector<Cell>::const_iterator it = std::lower_bound(cells.begin(), cells.end(), key, cellLess);
+  if (it != cells.end() && it->first == key.first) return it->second;
+  return r < loopRows && c < loopCols ? r : 0.;
+}
+
+static inline bool isSparse(const Matrix &) { return false; }
+static inline bool isSparse(const SparseMatrix &) { return true; }
+
+// The number of rows of a state matrix that are states, the rest being
+// the input event routing row and the rows holding the sched wave specs
+static int numStateRows(int rows, int cols, unsigned numSchedWaves)
+{
+  const int swCells = numSchedWaves * 7; // each sched wave uses 7 cells.
+  const int swRows = (swCells / cols) + (swCells % cols ? 1 : 0);
+  return rows - swRows - 1;
+}
+
+extern "C" 
+{
+  static void * workerThrWrapper(void *)
+  {
+    pthread_detach(pthread_self());
+    // the worker's scratch ShmMsg, too big for its stack; workers never
+    // exit so it is never freed
+    ShmMsg * const msgbuf = new ShmMsg;
+    while (1) {
+      Connection *c = workQueue.pop();
+      Connection::Status status;
+      try {
+        status = c->processCommands(*msgbuf);
+      } catch (const Exception & e) {
+        log(1) << e.why() << std::endl; log(0, AsyncLog::Error);
+        status = Connection::Closed;
+      }
+      switch (status) {
+      case Connection::Idle: 
+        rearmConnection(c); 
+        break;
+      case Connection::Detached: 
+        notifyHubAdd(c);
+        break;
+      default:
+        reapConnection(c);
+        break;
+      }
+    }
+    return 0;
+  }
+}
+
+static void createNotifyHub()
+{
+  if (::pipe(notifyPipe)) 
+    throw Exception(std::string("pipe: ") + strerror(errno));
+  ::fcntl(notifyPipe[0], F_SETFL, ::fcntl(notifyPipe[0], F_GETFL) | O_NONBLOCK);
+  ::fcntl(notifyPipe[1], F_SETFL, ::fcntl(notifyPipe[1], F_GETFL) | O_NONBLOCK);
+  notifyEpollFd = ::epoll_create(64);
+  if (notifyEpollFd < 0) 
+    throw Exception(std::string("epoll_create: ") + strerror(errno));
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = 0;
+  if (::epoll_ctl(notifyEpollFd, EPOLL_CTL_ADD, notifyPipe[0], &ev))
+    throw Exception(std::string("epoll_ctl: ") + strerror(errno));
+  pthread_t thr;
+  if (pthread_create(&thr, NULL, notifyHubThrWrapper, 0))
+    throw Exception("Could not create a required thread, 'notify hub thread'!");
+}
+
+/* Everything GET STATS and the metrics port report: the latency
+ * histograms (see Metrics.h) and some gauges, in the Prometheus text
+ * format. */
+static std::string metricsText()
+{
+  std::ostringstream s;
+  s << Metrics::text();
+  for (int f = 0; f < numStateMachines; ++f) {
+    FSMSpecific & fsm = fsms[f];
+    pthread_mutex_lock(&fsm.daqLock);
+    const unsigned long long scans = fsm.daqRing.head;
+    // the rate is only updated as scans come in, so once they stop it goes stale
+    const double rate = fsm.daqRateTimer.elapsed() < 2.0 ? fsm.daqRate : 0.;
+    pthread_mutex_unlock(&fsm.daqLock);
+    s << "fsm_daq_scans_total{fsm=\"" << f << "\"} " << scans << "\n"
+      << "fsm_daq_scans_per_sec{fsm=\"" << f << "\"} " << rate << "\n";
+  }
+  {
+    MutexLocker ml(connectionsLock);
+    s << "fsm_connections " << connections.size() << "\n";
+  }
+  s << fsmCache.stats()
+    << "fsm_notify_subscribers " << notifySubscriberCount << "\n"
+    << "fsm_log_records_dropped_total " << AsyncLog::dropped() << "\n";
+  return s.str();
+}
+
+/* The metrics port: whoever connects gets metricsText() and is hung up on,
+ * so "nc localhost <metricsPort>" works, and so does a Prometheus scrape (anything
+ * that starts with "GET " gets an HTTP reply).  Only listens on localhost. */
+namespace
+{
+  int metricsFd = -1;
+}
+
+extern "C" 
+{
+  static void * metricsThrWrapper(void *)
+  {
+    pthread_detach(pthread_self());
+    while (1) {
+      int fd = ::accept(metricsFd, 0, 0);
+      if (fd < 0) {
+        if (errno != EINTR && errno != ECONNABORTED) {
+          log(1) << "Error: metrics port accept returned " << ::strerror(errno) << std::endl; log(0, AsyncLog::Error);
+          ::sleep(1);
+        }
+        continue;
+      }
+      // give the client a moment to say what it is, without letting it stall us
+      struct pollfd pfd;
+      pfd.fd = fd;
+      pfd.events = POLLIN;
+      char req[1024];
+      int n = 0;
+      if (::poll(&pfd, 1, 100) == 1) n = ::recv(fd, req, sizeof(req), MSG_DONTWAIT);
+      std::string out = metricsText();
+      if (n >= 4 && !::strncmp(req, "GET ", 4)) {
+        std::ostringstream hdr;
+        hdr << "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " << out.length() << "\r\n\r\n";
+        out.insert(0, hdr.str());
+      }
+      struct timeval tv = { 1, 0 };
+      ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+      ::send(fd, out.data(), out.length(), MSG_NOSIGNAL);
+      ::close(fd);
+    }
+    return 0;
+  }
+}
+
+static void createMetricsListener()
+{
+  if (!metricsPort) return;
+  metricsFd = ::socket(PF_INET, SOCK_STREAM, 0);
+  if (metricsFd < 0) 
+    throw Exception(std::string("socket: ") + strerror(errno));
+  int parm = 1;
+  ::setsockopt(metricsFd, SOL_SOCKET, SO_REUSEADDR, &parm, sizeof(parm));
+  struct sockaddr_in inaddr;
+  memset(&inaddr, 0, sizeof(inaddr));
+  inaddr.sin_family = AF_INET;
+  inaddr.sin_port = htons(metricsPort);
+  inaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (::bind(metricsFd, (struct sockaddr *)&inaddr, sizeof(inaddr)) || ::listen(metricsFd, 16)) {
+    // not worth dying over, GET STATS still works
+    log(1) << "Could not listen on metrics port " << metricsPort << ": " << strerror(errno) << std::endl; log(0, AsyncLog::Warning);
+    ::close(metricsFd), metricsFd = -1;
+    return;
+  }
+  log(1) << "Serving metrics on localhost port: " << metricsPort << std::endl; log(0);
+  pthread_t thr;
+  if (pthread_create(&thr, NULL, metricsThrWrapper, 0))
+    throw Exception("Could not create a required thread, 'metrics port thread'!");
+}
+
+static void createWorkerThreads()
+{
+  // two threads per state machine run client commands (and thus RT round-trips)
+  for (int i = 0; i < numStateMachines*2; ++i) {
+    pthread_t thr;
+    int ret = pthread_create(&thr, NULL, workerThrWrapper, 0);
+    if (ret) 
+      throw Exception("Could not create a required thread, 'connection worker thread'!");
+  }
+}
+
+static void acceptConnections()
+{
+  struct sockaddr_in inaddr;
+  socklen_t addr_sz = sizeof(inaddr);
+  int sock, parm = 1;
+
+  while ( (sock = ::accept(listen_fd, (struct sockaddr *)&inaddr, &addr_sz)) >= 0 ) {
+    if (::setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &parm, sizeof(parm)) ) {
+      log(1) << "Error: setsockopt returned " << ::strerror(errno) << std::endl; log(0, AsyncLog::Error);
+    }
+    struct timeval tv = { SOCK_IO_TIMEOUT_SECS, 0 };
+    ::setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ::setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    Connection *conn = new Connection(sock, inet_ntoa(inaddr.sin_addr));
+    MutexLocker ml(connectionsLock);
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    if (::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev)) {
+      log(1) << "Error: epoll_ctl returned " << ::strerror(errno) << std::endl; log(0, AsyncLog::Error);
+      delete conn;
+      continue;
+    }
+    connections.insert(conn);
+    log(1) << "Connection received from host " << inet_ntoa(inaddr.sin_addr) << ", now have " << connections.size() << " total." << std::endl; log(0);
+    addr_sz = sizeof(inaddr);
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+    log(1) << "Error: accept returned " << ::strerror(errno) << std::endl; log(0, AsyncLog::Error);
+  }
 }
 
 static void doServer(void)
@@ -494,39 +1582,59 @@ static void doServer(void)
   inaddr.sin_port = htons(listenPort);
   inet_aton("0.0.0.0", &inaddr.sin_addr);
 
-  log() << "Listening for connections on port: " << listenPort << std::endl; 
+  log(1) << "Listening for connections on port: " << listenPort << std::endl; log(0);
 
   int parm = 1;
-  if (::setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &parm, sizeof(parm)) )
-    log() << "Error: setsockopt returned " << ::strerror(errno) << std::endl; 
+  if (::setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &parm, sizeof(parm)) ) {
+    log(1) << "Error: setsockopt returned " << ::strerror(errno) << std::endl; log(0, AsyncLog::Error);
+  }
   
   if ( ::bind(listen_fd, (struct sockaddr *)&inaddr, addr_sz) != 0 ) 
     throw Exception(std::string("bind: ") + strerror(errno));
   
-  if ( ::listen(listen_fd, 1) != 0 ) 
+  // all rigs reconnect at once at session start, so don't refuse anyone
+  if ( ::listen(listen_fd, SOMAXCONN) != 0 ) 
     throw Exception(std::string("listen: ") + strerror(errno));
 
-  while (1) {
-    int sock;
-    if ( (sock = ::accept(listen_fd, (struct sockaddr *)&inaddr, &addr_sz)) < 0 ) 
-      throw Exception(std::string("accept: ") + strerror(errno));
+  if ( ::fcntl(listen_fd, F_SETFL, O_NONBLOCK) != 0 )
+    throw Exception(std::string("fcntl: ") + strerror(errno));
 
-    if (::setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &parm, sizeof(parm)) )
-      log() << "Error: setsockopt returned " << ::strerror(errno) << std::endl; 
-    
-    ConnectionThread *conn = new ConnectionThread;
-    pthread_mutex_lock(&connectedThreadsLock);
-    if ( conn->start(sock, inet_ntoa(inaddr.sin_addr)) ) {
-      ++n_threads;
-      connectedThreads[conn] = conn;
-      log(1) << "Started new thread, now have " << n_threads << " total." 
-             << std::endl; log(0);
-    } else 
-      delete conn;
-    pthread_mutex_unlock(&connectedThreadsLock);
+  if ( (epoll_fd = ::epoll_create(64)) < 0 )
+    throw Exception(std::string("epoll_create: ") + strerror(errno));
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = 0; // NULL means the listen socket
+  if ( ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) != 0 )
+    throw Exception(std::string("epoll_ctl: ") + strerror(errno));
+
+  createWorkerThreads();
+  createNotifyHub();
+  createMetricsListener();
+
+  while (1) {
+    struct epoll_event evts[64];
+    int n = ::epoll_wait(epoll_fd, evts, sizeof(evts)/sizeof(*evts), -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      throw Exception(std::string("epoll_wait: ") + strerror(errno));
+    }
+    for (int i = 0; i < n; ++i) {
+      Connection *conn = static_cast<Connection *>(evts[i].data.ptr);
+      if (!conn) {
+        acceptConnections();
+        continue;
+      }
+      // we own conn until we rearm it or queue it, since it's EPOLLONESHOT
+      bool alive = conn->readAvail();
+      if (conn->hasCommand())  workQueue.push(conn);
+      else if (alive)  rearmConnection(conn);
+      else  reapConnection(conn);
+    }
   }
 }
 
+
 int main(int argc, const char *argv[])
 {
   int ret = 0;
@@ -539,6 +1647,8 @@ int main(int argc, const char *argv[])
   signal(SIGHUP, sighandler);
   signal(SIGTERM, sighandler);
 
+  AsyncLog::start(logstream ? *logstream : std::cerr);
+
   try {
   
     init();
@@ -550,7 +1660,7 @@ int main(int argc, const char *argv[])
 
   } catch (const Exception & e) {
 
-    log(1) << e.why() << std::endl; log(0);
+    log(1) << e.why() << std::endl; log(0, AsyncLog::Error);
     ret = 1;
 
   }
@@ -560,395 +1670,846 @@ int main(int argc, const char *argv[])
   return ret;
 }
 
-void *ConnectionThread::threadFunc(void)
+Connection::Status Connection::doCommand(std::string & line)
 {
-  Timer connectionTimer;
-
-  log(1) << "Connection received from host " << remoteHost << std::endl; log(0);
-
-  thread_running = true;
-  thread_ran = true;
-    
-  std::string line;
   int count;
 
-  while ( (line = sockReceiveLine()).length() > 0) {
-      
-    bool cmd_error = true;
-
-    if (line.find("SET STATE MATRIX") == 0) {
-      /* FSM Upload.. */
-        
-      // determine M and N
-      std::string::size_type pos = line.find_first_of("0123456789");
-
-      if (pos != std::string::npos) {
-        unsigned m = 0, n = 0, num_Events = 0, num_SchedWaves = 0, readyForTrialState = 0, num_ContChans = 0, num_TrigChans = 0, num_Vtrigs = 0, pend_sm_swap_flg = 0;
-        std::string outputSpecStr = "";
-        std::string inChanType = "ERROR";
-        std::stringstream s(line.substr(pos));
-        s >> m >> n >> num_Events >> num_SchedWaves >> inChanType >> readyForTrialState >> num_ContChans >> num_TrigChans >> num_Vtrigs >> outputSpecStr >> pend_sm_swap_flg;
-        if (m && n) {
-          if (outputSpecStr.length() == 0 && (num_ContChans || num_TrigChans || num_Vtrigs || num_SchedWaves)) {
-            // old FSM client, so build an output spec string for them
-            log(1) << "Client appears to use old SET STATE MATRIX interface, trying to create an output spec string that matches.\n"; log(0);
-            std::stringstream s("");
-            if (num_ContChans+num_TrigChans) 
-              s << "\1" << "dout" << "\2" << "0-" << (num_ContChans+num_TrigChans);
-            if (num_Vtrigs)
-              s << "\1" << "sound" << "\2" << fsm_id;
-            if (num_SchedWaves)
-              s << "\1" << "sched_wave" << "\2" << "Ignored";
-            outputSpecStr = s.str();
-          } else
-            outputSpecStr = UrlDecode(outputSpecStr);
-
-          // guard against memory hogging DoS
-          if (m*n > FSM_FLAT_SIZE) {
-            log(1) << "Error, incoming matrix would exceed cell limit of " << FSM_FLAT_SIZE << std::endl; log(0);
-            break;
-          }
-          if ( (count = sockSend("READY\n")) <= 0 ) {
-            log(1) << "Send error..." << std::endl; log(0);
-            break;
-          }
-          log(1) << "Getting ready to receive matrix of  " << m << "x" << n << " with one row for (" << num_Events << ") event mapping and row(s) for " <<  num_SchedWaves << " scheduled waves " << std::endl; log(0);
-            
-          Matrix mat (m, n);
-          count = sockReceiveData(mat.buf(), mat.bufSize());
-          if (count == (int)mat.bufSize()) {
-            cmd_error = !uploadMatrix(mat, num_Events, num_SchedWaves, inChanType, readyForTrialState, outputSpecStr, pend_sm_swap_flg);
-          } else if (count <= 0) {
-            break;
-          }
-        } 
+  bool cmd_error = true;
+
+  if (line.find("SET STATE MATRIX HASH") == 0) {
+    // SET STATE MATRIX HASH h [pend_sm_swap_flg], h as from GET STATE MATRIX HASH
+    std::istringstream s(line.substr(21));
+    std::string h;
+    unsigned pend_sm_swap_flg = 0;
+    s >> h >> pend_sm_swap_flg;
+    char *end = 0;
+    const uint64 hash = strtoull(h.c_str(), &end, 16);
+    if (hash && !h.empty() && !*end)
+      cmd_error = !uploadCachedMatrix(hash, pend_sm_swap_flg);
+  } else if (line.find("SET STATE MATRIX SPARSE") == 0) {
+    // SET STATE MATRIX SPARSE m n nnz num_Events num_SchedWaves inChanType readyForTrialState outputSpecStr pend_sm_swap_flg, 
+    // then an nnz x 3 matrix of row, col, value for the cells of the m x n state matrix
+    // that aren't the default (see struct SparseMatrix)
+    std::istringstream s(line.substr(23));
+    unsigned m = 0, n = 0, nnz = 0, num_Events = 0, num_SchedWaves = 0, readyForTrialState = 0, pend_sm_swap_flg = 0;
+    std::string outputSpecStr = "", inChanType = "ERROR";
+    s >> m >> n >> nnz >> num_Events >> num_SchedWaves >> inChanType >> readyForTrialState >> outputSpecStr >> pend_sm_swap_flg;
+    if (m && n && m <= USHRT_MAX && n <= FSM_FLAT_SIZE) {
+      // guard against memory hogging DoS
+      if (nnz > FSM_FLAT_SIZE) {
+        log(1) << "Error, incoming sparse matrix would exceed cell limit of " << FSM_FLAT_SIZE << std::endl; log(0, AsyncLog::Error);
+        return Closed;
       }
-    } else if (line.find("GET STATE MATRIX") == 0) {
-      unsigned rows, cols;
-      getFSMSizeFromRT(rows, cols);
-      Matrix m(rows, cols);
-      if (downloadMatrix(m)) {
-        std::stringstream s;
-          
-        s << "MATRIX " << m.rows() << " " << m.cols() << std::endl;
-        sockSend(s.str());
-          
-        line = sockReceiveLine(); // wait for "READY" from client
+      if ( !batching && (count = sockSend("READY\n")) <= 0 ) {
+        log(1) << "Send error..." << std::endl; log(0, AsyncLog::Error);
+        return Closed;
+      }
+      AsyncLog::logf(AsyncLog::Debug, "[Connection %ld] Getting ready to receive sparse matrix of %lux%lu with %lu cells, %lu event columns and %lu scheduled waves", myid, m, n, nnz, num_Events, num_SchedWaves);
+      Matrix cells (nnz, 3);
+      count = nnz ? sockReceiveData(cells.buf(), cells.bufSize()) : 0;
+      if (count == (int)cells.bufSize()) {
+        SparseMatrix mat (m, n, numStateRows(m, n, num_SchedWaves), num_Events+1, cells);
+        if (mat.ok())
+          cmd_error = !uploadMatrix(mat, num_Events, num_SchedWaves, inChanType, readyForTrialState, UrlDecode(outputSpecStr), pend_sm_swap_flg);
+        else {
+          log(1) << "Sparse matrix has cells outside its " << m << "x" << n << " size! Error!" << std::endl; log(0, AsyncLog::Error);
+        }
+      } else if (count <= 0) {
+        return Closed;
+      }
+    }
+  } else if (line.find("SET STATE MATRIX") == 0) {
+    /* FSM Upload.. */
+      
+    // determine M and N
+    std::string::size_type pos = line.find_first_of("0123456789");
+
+    if (pos != std::string::npos) {
+      unsigned m = 0, n = 0, num_Events = 0, num_SchedWaves = 0, readyForTrialState = 0, num_ContChans = 0, num_TrigChans = 0, num_Vtrigs = 0, pend_sm_swap_flg = 0;
+      std::string outputSpecStr = "";
+      std::string inChanType = "ERROR";
+      std::stringstream s(line.substr(pos));
+      s >> m >> n >> num_Events >> num_SchedWaves >> inChanType >> readyForTrialState >> num_ContChans >> num_TrigChans >> num_Vtrigs >> outputSpecStr >> pend_sm_swap_flg;
+      if (m && n) {
+        if (outputSpecStr.length() == 0 && (num_ContChans || num_TrigChans || num_Vtrigs || num_SchedWaves)) {
+          // old FSM client, so build an output spec string for them
+          log(1) << "Client appears to use old SET STATE MATRIX interface, trying to create an output spec string that matches.\n"; log(0);
+          std::stringstream s("");
+          if (num_ContChans+num_TrigChans) 
+            s << "\1" << "dout" << "\2" << "0-" << (num_ContChans+num_TrigChans);
+          if (num_Vtrigs)
+            s << "\1" << "sound" << "\2" << fsm_id;
+          if (num_SchedWaves)
+            s << "\1" << "sched_wave" << "\2" << "Ignored";
+          outputSpecStr = s.str();
+        } else
+          outputSpecStr = UrlDecode(outputSpecStr);
+
+        // guard against memory hogging DoS
+        if (m*n > FSM_FLAT_SIZE) {
+          log(1) << "Error, incoming matrix would exceed cell limit of " << FSM_FLAT_SIZE << std::endl; log(0, AsyncLog::Error);
+          return Closed;
+        }
+        // in a batch the client sends the data right behind the command
+        if ( !batching && (count = sockSend("READY\n")) <= 0 ) {
+          log(1) << "Send error..." << std::endl; log(0, AsyncLog::Error);
+          return Closed;
+        }
+        AsyncLog::logf(AsyncLog::Debug, "[Connection %ld] Getting ready to receive matrix of %lux%lu with %lu event columns and %lu scheduled waves", myid, m, n, num_Events, num_SchedWaves);
           
-        if (line.find("READY") != std::string::npos) {
-          count = sockSend(m.buf(), m.bufSize(), true);
-          if (count == (int)m.bufSize()) 
-            cmd_error = false;
+        Matrix mat (m, n);
+        count = sockReceiveData(mat.buf(), mat.bufSize());
+        if (count == (int)mat.bufSize()) {
+          cmd_error = !uploadMatrix(mat, num_Events, num_SchedWaves, inChanType, readyForTrialState, outputSpecStr, pend_sm_swap_flg);
+        } else if (count <= 0) {
+          return Closed;
         }
+      } 
+    }
+  } else if (line.find("PATCH STATE MATRIX") == 0) {
+    // PATCH STATE MATRIX n, then an n x 3 matrix of row, col, value
+    std::string::size_type pos = line.find_first_of("0123456789");
+    unsigned n = 0;
+    if (pos != std::string::npos) std::istringstream(line.substr(pos)) >> n;
+    if (n && n <= FSM_PATCH_MAX_CELLS) {
+      if ( !batching && (count = sockSend("READY\n")) <= 0 ) {
+        log(1) << "Send error..." << std::endl; log(0, AsyncLog::Error);
+        return Closed;
       }
-    } else if (line.find("INITIALIZE") == 0) {
-      sendToRT(RESET);
-      cmd_error = false;
-    } else if (line.find("HALT") == 0) {
-      msg.id = GETPAUSE;
-      sendToRT(msg);
-      if ( ! msg.u.is_paused ) 
-        sendToRT(PAUSEUNPAUSE);
+      Matrix mat (n, 3);
+      count = sockReceiveData(mat.buf(), mat.bufSize());
+      if (count == (int)mat.bufSize()) {
+        cmd_error = !patchMatrix(mat);
+      } else if (count <= 0) {
+        return Closed;
+      }
+    }
+  } else if (line.find("GET STATE MATRIX HASH") == 0) {
+    if (const uint64 hash = fsmCache.current(fsm_id)) {
+      std::ostringstream s;
+      s << std::hex << std::setw(16) << std::setfill('0') << hash << "\n";
+      sockSend(s.str());
       cmd_error = false;
-    } else if (line.find("RUN") == 0) {
-      msg.id = GETPAUSE;
-      sendToRT(msg);
-      if ( msg.u.is_paused ) 
-        sendToRT(PAUSEUNPAUSE);
-      cmd_error = false;        
-    } else if (line.find("FORCE TIME UP") == 0 ) { 
-      sendToRT(FORCETIMESUP);
+    }
+  } else if (line.find("GET STATE MATRIX") == 0) {
+    Matrix m(0, 0);
+    if (getStateMatrix(m)) 
+      cmd_error = !sendMatrixText(m);
+  } else if (line.find("INITIALIZE") == 0) {
+    sendToRT(RESET);
+    cmd_error = false;
+  } else if (line.find("HALT") == 0) {
+    doHalt();
+    cmd_error = false;
+  } else if (line.find("RUN") == 0) {
+    doRun();
+    cmd_error = false;        
+  } else if (line.find("FORCE TIME UP") == 0 ) { 
+    sendToRT(FORCETIMESUP);
+    cmd_error = false;
+  } else if (line.find("READY TO START TRIAL") == 0 ) { 
+    sendToRT(READYFORTRIAL);
+    cmd_error = false;
+  } else if (line.find("TRIGSOUND") == 0 ) { 
+    int trigmask = 0;
+    std::string::size_type pos = line.find_first_of("-0123456789");
+    if (pos != std::string::npos) {
+      std::stringstream s(line.substr(pos));
+      s >> trigmask;
+      doTrigSound(trigmask);
       cmd_error = false;
-    } else if (line.find("READY TO START TRIAL") == 0 ) { 
-      sendToRT(READYFORTRIAL);
+    }
+  } else if (line.find("BYPASS DOUT") == 0) {
+    int bypassmask = 0;
+    std::string::size_type pos = line.find_first_of("-0123456789");
+    if (pos != std::string::npos) {
+      std::stringstream s(line.substr(pos));
+      s >> bypassmask;
+      doBypassDout(bypassmask);
       cmd_error = false;
-    } else if (line.find("TRIGSOUND") == 0 ) { 
-      int trigmask = 0;
-      std::string::size_type pos = line.find_first_of("-0123456789");
-      if (pos != std::string::npos) {
-        std::stringstream s(line.substr(pos));
-        s >> trigmask;
-        msg.id = FORCESOUND;
-        msg.u.forced_triggers = trigmask;
-        sendToRT(msg);
-        cmd_error = false;
+    }
+  } else if (line.find("FORCE STATE") == 0 ) { 
+    unsigned forced_state = 0;
+    std::string::size_type pos = line.find_first_of("0123456789");
+    if (pos != std::string::npos) {
+      std::stringstream s(line.substr(pos));
+      s >> forced_state;
+      cmd_error = !doForceState(forced_state);
+    }
+  } else if (line.find("GET EVENT COUNTER") == 0) {
+    std::stringstream s;
+    s << readStatus(fsm_id).transition_count << std::endl;
+    sockSend(s.str());
+    cmd_error = false;
+  } else if (line.find("IS RUNNING") == 0) {
+    std::stringstream s;
+    s << !readStatus(fsm_id).paused << std::endl;
+    sockSend(s.str());
+    cmd_error = false;
+  } else if (line.find("GET TIME") == 0) {
+    std::stringstream s;
+    s << static_cast<double>(readStatus(fsm_id).current_ts/1000LL)/1000000.0 << std::endl;
+    sockSend(s.str());
+    cmd_error = false;        
+  } else if (line.find("GET CURRENT STATE") == 0) {
+    std::stringstream s;
+    s << readStatus(fsm_id).current_state << std::endl;
+    sockSend(s.str());
+    cmd_error = false;        
+  } else if (line.find("GET EVENTS") == 0) {
+    std::string::size_type pos = line.find_first_of("0123456789");
+    if (pos != std::string::npos) {
+      std::stringstream s(line.substr(pos));
+      int first = -1, last = -1;
+      s >> first >> last;
+      Matrix mat(0, 0);
+      if (getEvents(first, last, mat)) 
+        cmd_error = !sendMatrixText(mat);
+    }
+  } else if ( line.find("EXIT") == 0 || line.find("BYE") == 0 || line.find("QUIT") == 0) {
+    log(1) << "Graceful exit requested." << std::endl; log(0);
+    return Closed;
+  } else if (line.find("NOTIFY EVENTS") == 0 && !batching) {
+    // NOTIFY EVENTS [VERBOSE] [STATES s1,s2,..] [EVENTS e1,e2,..] [INTERVAL ms] [QUEUE n]
+    notify = NotifySubscription();
+    if (notify.parse(line.substr(sizeof("NOTIFY EVENTS")-1))) {
+      notifyCursor = fsms[fsm_id].transRing.count(); // only events from now on
+      sockSend("OK\n"); // tell them we accept the command..
+      // the connection only gets events from now on, which the notify hub 
+      // sends, so it leaves the worker pool for good
+      return Detached; 
+    }
+  } else if (line.find("STREAM DAQ") == 0 && !batching) {
+    // STREAM DAQ, the connection gets a FSMProtoDAQBlock (see RatExpFSMProto.h)
+    // for every lot of scans that comes in, starting with the next one
+    pthread_mutex_lock(&fsms[fsm_id].daqLock);
+    daqCursor = fsms[fsm_id].daqRing.head;
+    pthread_mutex_unlock(&fsms[fsm_id].daqLock);
+    daqStream = true;
+    sockSend("OK\n");
+    return Detached;
+  } else if (line.find("NOOP") == 0) {
+    // noop is just used to test the connection, keep it alive, etc
+    // it doesn't touch the shm...
+    cmd_error = false;        
+  } else if (line.find("START DAQ") == 0) { // START DAQ
+    // determine chans and range
+    std::string::size_type pos = line.find_first_of("0123456789");
+
+    if (pos != std::string::npos) {
+      std::string chanstr, rangestr;
+      std::stringstream s(line.substr(pos));
+      s >> chanstr >> rangestr;
+      std::vector<double> chans = splitNumericString(chanstr);
+      std::vector<double> ranges = splitNumericString(rangestr);
+      unsigned chanMask = 0;
+      for (unsigned i = 0; i < chans.size(); ++i) {
+        unsigned ch = i;
+        if (ch < sizeof(int)*8) chanMask |= 0x1<<ch;
       }
-    } else if (line.find("BYPASS DOUT") == 0) {
-      int bypassmask = 0;
-      std::string::size_type pos = line.find_first_of("-0123456789");
-      if (pos != std::string::npos) {
-        std::stringstream s(line.substr(pos));
-        s >> bypassmask;
-        msg.id = FORCEOUTPUT;
-        msg.u.forced_outputs = bypassmask;
-        sendToRT(msg);
-        cmd_error = false;
+      if (!chanMask || ranges.size() != 2) {
+        log(1) << "Chan or range spec for START DAQ has invalid chanspec or rangespec" << std::endl; log(0, AsyncLog::Error); 
+      } else {
+        cmd_error = !startDAQ(chanMask, int(ranges[0]*1e6), int(ranges[1]*1e6));
       }
-    } else if (line.find("FORCE STATE") == 0 ) { 
-      unsigned forced_state = 0;
-      std::string::size_type pos = line.find_first_of("0123456789");
-      if (pos != std::string::npos) {
-        unsigned rows, cols;
-        getFSMSizeFromRT(rows, cols);
-        std::stringstream s(line.substr(pos));
-        s >> forced_state;
-        if (forced_state < rows) { // ensure legal state here..
-          msg.id = FORCESTATE;
-          msg.u.forced_state = forced_state;
-          sendToRT(msg);
-          cmd_error = false;
+    }
+  } else if (line.find("STOP DAQ") == 0) { // STOP DAQ
+    stopDAQ();
+    cmd_error = false;        
+  } else if (line.find("GET DAQ SCANS") == 0) { // GET DAQ SCANS
+    cmd_error = !sendMatrixText(fsms[fsm_id].getDAQScans());
+  } else if (line.find("GET DAQ DECIMATED") == 0) { // GET DAQ DECIMATED factor [t0 [t1]]
+    std::stringstream s(line.substr(sizeof("GET DAQ DECIMATED")-1));
+    unsigned factor = 0;
+    double t0 = 0., t1 = 1e300;
+    s >> factor;
+    if (!s.fail() && !(s >> t0).fail()) s >> t1;
+    Matrix mat(0, 0);
+    if (fsms[fsm_id].getDAQDecimated(factor, t0, t1, mat))
+      cmd_error = !sendMatrixText(mat);
+  } else if (line.find("SET AO WAVE") == 0) { // SET AO WAVE
+
+    // determine M N id aoline loop
+    std::string::size_type pos = line.find_first_of("0123456789");
+
+    if (pos != std::string::npos) {
+      unsigned m = 0, n = 0, id = 0, aoline = 0, loop = 0;
+      std::stringstream s(line.substr(pos));
+      s >> m >> n >> id >> aoline >> loop;
+      if (m && n) {
+        // guard against memory hogging DoS
+        if (m*n > FSM_FLAT_SIZE) {
+          log(1) << "Error, incoming matrix would exceed cell limit of " << FSM_FLAT_SIZE << std::endl; log(0, AsyncLog::Error);
+          return Closed;
+        }
+        // in a batch the client sends the data right behind the command
+        if ( !batching && (count = sockSend("READY\n")) <= 0 ) {
+          log(1) << "Send error..." << std::endl; log(0, AsyncLog::Error);
+          return Closed;
+        }
+        AsyncLog::logf(AsyncLog::Debug, "[Connection %ld] Getting ready to receive AO wave matrix sized %lux%lu", myid, m, n);
+          
+        Matrix mat (m, n);
+        count = sockReceiveData(mat.buf(), mat.bufSize());
+        if (count == (int)mat.bufSize()) {
+          setAOWave(id, aoline, loop, &mat);
+        } else if (count <= 0) {
+          return Closed;
         }
+      } else {
+        // indicates we are clearing an existing wave
+        setAOWave(id, aoline, loop, 0);
       }
-    } else if (line.find("GET EVENT COUNTER") == 0) {
-      msg.id = TRANSITIONCOUNT;
-      sendToRT(msg);
-      std::stringstream s;
-      s << msg.u.transition_count << std::endl;
-      sockSend(s.str());
+      cmd_error = false;        
+    }
+  } else if (line.find("GET STATE MACHINE") == 0) { // GET STATE MACHINE
+    std::ostringstream s;
+    s << fsm_id << "\n";      
+    sockSend(s.str());
+    cmd_error = false;
+  } else if (line.find("GET NUM STATE MACHINES") == 0) { // GET NUM STATE MACHINES
+    std::ostringstream s;
+    s << numStateMachines << "\n";      
+    sockSend(s.str());
+    cmd_error = false;
+  } else if (line.find("SET STATE MACHINE") == 0) { // SET STATE MACHINE
+    // determine param
+    std::string::size_type pos = line.find_first_of("0123456789");
+    if (pos != std::string::npos) {
+      std::istringstream s(line.substr(pos));
+      unsigned in_id = unsigned(numStateMachines);
+      s >> in_id;
+      if (in_id < unsigned(numStateMachines)) {
+        cmd_error = false;
+        fsm_id = in_id;
+      }
+    }
+  } else if (line.find("SET LOG LEVEL") == 0) { // SET LOG LEVEL 0-4
+    // determine param
+    std::string::size_type pos = line.find_first_of("0123456789");
+    if (pos != std::string::npos) {
+      std::istringstream s(line.substr(pos));
+      int lvl = -1;
+      s >> lvl;
+      if (lvl >= AsyncLog::Error && lvl <= AsyncLog::Trace) {
+        log(1) << "Log level set to " << AsyncLog::levelName(AsyncLog::Level(lvl)) << std::endl; log(0);
+        AsyncLog::level = lvl;
+        cmd_error = false;
+      }
+    }
+  } else if (line.find("GET LOG LEVEL") == 0) { // GET LOG LEVEL
+    std::ostringstream s;
+    s << AsyncLog::level << "\n";
+    sockSend(s.str());
+    cmd_error = false;
+  } else if (line.find("START RECORDING") == 0) { // START RECORDING [filename]
+    std::istringstream s(line.substr(sizeof("START RECORDING")-1));
+    std::string path, err;
+    if (!(s >> path)) {
+      // default to fsmN-YYYYMMDD-HHMMSS.fsmrec in the working dir
+      char buf[64];
+      time_t now = ::time(0);
+      struct tm tm;
+      strftime(buf, sizeof(buf), "-%Y%m%d-%H%M%S.fsmrec", localtime_r(&now, &tm));
+      std::ostringstream name;
+      name << "fsm" << fsm_id << buf;
+      path = name.str();
+    }
+    if (fsms[fsm_id].recorder.start(path, fsm_id, err)) {
+      log(1) << "Recording state machine " << fsm_id << " to " << path << std::endl; log(0);
+      sockSend(path + "\n");
       cmd_error = false;
-    } else if (line.find("IS RUNNING") == 0) {
-      msg.id = GETPAUSE;
-      sendToRT(msg);
-      std::stringstream s;
-      s << !msg.u.is_paused << std::endl;
-      sockSend(s.str());
+    } else {
+      log(1) << "START RECORDING failed: " << err << std::endl; log(0, AsyncLog::Warning);
+    }
+  } else if (line.find("STOP RECORDING") == 0) { // STOP RECORDING
+    fsms[fsm_id].recorder.stop();
+    cmd_error = false;
+  } else if (line.find("GET RECORDING") == 0) { // GET RECORDING
+    // the file, bytes written so far and records dropped, or just a blank line if not recording
+    std::string path;
+    unsigned long long bytes;
+    unsigned long dropped;
+    fsms[fsm_id].recorder.status(path, bytes, dropped);
+    std::ostringstream s;
+    if (path.length()) s << path << " " << bytes << " " << dropped;
+    s << "\n";
+    sockSend(s.str());
+    cmd_error = false;
+  } else if (line.find("GET STATS") == 0) { // GET STATS
+    // the number of lines, then the same text the metrics port serves
+    const std::string text = metricsText();
+    std::ostringstream s;
+    s << std::count(text.begin(), text.end(), '\n') << "\n" << text;
+    sockSend(s.str());
+    cmd_error = false;
+  } else if (line.find("GET NRT STATS") == 0) { // GET NRT STATS
+    sockSend(nrtDispatcher.stats());
+    cmd_error = false;
+  } else if (line.find("BEGIN BATCH") == 0) { // BEGIN BATCH
+    if (!batching) {
+      // hold back all replies, including this one, until END BATCH
+      batching = corked = true;
+      batchErrors = 0;
       cmd_error = false;
-    } else if (line.find("GET TIME") == 0) {
-      msg.id = GETRUNTIME;
-      sendToRT(msg);
-      std::stringstream s;
-      s << static_cast<double>(msg.u.runtime_us)/1000000.0 << std::endl;
-      sockSend(s.str());
-      cmd_error = false;        
-    } else if (line.find("GET CURRENT STATE") == 0) {
-      msg.id = GETCURRENTSTATE;
-      sendToRT(msg);
-      std::stringstream s;
-      s << msg.u.current_state << std::endl;
-      sockSend(s.str());
-      cmd_error = false;        
-    } else if (line.find("GET EVENTS") == 0) {
-      std::string::size_type pos = line.find_first_of("0123456789");
-      if (pos != std::string::npos) {
-        std::stringstream s(line.substr(pos));
-        int first = -1, last = -1, n_trans = 0;
-        s >> first >> last;
-
-        // query the count first to check sanity
-        msg.id = TRANSITIONCOUNT;
-        sendToRT(msg);
-          
-        n_trans = msg.u.transition_count;
-          
-        if (first > -1 && first <= last && last < n_trans) {
-          unsigned num_input_events = getNumInputEventsFromRT();
-          int desired = last-first+1, received = 0, ct = 0;
-          Matrix mat(desired, 5);
-            
-
-          // keep 'downloading' the matrix from RT until we get all the transitions we require
-          while (received < desired) {
-            msg.id = TRANSITIONS;
-            msg.u.transitions.num = desired - received;
-            msg.u.transitions.from = first + received;
-            sendToRT(msg);
-            received += (int)msg.u.transitions.num;              
-            for (int i = 0; i < (int)msg.u.transitions.num; ++i, ++ct) {
-              struct StateTransition & t = msg.u.transitions.transitions[i];
-              mat.at(ct, 0) = t.previous_state;
-              mat.at(ct, 1) = t.event_id > -1 ? 0x1 << t.event_id : 0x1<<num_input_events;
-              mat.at(ct, 2) = static_cast<double>(t.ts/1000) / 1000000.0; /* convert us to seconds */
-              mat.at(ct, 3) = t.state;
-              mat.at(ct, 4) = static_cast<double>(t.ext_ts/1000) / 1000000.0;
-            }
-          }
-          std::ostringstream os;
-          os << "MATRIX " << mat.rows() << " " << mat.cols() << std::endl; 
-          sockSend(os.str());
-
-          line = sockReceiveLine(); // wait for "READY" from client
-            
-          if (line.find("READY") != std::string::npos) {
-            sockSend(mat.buf(), mat.bufSize(), true);
-            cmd_error = false;
-          }
-        }
+    }
+  } else if (line.find("END BATCH") == 0) { // END BATCH
+    if (batching) {
+      batching = false;
+      sockSend(batchErrors ? "ERROR\n" : "OK\n");
+      corked = false;
+      return flushOutput() ? Idle : Closed;
+    }
+  } else if (line.find("PROTOCOL") == 0 && !batching) { // PROTOCOL version
+    std::string::size_type pos = line.find_first_of("0123456789");
+    if (pos != std::string::npos) {
+      unsigned version = 0;
+      std::istringstream s(line.substr(pos));
+      s >> version;
+      if (version == 1 || version == FSM_PROTO_VERSION) {
+        sockSend("OK\n");
+        // from here on every byte in inbuf is binary frames, see RatExpFSMProto.h
+        protocol = version;
+        return Idle;
+      }
+    }
+  }
+
+  if (cmd_error) {
+    if (batching) ++batchErrors;
+    sockSend("ERROR\n"); 
+  } else {
+    sockSend("OK\n"); 
+  }
+
+  return Idle;
+}
+
+namespace 
+{
+  // helpers for building and parsing binary protocol payloads
+  template <class T> void putPOD(std::string & out, const T & t)
+  {
+    out.append(reinterpret_cast<const char *>(&t), sizeof(t));
+  }
+
+  void putMatrix(std::string & out, const Matrix & m)
+  {
+    FSMProtoMatrix hdr;
+    hdr.rows = m.rows();
+    hdr.cols = m.cols();
+    putPOD(out, hdr);
+    out.append(static_cast<const char *>(m.buf()), m.bufSize());
+  }
+
+  struct PayloadReader
+  {
+    PayloadReader(const std::string & p) : buf(p), pos(0), ok(true) {}
+
+    template <class T> bool get(T & t) 
+    {
+      if (!ok || buf.length() - pos < sizeof(T)) return ok = false;
+      std::memcpy(&t, buf.data() + pos, sizeof(T));
+      pos += sizeof(T);
+      return true;
+    }
+    bool getString(std::string & s, unsigned len)
+    {
+      if (!ok || buf.length() - pos < len) return ok = false;
+      s = buf.substr(pos, len);
+      pos += len;
+      return true;
+    }
+    bool getMatrix(Matrix & m, unsigned rows, unsigned cols)
+    {
+      if (!ok || (rows && cols && (buf.length() - pos)/sizeof(double)/rows < cols)) return ok = false;
+      m = Matrix(rows, cols);
+      std::memcpy(m.buf(), buf.data() + pos, m.bufSize());
+      pos += m.bufSize();
+      return true;
+    }
+
+    const std::string & buf;
+    std::string::size_type pos;
+    bool ok;
+  };
+}
+
+// Run one binary protocol request frame, see RatExpFSMProto.h
+Connection::Status Connection::doFrame(const FSMProtoHdr & req, const std::string & payload)
+{
+  PayloadReader in(payload);
+  std::string out;
+  bool ok = false;
+
+  AsyncLog::logf(AsyncLog::Debug, "[Connection %ld] Got frame op=%lu fsm=%lu req=%lu len=%lu", myid, req.opcode, req.fsm_id, req.req_id, req.payload_len);
+
+  if (req.fsm_id < unsigned(numStateMachines)) {
+    // the commands act on fsm_id, but only for this frame: the connection's
+    // own state machine (SET STATE MACHINE, notifications) stays as it was
+    const int conn_fsm_id = fsm_id;
+    fsm_id = req.fsm_id;
+
+    switch (req.opcode) {
+    case FSM_OP_NOOP:
+      ok = true;
+      break;
+    case FSM_OP_SET_STATE_MATRIX: {
+      FSMProtoSetMatrix p;
+      std::string outputSpecStr;
+      Matrix mat(0, 0);
+      if (in.get(p) && in.getString(outputSpecStr, p.output_spec_len) 
+          && p.rows*p.cols <= FSM_FLAT_SIZE && in.getMatrix(mat, p.rows, p.cols))
+        ok = uploadMatrix(mat, p.num_events, p.num_sched_waves, 
+                          p.in_chan_type == AI_TYPE ? "ai" : (p.in_chan_type == DIO_TYPE ? "dio" : "ERROR"),
+                          p.ready_for_trial_state, outputSpecStr, p.swap_on_state0);
+    }
+      break;
+    case FSM_OP_SET_STATE_MATRIX_SPARSE: {
+      FSMProtoSetMatrix p;
+      FSMProtoMatrix nz;
+      std::string outputSpecStr;
+      Matrix cells(0, 0);
+      if (in.get(p) && in.getString(outputSpecStr, p.output_spec_len) && in.get(nz)
+          && p.rows && p.rows <= USHRT_MAX && p.cols <= FSM_FLAT_SIZE
+          && nz.cols == 3 && nz.rows <= FSM_FLAT_SIZE && in.getMatrix(cells, nz.rows, nz.cols)) {
+        SparseMatrix mat(p.rows, p.cols, numStateRows(p.rows, p.cols, p.num_sched_waves), p.num_events+1, cells);
+        ok = mat.ok() && uploadMatrix(mat, p.num_events, p.num_sched_waves, 
+                                      p.in_chan_type == AI_TYPE ? "ai" : (p.in_chan_type == DIO_TYPE ? "dio" : "ERROR"),
+                                      p.ready_for_trial_state, outputSpecStr, p.swap_on_state0);
+      }
+    }
+      break;
+    case FSM_OP_PATCH_STATE_MATRIX: {
+      FSMProtoMatrix p;
+      Matrix mat(0, 0);
+      ok = in.get(p) && p.cols == 3 && p.rows && p.rows <= FSM_PATCH_MAX_CELLS 
+           && in.getMatrix(mat, p.rows, p.cols) && patchMatrix(mat);
+    }
+      break;
+    case FSM_OP_SET_STATE_MATRIX_HASH: {
+      FSMProtoSetMatrixHash p;
+      ok = in.get(p) && uploadCachedMatrix(p.hash, p.swap_on_state0);
+    }
+      break;
+    case FSM_OP_GET_STATE_MATRIX_HASH: {
+      const uint64 hash = fsmCache.current(fsm_id);
+      if ( (ok = hash != 0) ) putPOD(out, hash);
+    }
+      break;
+    case FSM_OP_GET_STATE_MATRIX: {
+      Matrix m(0, 0);
+      if ( (ok = getStateMatrix(m)) )  putMatrix(out, m);
+    }
+      break;
+    case FSM_OP_INITIALIZE:
+      sendToRT(RESET);
+      ok = true;
+      break;
+    case FSM_OP_HALT:
+      doHalt();
+      ok = true;
+      break;
+    case FSM_OP_RUN:
+      doRun();
+      ok = true;
+      break;
+    case FSM_OP_FORCE_TIME_UP:
+      sendToRT(FORCETIMESUP);
+      ok = true;
+      break;
+    case FSM_OP_READY_TO_START_TRIAL:
+      sendToRT(READYFORTRIAL);
+      ok = true;
+      break;
+    case FSM_OP_TRIGSOUND: {
+      int32 mask;
+      if ( (ok = in.get(mask)) )  doTrigSound(mask);
+    }
+      break;
+    case FSM_OP_BYPASS_DOUT: {
+      int32 mask;
+      if ( (ok = in.get(mask)) )  doBypassDout(mask);
+    }
+      break;
+    case FSM_OP_FORCE_STATE: {
+      uint32 state;
+      ok = in.get(state) && doForceState(state);
+    }
+      break;
+    case FSM_OP_GET_EVENT_COUNTER:
+      putPOD(out, uint32(readStatus(fsm_id).transition_count));
+      ok = true;
+      break;
+    case FSM_OP_IS_RUNNING:
+      putPOD(out, uint32(!readStatus(fsm_id).paused));
+      ok = true;
+      break;
+    case FSM_OP_GET_TIME:
+      putPOD(out, static_cast<double>(readStatus(fsm_id).current_ts/1000LL)/1000000.0);
+      ok = true;
+      break;
+    case FSM_OP_GET_CURRENT_STATE:
+      putPOD(out, uint32(readStatus(fsm_id).current_state));
+      ok = true;
+      break;
+    case FSM_OP_GET_EVENTS: {
+      FSMProtoGetEvents p;
+      Matrix m(0, 0);
+      if ( (ok = in.get(p) && getEvents(p.first, p.last, m)) )  putMatrix(out, m);
+    }
+      break;
+    case FSM_OP_START_DAQ: {
+      FSMProtoStartDAQ p;
+      ok = in.get(p) && p.chan_mask && startDAQ(p.chan_mask, p.range_min, p.range_max);
+    }
+      break;
+    case FSM_OP_STOP_DAQ:
+      stopDAQ();
+      ok = true;
+      break;
+    case FSM_OP_GET_DAQ_SCANS:
+      putMatrix(out, fsms[fsm_id].getDAQScans());
+      ok = true;
+      break;
+    case FSM_OP_GET_DAQ_DECIMATED: {
+      FSMProtoGetDAQDecimated p;
+      Matrix m(0, 0);
+      if ( (ok = in.get(p) && fsms[fsm_id].getDAQDecimated(p.factor, p.t0, p.t1, m)) )  putMatrix(out, m);
+    }
+      break;
+    case FSM_OP_SET_AO_WAVE: {
+      FSMProtoSetAOWave p;
+      Matrix mat(0, 0);
+      if (in.get(p) && p.rows*p.cols <= FSM_FLAT_SIZE && in.getMatrix(mat, p.rows, p.cols)) {
+        setAOWave(p.id, p.aoline, p.loop, p.rows && p.cols ? &mat : 0);
+        ok = true;
       }
-    } else if ( line.find("EXIT") == 0 || line.find("BYE") == 0 || line.find("QUIT") == 0) {
-      log(1) << "Graceful exit requested." << std::endl; log(0);
+    }
       break;
-    } else if (line.find("NOTIFY EVENTS") == 0) {
-      std::string::size_type pos = line.find("VERBOSE");
-      bool verbose = pos != std::string::npos;
-      sockSend("OK\n"); // tell them we accept the command..
-      doNotifyEvents(verbose); // this doesn't return for a LONG time normally..
-      break; // if we return from the above, means there is a socket error
-    } else if (line.find("NOOP") == 0) {
-      // noop is just used to test the connection, keep it alive, etc
-      // it doesn't touch the shm...
-      cmd_error = false;        
-    } else if (line.find("START DAQ") == 0) { // START DAQ
-      // determine chans and range
-      std::string::size_type pos = line.find_first_of("0123456789");
-
-      if (pos != std::string::npos) {
-        std::string chanstr, rangestr;
-        std::stringstream s(line.substr(pos));
-        s >> chanstr >> rangestr;
-        std::vector<double> chans = splitNumericString(chanstr);
-        std::vector<double> ranges = splitNumericString(rangestr);
-        unsigned chanMask = 0, nChans = 0;
-        for (unsigned i = 0; i < chans.size(); ++i) {
-          unsigned ch = i;
-          if (ch < sizeof(int)*8 && !(chanMask&(0x1<<ch)))
-            (chanMask |= 0x1<<ch), nChans++;
-        }
-        if (!chanMask || !nChans || ranges.size() != 2) {
-          log(1) << "Chan or range spec for START DAQ has invalid chanspec or rangespec" << std::endl; log(0); 
-        } else {
-          msg.id = STARTDAQ;
-          msg.u.start_daq.chan_mask = chanMask;
-          msg.u.start_daq.range_min = int(ranges[0]*1e6);
-          msg.u.start_daq.range_max = int(ranges[1]*1e6);
-          msg.u.start_daq.started_ok = 0;
-          sendToRT(msg);
-          if (msg.u.start_daq.started_ok) {
-            cmd_error = false;        
-            pthread_mutex_lock(&fsms[fsm_id].daqLock);
-            fsms[fsm_id].daqNumChans = nChans;
-            fsms[fsm_id].daqMaxData = msg.u.start_daq.maxdata;
-            //fsms[fsm_id].daqRangeMin = msg.u.start_daq.range_min/1e6;
-            //fsms[fsm_id].daqRangeMax = msg.u.start_daq.range_max/1e6;
-            pthread_mutex_unlock(&fsms[fsm_id].daqLock);
-          } else { 
-            log(1) << "RT Task refused to do start a DAQ task -- probably invalid parameters are to blame" << std::endl; log(0); 
-          }
+    case FSM_OP_GET_NUM_STATE_MACHINES:
+      putPOD(out, uint32(numStateMachines));
+      ok = true;
+      break;
+    case FSM_OP_BATCH: {
+      // run the embedded frames back-to-back, their replies become our payload
+      const bool was_corked = corked;
+      const std::string::size_type mark = outbuf.length();
+      std::string::size_type pos = 0;
+      uint32 index = 0;
+      corked = true;
+      ok = true;
+      for ( ; pos < payload.length(); ++index) {
+        FSMProtoHdr sub;
+        if (payload.length() - pos < sizeof(sub)) { ok = false; break; }
+        std::memcpy(&sub, payload.data() + pos, sizeof(sub));
+        pos += sizeof(sub);
+        if (sub.magic != FSM_PROTO_MAGIC || sub.opcode == FSM_OP_BATCH || payload.length() - pos < sub.payload_len) { 
+          ok = false; 
+          break; 
         }
+        doFrame(sub, payload.substr(pos, sub.payload_len));
+        pos += sub.payload_len;
       }
-    } else if (line.find("STOP DAQ") == 0) { // STOP DAQ
-      sendToRT(STOPDAQ);
-      //fifoReadAllAvail(fifo_daq); // discard fifo data for stopped scan
-      // FIXME avoid race coditions with daq thread
-      pthread_mutex_lock(&fsms[fsm_id].daqLock);
-      fsms[fsm_id].daqBuf.clear();
-      pthread_mutex_unlock(&fsms[fsm_id].daqLock);
-      cmd_error = false;        
-    } else if (line.find("GET DAQ SCANS") == 0) { // GET DAQ SCANS
+      // the frames before a malformed one already ran, so their replies still go back
+      if (!ok) putPOD(out, index);
+      out.append(outbuf, mark, std::string::npos);
+      outbuf.erase(mark);
+      corked = was_corked;
+    }
+      break;
+    default:
+      log(1) << "Unknown opcode " << req.opcode << std::endl; log(0, AsyncLog::Error);
+      break;
+    }
+    fsm_id = conn_fsm_id;
+  }
 
-      Matrix mat = fsms[fsm_id].getDAQScans();
-      std::ostringstream os;
-      os << "MATRIX " << mat.rows() << " " << mat.cols() << std::endl; 
-      sockSend(os.str());
+  FSMProtoHdr reply = req;
+  reply.status = ok ? FSM_PROTO_OK : FSM_PROTO_ERROR;
+  if (!ok && req.opcode != FSM_OP_BATCH) out.clear();
+  reply.payload_len = out.length();
+  out.insert(0, reinterpret_cast<const char *>(&reply), sizeof(reply));
+  if (sockSend(out.data(), out.length(), true) != (int)out.length()) 
+    return Closed;
+  return Idle;
+}
 
-      line = sockReceiveLine(); // wait for "READY" from client
-            
-      if (line.find("READY") != std::string::npos) {
-        sockSend(mat.buf(), mat.bufSize(), true);
-        cmd_error = false;
-      }
- 
-    } else if (line.find("SET AO WAVE") == 0) { // SET AO WAVE
-
-      // determine M N id aoline loop
-      std::string::size_type pos = line.find_first_of("0123456789");
-
-      if (pos != std::string::npos) {
-        unsigned m = 0, n = 0, id = 0, aoline = 0, loop = 0;
-        std::stringstream s(line.substr(pos));
-        s >> m >> n >> id >> aoline >> loop;
-        if (m && n) {
-          // guard against memory hogging DoS
-          if (m*n > FSM_FLAT_SIZE) {
-            log(1) << "Error, incoming matrix would exceed cell limit of " << FSM_FLAT_SIZE << std::endl; log(0);
-            break;
-          }
-          if ( (count = sockSend("READY\n")) <= 0 ) {
-            log(1) << "Send error..." << std::endl; log(0);
-            break;
-          }
-          log(1) << "Getting ready to receive AO wave matrix sized " << m << "x" << n << std::endl; log(0);
-            
-          Matrix mat (m, n);
-          count = sockReceiveData(mat.buf(), mat.bufSize());
-          if (count == (int)mat.bufSize()) {
-            msg.id = GETAOMAXDATA;
-            sendToRT(msg);
-            fsms[fsm_id].aoMaxData = msg.u.ao_maxdata;
-            msg.id = AOWAVE;
-            msg.u.aowave.id = id;
-            msg.u.aowave.aoline = aoline;
-            msg.u.aowave.loop = loop;
-            // scale data from [-1,1] -> [0,aoMaxData]
-            for (unsigned i = 0; i < n && i < AOWAVE_MAX_SAMPLES; ++i) {
-              msg.u.aowave.samples[i] = static_cast<unsigned short>(((mat.at(0, i) + 1.0) / 2.0) * fsms[fsm_id].aoMaxData);
-              if (m > 1)
-                msg.u.aowave.evt_cols[i] = static_cast<signed char>(mat.at(1, i));
-              else
-                msg.u.aowave.evt_cols[i] = -1;
-            }
-            msg.u.aowave.nsamples = n;
-            // send to kernel
-            sendToRT(msg);
-          } else if (count <= 0) {
-            break;
-          }
-        } else {
-          // indicates we are clearing an existing wave
-          msg.id = AOWAVE;
-          msg.u.aowave.id = id;
-          msg.u.aowave.nsamples = 0;
-          sendToRT(msg);
-        }
-        cmd_error = false;        
-      }
-    } else if (line.find("GET STATE MACHINE") == 0) { // GET STATE MACHINE
-      std::ostringstream s;
-      s << fsm_id << "\n";      
-      sockSend(s.str());
-      cmd_error = false;
-    } else if (line.find("GET NUM STATE MACHINES") == 0) { // GET NUM STATE MACHINES
-      std::ostringstream s;
-      s << NUM_STATE_MACHINES << "\n";      
-      sockSend(s.str());
-      cmd_error = false;
-    } else if (line.find("SET STATE MACHINE") == 0) { // SET STATE MACHINE
-      // determine param
-      std::string::size_type pos = line.find_first_of("0123456789");
-      if (pos != std::string::npos) {
-        std::istringstream s(line.substr(pos));
-        unsigned in_id = NUM_STATE_MACHINES;
-        s >> in_id;
-        if (in_id < NUM_STATE_MACHINES) {
-          cmd_error = false;
-          fsm_id = in_id;
-        }
-      }
-    }
+bool Connection::sendMatrixText(const Matrix & m)
+{
+  std::ostringstream os;
+  os << "MATRIX " << m.rows() << " " << m.cols() << std::endl; 
+  sockSend(os.str());
 
-    if (cmd_error) {
-      sockSend("ERROR\n"); 
-    } else {
-      sockSend("OK\n"); 
-    }
+  if (!batching) {
+    std::string line = sockReceiveLine(); // wait for "READY" from client
+    if (line.find("READY") == std::string::npos) return false;
+  }
+  return sockSend(m.buf(), m.bufSize(), true) == (int)m.bufSize();
+}
+
+void Connection::doHalt()
+{
+  if ( ! readStatus(fsm_id).paused ) 
+    sendToRT(PAUSEUNPAUSE);
+}
+
+void Connection::doRun()
+{
+  if ( readStatus(fsm_id).paused ) 
+    sendToRT(PAUSEUNPAUSE);
+}
+
+void Connection::doTrigSound(int trigmask)
+{
+  msg->id = FORCESOUND;
+  msg->u.forced_triggers = trigmask;
+  sendToRT(*msg);
+}
+
+void Connection::doBypassDout(int bypassmask)
+{
+  msg->id = FORCEOUTPUT;
+  msg->u.forced_outputs = bypassmask;
+  sendToRT(*msg);
+}
 
+bool Connection::doForceState(unsigned forced_state)
+{
+  unsigned rows, cols;
+  getFSMSizeFromRT(rows, cols);
+  if (forced_state >= rows) return false; // ensure legal state here..
+  msg->id = FORCESTATE;
+  msg->u.forced_state = forced_state;
+  sendToRT(*msg);
+  return true;
+}
+
+bool Connection::getStateMatrix(Matrix & m)
+{
+  unsigned rows, cols;
+  getFSMSizeFromRT(rows, cols);
+  m = Matrix(rows, cols);
+  return downloadMatrix(m);
+}
+
+bool Connection::getEvents(int first, int last, Matrix & mat)
+{
+  // query the count first to check sanity
+  int n_trans = readStatus(fsm_id).transition_count;
+        
+  if (first < 0 || first > last || last >= n_trans) return false;
+
+  unsigned num_input_events = getNumInputEventsFromRT();
+  int desired = last-first+1, received = 0, ct = 0;
+  mat = Matrix(desired, 5);
+
+  if (histShm) {
+    std::vector<StateTransition> trans(desired);
+    if (!readHistory(fsm_id, first, desired, &trans[0])) return false;
+    for (ct = 0; ct < desired; ++ct) 
+      transitionToRow(trans[ct], num_input_events, mat, ct);
+    return true;
   }
-    
-  log(1) << "Connection to host " << remoteHost << " ended after " << connectionTimer.elapsed() << " seconds." << std::endl; log(0);
-    
 
-  ::shutdown(sock, SHUT_RDWR);
-  ::close(sock);
-  sock = -1;
-  thread_running = false;
-  log(1) << " thread exit." << std::endl; log(0);
-  return 0;
+  // keep 'downloading' the matrix from RT until we get all the transitions we require
+  while (received < desired) {
+    msg->id = TRANSITIONS;
+    msg->u.transitions.num = desired - received;
+    msg->u.transitions.from = first + received;
+    sendToRT(*msg);
+    received += (int)msg->u.transitions.num;              
+    for (int i = 0; i < (int)msg->u.transitions.num; ++i, ++ct) 
+      transitionToRow(msg->u.transitions.transitions[i], num_input_events, mat, ct);
+  }
+  return true;
+}
+
+void Connection::transitionToRow(const StateTransition & t, unsigned num_input_events, Matrix & mat, int row)
+{
+  mat.at(row, 0) = t.previous_state;
+  // 2^event_id, as a double since there can be more than 32 event columns
+  mat.at(row, 1) = std::ldexp(1.0, t.event_id > -1 ? t.event_id : int(num_input_events));
+  mat.at(row, 2) = static_cast<double>(t.ts/1000) / 1000000.0; /* convert us to seconds */
+  mat.at(row, 3) = t.state;
+  mat.at(row, 4) = static_cast<double>(t.ext_ts/1000) / 1000000.0;
+}
+
+bool Connection::startDAQ(unsigned chanMask, int rangeMin, int rangeMax)
+{
+  unsigned nChans = 0;
+  for (unsigned ch = 0; ch < sizeof(chanMask)*8; ++ch) 
+    if (chanMask & (0x1<<ch)) ++nChans;
+  msg->id = STARTDAQ;
+  msg->u.start_daq.chan_mask = chanMask;
+  msg->u.start_daq.range_min = rangeMin;
+  msg->u.start_daq.range_max = rangeMax;
+  msg->u.start_daq.started_ok = 0;
+  sendToRT(*msg);
+  if (!msg->u.start_daq.started_ok) {
+    log(1) << "RT Task refused to do start a DAQ task -- probably invalid parameters are to blame" << std::endl; log(0, AsyncLog::Error); 
+    return false;
+  }
+  pthread_mutex_lock(&fsms[fsm_id].daqLock);
+  fsms[fsm_id].daqNumChans = nChans;
+  fsms[fsm_id].daqRing.configure(nChans);
+  fsms[fsm_id].daqMaxData = msg->u.start_daq.maxdata;
+  //fsms[fsm_id].daqRangeMin = msg->u.start_daq.range_min/1e6;
+  //fsms[fsm_id].daqRangeMax = msg->u.start_daq.range_max/1e6;
+  pthread_mutex_unlock(&fsms[fsm_id].daqLock);
+  return true;
+}
+
+void Connection::stopDAQ()
+{
+  sendToRT(STOPDAQ);
+  //fifoReadAllAvail(fifo_daq); // discard fifo data for stopped scan
+  // FIXME avoid race coditions with daq thread
+  pthread_mutex_lock(&fsms[fsm_id].daqLock);
+  fsms[fsm_id].daqRing.tail = fsms[fsm_id].daqRing.head;
+  pthread_mutex_unlock(&fsms[fsm_id].daqLock);
+}
+
+void Connection::setAOWave(unsigned id, unsigned aoline, unsigned loop, const Matrix *mat)
+{
+  if (!mat) {
+    // indicates we are clearing an existing wave
+    msg->id = AOWAVE;
+    msg->u.aowave.id = id;
+    msg->u.aowave.nsamples = 0;
+    sendToRT(*msg);
+    return;
+  }
+  const unsigned m = mat->rows(), n = mat->cols();
+  msg->id = GETAOMAXDATA;
+  sendToRT(*msg);
+  fsms[fsm_id].aoMaxData = msg->u.ao_maxdata;
+  msg->id = AOWAVE;
+  msg->u.aowave.id = id;
+  msg->u.aowave.aoline = aoline;
+  msg->u.aowave.loop = loop;
+  // scale data from [-1,1] -> [0,aoMaxData]
+  for (unsigned i = 0; i < n && i < AOWAVE_MAX_SAMPLES; ++i) {
+    msg->u.aowave.samples[i] = static_cast<unsigned short>(((mat->at(0, i) + 1.0) / 2.0) * fsms[fsm_id].aoMaxData);
+    if (m > 1)
+      msg->u.aowave.evt_cols[i] = static_cast<signed char>(mat->at(1, i));
+    else
+      msg->u.aowave.evt_cols[i] = -1;
+  }
+  msg->u.aowave.nsamples = n;
+  // send to kernel
+  sendToRT(*msg);
 }
 
-void ConnectionThread::sendToRT(ShmMsg & msg) // note param name masks class member
+void Connection::sendToRT(ShmMsg & msg) // note param name masks class member
 {
-  MutexLocker locker(fsms[fsm_id].msgFifoLock);
+  FSMSpecific & fsm = fsms[fsm_id];
+  Timer rtTimer;
+  MutexLocker locker(fsm.msgFifoLock);
+  fsm.rtLockWait->recordSecs(rtTimer.elapsed());
+  rtTimer.reset();
 
-  std::memcpy(const_cast<ShmMsg *>(&shm->msg[fsm_id]), &msg, sizeof(msg));
+  shmMsgCopy(SHM_MSG(shm, fsm_id), &msg, SHM_MSG_REQUEST);
 
   FifoNotify_t dummy = 1;    
     
@@ -959,7 +2520,8 @@ void ConnectionThread::sendToRT(ShmMsg & msg) // note param name masks class mem
   // now wait synchronously for a reply from the rt-process.. 
   if ( (err = ::read(fsms[fsm_id].fifo_in, &dummy, sizeof(dummy))) == sizeof(dummy) ) { 
     /* copy the reply from the shm back to the user-supplied msg buffer.. */
-    std::memcpy(&msg, const_cast<struct ShmMsg *>(&shm->msg[fsm_id]), sizeof(msg));
+    shmMsgCopy(&msg, SHM_MSG(shm, fsm_id), SHM_MSG_REPLY);
+    fsm.rtRoundTrip->recordSecs(rtTimer.elapsed());
   } else if (err < 0) { 
     throw Exception(std::string("INTERNAL ERROR: Reading of input fifo got an error: ") + strerror(errno));
   } else {
@@ -968,7 +2530,7 @@ void ConnectionThread::sendToRT(ShmMsg & msg) // note param name masks class mem
   // NB: mutex locker destructor unlocks msgFifoLock here..
 }
 
-void ConnectionThread::sendToRT(ShmMsgID cmd)
+void Connection::sendToRT(ShmMsgID cmd)
 {
   switch (cmd) {
   case RESET:
@@ -977,8 +2539,10 @@ void ConnectionThread::sendToRT(ShmMsgID cmd)
   case READYFORTRIAL:
   case FORCETIMESUP:
   case STOPDAQ:
-    msg.id = cmd;
-    sendToRT(msg);
+    msg->id = cmd;
+    sendToRT(*msg);
+    // RT has no state matrix any more, so there's no cached one to report
+    if (cmd == RESET || cmd == INVALIDATE) fsmCache.setCurrent(fsm_id, 0);
     break;
   default:
     throw Exception("INTERNAL ERRROR: sendToRT(ShmMsgID) called with an inappropriate command ID!");
@@ -986,95 +2550,105 @@ void ConnectionThread::sendToRT(ShmMsgID cmd)
   }
 }
 
-void ConnectionThread::getFSMSizeFromRT(unsigned & r, unsigned & c)
+void Connection::getFSMSizeFromRT(unsigned & r, unsigned & c)
 {
-  msg.id = GETFSMSIZE;
-  sendToRT(msg);
-  r = msg.u.fsm_size[0];
-  c = msg.u.fsm_size[1];
+  msg->id = GETFSMSIZE;
+  sendToRT(*msg);
+  r = msg->u.fsm_size[0];
+  c = msg->u.fsm_size[1];
 }
 
-unsigned ConnectionThread::getNumInputEventsFromRT(void)
+unsigned Connection::getNumInputEventsFromRT(void)
 {
-  msg.id = GETNUMINPUTEVENTS;
-  sendToRT(msg);
-  return msg.u.num_input_events;
+  msg->id = GETNUMINPUTEVENTS;
+  sendToRT(*msg);
+  return msg->u.num_input_events;
 }
 
-int ConnectionThread::sockSend(const std::string & str) 
+int Connection::sockSend(const std::string & str) 
 {
   return sockSend(str.c_str(), str.length());
 }
 
-int ConnectionThread::sockSend(const void *buf, size_t len, bool is_binary, int flags)
+int Connection::sockSend(const void *buf, size_t len, bool is_binary, int flags)
 {
   const char *charbuf = static_cast<const char *>(buf);
   if (!is_binary) {
-    std::stringstream ss;
-    ss << "Sending: " << charbuf; 
-    if (charbuf[len-1] != '\n') ss << std::endl;
-    log(1) << ss.str() << std::flush; log(0);
-  } else {
-    log(1) << "Sending binary data of length " << len << std::endl; log(0);  
+    if (AsyncLog::enabled(AsyncLog::Debug))
+      AsyncLog::put(AsyncLog::Debug, "[Connection %ld] Sending: ", charbuf, len, myid);
+  } else 
+    AsyncLog::logf(AsyncLog::Debug, "[Connection %ld] Sending binary data of length %lu", myid, len);
+  if (corked) {
+    outbuf.append(charbuf, len);
+    return len;
   }
   int ret = ::send(sock, buf, len, flags);
   if (ret < 0) {
-    log(1) << "ERROR returned from send: " << strerror(errno) << std::endl; log(0);
+    log(1) << "ERROR returned from send: " << strerror(errno) << std::endl; log(0, AsyncLog::Error);
   } else if (ret != (int)len) {
-    log(1) << "::send() returned the wrong size; expected " << len << " got " << ret << std::endl; log(0);
+    log(1) << "::send() returned the wrong size; expected " << len << " got " << ret << std::endl; log(0, AsyncLog::Error);
   }
   return ret;
 }
 
+bool Connection::flushOutput()
+{
+  if (outbuf.empty()) return true;
+  std::string out;
+  out.swap(outbuf);
+  return sockSend(out.data(), out.length(), true) == (int)out.length();
+}
+
 // Note: trims trailing whitespace!  If string is empty, connection error!
-std::string ConnectionThread::sockReceiveLine()
+std::string Connection::sockReceiveLine()
 {
-#define MAX_LINE 2048
-  char buf[MAX_LINE] = { 0 };
-  int ret, slen = 0;
-  std::string rets = "";
-
-  // keep looping until we fill the buffer, or we get a \n
-  // eg: slen < MAXLINE and (if nread then buf[slen-1] must not equal \n)
-  while ( slen < MAX_LINE && (!slen || buf[slen-1] != '\n') ) {
-    ret = ::recv(sock, buf+slen, MAX_LINE-slen, 0);
-    if (ret <= 0) break;
-    slen += ret;
-  }
-  if (slen >= MAX_LINE) slen = MAX_LINE-1;
-  if (slen) buf[slen] = 0; // add NUL
+  std::string::size_type pos;
+  // usually the reactor already buffered the whole line, otherwise block for the rest of it
+  while ( (pos = inbuf.find('\n')) == std::string::npos && inbuf.length() < MAX_LINE && !eof ) {
+    char buf[MAX_LINE];
+    int ret = ::recv(sock, buf, sizeof(buf), 0);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) { eof = true; break; }
+    inbuf.append(buf, ret);
+  }
+  std::string::size_type len = pos != std::string::npos ? pos+1 : MIN(inbuf.length(), MAX_LINE-1);
+  std::string rets = inbuf.substr(0, len);
+  inbuf.erase(0, len);
   // now, trim trailing spaces
-  while(slen && ::isspace(buf[slen-1])) { buf[--slen] = 0; }
-  rets = buf;
-  log(1) << "Got: " << rets << std::endl; log(0);
+  while (rets.length() && ::isspace(rets[rets.length()-1])) rets.erase(rets.length()-1);
+  AsyncLog::logs(AsyncLog::Debug, "[Connection %ld] Got: ", rets, myid);
   return rets;
 }
 
 
-int ConnectionThread::sockReceiveData(void *buf, int size, bool is_binary)
+int Connection::sockReceiveData(void *buf, int size, bool is_binary)
 {
-  int nread = 0;
+  // consume whatever the reactor already buffered first
+  int nread = MIN((int)inbuf.length(), size);
+  if (nread) {
+    inbuf.copy(static_cast<char *>(buf), nread);
+    inbuf.erase(0, nread);
+  }
 
-  while (nread < size) {
+  while (nread < size && (is_binary || !nread)) {
     int ret = ::recv(sock, (char *)(buf) + nread, size - nread, 0);
     
     if (ret < 0) {
-      log(1) << "ERROR returned from recv: " << strerror(errno) << std::endl; log(0);
+      log(1) << "ERROR returned from recv: " << strerror(errno) << std::endl; log(0, AsyncLog::Error);
       return ret;
     } else if (ret == 0) {
-      log(1) << "ERROR in recv, connection probably closed." << std::endl; log(0);
+      log(1) << "ERROR in recv, connection probably closed." << std::endl; log(0, AsyncLog::Error);
       return ret;
     } 
     nread += ret;
-    if (!is_binary) break;
   }
 
   if (!is_binary) {
     char *charbuf = static_cast<char *>(buf);
     charbuf[size-1] = 0;
-    log(1) << "Got: " << charbuf << std::endl; log(0);
+    AsyncLog::logs(AsyncLog::Debug, "[Connection %ld] Got: ", charbuf, myid);
   } else {
-    log(1) << "Got: " << nread << " bytes." << std::endl; log(0);
+    AsyncLog::logf(AsyncLog::Debug, "[Connection %ld] Got: %ld bytes.", myid, nread);
     if (nread != size) {
       log(1) << "INFO ::recv() returned the wrong size; expected " << size << " got " << nread << std::endl; log(0);
     }
@@ -1082,7 +2656,8 @@ int ConnectionThread::sockReceiveData(void *buf, int size, bool is_binary)
   return nread;
 }
 
-bool ConnectionThread::uploadMatrix(const Matrix & m, 
+template <class M>
+bool Connection::uploadMatrix(const M & m, 
                                     unsigned numEvents, 
                                     unsigned numSchedWaves, 
                                     const std::string & inChanType,
@@ -1091,70 +2666,86 @@ bool ConnectionThread::uploadMatrix(const Matrix & m,
                                     unsigned state0_fsm_swap)
 {
   // Matrix is XX rows by num_input_evts+4(+1) columns, cols 0-num_input_evts are inputs (cin, cout, lin, lout, rin, rout), 6 is timeout-state,  7 is a 14DIObits mask, 8 is a 7AObits, 9 is timeout-time, and 10 is the optional sched_wave
-  log(1) << "Matrix is:" << std::endl; log(0);
   int i,j;
-  for (i = 0; i < m.rows(); ++i) {
-    log(1);
-    for (j = 0; j < m.cols(); ++j)
-      ::log() << m.at(i,j) << " " ;
-    ::log() << std::endl; 
-    log(0);
+  if (AsyncLog::enabled(AsyncLog::Trace)) {
+    log(1) << "Matrix is:" << std::endl; log(0, AsyncLog::Trace);
+    for (i = 0; i < m.rows(); ++i) {
+      log(1);
+      for (j = 0; j < m.cols(); ++j)
+        ::log() << m.at(i,j) << " " ;
+      log(0, AsyncLog::Trace);
+    }
   }
   
   std::vector<OutputSpec> outSpec = parseOutputSpecStr(outputSpecStr);
 
   const int numFixedCols = 2; // timeout_state and timeout_us
 
-  if (m.rows() == 0 || m.cols() < numFixedCols || m.rows()*m.cols() > (int)FSM_FLAT_SIZE) {
-    log(1) << "Matrix needs to be at least 1x2 and no larger than " << FSM_FLAT_SIZE << " total elements! Error!" << std::endl; log(0);
+  if (m.rows() == 0 || m.cols() < numFixedCols || (!isSparse(m) && m.rows()*m.cols() > (int)FSM_FLAT_SIZE)) {
+    log(1) << "Matrix needs to be at least 1x2 and no larger than " << FSM_FLAT_SIZE << " total elements! Error!" << std::endl; log(0, AsyncLog::Error);
+    return false;
+  }
+  if (m.rows() > USHRT_MAX) {
+    log(1) << "Matrix has " << m.rows() << " rows, at most " << USHRT_MAX << " are supported! Error!" << std::endl; log(0, AsyncLog::Error);
+    return false;
+  }
+  if (m.cols() > USHRT_MAX) { // a sparse matrix's cols aren't bounded by FSM_FLAT_SIZE
+    log(1) << "Matrix has " << m.cols() << " columns, at most " << USHRT_MAX << " are supported! Error!" << std::endl; log(0, AsyncLog::Error);
     return false;
   }
   const unsigned requiredCols = numEvents + numFixedCols + outSpec.size();
   if (m.cols() < (int)requiredCols ) {
-    log(1) << "Matrix has the wrong number of columns: " << m.cols() << " when it actually needs events(" << numEvents << ") + fixed(" << numFixedCols << ") + outputs(" <<  outSpec.size() << ") = " << requiredCols << " columns! Error!" << std::endl; log(0);
+    log(1) << "Matrix has the wrong number of columns: " << m.cols() << " when it actually needs events(" << numEvents << ") + fixed(" << numFixedCols << ") + outputs(" <<  outSpec.size() << ") = " << requiredCols << " columns! Error!" << std::endl; log(0, AsyncLog::Error);
     return false;    
   }
+  if (numEvents > FSM_MAX_IN_EVENTS) {
+    log(1) << "Matrix has too many input event columns (" << numEvents << ").  The maximum number of input event columns is " << FSM_MAX_IN_EVENTS << "\n"; log(0, AsyncLog::Error);
+    return false;
+  }
   if (outSpec.size() > FSM_MAX_OUT_EVENTS) {
-    log(1) << "Matrix has too many output columns (" << outSpec.size() << ").  The maximum number of output columns is " << FSM_MAX_OUT_EVENTS << "\n"; log(0);
+    log(1) << "Matrix has too many output columns (" << outSpec.size() << ").  The maximum number of output columns is " << FSM_MAX_OUT_EVENTS << "\n"; log(0, AsyncLog::Error);
     return false;
   }
-  msg.id = FSM;
-  ::memset(&msg.u.fsm, 0, sizeof(msg.u.fsm)); // zero memory since some code assumes unset values are zero?
+  // build it straight into a slot of the FSM pool if we can, so that RT can
+  // just take it, otherwise in msg for RT to copy
+  MutexLocker ul(fsms[fsm_id].uploadLock);
+  PoolSlot slot(!readStatus(fsm_id).pending_swap);
+  FSMBlob & blob = slot.blob() ? *slot.blob() : msg->u.fsm;
+  // zero the header since some code assumes unset values are zero? (all the used cells get written below)
+  ::memset(&blob, 0, FSMBLOB_HDR_SIZE);
   
   // setup matrix here..
-  msg.u.fsm.n_rows = m.rows(); // note this will get set to inpRow later in this function via the alias nRows...
-  msg.u.fsm.n_cols = m.cols();
-  unsigned short & nRows = msg.u.fsm.n_rows; // alias used for below code, will get decremented once we pop out the sched wave spec that is in our matrix and the input event spec that is in our matrix..
+  blob.n_rows = m.rows(); // note this will get set to inpRow later in this function via the alias nRows...
+  blob.n_cols = m.cols();
+  unsigned short & nRows = blob.n_rows; // alias used for below code, will get decremented once we pop out the sched wave spec that is in our matrix and the input event spec that is in our matrix..
 
   // seetup in_chan_type
-  if ( (msg.u.fsm.routing.in_chan_type = (inChanType == "ai" ? AI_TYPE : (inChanType == "dio" ? DIO_TYPE : UNKNOWN_TYPE))) == UNKNOWN_TYPE ) {
-    log(1) << "Matrix specification is using an unknown in_chan_type of " << inChanType << "! Error!" << std::endl; log(0);
+  if ( (blob.routing.in_chan_type = (inChanType == "ai" ? AI_TYPE : (inChanType == "dio" ? DIO_TYPE : UNKNOWN_TYPE))) == UNKNOWN_TYPE ) {
+    log(1) << "Matrix specification is using an unknown in_chan_type of " << inChanType << "! Error!" << std::endl; log(0, AsyncLog::Error);
     return false;        
   }
   
-  msg.u.fsm.ready_for_trial_jumpstate = readyForTrialJumpState;
+  blob.ready_for_trial_jumpstate = readyForTrialJumpState;
   
-  msg.u.fsm.routing.num_evt_cols = numEvents;
-  msg.u.fsm.routing.num_out_cols = outSpec.size();
-  for (unsigned it = 0; it < msg.u.fsm.routing.num_out_cols; ++it) {
+  blob.routing.num_evt_cols = numEvents;
+  blob.routing.num_out_cols = outSpec.size();
+  for (unsigned it = 0; it < blob.routing.num_out_cols; ++it) {
     // put output spec into fsm blob..
-    memcpy(reinterpret_cast<void *>(&msg.u.fsm.routing.output_routing[it]),
+    memcpy(reinterpret_cast<void *>(&blob.routing.output_routing[it]),
            reinterpret_cast<void *>(&outSpec[it]),
            sizeof(struct OutputSpec));
   }
 
   // compute scheduled waves cells used
-  int swCells = numSchedWaves * 7; // each sched wave uses 7 cells.
-  int swRows = (swCells / m.cols()) + (swCells % m.cols() ? 1 : 0);
-  int swFirstRow = (int)nRows - swRows;
-  int inpRow = swFirstRow - 1;
-  if (inpRow < 0 || swFirstRow < 0 || inpRow < 0) {
-    log(1) << "Matrix specification has invalid number of rows! Error!" << std::endl; log(0);
+  int inpRow = numStateRows(nRows, m.cols(), numSchedWaves);
+  int swFirstRow = inpRow + 1;
+  if (inpRow < 0) {
+    log(1) << "Matrix specification has invalid number of rows! Error!" << std::endl; log(0, AsyncLog::Error);
     return false;            
   }
   
   // first clear the input routing array, by setting mappings to null (-1)
-  for (i = 0; i < FSM_MAX_IN_EVENTS; ++i) msg.u.fsm.routing.input_routing[i] = -1;
+  for (i = 0; i < FSM_MAX_IN_EDGES; ++i) blob.routing.input_routing[i] = -1;
   // compute input mapping from input spec vector
   int maxChan = -1, minChan = INT_MAX;
   for (i = 0; i < (int)numEvents && i < (int)m.cols() && i < FSM_MAX_IN_EVENTS; ++i) {
@@ -1166,14 +2757,14 @@ bool ConnectionThread::uploadMatrix(const Matrix & m,
     maxChan = maxChan < chan ? chan : maxChan;
     minChan = minChan > chan ? chan : minChan;
     if (chan >= FSM_MAX_IN_CHANS) {
-      log(1) << "Matrix specification is using a channel id of " << chan << " which is out of range!  We only support up to " << FSM_MAX_IN_CHANS << " channels! Error!" << std::endl; log(0);
+      log(1) << "Matrix specification is using a channel id of " << chan << " which is out of range!  We only support up to " << FSM_MAX_IN_CHANS << " channels! Error!" << std::endl; log(0, AsyncLog::Error);
       return false;
     }
-    msg.u.fsm.routing.input_routing[chan*2 + falling_offset] = i;
+    blob.routing.input_routing[chan*2 + falling_offset] = i;
   }
   if (!numEvents) minChan = 0, maxChan = -1;
-  msg.u.fsm.routing.num_in_chans = maxChan-minChan+1;
-  msg.u.fsm.routing.first_in_chan = minChan;
+  blob.routing.num_in_chans = maxChan-minChan+1;
+  blob.routing.first_in_chan = minChan;
   
   // rip out the sched wave spec in the matrix, use it to
   // populate fields in FSMBlob::Routing  
@@ -1183,39 +2774,39 @@ bool ConnectionThread::uploadMatrix(const Matrix & m,
     NEXT_COL();
     int id = (int)m.at(row, col);
     if (id >= (int)FSM_MAX_SCHED_WAVES || id < 0) {
-      log(1) << "Alarm/Sched Wave specification has invalid id: " << id <<"! Error!" << std::endl; log(0);
+      log(1) << "Alarm/Sched Wave specification has invalid id: " << id <<"! Error!" << std::endl; log(0, AsyncLog::Error);
       return false;
     }
-    SchedWave &w = msg.u.fsm.sched_waves[id];
+    SchedWave &w = blob.sched_waves[id];
     NEXT_COL();
     int in_evt_col = (int)m.at(row, col);
     if (in_evt_col >= 0) {
       if (in_evt_col >= (int)numEvents) {
-        log(1) << "Alarm/Sched Wave specification has invalid IN event column routing: " << in_evt_col <<"! Error!" << std::endl; log(0);
+        log(1) << "Alarm/Sched Wave specification has invalid IN event column routing: " << in_evt_col <<"! Error!" << std::endl; log(0, AsyncLog::Error);
         return false;
       }
-      msg.u.fsm.routing.sched_wave_input[id*2] = in_evt_col;
+      blob.routing.sched_wave_input[id*2] = in_evt_col;
     } else {
-      msg.u.fsm.routing.sched_wave_input[id*2] = -1;
+      blob.routing.sched_wave_input[id*2] = -1;
     }
     NEXT_COL();
     int out_evt_col = (int)m.at(row, col);
     if (out_evt_col >= 0) {
       if (out_evt_col >= (int)numEvents) {
-        log(1) << "Alarm/Sched Wave specification has invalid OUT event column routing: " << out_evt_col <<"! Error!" << std::endl; log(0);
+        log(1) << "Alarm/Sched Wave specification has invalid OUT event column routing: " << out_evt_col <<"! Error!" << std::endl; log(0, AsyncLog::Error);
         return false;
       }
-      msg.u.fsm.routing.sched_wave_input[id*2+1] = out_evt_col;
+      blob.routing.sched_wave_input[id*2+1] = out_evt_col;
     } else {
-      msg.u.fsm.routing.sched_wave_input[id*2+1] = -1;
+      blob.routing.sched_wave_input[id*2+1] = -1;
     }
     NEXT_COL();
     int dio_line = (int)m.at(row, col);
     if (dio_line >= 0 && dio_line >= FSM_MAX_OUT_CHANS) {
-      log(1) << "Alarm/Sched Wave specification has invalid DIO line: " << dio_line <<"! Error!" << std::endl; log(0);
+      log(1) << "Alarm/Sched Wave specification has invalid DIO line: " << dio_line <<"! Error!" << std::endl; log(0, AsyncLog::Error);
       return false;      
     }
-    msg.u.fsm.routing.sched_wave_output[id] = dio_line;
+    blob.routing.sched_wave_output[id] = dio_line;
     NEXT_COL();
     w.preamble_us = static_cast<uint64>(m.at(row,col)*1e6);
     NEXT_COL();
@@ -1227,9 +2818,42 @@ bool ConnectionThread::uploadMatrix(const Matrix & m,
 #undef NEXT_COL
 
   nRows = inpRow;
-  for (i = 0; i < (int)nRows; ++i) {
+  if (isSparse(m)) {
+    // Only the input event and timeout state cells that leave the state
+    // become pairs, see FSM_SPARSE_PAIRS()
+    FSMBlob & fsm = blob;
+    fsm.sparse = 1;
+    const unsigned fixedCols = FSM_SPARSE_FIXED_COLS(&fsm);
+    if (FSMBlobCells(1, nRows, m.cols(), numEvents, 0) > FSM_FLAT_SIZE) {
+      log(1) << "Sparse matrix of " << nRows << " states needs more than " << FSM_FLAT_SIZE << " cells! Error!" << std::endl; log(0, AsyncLog::Error);
+      return false;
+    }
+    const unsigned long maxPairs = FSM_FLAT_SIZE - FSMBlobCells(1, nRows, m.cols(), numEvents, 0);
+    unsigned *row_ptr = FSM_SPARSE_ROW_PTR(&fsm), *pairs = FSM_SPARSE_PAIRS(&fsm), num_pairs = 0;
+    for (i = 0; i < (int)nRows; ++i) {
+      unsigned *fixed = FSMTimeoutCell(&fsm, i);
+      fixed[0] = static_cast<unsigned>(m.at(i, numEvents+1)*1000000.0); // timeout_s to timeout_us
+      for (j = 1; j < (int)fixedCols; ++j)
+        fixed[j] = static_cast<unsigned>(m.at(i, numEvents+1+j));
+      row_ptr[i] = num_pairs;
+      for (j = 0; j <= (int)numEvents; ++j) {
+        const double next = m.at(i, j);
+        if (next == i) continue;
+        if (next < 0 || next >= nRows) {
+          log(1) << "Sparse matrix state " << i << " goes to nonexistent state " << next << " in column " << j << "! Error!" << std::endl; log(0, AsyncLog::Error);
+          return false;
+        }
+        if (num_pairs >= maxPairs) {
+          log(1) << "Sparse matrix has too many transitions to fit in " << FSM_FLAT_SIZE << " cells! Error!" << std::endl; log(0, AsyncLog::Error);
+          return false;
+        }
+        pairs[num_pairs++] = FSM_SPARSE_PAIR(j, static_cast<unsigned>(next));
+      }
+    }
+    row_ptr[nRows] = fsm.num_pairs = num_pairs;
+  } else for (i = 0; i < (int)nRows; ++i) {
     struct State state;
-    GET_STATE(&msg.u.fsm, &state, i);
+    GET_STATE(&blob, &state, i);
     for (j = 0; j < m.cols(); ++j) {
       // While appearing like we are breaking the input array with 
       // indices greater than state->n_inputs, this actually works due to:
@@ -1237,7 +2861,7 @@ bool ConnectionThread::uploadMatrix(const Matrix & m,
       // FSMBlob row..
       //
       // Note also how we don't even bother to set the other fields in struct
-      // State as they wouldn't affect the real msg.u.fsm anyway, only
+      // State as they wouldn't affect the real blob anyway, only
       // State::column (and State::input) does point to the actual memory 
       // (the other fields in struct state merely store copies).
       //
@@ -1246,35 +2870,111 @@ bool ConnectionThread::uploadMatrix(const Matrix & m,
     }
   }
 
-  msg.u.fsm.wait_for_jump_to_state_0_to_swap_fsm = state0_fsm_swap;
+  blob.wait_for_jump_to_state_0_to_swap_fsm = state0_fsm_swap;
+
+  // keep our own copy for the cache: once it's sent, msg gets reused and
+  // the slot is RT's, and it only goes in the cache if RT takes it
+  const uint64 hash = FSMCache::hash(blob);
+  const char *p = reinterpret_cast<const char *>(&blob);
+  std::vector<char> copy(p, p + FSMBlobUsedSize(&blob));
 
-  sendToRT(msg);
+  if (!sendMatrix(slot)) return false;
+  fsmCache.insert(fsm_id, hash, copy);
+  return true;
+}
+
+bool Connection::uploadCachedMatrix(uint64 hash, unsigned state0_fsm_swap)
+{
+  MutexLocker ul(fsms[fsm_id].uploadLock);
+  PoolSlot slot(!readStatus(fsm_id).pending_swap);
+  FSMBlob & blob = slot.blob() ? *slot.blob() : msg->u.fsm;
+  if (!fsmCache.lookup(hash, blob)) {
+    log(1) << "State matrix " << std::hex << hash << std::dec << " is not in the cache, it needs to be sent again with SET STATE MATRIX." << std::endl; log(0, AsyncLog::Error);
+    return false;
+  }
+  blob.wait_for_jump_to_state_0_to_swap_fsm = state0_fsm_swap;
+  if (!sendMatrix(slot)) return false;
+  fsmCache.setCurrent(fsm_id, hash);
+  return true;
+}
 
+bool Connection::sendMatrix(PoolSlot & slot)
+{
+  if (slot.blob()) {
+    msg->id = FSMSLOT;
+    msg->u.fsm_slot = slot.handOver();
+  } else
+    msg->id = FSM;
+  sendToRT(*msg);
+  if (!msg->u.fsm_accepted) {
+    // RT threw it out and is left running the empty FSM
+    fsmCache.setCurrent(fsm_id, 0);
+    log(1) << "RT refused the new state matrix for FSM " << fsm_id << ", see the kernel log. Error!" << std::endl; log(0, AsyncLog::Error);
+    return false;
+  }
   return true;
 }
 
-bool ConnectionThread::downloadMatrix(Matrix & m)
+bool Connection::patchMatrix(const Matrix & cells)
+{
+  MutexLocker ul(fsms[fsm_id].uploadLock); // RT may need a pool slot for it, see PoolSlot
+  // the shape of what we patch, so that RT refuses it if a new FSM came in since
+  const FSMStatus st = readStatus(fsm_id);
+  const unsigned rows = st.fsm_rows, cols = st.fsm_cols, numEvents = st.fsm_evt_cols;
+  if (!rows || !cols) {
+    log(1) << "There is no state matrix to patch! Error!" << std::endl; log(0, AsyncLog::Error);
+    return false;
+  }
+
+  FSMPatch & p = msg->u.fsm_patch;
+  msg->id = FSMPATCH;
+  p.n_rows = rows;
+  p.n_cols = cols;
+  p.num_evt_cols = numEvents;
+  p.num = cells.rows();
+  for (int i = 0; i < cells.rows(); ++i) {
+    const double r = cells.at(i, 0), c = cells.at(i, 1), v = cells.at(i, 2);
+    if (r < 0 || r >= rows || c < 0 || c >= cols) {
+      log(1) << "Patch cell " << r << "," << c << " is outside the " << rows << "x" << cols << " state matrix! Error!" << std::endl; log(0, AsyncLog::Error);
+      return false;
+    }
+    p.cells[i].row = static_cast<unsigned short>(r);
+    p.cells[i].col = static_cast<unsigned short>(c);
+    // same conversions as uploadMatrix()
+    if (p.cells[i].col == numEvents+1) p.cells[i].value = static_cast<unsigned>(v*1000000.0); // timeout_s to timeout_us
+    else p.cells[i].value = static_cast<unsigned>(v);
+  }
+  sendToRT(*msg);
+  if (p.ok) {
+    fsmCache.setCurrent(fsm_id, 0); // whatever it was, it isn't a cached matrix any more
+  } else {
+    log(1) << "RT refused the state matrix patch, did the state matrix change shape, or is it sparse and the patch changes transitions? Error!" << std::endl; log(0, AsyncLog::Error);
+  }
+  return p.ok;
+}
+
+bool Connection::downloadMatrix(Matrix & m)
 {
-  msg.id = GETVALID;
+  msg->id = GETVALID;
 
-  sendToRT(msg);
+  sendToRT(*msg);
 
-  if (!msg.u.is_valid) {
+  if (!msg->u.is_valid) {
     int i,j;
     for (i = 0; i < m.rows(); ++i)  
       for (j = 0; j < m.cols(); ++j) 
         m.at(i,j) = 0;
-    log(1) << "FSM is invalid, so sending empty matrix for GET STATE MATRIX request." << std::endl; log(0);
+    log(1) << "FSM is invalid, so sending empty matrix for GET STATE MATRIX request." << std::endl; log(0, AsyncLog::Warning);
     return true; // no valid matrix defined  
   }
   
-  msg.id = GETFSM;
-  sendToRT(msg);
+  msg->id = GETFSM;
+  sendToRT(*msg);
 
   // Matrix is ?? rows by ??' columns, cols 0-? are inputs (cin, cout, lin, lout, rin, rout, etc), cols-4 is timeout-state, cols-3 is timeout-time, cols-2 is a 14DIObits mask, and cols-1 is a 7AObits
   
-  if (m.rows() != msg.u.fsm.n_rows || m.cols() != msg.u.fsm.n_cols) {
-    log(1) << "Matrix needs to be " << msg.u.fsm.n_rows << " x " << msg.u.fsm.n_cols << "! Error!" << std::endl << log(0);
+  if (m.rows() != msg->u.fsm.n_rows || m.cols() != msg->u.fsm.n_cols) {
+    log(1) << "Matrix needs to be " << msg->u.fsm.n_rows << " x " << msg->u.fsm.n_cols << "! Error!" << std::endl; log(0, AsyncLog::Error);
     return false;
   }
 
@@ -1283,21 +2983,23 @@ bool ConnectionThread::downloadMatrix(Matrix & m)
 
   for (i = 0;  i < m.rows(); ++i) {
     struct State state;
-    GET_STATE(&msg.u.fsm, &state, i);
+    GET_STATE(&msg->u.fsm, &state, i);
     for (j = 0; j < m.cols(); ++j)
-      m.at(i, j) = static_cast<double>(state.input[j]);    
+      m.at(i, j) = static_cast<double>(FSMCell(&msg->u.fsm, i, j));
 
     // Convert the 2 timeout_state and timeout_us columns -- this code assumes there are 2 more columns after all the input cols
     m.at(i, state.n_inputs) = static_cast<double>(state.timeout_state);
     m.at(i, state.n_inputs+1) = static_cast<double>(state.timeout_us/1000000.0);
   }
   
-  log(1) << "Matrix from RT is:" << std::endl; log(0);
-  for (i = 0; i < m.rows(); ++i) {
-    log(1);
-    for (j = 0; j < m.cols(); ++j)
-      ::log() << m.at(i,j) << " ";
-    ::log() << std::endl; log(0);
+  if (AsyncLog::enabled(AsyncLog::Trace)) {
+    log(1) << "Matrix from RT is:" << std::endl; log(0, AsyncLog::Trace);
+    for (i = 0; i < m.rows(); ++i) {
+      log(1);
+      for (j = 0; j < m.cols(); ++j)
+        ::log() << m.at(i,j) << " ";
+      log(0, AsyncLog::Trace);
+    }
   }
       
   return true;
@@ -1306,24 +3008,24 @@ bool ConnectionThread::downloadMatrix(Matrix & m)
 static void *transNotifyThrWrapper(void *arg)
 {
   pthread_detach(pthread_self());
-  int myfsm = reinterpret_cast<int>(arg);
-  if (myfsm < 0 || myfsm >= NUM_STATE_MACHINES) return 0;
+  int myfsm = static_cast<int>(reinterpret_cast<long>(arg));
+  if (myfsm < 0 || myfsm >= numStateMachines) return 0;
   return fsms[myfsm].transNotifyThrFun();
 }
 
 static void *daqThrWrapper(void *arg)
 {
   pthread_detach(pthread_self());
-  int myfsm = reinterpret_cast<int>(arg);
-  if (myfsm < 0 || myfsm >= NUM_STATE_MACHINES) return 0;
+  int myfsm = static_cast<int>(reinterpret_cast<long>(arg));
+  if (myfsm < 0 || myfsm >= numStateMachines) return 0;
   return fsms[myfsm].daqThrFun();
 }
 
 static void *nrtThrWrapper(void *arg)
 {
   pthread_detach(pthread_self());
-  int myfsm = reinterpret_cast<int>(arg);
-  if (myfsm < 0 || myfsm >= NUM_STATE_MACHINES) return 0;
+  int myfsm = static_cast<int>(reinterpret_cast<long>(arg));
+  if (myfsm < 0 || myfsm >= numStateMachines) return 0;
   return fsms[myfsm].nrtThrFun();
 }
 
@@ -1337,68 +3039,151 @@ void *FSMSpecific::transNotifyThrFun()
     nread = ::read(fifo_trans, buf, bufsz);
     if (nread > 0) {
       unsigned num = nread / sizeof(*buf), i;
-      pthread_mutex_lock(&transNotifyLock);
       for (i = 0; i < num; ++i) {
-        transBuf.push(buf[i]);
+        transRing.push(buf[i]);
         // DEBUG...
         //::log() << "Got transition: " << 
         //    buf[i].previous_state << " " << buf[i].state << " " << buf[i].event_id << " " << buf[i].ts/1000000000.0 << std::endl; ::log(0);
       }
-      pthread_cond_broadcast(&transNotifyCond);
-      pthread_mutex_unlock(&transNotifyLock);
+      recorder.addTransitions(buf, num);
+      wakeNotifyHub();
     }
   }
   delete [] buf;
   return 0;
 }
 
-void ConnectionThread::doNotifyEvents(bool verbose)
-{
-  unsigned long long lastct = 0, ct;
-  bool err = false;
-  FSMSpecific & f = fsms[fsm_id];
-  pthread_mutex_lock(&f.transNotifyLock);
-  lastct = f.transBuf.count();
-  pthread_mutex_unlock(&f.transNotifyLock);
-  while (sock > -1 && !err) {
-    int nready;
-    ::ioctl(sock, FIONREAD, &nready);
-    if (nready > 0) {
-      // socket got data! abort it all since this is outside of protocol spec!
-      char buf[nready > 1024 ? 1024 : nready];
-      sockReceiveData(buf, nready, true); // consume data..
-      sockSend("BYE\n");
-      return;
-    }
-    pthread_mutex_lock(&f.transNotifyLock);
-    while ((ct = f.transBuf.count()) == lastct && sock > -1) {
-      struct timeval now;
-      struct timespec timeout;
-      ::gettimeofday(&now, NULL);
-      // wait 1 second on the condition
-      timeout.tv_sec = now.tv_sec + 1;
-      timeout.tv_nsec = now.tv_usec * 1000;
-      int ret = pthread_cond_timedwait(&f.transNotifyCond, &f.transNotifyLock, &timeout);
-      if (ret == ETIMEDOUT) continue;
-    }
-    // handle overflow condition..
-    if (ct - lastct > f.transBuf.size())  lastct = ct - f.transBuf.size();
-    CircBuf<StateTransition> tb(f.transBuf); // copy the tranition events locally
-    pthread_mutex_unlock(&f.transNotifyLock);  // release the lock
-    if (verbose) { // process each event in verbose mode
-      // operate on local transition events
-      std::stringstream ss;
-      for (unsigned long long i = lastct; i < ct; i++) {
-        struct StateTransition & t = tb[i];
+bool NotifySubscription::parse(const std::string & args)
+{
+  std::istringstream s(args);
+  std::string tok;
+  while (s >> tok) {
+    if (tok == "VERBOSE") {
+      verbose = true;
+    } else if (tok == "STATES" || tok == "EVENTS") {
+      // comma separated list of state numbers or event ids (-1 for timeouts)
+      std::string list;
+      if (!(s >> list)) return false;
+      std::vector<double> ids = splitNumericString(list);
+      if (ids.empty()) return false;
+      const bool isStates = tok == "STATES";
+      std::vector<bool> & filter = isStates ? states : events;
+      for (unsigned i = 0; i < ids.size(); ++i) {
+        int idx = int(ids[i]) + (isStates ? 0 : 1);
+        // event ids go up to FSM_MAX_IN_EVENTS, the timeout column of the widest matrix
+        if (idx < 0 || idx > (isStates ? USHRT_MAX : FSM_MAX_IN_EVENTS+1)) return false;
+        if (filter.size() <= unsigned(idx)) filter.resize(idx+1);
+        filter[idx] = true;
+      }
+    } else if (tok == "INTERVAL") {
+      if (!(s >> intervalMS)) return false;
+    } else if (tok == "QUEUE") {
+      if (!(s >> queueMax) || !queueMax) return false;
+      reportDrops = true;
+    } else 
+      return false;
+  }
+  return true;
+}
+
+int Connection::notifyTimeout() const
+{
+  if (notify.queue.empty() && !notify.dropped) return -1;
+  const double left = notify.intervalMS - notify.lastSent.elapsed()*1000.0;
+  return left > 0. ? int(left) + 1 : 0;
+}
+
+bool Connection::notifyPump()
+{
+  if (daqStream) {
+    // keep going while the socket takes it, so a backlog gets sent in one go
+    while (outbuf.empty() && formatDAQBlock()) 
+      if (!flushNotify()) return false;
+    return flushNotify();
+  }
+  const TransRing & ring = fsms[fsm_id].transRing;
+  if (ring.count() != notifyCursor) {
+    std::vector<StateTransition> trans;
+    notify.dropped += ring.read(notifyCursor, trans);
+    for (unsigned i = 0; i < trans.size(); ++i)
+      if (notify.matches(trans[i])) notify.enqueue(trans[i]);
+  }
+  // format the queue once the last lot is gone and the interval is up, 
+  // meanwhile a slow client's events pile up (bounded) in the queue
+  if (outbuf.empty() && notifyTimeout() == 0) {
+    std::ostringstream ss;
+    if (notify.dropped) {
+      log(1) << "NOTIFY EVENTS client fell behind, it missed " << notify.dropped << " events." << std::endl; log(0, AsyncLog::Warning);
+      if (notify.reportDrops && notify.verbose) ss << "DROPPED " << notify.dropped << "\n";
+      notify.dropped = 0;
+    }
+    if (notify.verbose) { // process each event in verbose mode
+      for (unsigned i = 0; i < notify.queue.size(); ++i) {
+        const StateTransition & t = notify.queue[i];
         ss << t.previous_state << " " << t.state << " " << int(t.event_id) << " " << std::setprecision(12) << std::setw(12) << (static_cast<double>(t.ts)/(double)1000000000.0) << " " << (static_cast<double>(t.ext_ts)/(double)1000000000.0) << std::endl;
       }
-      err = sockSend(ss.str()) < 0;
-    } else {
+    } else if (notify.queue.size()) {
       // do a bulk notify that an event occurred in  no-verbose mode
-      err = sockSend("e") < 0;
+      ss << "e";
     }
-    lastct = ct;
+    notify.queue.clear();
+    notify.lastSent.reset();
+    outbuf = ss.str();
   }
+  return flushNotify();
+}
+
+bool Connection::flushNotify()
+{
+  if (outbuf.empty()) return true;
+  // never block the hub on one client
+  int ret = ::send(sock, outbuf.data(), outbuf.length(), MSG_DONTWAIT|MSG_NOSIGNAL);
+  if (ret < 0) 
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  AsyncLog::logf(AsyncLog::Debug, "[Connection %ld] Sent %ld bytes of events", myid, ret);
+  outbuf.erase(0, ret);
+  return true;
+}
+
+bool Connection::formatDAQBlock()
+{
+  enum { MaxBlockScans = 4096 };
+  FSMSpecific & fsm = fsms[fsm_id];
+  std::vector<long long> ts;
+  std::vector<unsigned short> raw;
+  FSMProtoDAQBlock blk;
+  pthread_mutex_lock(&fsm.daqLock);
+  const unsigned long long lost = fsm.daqRing.read(daqCursor, ts, raw, MaxBlockScans);
+  blk.nchans = fsm.daqRing.nChans;
+  blk.scale = (fsm.daqRangeMax-fsm.daqRangeMin)/double(fsm.daqMaxData);
+  blk.offset = fsm.daqRangeMin;
+  pthread_mutex_unlock(&fsm.daqLock);
+  if (lost) {
+    log(1) << "STREAM DAQ client fell behind, it missed " << lost << " scans." << std::endl; log(0, AsyncLog::Warning);
+  }
+  if (ts.empty()) return false;
+  blk.magic = FSM_DAQ_BLOCK_MAGIC;
+  blk.nscans = ts.size();
+  blk.first_scan = daqCursor - blk.nscans;
+  blk.payload_len = ts.size()*sizeof(ts[0]) + raw.size()*sizeof(raw[0]);
+  outbuf.reserve(sizeof(blk) + blk.payload_len);
+  outbuf.append(reinterpret_cast<const char *>(&blk), sizeof(blk));
+  outbuf.append(reinterpret_cast<const char *>(&ts[0]), ts.size()*sizeof(ts[0]));
+  if (raw.size()) outbuf.append(reinterpret_cast<const char *>(&raw[0]), raw.size()*sizeof(raw[0]));
+  return true;
+}
+
+bool Connection::notifyInput()
+{
+  char buf[1024];
+  int ret = ::recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+  if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) 
+    return true;
+  if (ret > 0) {
+    // socket got data! abort it all since this is outside of protocol spec!
+    ::send(sock, "BYE\n", 4, MSG_DONTWAIT|MSG_NOSIGNAL);
+  }
+  return false;
 }
 
 void *FSMSpecific::daqThrFun()
@@ -1411,15 +3196,23 @@ void *FSMSpecific::daqThrFun()
     nread = ::read(fifo_daq, &buf[0], FIFO_DAQ_SZ);
     int nproc = 0;
     sc = reinterpret_cast<DAQScan *>(&buf[nproc]);
+    pthread_mutex_lock(&daqLock);
+    const unsigned long long head0 = daqRing.head;
     while (nread > 0 && nread-nproc >= int(sizeof(*sc)) && sc->magic == DAQSCAN_MAGIC) {
-      pthread_mutex_lock(&daqLock);
-      DAQScanVec & vec = daqBuf.next();
-      vec.assign(sc, daqMaxData, daqRangeMin, daqRangeMax);
-      daqBuf.push();
+      daqRing.push(sc);
       nproc += sizeof(DAQScan) + sizeof(sc->samps[0])*sc->nsamps;
       sc = reinterpret_cast<DAQScan *>(&buf[nproc]);
-      pthread_mutex_unlock(&daqLock);
     }
+    daqRateScans += daqRing.head - head0;
+    const double secs = daqRateTimer.elapsed();
+    if (secs >= 1.0) {
+      daqRate = daqRateScans / secs;
+      daqRateScans = 0;
+      daqRateTimer.reset();
+    }
+    pthread_mutex_unlock(&daqLock);
+    recorder.addDAQ(&buf[0], nproc);
+    if (nproc) wakeNotifyHub(); // for the STREAM DAQ subscribers
   }
   return 0;
 }
@@ -1432,20 +3225,21 @@ void *FSMSpecific::nrtThrFun()
   while(nread >= 0 && fifo_nrt_output >= 0) {
     nread = ::read(fifo_nrt_output, nrt.get(), sizeof(*nrt));
     if (nread == sizeof(*nrt) && nrt->magic == NRTOUTPUT_MAGIC) {
+      recorder.addNRT(*nrt);
       switch (nrt->type) {
       case NRT_TCP: 
-        doNRT_IP(nrt.get(), false);
-        break;
       case NRT_UDP: 
-        doNRT_IP(nrt.get(), true);
+        nrt->ip_host[IP_HOST_LEN-1] = 0;
+        nrtDispatcher.post(nrt->ip_host, nrt->ip_port, nrt->type == NRT_UDP, 
+                           FormatPacketText(nrt->ip_packet_fmt, nrt.get()));
         break;
       default:
         log(1) << "ERROR In nrtThrFun() got unknown NRT output type " 
-               << int(nrt->type) << "\n"; log(0);
+               << int(nrt->type) << "\n"; log(0, AsyncLog::Error);
         break;
       }
     } else {
-        log(1) << "ERROR In nrtThrFun() read invalid struct NRTOutput from fifo!\n"; log(0);
+        log(1) << "ERROR In nrtThrFun() read invalid struct NRTOutput from fifo!\n"; log(0, AsyncLog::Error);
     }
   }
   return 0;
@@ -1471,67 +3265,343 @@ std::vector<double> splitNumericString(const std::string &str,
 
 Matrix FSMSpecific::getDAQScans()
 {
+  // copy out the raw samples under the lock, scale them after
+  std::vector<long long> ts;
+  std::vector<unsigned short> raw;
   pthread_mutex_lock(&daqLock);
-  Matrix mat(daqBuf.countNormalized(), daqNumChans+1);
-  for (unsigned i = 0; i < daqBuf.countNormalized(); ++i) {
-    mat.at(i, 0) = daqBuf[i].ts_nanos / 1e9;
-    for (unsigned j = 0; j < daqNumChans; ++j)
-      if (j < daqBuf[i].samples.size())
-        mat.at(i, j+1) = daqBuf[i].samples[j];
-      else 
-        mat.at(i, j+1) = 0.;
-  }
-  daqBuf.clear();
+  daqRing.read(daqRing.tail, ts, raw);
+  const unsigned nChans = daqRing.nChans;
+  const double scale = (daqRangeMax-daqRangeMin)/double(daqMaxData), offset = daqRangeMin;
   pthread_mutex_unlock(&daqLock);
+
+  const unsigned n = ts.size();
+  Matrix mat(n, nChans+1);
+  for (unsigned i = 0; i < n; ++i)
+    mat.at(i, 0) = ts[i] / 1e9;
+  if (n)
+    for (unsigned c = 0; c < nChans; ++c)
+      scaleDAQSamples(&raw[c*n], &mat.at(0, c+1), n, scale, offset);
   return mat;
 }
 
-void FSMSpecific::doNRT_IP(const NRTOutput *nrt, bool isUDP) const
-{  
-        struct hostent he, *he_result;
-        int h_err;
-        char hostEntAux[32768];
-        std::string packetText = FormatPacketText(nrt->ip_packet_fmt, nrt);
-        int ret = ::gethostbyname2_r(nrt->ip_host, AF_INET, &he, hostEntAux, sizeof(hostEntAux),&he_result, &h_err);
-        if (ret) {
-          log(1) << "ERROR In doNRT_IP() got error (ret=" << ret << ") in hostname lookup for " << nrt->ip_host << ": h_errno=" << h_err << "\n"; log(0);
-          return;
-        }
-        int theSock;
-        if (isUDP) theSock = socket(PF_INET, SOCK_DGRAM, 0);
-        else theSock = socket(PF_INET, SOCK_STREAM, 0);
-        if (theSock < 0) {
-          log(1) << "ERROR In doNRT_IP() got error (errno=" << strerror(errno) << ") in socket() call\n"; log(0);
-          return; 
-        }
-        if (!isUDP) {
-          long flag = 1;
-          setsockopt(theSock, SOL_TCP, SO_REUSEADDR, &flag, sizeof(flag));
-          flag = 1;
-          // turn off nagle for less latency
-          setsockopt(theSock, SOL_TCP, TCP_NODELAY, &flag, sizeof(flag));
-        }
-        struct sockaddr_in addr;
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons(nrt->ip_port);
-        memcpy(&addr.sin_addr.s_addr, he.h_addr, sizeof(addr.sin_addr.s_addr));
-        ret = connect(theSock, (struct sockaddr *)&addr, sizeof(addr)); // this call is ok for UDP as well
-        if (ret) {
-          log(1) << "ERROR In doNRT_IP() could not connect to " << nrt->ip_host << ":" << nrt->ip_port << " got error (errno=" << strerror(errno) << ") in connect() call\n"; log(0);
-          ::close(theSock);
-          return;
-        }
-        int datalen = packetText.length();
-        if (isUDP)
-          // UDP
-          ret = sendto(theSock, packetText.c_str(), datalen, 0, (const struct sockaddr *)&addr, sizeof(addr));
-        else
-          // TCP
-          ret = send(theSock, packetText.c_str(), datalen, MSG_NOSIGNAL);
-        if (ret != datalen) {
-          log(1) << "ERROR In doNRT_IP() sending " << datalen << " bytes to " << nrt->ip_host << ":" << nrt->ip_port << " got error (errno=" << strerror(errno) << ") in send() call\n"; log(0);
-        }
-        ::close(theSock);
+bool FSMSpecific::getDAQDecimated(unsigned factor, double t0, double t1, Matrix & m)
+{
+  // like getDAQScans(), copy the raw buckets out under the lock and scale them after
+  std::vector<long long> ts;
+  std::vector<unsigned short> mins, maxs;
+  std::vector<unsigned> sums;
+  pthread_mutex_lock(&daqLock);
+  const DAQLevel *L = daqRing.level(factor);
+  if (!L) {
+    pthread_mutex_unlock(&daqLock);
+    return false;
+  }
+  const unsigned nChans = L->nChans;
+  // bounds beyond a few centuries (like the defaults) just mean "all of them"
+  const unsigned long long first = t0 > -9e9 ? L->find((long long)(t0*1e9)) : L->oldest(),
+    last = t1 < 9e9 ? L->find((long long)(t1*1e9) + 1) : L->head;
+  const unsigned n = last > first ? last - first : 0;
+  ts.resize(n), mins.resize(size_t(n)*nChans), maxs.resize(size_t(n)*nChans), sums.resize(size_t(n)*nChans);
+  for (unsigned i = 0; i < n; ++i) {
+    const unsigned slot = (first + i) % DAQLevel::Capacity;
+    ts[i] = L->ts[slot];
+    for (unsigned c = 0; c < nChans; ++c) {
+      mins[c*n + i] = L->mins[c*DAQLevel::Capacity + slot];
+      maxs[c*n + i] = L->maxs[c*DAQLevel::Capacity + slot];
+      sums[c*n + i] = L->sums[c*DAQLevel::Capacity + slot];
+    }
+  }
+  const double scale = (daqRangeMax-daqRangeMin)/double(daqMaxData), offset = daqRangeMin;
+  pthread_mutex_unlock(&daqLock);
+
+  Matrix mat(n, 3*nChans+1);
+  for (unsigned i = 0; i < n; ++i)
+    mat.at(i, 0) = ts[i] / 1e9;
+  if (n)
+    for (unsigned c = 0; c < nChans; ++c) {
+      scaleDAQSamples(&mins[c*n], &mat.at(0, 1+c), n, scale, offset);
+      scaleDAQSamples(&maxs[c*n], &mat.at(0, 1+nChans+c), n, scale, offset);
+      double *means = &mat.at(0, 1+2*nChans+c);
+      const double meanScale = scale/factor;
+      for (unsigned i = 0; i < n; ++i) means[i] = sums[c*n + i] * meanScale + offset;
+    }
+  m = mat;
+  return true;
+}
+
+extern "C" void *nrtWorkerThrWrapper(void *arg)
+{
+  return static_cast<NRTDispatcher *>(arg)->workerThrFun();
+}
+
+NRTDispatcher::Dest::Dest(const std::string & key, const std::string & h, unsigned short p, bool u)
+  : host(h), port(p), udp(u), busy(false), ready(false), sock(-1),
+    resolved(false), failed(false), sent(0), dropped(0), errors(0),
+    latencySum(0.), latencyMax(0.),
+    latency(Metrics::histogram("fsm_nrt_send_latency_us", "dest=\"" + key + "\""))
+{
+  memset(&addr, 0, sizeof(addr));
+}
+
+NRTDispatcher::NRTDispatcher()
+{
+  pthread_mutex_init(&lock, 0);
+  pthread_cond_init(&cond, 0);
+}
+
+void NRTDispatcher::start()
+{
+  for (unsigned i = 0; i < NumWorkers; ++i) {
+    pthread_t thr;
+    if (pthread_create(&thr, NULL, nrtWorkerThrWrapper, this))
+      throw Exception("Could not create a required thread, 'nrt output worker thread'!");
+  }
+}
+
+void NRTDispatcher::post(const std::string & host, unsigned short port, bool udp, const std::string & packet)
+{
+  std::ostringstream key;
+  key << host << ":" << port << (udp ? "/udp" : "/tcp");
+  MutexLocker ml(lock);
+  Dest *& d = dests[key.str()];
+  if (!d) d = new Dest(key.str(), host, port, udp);
+  if (d->queue.size() >= MaxQueue) {
+    d->queue.pop_front();
+    ++d->dropped;
+    AsyncLog::logs(AsyncLog::Warning, "NRT output queue full, dropped the oldest packet for ", key.str());
+  }
+  d->queue.push_back(Packet(packet));
+  // if it's busy its worker will pick this one up when it's done with the rest
+  if (!d->busy && !d->ready) {
+    d->ready = true;
+    readyList.push_back(d);
+    pthread_cond_signal(&cond);
+  }
+}
+
+void *NRTDispatcher::workerThrFun()
+{
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    while (readyList.empty()) pthread_cond_wait(&cond, &lock);
+    Dest *d = readyList.front();
+    readyList.pop_front();
+    d->ready = false;
+    d->busy = true;
+    std::deque<Packet> todo;
+    todo.swap(d->queue);
+    pthread_mutex_unlock(&lock);
+
+    unsigned long sent = 0, errors = 0;
+    double latencySum = 0., latencyMax = 0.;
+    for (std::deque<Packet>::const_iterator it = todo.begin(); it != todo.end(); ++it) {
+      if (sendPacket(*d, it->data)) {
+        const double latency = it->queued.elapsed();
+        ++sent;
+        latencySum += latency;
+        d->latency.recordSecs(latency);
+        if (latency > latencyMax) latencyMax = latency;
+      } else
+        ++errors;
+    }
+
+    pthread_mutex_lock(&lock);
+    d->sent += sent;
+    d->errors += errors;
+    d->latencySum += latencySum;
+    if (latencyMax > d->latencyMax) d->latencyMax = latencyMax;
+    d->busy = false;
+    if (!d->queue.empty()) { // more came in while we were sending
+      d->ready = true;
+      readyList.push_back(d);
+    }
+  }
+  return 0;
+}
+
+std::string NRTDispatcher::stats()
+{
+  std::ostringstream s;
+  MutexLocker ml(lock);
+  s << dests.size() << "\n";
+  for (DestMap::const_iterator it = dests.begin(); it != dests.end(); ++it) {
+    const Dest & d = *it->second;
+    s << it->first << " sent " << d.sent << " dropped " << d.dropped
+      << " errors " << d.errors << " queued " << d.queue.size()
+      << " avg_latency_ms " << (d.sent ? d.latencySum / d.sent * 1e3 : 0.)
+      << " max_latency_ms " << d.latencyMax * 1e3 << "\n";
+  }
+  return s.str();
+}
+
+bool NRTDispatcher::sendPacket(Dest & d, const std::string & data)
+{
+  // a kept-alive TCP connection may have been closed by the peer since the
+  // last packet, in which case the first send fails and we reconnect once
+  for (int attempt = 0; attempt < 2; ++attempt) {
+    if (d.sock < 0 && !connectDest(d)) return false;
+    if (!d.udp) {
+      // we never expect anything from the peer, discard whatever it sent and see if it hung up
+      char junk[256];
+      int n;
+      while ((n = ::recv(d.sock, junk, sizeof(junk), MSG_DONTWAIT)) > 0) {}
+      if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        closeDest(d);
+        continue;
+      }
+    }
+    const int ret = ::send(d.sock, data.data(), data.length(), MSG_NOSIGNAL);
+    if (ret == (int)data.length()) return true;
+    log(1) << "ERROR In NRTDispatcher sending " << data.length() << " bytes to " << d.host << ":" << d.port
+           << " got error (errno=" << strerror(errno) << ") in send() call\n"; log(0, AsyncLog::Error);
+    closeDest(d);
+  }
+  return false;
+}
+
+bool NRTDispatcher::connectDest(Dest & d)
+{
+  // don't let every packet wait out the timeout on a host that's down
+  if (d.failed && d.failedAt.elapsed() < NRT_RETRY_SECS) return false;
+  d.failed = true;
+  d.failedAt.reset();
+
+  if (!d.resolved || d.resolvedAt.elapsed() > NRT_DNS_CACHE_SECS) {
+    struct hostent he, *he_result;
+    int h_err;
+    char hostEntAux[32768];
+    int ret = ::gethostbyname2_r(d.host.c_str(), AF_INET, &he, hostEntAux, sizeof(hostEntAux), &he_result, &h_err);
+    if (ret || !he_result) {
+      log(1) << "ERROR In NRTDispatcher got error (ret=" << ret << ") in hostname lookup for " << d.host << ": h_errno=" << h_err << "\n"; log(0, AsyncLog::Error);
+      return false;
+    }
+    d.addr.sin_family = AF_INET;
+    d.addr.sin_port = htons(d.port);
+    memcpy(&d.addr.sin_addr.s_addr, he.h_addr, sizeof(d.addr.sin_addr.s_addr));
+    d.resolved = true;
+    d.resolvedAt.reset();
+  }
+
+  d.sock = ::socket(PF_INET, d.udp ? SOCK_DGRAM : SOCK_STREAM, 0);
+  if (d.sock < 0) {
+    log(1) << "ERROR In NRTDispatcher got error (errno=" << strerror(errno) << ") in socket() call\n"; log(0, AsyncLog::Error);
+    return false;
+  }
+  int flag = 1;
+  if (!d.udp) {
+    // turn off nagle for less latency
+    setsockopt(d.sock, SOL_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    setsockopt(d.sock, SOL_SOCKET, SO_KEEPALIVE, &flag, sizeof(flag));
+  }
+  struct timeval tv;
+  tv.tv_sec = NRT_IO_TIMEOUT_MS / 1000;
+  tv.tv_usec = (NRT_IO_TIMEOUT_MS % 1000) * 1000;
+  setsockopt(d.sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  // connect without blocking so an unreachable host costs at most NRT_IO_TIMEOUT_MS
+  // (for UDP this just fixes the destination address)
+  const int fl = ::fcntl(d.sock, F_GETFL);
+  ::fcntl(d.sock, F_SETFL, fl | O_NONBLOCK);
+  int err = 0;
+  if (::connect(d.sock, (const struct sockaddr *)&d.addr, sizeof(d.addr))) {
+    err = errno;
+    if (err == EINPROGRESS) {
+      struct pollfd pfd;
+      pfd.fd = d.sock;
+      pfd.events = POLLOUT;
+      socklen_t len = sizeof(err);
+      if (::poll(&pfd, 1, NRT_IO_TIMEOUT_MS) != 1) err = ETIMEDOUT;
+      else if (::getsockopt(d.sock, SOL_SOCKET, SO_ERROR, &err, &len)) err = errno;
+    }
+  }
+  ::fcntl(d.sock, F_SETFL, fl);
+  if (err) {
+    log(1) << "ERROR In NRTDispatcher could not connect to " << d.host << ":" << d.port << " got error (errno=" << strerror(err) << ") in connect() call\n"; log(0, AsyncLog::Error);
+    closeDest(d);
+    d.resolved = false; // maybe it moved, look it up again next time
+    return false;
+  }
+  d.failed = false;
+  return true;
+}
+
+void NRTDispatcher::closeDest(Dest & d)
+{
+  if (d.sock >= 0) ::close(d.sock);
+  d.sock = -1;
+}
+
+uint64 FSMCache::hash(const FSMBlob & fsm)
+{
+  const unsigned char *p = reinterpret_cast<const unsigned char *>(&fsm);
+  const unsigned long skip = reinterpret_cast<const unsigned char *>(&fsm.wait_for_jump_to_state_0_to_swap_fsm) - p,
+                      skipEnd = skip + sizeof(fsm.wait_for_jump_to_state_0_to_swap_fsm),
+                      n = FSMBlobUsedSize(&fsm);
+  uint64 h = 14695981039346656037ULL;
+  for (unsigned long i = 0; i < n; ++i) {
+    if (i == skip) i = skipEnd;
+    h = (h ^ p[i]) * 1099511628211ULL;
+  }
+  return h ? h : 1; // 0 means "unknown" to current()
+}
+
+void FSMCache::insert(unsigned fsmId, uint64 h, std::vector<char> & blob)
+{
+  MutexLocker ml(lock);
+  currentHash[fsmId] = h;
+  std::map<uint64, LRUList::iterator>::iterator it = index.find(h);
+  if (it != index.end()) {
+    lru.splice(lru.begin(), lru, it->second);
+    return;
+  }
+  lru.push_front(std::make_pair(h, std::vector<char>()));
+  lru.front().second.swap(blob);
+  index[h] = lru.begin();
+  if (lru.size() > MaxEntries) {
+    index.erase(lru.back().first);
+    lru.pop_back();
+  }
+}
+
+bool FSMCache::lookup(uint64 h, FSMBlob & fsm)
+{
+  MutexLocker ml(lock);
+  std::map<uint64, LRUList::iterator>::iterator it = index.find(h);
+  if (it == index.end()) {
+    ++misses;
+    return false;
+  }
+  ++hits;
+  lru.splice(lru.begin(), lru, it->second);
+  const std::vector<char> & blob = it->second->second;
+  ::memcpy(&fsm, &blob[0], blob.size());
+  return true;
+}
+
+uint64 FSMCache::current(unsigned fsmId)
+{
+  MutexLocker ml(lock);
+  std::map<unsigned, uint64>::const_iterator it = currentHash.find(fsmId);
+  return it == currentHash.end() ? 0 : it->second;
+}
+
+void FSMCache::setCurrent(unsigned fsmId, uint64 h)
+{
+  MutexLocker ml(lock);
+  currentHash[fsmId] = h;
+}
+
+std::string FSMCache::stats()
+{
+  MutexLocker ml(lock);
+  unsigned long bytes = 0;
+  for (LRUList::const_iterator it = lru.begin(); it != lru.end(); ++it) bytes += it->second.size();
+  std::ostringstream s;
+  s << "fsm_cache_entries " << lru.size() << "\n"
+    << "fsm_cache_bytes " << bytes << "\n"
+    << "fsm_cache_hits_total " << hits << "\n"
+    << "fsm_cache_misses_total " << misses << "\n";
+  return s.str();
 }
 
 namespace {
@@ -1596,7 +3666,7 @@ namespace {
 
 };
 
-std::vector<OutputSpec> ConnectionThread::parseOutputSpecStr(const std::string & str)
+std::vector<OutputSpec> Connection::parseOutputSpecStr(const std::string & str)
 {
   // format of output string is \1TYPE_STR\2DATA_STR...
 
@@ -1611,6 +3681,8 @@ std::vector<OutputSpec> ConnectionThread::parseOutputSpecStr(const std::string &
     std::string data = str.substr(pos2, str.find('\1', pos2)-pos2);
     std::string typeData = type + "::" + data;
     struct OutputSpec spec;
+    // zeroed so that the same spec always makes the same FSMBlob, see FSMCache::hash()
+    ::memset(&spec, 0, sizeof(spec));
     if (type == "dout") {
       spec.type = OSPEC_DOUT;
     } else if (type == "trig") {
@@ -1626,28 +3698,28 @@ std::vector<OutputSpec> ConnectionThread::parseOutputSpecStr(const std::string &
     } else if (type == "noop") {
       spec.type = OSPEC_NOOP;
     } else {
-      log(1) << "Parse error for output spec \"" << typeData << "\" (ignoring matrix column! Argh!)\n"; log(0);
+      log(1) << "Parse error for output spec \"" << typeData << "\" (ignoring matrix column! Argh!)\n"; log(0, AsyncLog::Error);
       spec.type = OSPEC_NOOP;
     }
     // spec.data
     if (type == "dout" || type == "trig") {
       // parse data range
       if (sscanf(data.c_str(), "%u-%u", &spec.from, &spec.to) != 2) {
-        log(1) << "Could not parse channel range from output spec \"" << typeData << "\" assuming 0-1! Argh!\n"; log(0);
+        log(1) << "Could not parse channel range from output spec \"" << typeData << "\" assuming 0-1! Argh!\n"; log(0, AsyncLog::Warning);
         spec.from = 0;
         spec.to = 1;
       }
     } else if (type == "sound") {
       // parse data range
       if (sscanf(data.c_str(), "%u", &spec.sound_card) != 1) {
-        log(1) << "Could not parse sound card from output spec \"" << typeData << "\" assuming same as fsm id " << fsm_id << "!\n"; log(0);
+        log(1) << "Could not parse sound card from output spec \"" << typeData << "\" assuming same as fsm id " << fsm_id << "!\n"; log(0, AsyncLog::Warning);
         spec.sound_card = fsm_id;
       }
     } else if (type == "udp" || type == "tcp") {
       // parse host:port:
       memset(spec.data, 0, sizeof(spec.data));
       if (sscanf(data.c_str(), "%79[0-9a-zA-Z.]:%hu:%942c", spec.host, &spec.port, spec.fmt_text) != 3) {
-        log(1) << "Could not parse host:port:packet from output spec \"" << typeData << "\"!  Suppressing column! Argh!\n"; log(0);
+        log(1) << "Could not parse host:port:packet from output spec \"" << typeData << "\"!  Suppressing column! Argh!\n"; log(0, AsyncLog::Error);
         spec.type = OSPEC_NOOP;
       }
     } else {
@@ -0,0 +1,751 @@
+/**
+ * RatExpFSMSim: runs RatExpFSM.c in userspace, see RatExpFSMSim.h.
+ *
+ * This file supplies everything RatExpFSM.c would otherwise get from the
+ * kernel, RTLinux, mbuff and comedi, the default fake DAQ board (which
+ * replays an input trace and logs its outputs), and main().
+ *
+ * License: GPL v2 or later.
+ */
+#define FSM_SIM_IMPL
+#include "RatExpFSMSim.h"
+#include "softtask.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#define MODULE_NAME "RatExpFSMSim"
+#define LOG_MSG(x...) rtl_printf(MODULE_NAME ": " x)
+#define WARNING(x...) rtl_printf(MODULE_NAME ": WARNING - " x)
+#define ERROR(x...) rtl_printf(MODULE_NAME ": ERROR - " x)
+
+extern int sampling_rate; /* RatExpFSM.c's */
+
+static hrtime_t sim_start_ts = 0;
+
+/* our own parameters, settable on the command line like the module's */
+static char *trace = 0;     /* input trace to replay, see loadTrace() */
+static int trace_loop = 0;  /* iff true, replay the trace over and over */
+static char *out_log = 0;   /* log outputs to this file, - for stdout */
+MODULE_PARM(trace, "s");
+MODULE_PARM_DESC(trace, "A file of inputs to replay, one line per change: the time in seconds, the DIO input lines as a bitfield (0x.. for hex), then optionally the AI inputs in volts.  Lines starting with # are ignored.  Defaults to no input at all.");
+MODULE_PARM(trace_loop, "i");
+MODULE_PARM_DESC(trace_loop, "If true, start the trace over when it ends.  Defaults to 0.");
+MODULE_PARM(out_log, "s");
+MODULE_PARM_DESC(out_log, "A file to log DIO, AO and sound trigger outputs to, with their times, or - for stdout.  Defaults to none.");
+
+/*---------------------------------------------------------------------------
+  Kernel and RTLinux basics
+-----------------------------------------------------------------------------*/
+int rtl_printf(const char *fmt, ...)
+{
+  va_list ap;
+  int ret;
+  va_start(ap, fmt);
+  ret = vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  return ret;
+}
+
+hrtime_t gethrtime(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+hrtime_t clock_gethrtime(clockid_t clk)
+{
+  (void)clk;
+  return gethrtime();
+}
+
+#define NUM_PARAMS_MAX 64
+static struct Param
+{
+  const char *name, *type, *desc;
+  void *var;
+} params[NUM_PARAMS_MAX];
+static unsigned num_params = 0;
+
+void fsmSimAddParam(const char *name, const char *type, void *var, const char *desc)
+{
+  unsigned i;
+  for (i = 0; i < num_params && strcmp(params[i].name, name); ++i)
+    ;
+  if (i == num_params) {
+    if (num_params == NUM_PARAMS_MAX) return;
+    params[num_params++].name = name;
+  }
+  if (type) params[i].type = type, params[i].var = var;
+  if (desc) params[i].desc = desc;
+}
+
+static int setParam(const char *arg)
+{
+  const char *eq = strchr(arg, '=');
+  unsigned i;
+  if (!eq) return -EINVAL;
+  for (i = 0; i < num_params; ++i)
+    if (params[i].type && strlen(params[i].name) == (size_t)(eq - arg)
+        && !strncmp(params[i].name, arg, eq - arg))
+      break;
+  if (i == num_params) return -ENOENT;
+  if (*params[i].type == 'i') {
+    char *end;
+    long v = strtol(eq+1, &end, 0);
+    if (!eq[1] || *end) return -EINVAL;
+    *(int *)params[i].var = v;
+  } else {
+    *(char **)params[i].var = strdup(eq+1);
+  }
+  return 0;
+}
+
+/*---------------------------------------------------------------------------
+  /proc
+-----------------------------------------------------------------------------*/
+static struct proc_dir_entry proc_entry, *proc_entry_used = 0;
+
+struct proc_dir_entry *create_proc_entry(const char *name, mode_t mode, struct proc_dir_entry *parent)
+{
+  (void)name; (void)mode; (void)parent;
+  memset(&proc_entry, 0, sizeof(proc_entry));
+  return proc_entry_used = &proc_entry;
+}
+
+void remove_proc_entry(const char *name, struct proc_dir_entry *parent)
+{
+  (void)name; (void)parent;
+  proc_entry_used = 0;
+}
+
+/* all at once, there's no paging through a file here */
+int single_open(struct file *f, int (*show)(struct seq_file *, void *), void *data)
+{
+  return show(&f->seq, data);
+}
+
+int single_release(struct inode *i, struct file *f) { (void)i; (void)f; return 0; }
+ssize_t seq_read(struct file *f, char *buf, size_t n, loff_t *off) { (void)f; (void)buf; (void)n; (void)off; return 0; }
+loff_t seq_lseek(struct file *f, loff_t off, int whence) { (void)f; (void)whence; return off; }
+
+int seq_printf(struct seq_file *m, const char *fmt, ...)
+{
+  va_list ap;
+  int ret;
+  va_start(ap, fmt);
+  ret = vfprintf(m->out, fmt, ap);
+  va_end(ap);
+  return ret;
+}
+
+static void printProcEntry(FILE *out)
+{
+  struct file f;
+  if (!proc_entry_used || !proc_entry.proc_fops) return;
+  f.seq.out = out;
+  proc_entry.proc_fops->open(0, &f);
+  fflush(out);
+}
+
+/*---------------------------------------------------------------------------
+  The RT task: its pthread, and how late it wakes up
+-----------------------------------------------------------------------------*/
+int fsmSimThreadAttrRT(pthread_attr_t *attr, int on)
+{
+  if (!on) return 0;
+  pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+  return pthread_attr_setschedpolicy(attr, SCHED_FIFO);
+}
+
+int fsmSimThreadCreate(pthread_t *thr, pthread_attr_t *attr, void *(*fn)(void *), void *arg)
+{
+  int err = pthread_create(thr, attr, fn, arg);
+  if (err == EPERM) {
+    WARNING("Not allowed to run the FSM task as SCHED_FIFO (run as root for that), running it as an ordinary thread -- expect a lot more jitter.\n");
+    /* keep any CPU pinning, just drop the scheduling policy */
+    pthread_attr_setinheritsched(attr, PTHREAD_INHERIT_SCHED);
+    err = pthread_create(thr, attr, fn, arg);
+  }
+  return err;
+}
+
+int fsmSimThreadAttrCpu(pthread_attr_t *attr, int cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+/* wakeup latency, in power-of-2 microsecond buckets */
+#define LATE_BUCKETS 24
+static struct
+{
+  unsigned long long n, sum_ns, max_ns;
+  unsigned long long buckets[LATE_BUCKETS];
+} wakeups;
+
+int fsmSimClockNanosleep(clockid_t clk, int flags, const struct timespec *req, struct timespec *rem)
+{
+  int err;
+  (void)clk;
+  while ((err = clock_nanosleep(CLOCK_MONOTONIC, flags, req, rem)) == EINTR)
+    ;
+  if (!err && (flags & TIMER_ABSTIME)) {
+    long long late = gethrtime() - (req->tv_sec * 1000000000LL + req->tv_nsec);
+    unsigned b = 0;
+    if (late < 0) late = 0;
+    while (b < LATE_BUCKETS-1 && (late/1000) >> b) ++b;
+    ++wakeups.n;
+    wakeups.sum_ns += late;
+    if ((unsigned long long)late > wakeups.max_ns) wakeups.max_ns = late;
+    ++wakeups.buckets[b];
+  }
+  return err;
+}
+
+static void printWakeupStats(FILE *out)
+{
+  unsigned long long seen = 0;
+  const double qs[] = { 0.5, 0.99, 0.999 };
+  unsigned b, q = 0;
+  if (!wakeups.n) return;
+  fprintf(out, "FSM task wakeups: %llu, late by: mean %.1f us", wakeups.n, wakeups.sum_ns / 1000. / wakeups.n);
+  /* upper bound of the bucket each percentile falls in */
+  for (b = 0; b < LATE_BUCKETS && q < 3; ++b) {
+    seen += wakeups.buckets[b];
+    while (q < 3 && seen >= qs[q] * wakeups.n)
+      fprintf(out, ", p%g < %llu us", qs[q++]*100, 1ULL << b);
+  }
+  fprintf(out, ", max %.1f us\n", wakeups.max_ns / 1000.);
+  fflush(out);
+}
+
+/*---------------------------------------------------------------------------
+  rt-fifos, as named pipes in the RTOS_SIM_DIR directory.  We keep each one
+  open read-write and non-blocking, so opening it from RatExpFSMServer never
+  blocks and rtf_put()/rtf_get() never do either.
+-----------------------------------------------------------------------------*/
+static const char *sim_dir = RTOS_SIM_DEFAULT_DIR;
+static int rtf_fd[RTF_NO];
+
+static void rtfPath(unsigned minor, char *buf, unsigned bufsz)
+{
+  snprintf(buf, bufsz, "%s/rtf%u", sim_dir, minor);
+}
+
+int rtf_create(unsigned minor, int size)
+{
+  char path[PATH_MAX];
+  int fd;
+  if (minor >= RTF_NO) return -ENODEV;
+  if (rtf_fd[minor] > 0) return -EBUSY;
+  rtfPath(minor, path, sizeof(path));
+  unlink(path); /* left over from a previous run */
+  if (mkfifo(path, 0666) && errno != EEXIST) return -errno;
+  fd = open(path, O_RDWR|O_NONBLOCK);
+  if (fd < 0) return -errno;
+  if (fcntl(fd, F_GETPIPE_SZ) < size) fcntl(fd, F_SETPIPE_SZ, size); /* best effort */
+  rtf_fd[minor] = fd;
+  return 0;
+}
+
+int rtf_destroy(unsigned minor)
+{
+  char path[PATH_MAX];
+  if (minor >= RTF_NO || rtf_fd[minor] <= 0) return -EINVAL;
+  close(rtf_fd[minor]);
+  rtf_fd[minor] = 0;
+  rtfPath(minor, path, sizeof(path));
+  unlink(path);
+  return 0;
+}
+
+int rtf_put(unsigned minor, void *buf, int count)
+{
+  int ret;
+  if (minor >= RTF_NO || rtf_fd[minor] <= 0) return -EINVAL;
+  ret = write(rtf_fd[minor], buf, count);
+  if (ret < 0) return errno == EAGAIN ? -ENOSPC : -errno;
+  return ret;
+}
+
+int rtf_get(unsigned minor, void *buf, int count)
+{
+  int ret;
+  if (minor >= RTF_NO || rtf_fd[minor] <= 0) return -EINVAL;
+  ret = read(rtf_fd[minor], buf, count);
+  if (ret < 0) return errno == EAGAIN ? 0 : -errno;
+  return ret;
+}
+
+int fsmSimRtfFree(unsigned minor)
+{
+  int used = 0, size;
+  if (minor >= RTF_NO || rtf_fd[minor] <= 0) return -EINVAL;
+  size = fcntl(rtf_fd[minor], F_GETPIPE_SZ);
+  ioctl(rtf_fd[minor], FIONREAD, &used);
+  return size - used;
+}
+
+/*---------------------------------------------------------------------------
+  mbuff, as POSIX shm
+-----------------------------------------------------------------------------*/
+#define NUM_MBUFFS_MAX 16
+static struct
+{
+  char name[64];
+  void *addr;
+  size_t size;
+  int created; /* nobody else uses what we created, so detaching frees it */
+} mbuffs[NUM_MBUFFS_MAX];
+
+void *mbuff_alloc(const char *name, int size)
+{
+  void *addr;
+  unsigned i;
+  int fd, created = 1;
+  for (i = 0; i < NUM_MBUFFS_MAX && mbuffs[i].addr; ++i)
+    ;
+  if (i == NUM_MBUFFS_MAX) return 0;
+  snprintf(mbuffs[i].name, sizeof(mbuffs[i].name), "/%s", name);
+  fd = shm_open(mbuffs[i].name, O_RDWR|O_CREAT|O_EXCL, 0666);
+  if (fd < 0 && errno == EEXIST) /* left over from a previous run */
+    fd = shm_open(mbuffs[i].name, O_RDWR, 0666), created = 0;
+  if (fd < 0) return 0;
+  if (ftruncate(fd, size)) { close(fd); return 0; }
+  addr = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) return 0;
+  mbuffs[i].addr = addr;
+  mbuffs[i].size = size;
+  mbuffs[i].created = created;
+  return addr;
+}
+
+static void unmap(void *addr, int unlink)
+{
+  unsigned i;
+  for (i = 0; i < NUM_MBUFFS_MAX; ++i)
+    if (mbuffs[i].addr == addr) {
+      munmap(addr, mbuffs[i].size);
+      if (unlink) shm_unlink(mbuffs[i].name);
+      mbuffs[i].addr = 0;
+    }
+}
+
+void mbuff_detach(const char *name, void *addr)
+{
+  unsigned i;
+  (void)name;
+  for (i = 0; i < NUM_MBUFFS_MAX && mbuffs[i].addr != addr; ++i)
+    ;
+  if (i < NUM_MBUFFS_MAX) unmap(addr, mbuffs[i].created);
+}
+
+void mbuff_free(const char *name, void *addr)
+{
+  (void)name;
+  unmap(addr, 1);
+}
+
+/*---------------------------------------------------------------------------
+  Soft tasks, each a thread waiting to be pended
+-----------------------------------------------------------------------------*/
+struct SoftTask
+{
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  SoftTask_Handler func;
+  void *arg;
+  int pended, busy, stop;
+};
+
+static void *softTaskThread(void *arg)
+{
+  struct SoftTask *t = (struct SoftTask *)arg;
+  pthread_mutex_lock(&t->lock);
+  for (;;) {
+    while (!t->pended && !t->stop) pthread_cond_wait(&t->cond, &t->lock);
+    if (!t->pended) break;
+    t->pended = 0;
+    pthread_mutex_unlock(&t->lock);
+    t->func(t->arg);
+    pthread_mutex_lock(&t->lock);
+    t->busy = 0;
+    pthread_cond_broadcast(&t->cond);
+  }
+  pthread_mutex_unlock(&t->lock);
+  return 0;
+}
+
+struct SoftTask *softTaskCreate(SoftTask_Handler handler_function, const char *taskName)
+{
+  struct SoftTask *t = (struct SoftTask *)calloc(1, sizeof(*t));
+  (void)taskName;
+  if (!t) return 0;
+  pthread_mutex_init(&t->lock, 0);
+  pthread_cond_init(&t->cond, 0);
+  t->func = handler_function;
+  if (pthread_create(&t->thread, 0, softTaskThread, t)) {
+    free(t);
+    return 0;
+  }
+  return t;
+}
+
+int softTaskPend(struct SoftTask *t, void *arg)
+{
+  int ret = 0;
+  if (!t) return EINVAL;
+  pthread_mutex_lock(&t->lock);
+  if (t->busy) ret = EBUSY;
+  else {
+    t->arg = arg;
+    t->busy = t->pended = 1;
+    pthread_cond_signal(&t->cond);
+  }
+  pthread_mutex_unlock(&t->lock);
+  return ret;
+}
+
+void softTaskDestroy(struct SoftTask *t)
+{
+  if (!t) return;
+  pthread_mutex_lock(&t->lock);
+  while (t->busy) pthread_cond_wait(&t->cond, &t->lock);
+  t->stop = 1;
+  pthread_cond_broadcast(&t->cond);
+  pthread_mutex_unlock(&t->lock);
+  pthread_join(t->thread, 0);
+  pthread_cond_destroy(&t->cond);
+  pthread_mutex_destroy(&t->lock);
+  free(t);
+}
+
+/*---------------------------------------------------------------------------
+  Comedi: one board, /dev/comedi0, subdevice 0 is DIO, 1 AI and 2 AO, all
+  forwarding to fsmSimDevice.  Every range is 0-5V.
+-----------------------------------------------------------------------------*/
+enum { SUBDEV_DIO = 0, SUBDEV_AI, SUBDEV_AO, NUM_SUBDEVS };
+struct comedi_t_struct { int minor; };
+static comedi_t comedi0 = { 0 };
+struct FSMSimDevice *fsmSimDevice = 0;
+
+comedi_t *comedi_open(const char *fn)
+{
+  return !strcmp(fn, "/dev/comedi0") && fsmSimDevice ? &comedi0 : 0;
+}
+
+int comedi_close(comedi_t *d) { (void)d; return 0; }
+int comedi_lock(comedi_t *d, unsigned s) { (void)d; (void)s; return 0; }
+int comedi_unlock(comedi_t *d, unsigned s) { (void)d; (void)s; return 0; }
+
+int comedi_get_n_channels(comedi_t *d, unsigned s)
+{
+  (void)d;
+  switch (s) {
+  case SUBDEV_DIO: return fsmSimDevice->n_dio;
+  case SUBDEV_AI: return fsmSimDevice->n_ai;
+  case SUBDEV_AO: return fsmSimDevice->n_ao;
+  }
+  return -1;
+}
+
+int comedi_find_subdevice_by_type(comedi_t *d, int type, unsigned start)
+{
+  int s = type == COMEDI_SUBD_DIO ? SUBDEV_DIO : (type == COMEDI_SUBD_AI ? SUBDEV_AI : (type == COMEDI_SUBD_AO ? SUBDEV_AO : -1));
+  if (s < (int)start || comedi_get_n_channels(d, s) <= 0) return -1;
+  return s;
+}
+
+int comedi_get_n_ranges(comedi_t *d, unsigned s, unsigned c) { (void)d; (void)s; (void)c; return 1; }
+
+int comedi_get_krange(comedi_t *d, unsigned s, unsigned c, unsigned r, comedi_krange *k)
+{
+  (void)d; (void)s; (void)c;
+  if (r) return -1;
+  k->min = 0;
+  k->max = 5000000;
+  k->flags = UNIT_volt;
+  return 0;
+}
+
+lsampl_t comedi_get_maxdata(comedi_t *d, unsigned s, unsigned c)
+{
+  (void)d; (void)c;
+  return s == SUBDEV_AI ? fsmSimDevice->ai_maxdata : (s == SUBDEV_AO ? fsmSimDevice->ao_maxdata : 1);
+}
+
+int comedi_dio_config(comedi_t *d, unsigned s, unsigned chan, unsigned io)
+{
+  (void)d;
+  if (s != SUBDEV_DIO || chan >= fsmSimDevice->n_dio) return -1;
+  if (fsmSimDevice->dio_config) fsmSimDevice->dio_config(fsmSimDevice, chan, io == COMEDI_OUTPUT);
+  return 1;
+}
+
+int comedi_dio_bitfield(comedi_t *d, unsigned s, unsigned mask, unsigned *bits)
+{
+  hrtime_t t = gethrtime();
+  (void)d;
+  if (s != SUBDEV_DIO) return -1;
+  if (mask) fsmSimDevice->dio_write(fsmSimDevice, t, mask, *bits & mask);
+  *bits = fsmSimDevice->dio_read(fsmSimDevice, t);
+  return 1;
+}
+
+int comedi_data_read(comedi_t *d, unsigned s, unsigned chan, unsigned r, unsigned aref, lsampl_t *data)
+{
+  (void)d; (void)r; (void)aref;
+  if (s != SUBDEV_AI || chan >= fsmSimDevice->n_ai) return -1;
+  *data = fsmSimDevice->ai_read(fsmSimDevice, gethrtime(), chan);
+  return 1;
+}
+
+int comedi_data_write(comedi_t *d, unsigned s, unsigned chan, unsigned r, unsigned aref, lsampl_t data)
+{
+  (void)d; (void)r; (void)aref;
+  if (s != SUBDEV_AO || chan >= fsmSimDevice->n_ao) return -1;
+  fsmSimDevice->ao_write(fsmSimDevice, gethrtime(), chan, data);
+  return 1;
+}
+
+int comedi_register_callback(comedi_t *d, unsigned s, unsigned mask, int (*cb)(unsigned, void *), void *arg)
+{
+  (void)d; (void)s; (void)mask; (void)cb; (void)arg;
+  return 0;
+}
+int comedi_command_test(comedi_t *d, comedi_cmd *c) { (void)d; (void)c; return -EOPNOTSUPP; }
+int comedi_command(comedi_t *d, comedi_cmd *c) { (void)d; (void)c; return -EOPNOTSUPP; }
+int comedi_cancel(comedi_t *d, unsigned s) { (void)d; (void)s; return 0; }
+int comedi_map(comedi_t *d, unsigned s, void *p) { (void)d; (void)s; (void)p; return -EOPNOTSUPP; }
+int comedi_get_buffer_size(comedi_t *d, unsigned s) { (void)d; (void)s; return 0; }
+int comedi_get_buffer_offset(comedi_t *d, unsigned s) { (void)d; (void)s; return 0; }
+int comedi_get_buffer_contents(comedi_t *d, unsigned s) { (void)d; (void)s; return 0; }
+int comedi_mark_buffer_read(comedi_t *d, unsigned s, unsigned n) { (void)d; (void)s; (void)n; return 0; }
+
+void fsmSimSoundTrig(unsigned card, int trig)
+{
+  if (fsmSimDevice->sound_trig) fsmSimDevice->sound_trig(fsmSimDevice, gethrtime(), card, trig);
+}
+
+/*---------------------------------------------------------------------------
+  The default device: replays the trace= file, logs to out_log=
+-----------------------------------------------------------------------------*/
+#define TRACE_AI_CHANS 8
+struct TraceLine
+{
+  hrtime_t t; /* since sim_start_ts */
+  unsigned dio;
+  lsampl_t ai[TRACE_AI_CHANS];
+};
+
+struct TraceDevice
+{
+  struct TraceLine *lines;
+  unsigned nlines, cur;
+  unsigned out_mask, out_bits; /* DIO lines configured as outputs, and their state */
+  lsampl_t ao[2];
+  FILE *log;
+};
+
+static const struct TraceLine *traceAt(struct TraceDevice *td, hrtime_t t)
+{
+  hrtime_t rel = t - sim_start_ts;
+  if (!td->nlines) return 0;
+  if (trace_loop && td->lines[td->nlines-1].t > 0) rel %= td->lines[td->nlines-1].t;
+  if (rel < td->lines[td->cur].t) td->cur = 0; /* looped */
+  while (td->cur+1 < td->nlines && td->lines[td->cur+1].t <= rel) ++td->cur;
+  return rel < td->lines[td->cur].t ? 0 : &td->lines[td->cur];
+}
+
+static void traceLog(struct TraceDevice *td, hrtime_t t, const char *fmt, ...)
+{
+  va_list ap;
+  if (!td->log) return;
+  fprintf(td->log, "%.6f ", (t - sim_start_ts) / 1e9);
+  va_start(ap, fmt);
+  vfprintf(td->log, fmt, ap);
+  va_end(ap);
+  fflush(td->log);
+}
+
+static void traceDioConfig(struct FSMSimDevice *d, unsigned chan, int output)
+{
+  struct TraceDevice *td = (struct TraceDevice *)d->priv;
+  if (output) td->out_mask |= 0x1 << chan;
+  else td->out_mask &= ~(0x1 << chan);
+}
+
+static unsigned traceDioRead(struct FSMSimDevice *d, hrtime_t t)
+{
+  struct TraceDevice *td = (struct TraceDevice *)d->priv;
+  const struct TraceLine *l = traceAt(td, t);
+  return ((l ? l->dio : 0) & ~td->out_mask) | (td->out_bits & td->out_mask);
+}
+
+static void traceDioWrite(struct FSMSimDevice *d, hrtime_t t, unsigned mask, unsigned bits)
+{
+  struct TraceDevice *td = (struct TraceDevice *)d->priv;
+  unsigned now = (td->out_bits & ~mask) | (bits & mask);
+  if (now != td->out_bits) traceLog(td, t, "DOUT 0x%08x\n", now);
+  td->out_bits = now;
+}
+
+static lsampl_t traceAiRead(struct FSMSimDevice *d, hrtime_t t, unsigned chan)
+{
+  const struct TraceLine *l = traceAt((struct TraceDevice *)d->priv, t);
+  return l && chan < TRACE_AI_CHANS ? l->ai[chan] : 0;
+}
+
+static void traceAoWrite(struct FSMSimDevice *d, hrtime_t t, unsigned chan, lsampl_t samp)
+{
+  struct TraceDevice *td = (struct TraceDevice *)d->priv;
+  if (td->ao[chan] != samp) traceLog(td, t, "AO %u %u\n", chan, samp);
+  td->ao[chan] = samp;
+}
+
+static void traceSoundTrig(struct FSMSimDevice *d, hrtime_t t, unsigned card, int trig)
+{
+  traceLog((struct TraceDevice *)d->priv, t, "SOUND %u %d\n", card, trig);
+}
+
+static struct TraceDevice trace_device;
+static struct FSMSimDevice default_device =
+{
+  "trace", 32, TRACE_AI_CHANS, 2, 65535, 65535,
+  traceDioConfig, traceDioRead, traceDioWrite, traceAiRead, traceAoWrite, traceSoundTrig,
+  &trace_device
+};
+
+static int loadTrace(struct TraceDevice *td, const char *fn)
+{
+  char line[1024];
+  unsigned lineno = 0, cap = 0;
+  FILE *f = fopen(fn, "r");
+  if (!f) { ERROR("%s: %s\n", fn, strerror(errno)); return -errno; }
+  while (fgets(line, sizeof(line), f)) {
+    struct TraceLine l;
+    char *p = line, *end;
+    double secs, volts;
+    unsigned c;
+    ++lineno;
+    while (*p == ' ' || *p == '\t') ++p;
+    if (*p == '#' || *p == '\n' || !*p) continue;
+    memset(&l, 0, sizeof(l));
+    secs = strtod(p, &end);
+    if (end == p) goto bad;
+    l.t = (hrtime_t)(secs * 1e9 + 0.5);
+    p = end;
+    l.dio = strtoul(p, &end, 0);
+    if (end == p) goto bad;
+    p = end;
+    for (c = 0; c < TRACE_AI_CHANS; ++c, p = end) {
+      volts = strtod(p, &end);
+      if (end == p) break;
+      if (volts < 0) volts = 0;
+      if (volts > 5) volts = 5;
+      l.ai[c] = (lsampl_t)(volts / 5. * default_device.ai_maxdata + 0.5);
+    }
+    if (td->nlines && l.t < td->lines[td->nlines-1].t) goto bad;
+    if (td->nlines == cap) {
+      cap = cap ? cap*2 : 256;
+      td->lines = (struct TraceLine *)realloc(td->lines, cap * sizeof(*td->lines));
+      if (!td->lines) { fclose(f); return -ENOMEM; }
+    }
+    td->lines[td->nlines++] = l;
+  }
+  fclose(f);
+  LOG_MSG("Replaying %u input changes from %s%s.\n", td->nlines, fn, trace_loop ? ", looped" : "");
+  return 0;
+bad:
+  ERROR("%s:%u: expected: seconds dio_bits [ai_volts ...], in time order\n", fn, lineno);
+  fclose(f);
+  return -EINVAL;
+}
+
+/*---------------------------------------------------------------------------
+  main
+-----------------------------------------------------------------------------*/
+static void usage(const char *argv0)
+{
+  unsigned i;
+  printf("Usage: %s [param=value ...]\n\n"
+         "Runs the RatExpFSM real-time task in userspace.  Point RatExpFSMServer at it\n"
+         "by setting RTOS_SIM_DIR to the directory the fifos are in (by default and\n"
+         "if RTOS_SIM_DIR is empty, " RTOS_SIM_DEFAULT_DIR ").  SIGUSR1 prints the\n"
+         "status otherwise shown in /proc/RatExpFSM.\n\nParameters:\n", argv0);
+  for (i = 0; i < num_params; ++i)
+    if (params[i].type)
+      printf("  %s=%s\n      %s\n", params[i].name, *params[i].type == 'i' ? "int" : "string", params[i].desc ? params[i].desc : "");
+}
+
+int main(int argc, char *argv[])
+{
+  sigset_t sigs;
+  int i, err, sig;
+  const char *dir = getenv("RTOS_SIM_DIR");
+
+  for (i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+      usage(argv[0]);
+      return 0;
+    }
+    if ((err = setParam(argv[i]))) {
+      fprintf(stderr, "%s: %s parameter: %s (try --help)\n", argv[0], err == -ENOENT ? "unknown" : "invalid", argv[i]);
+      return 1;
+    }
+  }
+
+  if (dir && *dir) sim_dir = dir;
+  if (mkdir(sim_dir, 0777) && errno != EEXIST) {
+    ERROR("%s: %s\n", sim_dir, strerror(errno));
+    return 1;
+  }
+
+  if (!fsmSimDevice) {
+    if (trace && loadTrace(&trace_device, trace)) return 1;
+    if (out_log)
+      trace_device.log = strcmp(out_log, "-") ? fopen(out_log, "w") : stdout;
+    if (out_log && !trace_device.log) {
+      ERROR("%s: %s\n", out_log, strerror(errno));
+      return 1;
+    }
+    fsmSimDevice = &default_device;
+  }
+
+  /* the threads we create inherit this, so only main() gets the signals */
+  sigemptyset(&sigs);
+  sigaddset(&sigs, SIGINT);
+  sigaddset(&sigs, SIGTERM);
+  sigaddset(&sigs, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &sigs, 0);
+  signal(SIGPIPE, SIG_IGN);
+
+  sim_start_ts = gethrtime();
+  if ((err = fsmSimModuleInit())) {
+    ERROR("RatExpFSM failed to start: %s\n", strerror(err < 0 ? -err : err));
+    return 1;
+  }
+  /* after init, so the shm and the FSM task's stack are in */
+  if (mlockall(MCL_CURRENT))
+    WARNING("Could not lock memory (%s), page faults may add to the FSM task's jitter.\n", strerror(errno));
+  LOG_MSG("fifos are in %s, run RatExpFSMServer with RTOS_SIM_DIR=%s\n", sim_dir, sim_dir);
+
+  while (!sigwait(&sigs, &sig) && sig == SIGUSR1) {
+    printProcEntry(stdout);
+    printWakeupStats(stdout);
+  }
+
+  fsmSimModuleExit();
+  printWakeupStats(stderr);
+  rmdir(sim_dir);
+  return 0;
+}
@@ -0,0 +1,291 @@
+#ifndef RAT_EXP_FSM_SIM_H
+#define RAT_EXP_FSM_SIM_H
+/**
+   Userspace stand-ins for the kernel, RTLinux, mbuff and comedi APIs that
+   RatExpFSM.c uses, so that the very same doFSM() can be built as an
+   ordinary Linux program (RatExpFSMSim, see `make sim') and run without
+   RTLinux or a DAQ board -- for testing, benchmarking and CI.
+
+   How the pieces map:
+
+     RT task       a SCHED_FIFO pthread (plain SCHED_OTHER, with a warning,
+                   if we aren't allowed realtime priority), ticking on
+                   CLOCK_MONOTONIC with clock_nanosleep()
+     mbuff shm     POSIX shm, /dev/shm/<name>
+     rt-fifos      named pipes, $RTOS_SIM_DIR/rtf<minor>
+     soft tasks    a pthread each (softtask.h, softtask.c isn't used)
+     comedi        one fake board, /dev/comedi0, with a DIO, an AI and an
+                   AO subdevice, that forwards to a struct FSMSimDevice
+     /proc entry   printed to stdout on SIGUSR1
+
+   RatExpFSMServer finds all of this through rtos_utility.cpp when
+   RTOS_SIM_DIR is set in its environment.
+
+   Module parameters are given on the command line just as to insmod,
+   name=value, plus a few of the simulator's own (run it with --help).
+
+   Only ai=synch is simulated.  There's no LynxTrig or external time
+   module to talk to either: sound triggers go to the FSMSimDevice, and
+   the external time is always 0.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "RatExpFSM.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RTOS_SIM_DEFAULT_DIR "/tmp/RatExpFSMSim"
+
+/*---------------------------------------------------------------------------
+  Kernel
+-----------------------------------------------------------------------------*/
+#define LINUX_VERSION_CODE KERNEL_VERSION(2,6,0)
+#define KERNEL_VERSION(a,b,c) (((a) << 16) + ((b) << 8) + (c))
+
+#define KERN_INFO ""
+#define KERN_WARNING ""
+#define KERN_ERR ""
+#define KERN_CRIT ""
+#define KERN_DEBUG ""
+#define printk rtl_printf
+
+#define THIS_MODULE 0
+#define MODULE_AUTHOR(x)
+#define MODULE_DESCRIPTION(x)
+#define MODULE_LICENSE(x)
+/* module_init()/module_exit() give the simulator's main() something to call */
+#define module_init(fn) int fsmSimModuleInit(void) { return fn(); }
+#define module_exit(fn) void fsmSimModuleExit(void) { fn(); }
+/* module parameters register themselves, to be set from the command line */
+#define MODULE_PARM(var, type) \
+  static void __attribute__((constructor)) fsmSimParam_##var(void) { fsmSimAddParam(#var, type, &var, 0); }
+#define MODULE_PARM_DESC(var, desc) \
+  static void __attribute__((constructor)) fsmSimParamDesc_##var(void) { fsmSimAddParam(#var, 0, 0, desc); }
+
+extern int fsmSimModuleInit(void);
+extern void fsmSimModuleExit(void);
+/** type is "i" (int *) or "s" (char **), or 0 to just set the description */
+extern void fsmSimAddParam(const char *name, const char *type, void *var, const char *desc);
+
+#define GFP_KERNEL 0
+#define kmalloc(sz, flags) malloc(sz)
+#define kfree(p) free(p)
+#define vmalloc(sz) malloc(sz)
+#define vfree(p) free(p)
+
+#define mb() __sync_synchronize()
+#define rmb() __sync_synchronize()
+#define wmb() __sync_synchronize()
+#define cmpxchg(p, o, n) __sync_val_compare_and_swap((p), (o), (n))
+/* the FSM threads' barrier spins share the host's cores with everything else */
+#define cpu_relax() sched_yield()
+
+/* the kernel's divide-in-place: n becomes the quotient, the remainder is returned */
+#define do_div(n, base) ({ unsigned long __rem = (unsigned long)((n) % (base)); (n) = (n) / (base); __rem; })
+/* RatExpFSM.c has its own lldiv() */
+#define lldiv rtl_lldiv
+
+static inline unsigned long __ffs(unsigned long x) { return __builtin_ctzl(x); }
+
+/* /proc, only what RatExpFSM.c's myseq_show() needs */
+#define S_IRUGO (S_IRUSR|S_IRGRP|S_IROTH)
+struct inode;
+struct seq_file { FILE *out; };
+struct file { struct seq_file seq; };
+struct file_operations
+{
+  int (*open)(struct inode *, struct file *);
+  ssize_t (*read)(struct file *, char *, size_t, loff_t *);
+  loff_t (*llseek)(struct file *, loff_t, int);
+  int (*release)(struct inode *, struct file *);
+};
+struct proc_dir_entry
+{
+  void *owner;
+  int uid;
+  struct file_operations *proc_fops;
+};
+extern struct proc_dir_entry *create_proc_entry(const char *name, mode_t mode, struct proc_dir_entry *parent);
+extern void remove_proc_entry(const char *name, struct proc_dir_entry *parent);
+extern int single_open(struct file *, int (*show)(struct seq_file *, void *), void *);
+extern int single_release(struct inode *, struct file *);
+extern ssize_t seq_read(struct file *, char *, size_t, loff_t *);
+extern loff_t seq_lseek(struct file *, loff_t, int);
+extern int seq_printf(struct seq_file *, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/*---------------------------------------------------------------------------
+  RTLinux
+-----------------------------------------------------------------------------*/
+typedef long long hrtime_t;
+
+extern int rtl_printf(const char *fmt, ...);
+extern hrtime_t gethrtime(void); /**< CLOCK_MONOTONIC, in ns */
+extern hrtime_t clock_gethrtime(clockid_t);  /**< every clock is CLOCK_MONOTONIC */
+
+static inline void timespec_add_ns(struct timespec *t, long ns)
+{
+  t->tv_nsec += ns;
+  while (t->tv_nsec >= 1000000000L) t->tv_nsec -= 1000000000L, ++t->tv_sec;
+}
+
+#define rtl_critical(flags) ((void)((flags) = 0))
+#define rtl_end_critical(flags) ((void)(flags))
+
+#define RTF_NO 64
+extern int rtf_create(unsigned minor, int size);
+extern int rtf_destroy(unsigned minor);
+extern int rtf_put(unsigned minor, void *buf, int count);
+extern int rtf_get(unsigned minor, void *buf, int count);
+extern int fsmSimRtfFree(unsigned minor);
+#define RTF_FREE(minor) fsmSimRtfFree(minor)
+
+extern int fsmSimThreadAttrRT(pthread_attr_t *, int on);
+extern int fsmSimThreadCreate(pthread_t *, pthread_attr_t *, void *(*)(void *), void *);
+extern int fsmSimThreadAttrCpu(pthread_attr_t *, int cpu);
+#define rtl_num_cpus() ((int)sysconf(_SC_NPROCESSORS_ONLN))
+extern int fsmSimClockNanosleep(clockid_t, int flags, const struct timespec *, struct timespec *);
+
+/* RatExpFSM.c defines its own clock_gettime(), and the RT task's pthread
+   calls need adapting; RatExpFSMSim.c itself wants the real ones */
+#ifndef FSM_SIM_IMPL
+#  define clock_gettime fsmSimClockGettime
+#  define clock_nanosleep fsmSimClockNanosleep
+#  define pthread_attr_setfp_np fsmSimThreadAttrRT
+#  define pthread_create fsmSimThreadCreate
+#  define pthread_attr_setcpu_np fsmSimThreadAttrCpu
+#endif
+
+/*---------------------------------------------------------------------------
+  mbuff
+-----------------------------------------------------------------------------*/
+extern void *mbuff_alloc(const char *name, int size);
+extern void mbuff_free(const char *name, void *mbuf);
+#define mbuff_attach mbuff_alloc /* as in mbuff, attaching creates it if need be */
+extern void mbuff_detach(const char *name, void *mbuf);
+
+/*---------------------------------------------------------------------------
+  Comedi
+-----------------------------------------------------------------------------*/
+typedef unsigned short sampl_t;
+typedef unsigned int lsampl_t;
+typedef struct comedi_t_struct comedi_t;
+typedef struct
+{
+  int min, max; /* in microvolts */
+  unsigned flags;
+} comedi_krange;
+typedef struct
+{
+  unsigned subdev, flags;
+  unsigned start_src, start_arg, scan_begin_src, scan_begin_arg,
+           convert_src, convert_arg, scan_end_src, scan_end_arg,
+           stop_src, stop_arg;
+  unsigned *chanlist;
+  unsigned chanlist_len;
+} comedi_cmd;
+
+#define COMEDI_NDEVICES 4
+enum { COMEDI_SUBD_AI = 1, COMEDI_SUBD_AO, COMEDI_SUBD_DI, COMEDI_SUBD_DO, COMEDI_SUBD_DIO };
+enum { COMEDI_INPUT = 0, COMEDI_OUTPUT = 1 };
+#define AREF_GROUND 0
+#define UNIT_volt 0
+#define RF_UNIT(flags) ((flags) & 0xff)
+#define CR_PACK(chan, rng, aref) ((((aref) & 0x3) << 24) | (((rng) & 0xff) << 16) | (chan))
+#define COMEDI_CB_EOS 1
+#define COMEDI_CB_EOA 2
+#define COMEDI_CB_BLOCK 4
+#define COMEDI_CB_ERROR 16
+#define COMEDI_CB_OVERFLOW 32
+#define TRIG_NONE 0x1
+#define TRIG_NOW 0x2
+#define TRIG_TIMER 0x10
+#define TRIG_COUNT 0x20
+#define TRIG_RT 0x1
+#define TRIG_WAKE_EOS 0x20
+#define TRIG_ROUND_DOWN 0x30000
+
+extern comedi_t *comedi_open(const char *fn);
+extern int comedi_close(comedi_t *);
+extern int comedi_lock(comedi_t *, unsigned subdev);
+extern int comedi_unlock(comedi_t *, unsigned subdev);
+extern int comedi_find_subdevice_by_type(comedi_t *, int type, unsigned start);
+extern int comedi_get_n_channels(comedi_t *, unsigned subdev);
+extern int comedi_get_n_ranges(comedi_t *, unsigned subdev, unsigned chan);
+extern int comedi_get_krange(comedi_t *, unsigned subdev, unsigned chan, unsigned range, comedi_krange *);
+extern lsampl_t comedi_get_maxdata(comedi_t *, unsigned subdev, unsigned chan);
+extern int comedi_dio_config(comedi_t *, unsigned subdev, unsigned chan, unsigned io);
+extern int comedi_dio_bitfield(comedi_t *, unsigned subdev, unsigned mask, unsigned *bits);
+extern int comedi_data_read(comedi_t *, unsigned subdev, unsigned chan, unsigned range, unsigned aref, lsampl_t *data);
+extern int comedi_data_write(comedi_t *, unsigned subdev, unsigned chan, unsigned range, unsigned aref, lsampl_t data);
+/* asynchronous acquisition (ai=asynch) is not simulated, these all fail */
+extern int comedi_register_callback(comedi_t *, unsigned subdev, unsigned mask, int (*cb)(unsigned, void *), void *arg);
+extern int comedi_command_test(comedi_t *, comedi_cmd *);
+extern int comedi_command(comedi_t *, comedi_cmd *);
+extern int comedi_cancel(comedi_t *, unsigned subdev);
+extern int comedi_map(comedi_t *, unsigned subdev, void *ptr);
+extern int comedi_get_buffer_size(comedi_t *, unsigned subdev);
+extern int comedi_get_buffer_offset(comedi_t *, unsigned subdev);
+extern int comedi_get_buffer_contents(comedi_t *, unsigned subdev);
+extern int comedi_mark_buffer_read(comedi_t *, unsigned subdev, unsigned bytes);
+
+/** The simulated board behind comedi.  The simulator's default device
+    replays recorded inputs from a trace file and logs everything written
+    to it; to plug in another one, point fsmSimDevice at it before
+    fsmSimModuleInit() runs.  All the functions are called from the RT
+    task, so they had better be quick.  t is in ns, on gethrtime()'s clock. */
+struct FSMSimDevice
+{
+  const char *name;
+  unsigned n_dio, n_ai, n_ao; /**< channel counts */
+  lsampl_t ai_maxdata, ao_maxdata; /**< the AI and AO range is 0-5V */
+  void (*dio_config)(struct FSMSimDevice *, unsigned chan, int output);
+  unsigned (*dio_read)(struct FSMSimDevice *, hrtime_t t);  /**< all input lines as a bitfield */
+  void (*dio_write)(struct FSMSimDevice *, hrtime_t t, unsigned mask, unsigned bits);
+  lsampl_t (*ai_read)(struct FSMSimDevice *, hrtime_t t, unsigned chan);
+  void (*ao_write)(struct FSMSimDevice *, hrtime_t t, unsigned chan, lsampl_t samp);
+  void (*sound_trig)(struct FSMSimDevice *, hrtime_t t, unsigned card, int trig);
+  void *priv;
+};
+extern struct FSMSimDevice *fsmSimDevice;
+
+/*---------------------------------------------------------------------------
+  ../LynxTrig/LynxTrigVirt.h and FSMExternalTime.h, whose real versions are
+  kernel only
+-----------------------------------------------------------------------------*/
+struct LynxTrigVirtShm { int magic; };
+#define LYNX_TRIG_VIRT_SHM_NAME "LVirtShm"
+#define LYNX_TRIG_VIRT_SHM_SIZE sizeof(struct LynxTrigVirtShm)
+#define LYNX_TRIG_VIRT_SHM_IS_VALID(shm) ((shm) != 0)
+extern void fsmSimSoundTrig(unsigned card, int trig);
+#define LYNX_TRIG(shm, card, trig) fsmSimSoundTrig((card), (trig))
+#define LYNX_UNTRIG(shm, card, trig) fsmSimSoundTrig((card), (int)(trig) < 0 ? (int)(trig) : -(int)(trig))
+
+struct FSMExtTimeShm { int magic; };
+#define FSM_EXT_TIME_SHM_NAME "FSMExtTm"
+#define FSM_EXT_TIME_SHM_SIZE sizeof(struct FSMExtTimeShm)
+#define FSM_EXT_TIME_SHM_IS_VALID(shm) 0
+#define FSM_EXT_TIME_GET(shm) ((int64)0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
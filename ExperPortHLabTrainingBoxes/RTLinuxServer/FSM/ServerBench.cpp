@@ -0,0 +1,565 @@
+/**
+   ServerBench -- load generator and end-to-end benchmark for
+   RatExpFSMServer and LynxTrigServer.
+
+   Opens N concurrent clients spread over all the server's state machines,
+   each replaying a weighted mix of the commands the Matlab clients send
+   during a session, plus M NOTIFY EVENTS listeners, for a fixed time.  At
+   the end it prints throughput and latency percentiles per command kind,
+   how late NOTIFY EVENTS lines arrive, and how much CPU each server used
+   (if it runs on this host).
+
+   The command kinds, weighted with -m:
+
+     poll    GET EVENT COUNTER, then GET EVENTS for whatever is new (the
+             way the Matlab clients poll between trials)
+     time    GET TIME
+     state   GET CURRENT STATE
+     matrix  SET STATE MATRIX with a -x state matrix (a new trial)
+     patch   PATCH STATE MATRIX of 4 timeout and output cells (a new
+             trial for a protocol that only changes those)
+     hash    SET STATE MATRIX HASH of the -x state matrix (a new trial
+             reusing a matrix the server has cached)
+     daq     GET DAQ SCANS (DAQ gets started on every state machine)
+     sound   SET SOUND of -z bytes to the sound server (needs -s)
+
+   Beware that matrix uploads replace the state machines' programs, so
+   run this against a simulator (see RatExpFSMSim.h) or idle rigs only.
+
+   With -r each client issues that many commands a second, and a command
+   that goes out late because the previous ones were slow counts from
+   when it was due, so a stalled server shows up in the tail instead of
+   just slowing the clients down.  Without it the
+   clients go flat out.
+*/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#ifndef _REENTRANT
+#define _REENTRANT
+#endif
+#include "Metrics.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <algorithm>
+
+namespace
+{
+  enum Op { Poll = 0, Time, State, Matrix, Patch, Hash, DAQ, Sound, NumOps };
+  const char * const opNames[NumOps] = { "poll", "time", "state", "matrix", "patch", "hash", "daq", "sound" };
+
+  std::string host = "localhost";
+  unsigned short fsmPort = 3333, soundPort = 0;
+  unsigned nClients = 0, nNotify = 0, nStates = 64, soundBytes = 176400;
+  double duration = 10., rate = 0.;
+  int fsmPid = 0, soundPid = 0;
+  unsigned weights[NumOps] = { 60, 20, 10, 2, 0, 0, 5, 1 };
+  unsigned nFSMs = 1;
+
+  volatile bool stop = false;
+  LatencyHistogram opLatency[NumOps], notifyDelay;
+  volatile unsigned long opErrors[NumOps], connectErrors;
+
+  double now()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+  }
+
+  /// A blocking connection to one of the servers speaking their text protocol.
+  class Client
+  {
+  public:
+    Client() : fd(-1) {}
+    ~Client() { disconnect(); }
+
+    bool connect(unsigned short port);
+    void disconnect() { if (fd > -1) ::close(fd), fd = -1; buf.clear(); }
+    bool connected() const { return fd > -1; }
+
+    bool send(const std::string & s) { return send(s.data(), s.length()); }
+    bool send(const void *p, size_t n);
+    bool readLine(std::string & line, double deadline = 0.);
+    bool readData(void *p, size_t n);
+
+    /// send cmd, read the reply up to the OK line, false on ERROR or a dead connection
+    bool command(const std::string & cmd, std::string *reply = 0);
+    /// send cmd, do the MATRIX r c/READY handshake, read r*c doubles and the OK
+    bool matrixCommand(const std::string & cmd, unsigned *rows = 0);
+    /// send cmd, wait for READY, send the data, read the OK
+    bool uploadCommand(const std::string & cmd, const void *data, size_t n);
+
+  private:
+    int fd;
+    std::string buf;
+  };
+
+  bool Client::connect(unsigned short port)
+  {
+    disconnect();
+    struct addrinfo hints, *ai = 0;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    std::ostringstream p;
+    p << port;
+    if (getaddrinfo(host.c_str(), p.str().c_str(), &hints, &ai) || !ai) return false;
+    fd = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd > -1 && ::connect(fd, ai->ai_addr, ai->ai_addrlen)) ::close(fd), fd = -1;
+    freeaddrinfo(ai);
+    if (fd < 0) return false;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return true;
+  }
+
+  bool Client::send(const void *p, size_t n)
+  {
+    const char *c = static_cast<const char *>(p);
+    while (n) {
+      ssize_t r = ::send(fd, c, n, MSG_NOSIGNAL);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) { disconnect(); return false; }
+      c += r, n -= r;
+    }
+    return true;
+  }
+
+  bool Client::readLine(std::string & line, double deadline)
+  {
+    std::string::size_type nl;
+    while ((nl = buf.find('\n')) == std::string::npos) {
+      if (deadline > 0.) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        const double left = deadline - now();
+        if (left <= 0. || !::poll(&pfd, 1, int(left * 1000.) + 1)) return false;
+      }
+      char tmp[4096];
+      ssize_t r = ::recv(fd, tmp, sizeof(tmp), 0);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) { disconnect(); return false; }
+      buf.append(tmp, r);
+    }
+    line = buf.substr(0, nl);
+    buf.erase(0, nl + 1);
+    return true;
+  }
+
+  bool Client::readData(void *p, size_t n)
+  {
+    char *c = static_cast<char *>(p);
+    const size_t have = std::min(n, buf.length());
+    memcpy(c, buf.data(), have);
+    buf.erase(0, have);
+    c += have, n -= have;
+    while (n) {
+      ssize_t r = ::recv(fd, c, n, 0);
+      if (r < 0 && errno == EINTR) continue;
+      if (r <= 0) { disconnect(); return false; }
+      c += r, n -= r;
+    }
+    return true;
+  }
+
+  bool Client::command(const std::string & cmd, std::string *reply)
+  {
+    std::string line;
+    if (reply) reply->clear();
+    if (!send(cmd + "\n")) return false;
+    while (readLine(line)) {
+      if (line.find("OK") == 0) return true;
+      if (line.find("ERROR") == 0) return false;
+      if (reply) *reply += line + "\n";
+    }
+    return false;
+  }
+
+  bool Client::matrixCommand(const std::string & cmd, unsigned *rows)
+  {
+    std::string line;
+    unsigned r = 0, c = 0;
+    if (!send(cmd + "\n") || !readLine(line)) return false;
+    if (sscanf(line.c_str(), "MATRIX %u %u", &r, &c) != 2) return false;
+    std::vector<double> data(r * c);
+    if (!send("READY\n") || (r && c && !readData(&data[0], r * c * sizeof(double)))) return false;
+    if (rows) *rows = r;
+    return readLine(line) && line.find("OK") == 0;
+  }
+
+  bool Client::uploadCommand(const std::string & cmd, const void *data, size_t n)
+  {
+    std::string line;
+    if (!send(cmd + "\n") || !readLine(line) || line.find("READY") != 0) return false;
+    return send(data, n) && readLine(line) && line.find("OK") == 0;
+  }
+
+  /// A state matrix in the shape the Matlab clients send at the start of a
+  /// trial: Cin/Cout/Lin/Lout/Rin/Rout, timeout state and time, and the
+  /// dout and sound trigger output columns, plus the input mapping row.
+  /// The server's matrices are column major.
+  std::vector<double> makeStateMatrix(unsigned states, unsigned & rows, unsigned & cols)
+  {
+    rows = states + 1, cols = 6 + 2 + 2;
+    std::vector<double> m(rows * cols, 0.);
+    for (unsigned s = 0; s < states; ++s) {
+      for (unsigned e = 0; e < 6; ++e) m[e * rows + s] = (s + 1 + e) % states;
+      m[6 * rows + s] = (s + 1) % states; // timeout state
+      m[7 * rows + s] = 1. + s % 5;       // timeout time, s
+      m[8 * rows + s] = s & 0xff;         // dout bits
+      m[9 * rows + s] = s % 3 ? 0 : 1;    // sound trigger
+    }
+    const double inputs[6] = { 1, -1, 2, -2, 3, -3 };
+    for (unsigned e = 0; e < 6; ++e) m[e * rows + states] = inputs[e];
+    return m;
+  }
+
+  struct ClientArgs
+  {
+    unsigned id, fsm;
+  };
+
+  bool setup(Client & fsm, Client & sound, unsigned fsmId)
+  {
+    std::ostringstream s, c;
+    s << "SET STATE MACHINE " << fsmId;
+    c << "SET CARD " << fsmId; // the rigs pair state machine n with sound card n
+    if (!fsm.connect(fsmPort) || !fsm.command(s.str())) return false;
+    return !soundPort || (sound.connect(soundPort) && sound.command(c.str()));
+  }
+
+  void *clientThread(void *arg)
+  {
+    const ClientArgs & a = *static_cast<ClientArgs *>(arg);
+    Client fsm, sound;
+    unsigned rows, cols;
+    const std::vector<double> matrix = makeStateMatrix(nStates, rows, cols);
+    std::ostringstream m;
+    m << "SET STATE MATRIX " << rows << " " << cols << " 6 0 dio 0 8 0 1";
+    const std::string matrixCmd = m.str();
+    std::string hashCmd;
+    // row, col, value columns: new timeouts for states 0 and 1, new dout bits for 2 and 3
+    double patchCells[4*3] = { 0, 1, 2, 3,   7, 7, 8, 8,   0, 0, 0, 0 };
+    std::ostringstream snd;
+    snd << "SET SOUND " << (a.id + 1) << " " << soundBytes << " 2 2 44100";
+    const std::string soundCmd = snd.str();
+    std::vector<char> soundData(soundBytes, 0);
+    unsigned long lastCount = 0;
+    unsigned seed = a.id * 2654435761U + 1;
+    unsigned totalWeight = 0;
+    for (unsigned i = 0; i < NumOps; ++i) totalWeight += weights[i];
+
+    double due = now();
+    while (!stop) {
+      if (!fsm.connected() || (soundPort && !sound.connected())) {
+        // patches need a matrix of ours to patch, and hashes one to reuse
+        std::string hash;
+        if (!setup(fsm, sound, a.fsm)
+            || ((weights[Patch] || weights[Hash]) && !fsm.uploadCommand(matrixCmd, &matrix[0], matrix.size() * sizeof(double)))
+            || (weights[Hash] && !fsm.command("GET STATE MATRIX HASH", &hash))) {
+          __sync_fetch_and_add(&connectErrors, 1);
+          fsm.disconnect();
+          usleep(100000);
+          continue;
+        }
+        hashCmd = "SET STATE MATRIX HASH " + hash.substr(0, hash.find('\n'));
+      }
+      unsigned pick = rand_r(&seed) % totalWeight, op = 0;
+      while (pick >= weights[op]) pick -= weights[op++];
+
+      // behind schedule the command counts from when it was due, otherwise
+      // from when it went out so that our own oversleeping doesn't count
+      double start = now();
+      if (rate > 0.) {
+        due += 1. / rate;
+        if (due > start) usleep(useconds_t((due - start) * 1e6)), start = now();
+        else start = due;
+        if (stop) break;
+      }
+
+      bool ok = true;
+      std::string reply;
+      switch (op) {
+      case Poll:
+        ok = fsm.command("GET EVENT COUNTER", &reply);
+        if (ok) {
+          const unsigned long count = strtoul(reply.c_str(), 0, 10);
+          if (count < lastCount) lastCount = 0; // the FSM got reset
+          if (count > lastCount) {
+            // never more than a trial's worth at once, like the clients
+            const unsigned long first = std::max(lastCount, count > 64 ? count - 64 : 0UL);
+            std::ostringstream s;
+            s << "GET EVENTS " << first << " " << (count - 1);
+            ok = fsm.matrixCommand(s.str());
+            lastCount = count;
+          }
+        }
+        break;
+      case Time:   ok = fsm.command("GET TIME"); break;
+      case State:  ok = fsm.command("GET CURRENT STATE"); break;
+      case Matrix: ok = fsm.uploadCommand(matrixCmd, &matrix[0], matrix.size() * sizeof(double)); break;
+      case Patch:
+        for (unsigned i = 0; i < 4; ++i) patchCells[8 + i] = i < 2 ? 1. + rand_r(&seed) % 5 : rand_r(&seed) & 0xff;
+        ok = fsm.uploadCommand("PATCH STATE MATRIX 4", patchCells, sizeof(patchCells));
+        break;
+      case Hash:   ok = fsm.command(hashCmd); break;
+      case DAQ:    ok = fsm.matrixCommand("GET DAQ SCANS"); break;
+      case Sound:  ok = soundCmd.length() && sound.connected() && sound.uploadCommand(soundCmd, &soundData[0], soundData.size()); break;
+      }
+      if (stop) break; // don't count the ones cut short
+      opLatency[op].recordSecs(now() - start);
+      if (!ok) __sync_fetch_and_add(&opErrors[op], 1);
+    }
+    return 0;
+  }
+
+  void *notifyThread(void *arg)
+  {
+    const ClientArgs & a = *static_cast<ClientArgs *>(arg);
+    Client fsm;
+    std::ostringstream s;
+    s << "SET STATE MACHINE " << a.fsm;
+    if (!fsm.connect(fsmPort) || !fsm.command(s.str()) || !fsm.command("NOTIFY EVENTS VERBOSE")) {
+      __sync_fetch_and_add(&connectErrors, 1);
+      return 0;
+    }
+    // Each line carries the transition's FSM timestamp.  The FSM clock isn't
+    // ours so we keep (arrival - timestamp) and report it above the smallest
+    // one seen, which is the delivery delay over the best case.
+    std::vector<double> *diffs = new std::vector<double>;
+    std::string line;
+    while (!stop && fsm.connected()) {
+      int prev, state, event;
+      double ts;
+      if (fsm.readLine(line, now() + 0.1)
+          && sscanf(line.c_str(), "%d %d %d %lf", &prev, &state, &event, &ts) == 4)
+        diffs->push_back(now() - ts);
+    }
+    return diffs;
+  }
+
+  struct CPUTimes
+  {
+    double user, sys;
+  };
+
+  /// utime and stime of pid from /proc, in seconds
+  bool readCPU(int pid, CPUTimes & t)
+  {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return false;
+    char buf[1024];
+    const size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = 0;
+    const char *p = strrchr(buf, ')'); // comm may have spaces
+    unsigned long ut, st;
+    if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &ut, &st) != 2) return false;
+    const double hz = sysconf(_SC_CLK_TCK);
+    t.user = ut / hz, t.sys = st / hz;
+    return true;
+  }
+
+  /// the pid of the process called name, if it runs here, else 0
+  int findPid(const char *name)
+  {
+    DIR *d = opendir("/proc");
+    int ret = 0;
+    struct dirent *e;
+    while (d && !ret && (e = readdir(d))) {
+      const int pid = atoi(e->d_name);
+      char path[64], comm[64] = "";
+      if (pid <= 0) continue;
+      snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+      FILE *f = fopen(path, "r");
+      if (!f) continue;
+      if (fgets(comm, sizeof(comm), f)) {
+        comm[strcspn(comm, "\n")] = 0;
+        if (!strncmp(comm, name, 15) && strlen(comm) == std::min(strlen(name), size_t(15))) ret = pid; // comm is cut at 15
+      }
+      fclose(f);
+    }
+    if (d) closedir(d);
+    return ret;
+  }
+
+  void printRow(const char *name, const LatencyHistogram::Summary & s, unsigned long errors)
+  {
+    printf("%-8s %9llu %9.1f %9.1f %9.0f %9.0f %9.0f %9llu %7lu\n", name, s.count, s.count / duration,
+           s.mean, s.p50, s.p99, s.p999, s.max, errors);
+  }
+
+  void printCPU(const char *name, int pid, const CPUTimes & before, const CPUTimes & after, double secs)
+  {
+    printf("%s (pid %d): %.1f%% cpu (%.1f%% user, %.1f%% sys)\n", name, pid,
+           100. * (after.user + after.sys - before.user - before.sys) / secs,
+           100. * (after.user - before.user) / secs, 100. * (after.sys - before.sys) / secs);
+  }
+
+  bool parseMix(const char *arg)
+  {
+    std::fill(weights, weights + NumOps, 0);
+    std::istringstream s(arg);
+    std::string item;
+    while (std::getline(s, item, ',')) {
+      const std::string::size_type eq = item.find('=');
+      unsigned op = 0;
+      while (op < NumOps && item.substr(0, eq) != opNames[op]) ++op;
+      if (op == NumOps || eq == std::string::npos) return false;
+      weights[op] = atoi(item.c_str() + eq + 1);
+    }
+    unsigned total = 0;
+    for (unsigned i = 0; i < NumOps; ++i) total += weights[i];
+    return total > 0;
+  }
+
+  void usage(const char *prg)
+  {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -H host     the servers' host (localhost)\n"
+            "  -p port     RatExpFSMServer port (3333)\n"
+            "  -s port     LynxTrigServer port, enables sound uploads (none)\n"
+            "  -c n        concurrent clients (one per state machine)\n"
+            "  -n n        NOTIFY EVENTS listeners (0)\n"
+            "  -d secs     how long to run (10)\n"
+            "  -r hz       commands per second per client (0, flat out)\n"
+            "  -m mix      command weights (poll=60,time=20,state=10,matrix=2,patch=0,hash=0,daq=5,sound=1)\n"
+            "  -x states   states in the uploaded matrices (64)\n"
+            "  -z bytes    size of the uploaded sounds (176400)\n"
+            "  -P pid      RatExpFSMServer's pid for the CPU figures (looked up)\n"
+            "  -S pid      LynxTrigServer's pid for the CPU figures (looked up)\n", prg);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  int c;
+  while ((c = getopt(argc, argv, "H:p:s:c:n:d:r:m:x:z:P:S:h")) != -1) {
+    switch (c) {
+    case 'H': host = optarg; break;
+    case 'p': fsmPort = atoi(optarg); break;
+    case 's': soundPort = atoi(optarg); break;
+    case 'c': nClients = atoi(optarg); break;
+    case 'n': nNotify = atoi(optarg); break;
+    case 'd': duration = atof(optarg); break;
+    case 'r': rate = atof(optarg); break;
+    case 'm': if (!parseMix(optarg)) { usage(argv[0]); return 1; } break;
+    case 'x': nStates = std::max(1, atoi(optarg)); break;
+    case 'z': soundBytes = std::max(4, atoi(optarg)) & ~3; break;
+    case 'P': fsmPid = atoi(optarg); break;
+    case 'S': soundPid = atoi(optarg); break;
+    default: usage(argv[0]); return 1;
+    }
+  }
+  if (optind < argc || duration <= 0.) { usage(argv[0]); return 1; }
+  if (!soundPort) weights[Sound] = 0;
+
+  Client ctl;
+  std::string reply;
+  if (!ctl.connect(fsmPort) || !ctl.command("GET NUM STATE MACHINES", &reply)) {
+    fprintf(stderr, "Cannot talk to RatExpFSMServer at %s:%hu\n", host.c_str(), fsmPort);
+    return 1;
+  }
+  nFSMs = std::max(1, atoi(reply.c_str()));
+  if (!nClients) nClients = nFSMs;
+  if (weights[DAQ])
+    for (unsigned f = 0; f < nFSMs; ++f) {
+      std::ostringstream s;
+      s << "SET STATE MACHINE " << f;
+      ctl.command(s.str());
+      ctl.command("START DAQ 0 0,5");
+    }
+
+  if (host == "localhost" || host == "127.0.0.1") {
+    if (!fsmPid) fsmPid = findPid("RatExpFSMServer");
+    if (!soundPid && soundPort) soundPid = findPid("LynxTrigServer");
+  }
+  CPUTimes fsmBefore, fsmAfter, soundBefore, soundAfter;
+  const bool fsmCPU = fsmPid && readCPU(fsmPid, fsmBefore), soundCPU = soundPid && readCPU(soundPid, soundBefore);
+
+  printf("%u clients and %u NOTIFY EVENTS listeners on %u state machines for %g s%s\n",
+         nClients, nNotify, nFSMs, duration, rate > 0. ? "" : ", flat out");
+
+  std::vector<ClientArgs> args(nClients + nNotify);
+  std::vector<pthread_t> threads(args.size());
+  const double t0 = now();
+  for (unsigned i = 0; i < args.size(); ++i) {
+    args[i].id = i;
+    args[i].fsm = (i < nClients ? i : i - nClients) % nFSMs;
+    pthread_create(&threads[i], 0, i < nClients ? clientThread : notifyThread, &args[i]);
+  }
+  usleep(useconds_t(duration * 1e6));
+  stop = true;
+  std::vector<double> diffs;
+  for (unsigned i = 0; i < threads.size(); ++i) {
+    void *ret = 0;
+    pthread_join(threads[i], &ret);
+    if (i >= nClients && ret) {
+      std::vector<double> *d = static_cast<std::vector<double> *>(ret);
+      if (d->size()) {
+        const double best = *std::min_element(d->begin(), d->end());
+        for (unsigned j = 0; j < d->size(); ++j) notifyDelay.recordSecs((*d)[j] - best);
+      }
+      delete d;
+    }
+  }
+  const double secs = now() - t0;
+  if (fsmCPU && !readCPU(fsmPid, fsmAfter)) fsmAfter = fsmBefore;
+  if (soundCPU && !readCPU(soundPid, soundAfter)) soundAfter = soundBefore;
+
+  if (weights[DAQ])
+    for (unsigned f = 0; f < nFSMs; ++f) {
+      std::ostringstream s;
+      s << "SET STATE MACHINE " << f;
+      ctl.command(s.str());
+      ctl.command("STOP DAQ");
+    }
+
+  printf("\n%-8s %9s %9s %9s %9s %9s %9s %9s %7s\n", "command", "count", "per sec", "mean us", "p50 us", "p99 us", "p99.9 us", "max us", "errors");
+  LatencyHistogram::Summary all;
+  memset(&all, 0, sizeof(all));
+  unsigned long allErrors = 0;
+  for (unsigned i = 0; i < NumOps; ++i) {
+    if (!weights[i]) continue;
+    const LatencyHistogram::Summary s = opLatency[i].summary();
+    printRow(opNames[i], s, opErrors[i]);
+    all.mean = all.count + s.count ? (all.mean * all.count + s.mean * s.count) / (all.count + s.count) : 0.;
+    all.count += s.count;
+    all.max = std::max(all.max, s.max);
+    allErrors += opErrors[i];
+  }
+  printf("%-8s %9llu %9.1f %9.1f %9s %9s %9s %9llu %7lu\n", "all", all.count, all.count / duration, all.mean, "", "", "", all.max, allErrors);
+  if (connectErrors) printf("%lu failed (re)connects\n", connectErrors);
+  if (nNotify) {
+    const LatencyHistogram::Summary s = notifyDelay.summary();
+    printf("\nNOTIFY EVENTS: %llu lines, %.1f per sec, delay over best case: mean %.1f us, p50 %.0f us, p99 %.0f us, p99.9 %.0f us, max %llu us\n",
+           s.count, s.count / duration, s.mean, s.p50, s.p99, s.p999, s.max);
+  }
+  printf("\n");
+  if (fsmCPU) printCPU("RatExpFSMServer", fsmPid, fsmBefore, fsmAfter, secs);
+  else printf("RatExpFSMServer: no cpu figures, it doesn't run here (try -P)\n");
+  if (soundPort) {
+    if (soundCPU) printCPU("LynxTrigServer", soundPid, soundBefore, soundAfter, secs);
+    else printf("LynxTrigServer: no cpu figures, it doesn't run here (try -S)\n");
+  }
+  return 0;
+}
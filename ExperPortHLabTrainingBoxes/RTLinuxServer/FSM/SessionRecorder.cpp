@@ -0,0 +1,244 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#ifndef _REENTRANT
+#define _REENTRANT
+#endif
+#include "SessionRecorder.h"
+#include "AsyncLog.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+
+extern "C" void *sessionRecorderWriterThr(void *arg)
+{
+  return static_cast<SessionRecorder *>(arg)->writerThrFun();
+}
+
+SessionRecorder::SessionRecorder()
+  : isRecording(false), stopping(false), fd(-1), offset(0), lastIndex(0),
+    pendingLastIndex(0), trial(0), dropped(0), written(0)
+{
+  pthread_mutex_init(&ctlLock, 0);
+  pthread_mutex_init(&lock, 0);
+  pthread_cond_init(&cond, 0);
+}
+
+SessionRecorder::~SessionRecorder()
+{
+  stop();
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&lock);
+  pthread_mutex_destroy(&ctlLock);
+}
+
+bool SessionRecorder::start(const std::string & path, unsigned fsm_id, std::string & err)
+{
+  pthread_mutex_lock(&ctlLock);
+  const bool ok = startLocked(path, fsm_id, err);
+  pthread_mutex_unlock(&ctlLock);
+  return ok;
+}
+
+bool SessionRecorder::startLocked(const std::string & path, unsigned fsm_id, std::string & err)
+{
+  if (isRecording) { err = "already recording to " + filePath; return false; }
+  // never clobber an earlier session
+  fd = ::open(path.c_str(), O_WRONLY|O_CREAT|O_EXCL, 0644);
+  if (fd < 0) { err = path + ": " + strerror(errno); return false; }
+  FSMRecFileHdr h;
+  memset(&h, 0, sizeof(h));
+  h.magic = FSM_REC_MAGIC;
+  h.version = FSM_REC_VERSION;
+  h.fsm_id = fsm_id;
+  h.hdr_size = sizeof(h);
+  h.start_time = ::time(0);
+  h.last_index = 0;
+  if (::write(fd, &h, sizeof(h)) != (int)sizeof(h)) {
+    err = path + ": " + strerror(errno);
+    ::close(fd), fd = -1;
+    return false;
+  }
+  pthread_mutex_lock(&lock);
+  filePath = path;
+  pending.clear();
+  index.clear();
+  offset = written = sizeof(h);
+  lastIndex = pendingLastIndex = 0;
+  trial = 0;
+  dropped = 0;
+  stopping = false;
+  pthread_mutex_unlock(&lock);
+  if (pthread_create(&writerThread, 0, sessionRecorderWriterThr, this)) {
+    err = "could not create the recorder's writer thread";
+    ::close(fd), fd = -1;
+    return false;
+  }
+  isRecording = true;
+  return true;
+}
+
+void SessionRecorder::stop()
+{
+  // so that two stops (say a client's and cleanup()'s) don't both join the writer
+  pthread_mutex_lock(&ctlLock);
+  if (isRecording) {
+    pthread_mutex_lock(&lock);
+    isRecording = false; // under the lock, so nobody appends after the writer's last flush
+    stopping = true;
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writerThread, 0);
+    ::close(fd), fd = -1;
+    if (dropped)
+      AsyncLog::logs(AsyncLog::Warning, "Session recorder dropped %ld records, the disk could not keep up, in ", filePath, dropped);
+  }
+  pthread_mutex_unlock(&ctlLock);
+}
+
+void SessionRecorder::status(std::string & path, unsigned long long & bytes, unsigned long & drops)
+{
+  pthread_mutex_lock(&lock);
+  path = isRecording ? filePath : "";
+  bytes = written;
+  drops = dropped;
+  pthread_mutex_unlock(&lock);
+}
+
+void SessionRecorder::addTransitions(const StateTransition *t, unsigned n)
+{
+  if (!isRecording || !n) return;
+  pthread_mutex_lock(&lock);
+  append(FSM_REC_TRANSITIONS, t[0].ts, t, n*sizeof(*t));
+  for (unsigned i = 0; i < n; ++i)
+    if (t[i].state == 0 && t[i].previous_state != 0) ++trial;
+  pthread_mutex_unlock(&lock);
+}
+
+void SessionRecorder::addDAQ(const void *scans, unsigned len)
+{
+  if (!isRecording || len < sizeof(DAQScan)) return;
+  pthread_mutex_lock(&lock);
+  append(FSM_REC_DAQ, static_cast<const DAQScan *>(scans)->ts_nanos, scans, len);
+  pthread_mutex_unlock(&lock);
+}
+
+void SessionRecorder::addNRT(const NRTOutput & nrt)
+{
+  if (!isRecording) return;
+  pthread_mutex_lock(&lock);
+  append(FSM_REC_NRT, nrt.ts_nanos, &nrt, sizeof(nrt));
+  pthread_mutex_unlock(&lock);
+}
+
+void SessionRecorder::append(unsigned type, long long ts, const void *data, unsigned len)
+{
+  if (!isRecording) return;
+  const unsigned padded = FSM_REC_PADDED_LEN(len);
+  if (pending.size() + sizeof(FSMRecHdr) + padded > MaxPending) {
+    ++dropped;
+    return;
+  }
+  FSMRecHdr h;
+  h.type = type;
+  h.len = len;
+  h.ts_nanos = ts;
+  h.trial = trial;
+  h.reserved = 0;
+  FSMRecIndexEntry e;
+  e.offset = offset;
+  e.ts_nanos = ts;
+  e.trial = trial;
+  e.type = type;
+  index.push_back(e);
+  pending.append(reinterpret_cast<const char *>(&h), sizeof(h));
+  pending.append(static_cast<const char *>(data), len);
+  pending.append(padded - len, '\0');
+  offset += sizeof(h) + padded;
+  if (index.size() >= IndexEvery) appendIndex();
+  if (pending.size() >= FlushBytes) pthread_cond_signal(&cond);
+}
+
+void SessionRecorder::appendIndex()
+{
+  if (index.empty()) return;
+  FSMRecIndex ix;
+  ix.prev_index = pendingLastIndex;
+  ix.nentries = index.size();
+  ix.reserved = 0;
+  const unsigned len = sizeof(ix) + index.size()*sizeof(index[0]); // always a multiple of 8
+  FSMRecHdr h;
+  h.type = FSM_REC_INDEX;
+  h.len = len;
+  h.ts_nanos = index[0].ts_nanos;
+  h.trial = index[0].trial;
+  h.reserved = 0;
+  pending.append(reinterpret_cast<const char *>(&h), sizeof(h));
+  pending.append(reinterpret_cast<const char *>(&ix), sizeof(ix));
+  pending.append(reinterpret_cast<const char *>(&index[0]), index.size()*sizeof(index[0]));
+  pendingLastIndex = offset;
+  offset += sizeof(h) + len;
+  index.clear();
+}
+
+bool SessionRecorder::writeOut(std::string & data, unsigned long long newLastIndex)
+{
+  const char *p = data.data();
+  size_t left = data.size();
+  while (left) {
+    const int ret = ::write(fd, p, left);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      AsyncLog::logs(AsyncLog::Error, "Session recorder could not write to ", filePath + ": " + strerror(errno));
+      return false;
+    }
+    p += ret, left -= ret;
+  }
+  if (newLastIndex != lastIndex) {
+    // the index must be on disk before the header points to it
+    ::fdatasync(fd);
+    const uint64 li = newLastIndex;
+    if (::pwrite(fd, &li, sizeof(li), offsetof(FSMRecFileHdr, last_index)) == (int)sizeof(li))
+      lastIndex = newLastIndex;
+  }
+  return true;
+}
+
+void *SessionRecorder::writerThrFun()
+{
+  bool ok = true;
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    struct timeval now;
+    ::gettimeofday(&now, 0);
+    struct timespec deadline;
+    deadline.tv_sec = now.tv_sec + FlushMS/1000;
+    deadline.tv_nsec = now.tv_usec*1000 + (FlushMS%1000)*1000000;
+    if (deadline.tv_nsec >= 1000000000) deadline.tv_sec++, deadline.tv_nsec -= 1000000000;
+    while (!stopping && pending.size() < FlushBytes)
+      if (pthread_cond_timedwait(&cond, &lock, &deadline) == ETIMEDOUT) break;
+    const bool done = stopping;
+    if (done) appendIndex(); // the last few records get an index too
+    std::string data;
+    data.swap(pending);
+    const unsigned long long newLastIndex = pendingLastIndex;
+    pthread_mutex_unlock(&lock);
+
+    // after a write error just throw data away, there's no good way to continue the file
+    if (ok && !data.empty()) ok = writeOut(data, newLastIndex);
+
+    pthread_mutex_lock(&lock);
+    if (ok) written += data.size();
+    if (done) break;
+  }
+  pthread_mutex_unlock(&lock);
+  if (ok) ::fdatasync(fd);
+  return 0;
+}
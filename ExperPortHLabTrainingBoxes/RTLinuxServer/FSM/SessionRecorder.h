@@ -0,0 +1,73 @@
+#ifndef SessionRecorder_h
+#define SessionRecorder_h
+
+#include "RatExpFSMRecord.h"
+
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+/**
+   Writes one state machine's session to a file in the format described in
+   RatExpFSMRecord.h.
+
+   The add*() functions are called by the fifo reader threads.  They only
+   append the record to an in-memory buffer (and are a no-op unless
+   recording), so they never wait on the disk.  A writer thread swaps the
+   buffer out every FlushMS milliseconds, or sooner once it holds
+   FlushBytes, and writes it with one sequential write().  If the disk
+   falls so far behind that MaxPending bytes are waiting, further records
+   are dropped and counted rather than blocking the fifo readers.
+*/
+class SessionRecorder
+{
+public:
+  enum {
+    FlushMS = 250,
+    FlushBytes = 1024*1024,
+    MaxPending = 64*1024*1024,
+    IndexEvery = 256 ///< records between index records
+  };
+
+  SessionRecorder();
+  ~SessionRecorder();
+
+  /// creates path and starts recording to it, false (with the reason in err) on failure
+  bool start(const std::string & path, unsigned fsm_id, std::string & err);
+  /// writes out everything pending, plus a final index, and closes the file
+  void stop();
+  bool recording() const { return isRecording; }
+  /// the file being recorded to, how many bytes went to it and how many records were dropped
+  void status(std::string & path, unsigned long long & bytes, unsigned long & dropped);
+
+  void addTransitions(const StateTransition *t, unsigned n);
+  void addDAQ(const void *scans, unsigned len); ///< len bytes of DAQScans, as read from fifo_daq
+  void addNRT(const NRTOutput & nrt);
+
+  void *writerThrFun();
+
+private:
+  bool startLocked(const std::string & path, unsigned fsm_id, std::string & err); ///< ctlLock must be held
+  void append(unsigned type, long long ts, const void *data, unsigned len); ///< lock must be held
+  void appendIndex(); ///< lock must be held
+  bool writeOut(std::string & data, unsigned long long newLastIndex);
+
+  pthread_mutex_t ctlLock; ///< serializes start() and stop(), which set up and tear down what follows
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_t writerThread;
+  volatile bool isRecording;
+  bool stopping;
+  int fd;
+  std::string filePath;
+  // everything below is protected by lock
+  std::string pending; ///< records not yet handed to the writer thread
+  std::vector<FSMRecIndexEntry> index; ///< records since the last index record
+  unsigned long long offset; ///< file offset the next appended record will get
+  unsigned long long lastIndex, pendingLastIndex; ///< newest index record on disk / appended
+  unsigned trial;
+  unsigned long dropped;
+  unsigned long long written; ///< bytes on disk, the writer thread adds to it after each write
+};
+
+#endif
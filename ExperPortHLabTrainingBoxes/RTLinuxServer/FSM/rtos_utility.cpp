@@ -5,19 +5,22 @@
 #include "rtos_shared_memory.h"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h> 
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 
 RTOS::RTOS RTOS::determine()
 {
   RTOS rtosUsed = Unknown;
   struct stat statbuf;
 
-  if (!stat("/proc/rtai", &statbuf)) rtosUsed = RTAI;
+  if (getenv("RTOS_SIM_DIR")) rtosUsed = Sim;
+  else if (!stat("/proc/rtai", &statbuf)) rtosUsed = RTAI;
   else if(!stat("/proc/modules", &statbuf)) {
     FILE *proc_modules = fopen("/proc/modules", "r");
     static const int BUFSZ = 256;
@@ -58,6 +61,25 @@ struct ShmInfo
 typedef std::map<unsigned long, ShmInfo> ShmMap;
 static ShmMap shmMap;
 
+// the simulator's "mbuffs" are POSIX shm objects, /dev/shm/<name>
+static void *simShmAttach(const char *SHM_NAME, size_t size, RTOS::ShmStatus *s)
+{
+  std::string name = std::string("/") + SHM_NAME;
+  int fd = shm_open(name.c_str(), O_RDWR, 0);
+  struct stat statbuf;
+  void *ret = 0;
+
+  if (fd < 0) { if (s) *s = RTOS::NotFound; return 0; }
+  if (fstat(fd, &statbuf) || size_t(statbuf.st_size) < size) {
+    if (s) *s = RTOS::WrongSize;
+  } else {
+    ret = mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ret == MAP_FAILED) { ret = 0; if (s) *s = RTOS::NotFound; }
+  }
+  close(fd);
+  return ret;
+}
+
 void *RTOS::shmAttach(const char *SHM_NAME, size_t size, ShmStatus *s)
 {
   void *ret = 0;
@@ -73,6 +95,7 @@ void *RTOS::shmAttach(const char *SHM_NAME, size_t size, ShmStatus *s)
     switch(rtos) {
       case RTLinux:  ret = mbuff_attach(SHM_NAME, size);    break;
       case RTAI:  ret = rtai_shm_attach(SHM_NAME, size);    break;
+      case Sim:   ret = simShmAttach(SHM_NAME, size, s);    break;
       default:  break;
     }
     
@@ -112,6 +135,7 @@ void RTOS::shmDetach(const void *SHM, ShmStatus *s)
       switch (inf.rtos) {
         case RTLinux:  mbuff_detach(inf.name.c_str(), inf.address); break;
         case RTAI:     rtai_shm_detach(inf.name.c_str(), inf.address); break;
+        case Sim:      munmap(inf.address, inf.size); break;
         default: break;
       }
       shmMap.erase(it);
@@ -139,6 +163,9 @@ bool RTOS::shmDevFileExists()
         return false;      
       return true;
     break;
+    case Sim:
+      return !stat("/dev/shm", &statbuf) && S_ISDIR(statbuf.st_mode);
+    break;
     default: break;
   }
   return false;  
@@ -174,6 +201,9 @@ bool RTOS::shmDevFileIsValid()
         return false;
       return true;
     break;
+    case Sim:
+      return shmDevFileExists() && !access("/dev/shm", R_OK|W_OK|X_OK);
+    break;
     default: break;
   }
   return false;
@@ -193,6 +223,9 @@ const char *RTOS::shmDevFile()
     }
     return RTAI_SHM_DEV;
     break;
+  case Sim:
+    return "/dev/shm";
+    break;
   default:
     break;
   }
@@ -208,6 +241,9 @@ const char *RTOS::shmDriverName()
   case RTAI:
     return "rtai_shm.o";
     break;
+  case Sim:
+    return "RatExpFSMSim";
+    break;
   default:
     break;
   }
@@ -223,6 +259,9 @@ const char *RTOS::name()
   case RTAI:
     return "RTAI";
     break;
+  case Sim:
+    return "Simulated (userspace)";
+    break;
   default:
     break;
   }
@@ -232,9 +271,14 @@ const char *RTOS::name()
 // opens /dev/rtf[minor no] and returns its fd or -errno on error              
 int RTOS::openFifo(int minor_no, ModeFlag mode)
 {
-  char buf[64];
+  char buf[PATH_MAX];
 
-  snprintf(buf, 63, "/dev/rtf%d", minor_no);
+  if (determine() == Sim) {
+    const char *dir = getenv("RTOS_SIM_DIR");
+    if (!*dir) dir = "/tmp/RatExpFSMSim"; // RTOS_SIM_DEFAULT_DIR in RatExpFSMSim.h
+    snprintf(buf, sizeof(buf), "%s/rtf%d", dir, minor_no);
+  } else
+    snprintf(buf, 63, "/dev/rtf%d", minor_no);
   int m = mode == Read ? O_RDONLY : (mode == Write ? O_WRONLY : O_RDWR);
   int ret = ::open(buf, m);
   if (ret < 0) return -errno;
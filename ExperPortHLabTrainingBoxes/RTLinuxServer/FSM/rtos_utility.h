@@ -30,7 +30,8 @@ namespace RTOS
     Unknown = 0,
     None = Unknown,
     RTLinux, 
-    RTAI    
+    RTAI,
+    Sim     // RatExpFSMSim, selected by setting RTOS_SIM_DIR (see RatExpFSMSim.h)
   };
 
   extern RTOS determine();  
@@ -55,7 +56,7 @@ namespace RTOS
   extern const char *shmDevFile();  // returns filename string of shm dev file
   extern const char *shmDriverName(); // returns name of shm driver
 
-  // opens /dev/rtf[minor no] and returns its fd or -errno on error            
+  // opens /dev/rtf[minor no] (or $RTOS_SIM_DIR/rtf[minor no]) and returns its fd or -errno on error
   enum ModeFlag { Read = 1, Write = 2, ReadWrite = Read|Write };
   extern int openFifo(int minor_no, ModeFlag m = Read); 
 
@@ -0,0 +1,190 @@
+#ifndef timerwheel_h
+#define timerwheel_h
+/**
+   Timer wheels: a fixed set of timers, each either disarmed or armed with
+   a deadline, kept so that finding the ones that are due only looks at
+   those due (plus, now and then, a cascade of the ones due later).
+   License: GPL.
+
+   Deadlines are in nanoseconds on whatever clock the caller likes, as long
+   as the 'now' passed to timerWheelAdvance() is on the same clock.  The
+   wheel has TW_LEVELS levels of TW_SLOTS slots.  A level-0 slot is
+   2^TW_SHIFT ns wide, and each level's slots are TW_SLOTS times wider than
+   the level below's, as in the Linux kernel's timer wheel.  A timer that
+   is due within TW_SLOTS level-0 slots sits in level 0, the others sit
+   further up and are moved down ('cascaded') as their time comes nearer.
+
+   Everything is static inline, there is no allocation, and nothing here
+   blocks, so it can be used from RT.  A wheel is not locked: use a given
+   wheel from one thread at a time.
+
+   Usage:
+   1. give the wheel an array of struct TimerWheelTimer, one per timer id,
+      with timerWheelInit().
+   2. timerWheelArm() / timerWheelCancel() timers by id.
+   3. call timerWheelAdvance() every so often: it disarms each timer that
+      is due and calls your function with its id.  Your function may arm
+      and cancel timers, including the one that just fired.
+*/
+
+#define TW_SHIFT 17   /* ~131 us level-0 slots */
+#define TW_BITS 6
+#define TW_SLOTS (1<<TW_BITS)
+#define TW_MASK (TW_SLOTS-1)
+#define TW_LEVELS 4   /* so the wheel spans 2^(TW_SHIFT+TW_BITS*TW_LEVELS) ns, ~36 minutes.  Later deadlines just get cascaded a few extra times. */
+
+struct TimerWheelTimer
+{
+  unsigned long long deadline;
+  short next, prev;     /* the other timers in its slot, -1 for none */
+  unsigned char level, slot;
+  unsigned char armed;
+};
+
+struct TimerWheel
+{
+  unsigned long long clk; /* the level-0 slot number we are up to */
+  short head[TW_LEVELS][TW_SLOTS]; /* first timer in each slot, -1 for none */
+  struct TimerWheelTimer *timers;
+  unsigned n_timers;
+};
+
+typedef void (*TimerWheel_Handler)(void *arg, unsigned id);
+
+static inline void twLink(struct TimerWheel *tw, unsigned id)
+{
+  struct TimerWheelTimer *t = &tw->timers[id];
+  unsigned long long dj = t->deadline >> TW_SHIFT, delta;
+  unsigned level;
+
+  if (dj < tw->clk) dj = tw->clk; /* overdue: goes in the current slot */
+  delta = dj - tw->clk;
+  for (level = 0; level < TW_LEVELS-1; ++level)
+    if (delta < (1ULL << (TW_BITS*(level+1)))) break;
+  if (delta >= (1ULL << (TW_BITS*TW_LEVELS)))
+    /* beyond the top level: park it in the top level's last slot */
+    dj = tw->clk + (1ULL << (TW_BITS*TW_LEVELS)) - 1;
+  t->level = level;
+  t->slot = (dj >> (TW_BITS*level)) & TW_MASK;
+  t->prev = -1;
+  t->next = tw->head[level][t->slot];
+  if (t->next >= 0) tw->timers[t->next].prev = id;
+  tw->head[level][t->slot] = id;
+}
+
+static inline void twUnlink(struct TimerWheel *tw, unsigned id)
+{
+  struct TimerWheelTimer *t = &tw->timers[id];
+  if (t->prev >= 0) tw->timers[t->prev].next = t->next;
+  else tw->head[t->level][t->slot] = t->next;
+  if (t->next >= 0) tw->timers[t->next].prev = t->prev;
+}
+
+/* Take all the timers out of a slot, returning the first of them, linked
+   by next */
+static inline int twDetach(struct TimerWheel *tw, unsigned level, unsigned slot)
+{
+  int id = tw->head[level][slot];
+  tw->head[level][slot] = -1;
+  return id;
+}
+
+/* Put the detached timers back, in the slots they belong in now */
+static inline void twRelink(struct TimerWheel *tw, int id)
+{
+  while (id >= 0) {
+    int next = tw->timers[id].next;
+    twLink(tw, id);
+    id = next;
+  }
+}
+
+static inline void timerWheelInit(struct TimerWheel *tw, struct TimerWheelTimer *timers, unsigned n_timers, unsigned long long now)
+{
+  unsigned i, j;
+  tw->clk = now >> TW_SHIFT;
+  for (i = 0; i < TW_LEVELS; ++i)
+    for (j = 0; j < TW_SLOTS; ++j)
+      tw->head[i][j] = -1;
+  tw->timers = timers;
+  tw->n_timers = n_timers;
+  for (i = 0; i < n_timers; ++i) timers[i].armed = 0;
+}
+
+static inline int timerWheelArmed(const struct TimerWheel *tw, unsigned id)
+{
+  return id < tw->n_timers && tw->timers[id].armed;
+}
+
+static inline void timerWheelCancel(struct TimerWheel *tw, unsigned id)
+{
+  if (!timerWheelArmed(tw, id)) return;
+  twUnlink(tw, id);
+  tw->timers[id].armed = 0;
+}
+
+/** Arms (or re-arms) timer id to go off at deadline */
+static inline void timerWheelArm(struct TimerWheel *tw, unsigned id, unsigned long long deadline)
+{
+  if (id >= tw->n_timers) return;
+  timerWheelCancel(tw, id);
+  tw->timers[id].deadline = deadline;
+  tw->timers[id].armed = 1;
+  twLink(tw, id);
+}
+
+/** Fires, in no particular order, all the timers due at or before now. */
+static inline void timerWheelAdvance(struct TimerWheel *tw, unsigned long long now, TimerWheel_Handler fire, void *arg)
+{
+  const unsigned long long nowj = now >> TW_SHIFT;
+
+  if (nowj < tw->clk || nowj - tw->clk >= TW_SLOTS) {
+    /* The clock went back (a reset) or we weren't called for a while (a
+       pause): walking the slots in between could take forever, so just
+       re-sort all the timers relative to now. */
+    int all = -1, id;
+    unsigned i, j;
+    for (i = 0; i < TW_LEVELS; ++i)
+      for (j = 0; j < TW_SLOTS; ++j)
+        if ((id = twDetach(tw, i, j)) >= 0) {
+          int last = id;
+          while (tw->timers[last].next >= 0) last = tw->timers[last].next;
+          tw->timers[last].next = all;
+          all = id;
+        }
+    tw->clk = nowj;
+    twRelink(tw, all);
+  }
+
+  for (;;) {
+    const unsigned slot = tw->clk & TW_MASK;
+    int id = tw->head[0][slot];
+
+    /* Fire the due timers in the current slot (in the slot 'now' is in,
+       some may not be due yet).  The handler may arm and cancel timers,
+       which can change this slot, so start over after each one. */
+    while (id >= 0) {
+      if (tw->timers[id].deadline <= now) {
+        timerWheelCancel(tw, id);
+        fire(arg, id);
+        id = tw->head[0][slot];
+      } else
+        id = tw->timers[id].next;
+    }
+
+    if (tw->clk == nowj) break;
+    ++tw->clk;
+
+    /* Crossed into a new slot of a higher level?  Cascade that slot's
+       timers down. */
+    {
+      unsigned level;
+      for (level = 1; level < TW_LEVELS; ++level) {
+        if (tw->clk & ((1ULL << (TW_BITS*level)) - 1)) break;
+        twRelink(tw, twDetach(tw, level, (tw->clk >> (TW_BITS*level)) & TW_MASK));
+      }
+    }
+  }
+}
+
+#endif